@@ -230,27 +230,19 @@ static void print_object_or_die(int fd, struct expand_data *data)
 struct batch_options {
 	int enabled;
 	int print_contents;
+	int unordered;
 	const char *format;
 };
 
-static int batch_one_object(const char *obj_name, struct batch_options *opt,
-			    struct expand_data *data)
+static void batch_object_write(const char *obj_name, struct batch_options *opt,
+			       struct expand_data *data)
 {
 	struct strbuf buf = STRBUF_INIT;
 
-	if (!obj_name)
-	   return 1;
-
-	if (get_sha1(obj_name, data->sha1)) {
-		printf("%s missing\n", obj_name);
-		fflush(stdout);
-		return 0;
-	}
-
 	if (sha1_object_info_extended(data->sha1, &data->info, LOOKUP_REPLACE_OBJECT) < 0) {
 		printf("%s missing\n", obj_name);
 		fflush(stdout);
-		return 0;
+		return;
 	}
 
 	strbuf_expand(&buf, opt->format, expand_format, data);
@@ -262,6 +254,48 @@ static int batch_one_object(const char *obj_name, struct batch_options *opt,
 		print_object_or_die(1, data);
 		write_or_die(1, "\n", 1);
 	}
+}
+
+static int batch_one_object(const char *obj_name, struct batch_options *opt,
+			    struct expand_data *data)
+{
+	if (!obj_name)
+	   return 1;
+
+	if (get_sha1(obj_name, data->sha1)) {
+		printf("%s missing\n", obj_name);
+		fflush(stdout);
+		return 0;
+	}
+
+	batch_object_write(obj_name, opt, data);
+	return 0;
+}
+
+/* An input line of --unordered, kept until its object's turn comes. */
+struct unordered_line {
+	char *obj_name;
+	char *rest;
+};
+
+struct unordered_cb {
+	struct batch_options *opt;
+	struct expand_data *data;
+};
+
+static int batch_unordered_object(const unsigned char *sha1, void *util,
+				  void *cb_data)
+{
+	struct unordered_line *line = util;
+	struct unordered_cb *cb = cb_data;
+
+	hashcpy(cb->data->sha1, sha1);
+	cb->data->rest = line->rest;
+	batch_object_write(line->obj_name, cb->opt, cb->data);
+
+	free(line->obj_name);
+	free(line->rest);
+	free(line);
 	return 0;
 }
 
@@ -269,6 +303,7 @@ static int batch_objects(struct batch_options *opt)
 {
 	struct strbuf buf = STRBUF_INIT;
 	struct expand_data data;
+	struct object_batch batch = OBJECT_BATCH_INIT;
 	int save_warning;
 	int retval = 0;
 
@@ -317,11 +352,36 @@ static int batch_objects(struct batch_options *opt)
 			data.rest = p;
 		}
 
+		if (opt->unordered) {
+			struct unordered_line *line;
+
+			if (get_sha1(buf.buf, data.sha1)) {
+				printf("%s missing\n", buf.buf);
+				fflush(stdout);
+				continue;
+			}
+			line = xmalloc(sizeof(*line));
+			line->obj_name = xstrdup(buf.buf);
+			line->rest = data.rest ? xstrdup(data.rest) : NULL;
+			object_batch_add(&batch, data.sha1, line);
+			continue;
+		}
+
 		retval = batch_one_object(buf.buf, opt, &data);
 		if (retval)
 			break;
 	}
 
+	if (opt->unordered) {
+		struct unordered_cb cb;
+
+		cb.opt = opt;
+		cb.data = &data;
+		retval = for_each_object_in_pack_order(&batch,
+						       batch_unordered_object, &cb);
+		object_batch_clear(&batch);
+	}
+
 	strbuf_release(&buf);
 	warn_on_object_refname_ambiguity = save_warning;
 	return retval;
@@ -329,7 +389,7 @@ static int batch_objects(struct batch_options *opt)
 
 static const char * const cat_file_usage[] = {
 	N_("git cat-file (-t|-s|-e|-p|<type>|--textconv) <object>"),
-	N_("git cat-file (--batch|--batch-check) < <list_of_objects>"),
+	N_("git cat-file (--batch|--batch-check) [--unordered] < <list_of_objects>"),
 	NULL
 };
 
@@ -364,6 +424,7 @@ int cmd_cat_file(int argc, const char **argv, const char *prefix)
 	int opt = 0;
 	const char *exp_type = NULL, *obj_name = NULL;
 	struct batch_options batch = {0};
+	int unordered = 0;
 
 	const struct option options[] = {
 		OPT_GROUP(N_("<type> can be one of: blob, tree, commit, tag")),
@@ -380,6 +441,8 @@ int cmd_cat_file(int argc, const char **argv, const char *prefix)
 		{ OPTION_CALLBACK, 0, "batch-check", &batch, "format",
 			N_("show info about objects fed from the standard input"),
 			PARSE_OPT_OPTARG, batch_option_callback },
+		OPT_BOOL(0, "unordered", &unordered,
+			 N_("with --batch*, output objects in the order they are stored")),
 		OPT_END()
 	};
 
@@ -406,6 +469,9 @@ int cmd_cat_file(int argc, const char **argv, const char *prefix)
 	if (batch.enabled && (opt || argc)) {
 		usage_with_options(cat_file_usage, options);
 	}
+	if (unordered && !batch.enabled)
+		usage_with_options(cat_file_usage, options);
+	batch.unordered = unordered;
 
 	if (batch.enabled)
 		return batch_objects(&batch);
@@ -566,6 +566,15 @@ static int merge_working_tree(const struct checkout_opts *opts,
 		}
 	}
 
+	/*
+	 * unpack_trees() leaves no cache tree behind, but a sparse
+	 * index takes the trees of the directories it collapses from
+	 * there.
+	 */
+	if (use_sparse_index && core_apply_sparse_checkout &&
+	    !cache_tree_fully_valid(active_cache_tree))
+		update_main_cache_tree(WRITE_TREE_SILENT);
+
 	if (write_cache(newfd, active_cache, active_nr) ||
 	    commit_locked_index(lock_file))
 		die(_("unable to write new index file"));
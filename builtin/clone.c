@@ -18,11 +18,13 @@
 #include "transport.h"
 #include "strbuf.h"
 #include "dir.h"
+#include "list-objects-filter.h"
 #include "sigchain.h"
 #include "branch.h"
 #include "remote.h"
 #include "run-command.h"
 #include "connected.h"
+#include "argv-array.h"
 
 /*
  * Overall FIXMEs:
@@ -44,6 +46,7 @@ static char *option_origin = NULL;
 static char *option_branch = NULL;
 static const char *real_git_dir;
 static char *option_upload_pack = "git-upload-pack";
+static struct list_objects_filter_options filter_options;
 static int option_verbosity;
 static int option_progress = -1;
 static struct string_list option_config;
@@ -93,6 +96,7 @@ static struct option builtin_clone_options[] = {
 		    N_("create a shallow clone of that depth")),
 	OPT_BOOL(0, "single-branch", &option_single_branch,
 		    N_("clone only one branch, HEAD or --branch")),
+	OPT_PARSE_LIST_OBJECTS_FILTER(&filter_options),
 	OPT_STRING(0, "separate-git-dir", &real_git_dir, N_("gitdir"),
 		   N_("separate git dir from working tree")),
 	OPT_STRING_LIST('c', "config", &option_config, N_("key=value"),
@@ -759,10 +763,14 @@ int cmd_clone(int argc, const char **argv, const char *prefix)
 
 	struct refspec *refspec;
 	const char *fetch_pattern;
+	struct argv_array ref_prefixes = ARGV_ARRAY_INIT;
 
 	junk_pid = getpid();
 
 	packet_trace_identity("clone");
+
+	/* objects are only fetched lazily once the refs are in place */
+	fetch_if_missing = 0;
 	argc = parse_options(argc, argv, prefix, builtin_clone_options,
 			     builtin_clone_usage, 0);
 
@@ -805,6 +813,8 @@ int cmd_clone(int argc, const char **argv, const char *prefix)
 	if (is_local) {
 		if (option_depth)
 			warning(_("--depth is ignored in local clones; use file:// instead."));
+		if (filter_options.choice)
+			warning(_("--filter is ignored in local clones; use file:// instead."));
 		if (!access(mkpath("%s/shallow", path), F_OK)) {
 			if (option_local > 0)
 				warning(_("source repository is shallow, ignoring --local"));
@@ -895,6 +905,21 @@ int cmd_clone(int argc, const char **argv, const char *prefix)
 	git_config_set(key.buf, repo);
 	strbuf_reset(&key);
 
+	if (filter_options.choice && !is_local) {
+		/*
+		 * The objects the filter leaves out are fetched from
+		 * this remote when they are needed.
+		 */
+		strbuf_addf(&key, "remote.%s.promisor", option_origin);
+		git_config_set(key.buf, "true");
+		strbuf_reset(&key);
+		strbuf_addf(&key, "remote.%s.partialclonefilter", option_origin);
+		git_config_set(key.buf, filter_options.filter_spec);
+		strbuf_reset(&key);
+		git_config_set("extensions.partialclone", option_origin);
+		repository_format_partial_clone = xstrdup(option_origin);
+	}
+
 	if (option_reference.nr)
 		setup_reference();
 
@@ -924,10 +949,24 @@ int cmd_clone(int argc, const char **argv, const char *prefix)
 		transport_set_option(transport, TRANS_OPT_UPLOADPACK,
 				     option_upload_pack);
 
-	if (transport->smart_options && !option_depth)
+	if (repository_format_partial_clone) {
+		transport_set_option(transport, TRANS_OPT_LIST_OBJECTS_FILTER,
+				     filter_options.filter_spec);
+		transport_set_option(transport, TRANS_OPT_FROM_PROMISOR, "1");
+	}
+
+	if (transport->smart_options && !option_depth &&
+	    !repository_format_partial_clone)
 		transport->smart_options->check_self_contained_and_connected = 1;
 
-	refs = transport_get_remote_refs(transport);
+	/* a mirror wants everything below "refs/" anyway */
+	if (!option_mirror) {
+		argv_array_push(&ref_prefixes, "HEAD");
+		argv_array_push(&ref_prefixes, src_ref_prefix);
+		argv_array_push(&ref_prefixes, "refs/tags/");
+	}
+
+	refs = transport_get_remote_refs(transport, &ref_prefixes);
 
 	if (refs) {
 		mapped_refs = wanted_peer_refs(refs, refspec);
@@ -998,6 +1037,7 @@ int cmd_clone(int argc, const char **argv, const char *prefix)
 	transport_disconnect(transport);
 
 	junk_mode = JUNK_LEAVE_REPO;
+	fetch_if_missing = 1;
 	err = checkout();
 
 	strbuf_release(&reflog_msg);
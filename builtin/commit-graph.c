@@ -0,0 +1,157 @@
+#include "builtin.h"
+#include "cache.h"
+#include "commit.h"
+#include "refs.h"
+#include "parse-options.h"
+#include "sha1-array.h"
+#include "commit-graph.h"
+
+static const char * const builtin_commit_graph_usage[] = {
+	N_("git commit-graph [--object-dir <objdir>] read"),
+	N_("git commit-graph [--object-dir <objdir>] write [--reachable|--stdin-commits]"),
+	NULL
+};
+
+static const char * const builtin_commit_graph_read_usage[] = {
+	N_("git commit-graph [--object-dir <objdir>] read"),
+	NULL
+};
+
+static const char * const builtin_commit_graph_write_usage[] = {
+	N_("git commit-graph [--object-dir <objdir>] write [--reachable|--stdin-commits]"),
+	NULL
+};
+
+static const char *obj_dir;
+
+static int graph_read(int argc, const char **argv, const char *prefix)
+{
+	struct commit_graph *graph;
+	char *graph_name;
+	struct option options[] = {
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, prefix, options,
+			     builtin_commit_graph_read_usage, 0);
+	if (argc)
+		usage_with_options(builtin_commit_graph_read_usage, options);
+
+	graph_name = get_commit_graph_filename(obj_dir);
+	graph = load_commit_graph_one(graph_name);
+	if (!graph)
+		die(_("could not load commit-graph '%s'"), graph_name);
+	free(graph_name);
+
+	printf("header: %08x %d %d %d %d\n",
+	       get_be32(graph->data),
+	       graph->data[4], graph->data[5], graph->data[6], graph->data[7]);
+	printf("num_commits: %u\n", graph->num_commits);
+	printf("chunks:");
+	if (graph->chunk_oid_fanout)
+		printf(" oid_fanout");
+	if (graph->chunk_oid_lookup)
+		printf(" oid_lookup");
+	if (graph->chunk_commit_data)
+		printf(" commit_metadata");
+	if (graph->chunk_extra_edges)
+		printf(" extra_edges");
+	printf("\n");
+
+	free_commit_graph(graph);
+	return 0;
+}
+
+static int add_ref_to_list(const char *refname, const unsigned char *sha1,
+			   int flags, void *cb_data)
+{
+	sha1_array_append(cb_data, sha1);
+	return 0;
+}
+
+static void add_packed_commits(struct sha1_array *commits)
+{
+	struct packed_git *p;
+
+	prepare_packed_git();
+	for (p = packed_git; p; p = p->next) {
+		uint32_t i;
+
+		if (!p->pack_local || open_pack_index(p))
+			continue;
+		for (i = 0; i < p->num_objects; i++) {
+			const unsigned char *sha1 = nth_packed_object_sha1(p, i);
+
+			if (sha1_object_info(sha1, NULL) == OBJ_COMMIT)
+				sha1_array_append(commits, sha1);
+		}
+	}
+}
+
+static int graph_write(int argc, const char **argv, const char *prefix)
+{
+	struct sha1_array commits = SHA1_ARRAY_INIT;
+	int reachable = 0, stdin_commits = 0;
+	struct option options[] = {
+		OPT_BOOL(0, "reachable", &reachable,
+			 N_("start walk at all refs")),
+		OPT_BOOL(0, "stdin-commits", &stdin_commits,
+			 N_("start walk at commits listed by stdin")),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, prefix, options,
+			     builtin_commit_graph_write_usage, 0);
+	if (argc)
+		usage_with_options(builtin_commit_graph_write_usage, options);
+	if (reachable && stdin_commits)
+		die(_("use at most one of --reachable and --stdin-commits"));
+
+	if (reachable) {
+		head_ref(add_ref_to_list, &commits);
+		for_each_ref(add_ref_to_list, &commits);
+	} else if (stdin_commits) {
+		struct strbuf buf = STRBUF_INIT;
+
+		while (strbuf_getline(&buf, stdin, '\n') != EOF) {
+			unsigned char sha1[20];
+
+			if (get_sha1_hex(buf.buf, sha1))
+				die(_("invalid commit id '%s'"), buf.buf);
+			sha1_array_append(&commits, sha1);
+		}
+		strbuf_release(&buf);
+	} else
+		add_packed_commits(&commits);
+
+	write_commit_graph(obj_dir, &commits);
+	sha1_array_clear(&commits);
+	return 0;
+}
+
+int cmd_commit_graph(int argc, const char **argv, const char *prefix)
+{
+	static struct option builtin_commit_graph_options[] = {
+		OPT_STRING(0, "object-dir", &obj_dir, N_("dir"),
+			   N_("The object directory to store the graph")),
+		OPT_END()
+	};
+
+	git_config(git_default_config, NULL);
+	argc = parse_options(argc, argv, prefix,
+			     builtin_commit_graph_options,
+			     builtin_commit_graph_usage,
+			     PARSE_OPT_STOP_AT_NON_OPTION);
+	if (!obj_dir)
+		obj_dir = get_object_directory();
+
+	if (argc > 0) {
+		if (!strcmp(argv[0], "read"))
+			return graph_read(argc, argv, prefix);
+		if (!strcmp(argv[0], "write"))
+			return graph_write(argc, argv, prefix);
+	}
+
+	usage_with_options(builtin_commit_graph_usage,
+			   builtin_commit_graph_options);
+}
@@ -4,11 +4,13 @@
 #include "remote.h"
 #include "connect.h"
 #include "sha1-array.h"
+#include "argv-array.h"
 
 static const char fetch_pack_usage[] =
 "git fetch-pack [--all] [--stdin] [--quiet|-q] [--keep|-k] [--thin] "
 "[--include-tag] [--upload-pack=<git-upload-pack>] [--depth=<n>] "
-"[--no-progress] [--diag-url] [-v] [<host>:]<directory> [<refs>...]";
+"[--no-progress] [--diag-url] [--filter=<filter-spec>] [-v] "
+"[<host>:]<directory> [<refs>...]";
 
 static void add_sought_entry_mem(struct ref ***sought, int *nr, int *alloc,
 				 const char *name, int namelen)
@@ -50,6 +52,7 @@ int cmd_fetch_pack(int argc, const char **argv, const char *prefix)
 	struct sha1_array shallow = SHA1_ARRAY_INIT;
 
 	packet_trace_identity("fetch-pack");
+	fetch_if_missing = 0;
 
 	memset(&args, 0, sizeof(args));
 	args.uploadpack = "git-upload-pack";
@@ -127,6 +130,20 @@ int cmd_fetch_pack(int argc, const char **argv, const char *prefix)
 			args.update_shallow = 1;
 			continue;
 		}
+		if (starts_with(arg, "--filter=")) {
+			if (parse_list_objects_filter(&args.filter_options,
+						      arg + 9))
+				usage(fetch_pack_usage);
+			continue;
+		}
+		if (!strcmp("--from-promisor", arg)) {
+			args.from_promisor = 1;
+			continue;
+		}
+		if (!strcmp("--no-dependents", arg)) {
+			args.no_dependents = 1;
+			continue;
+		}
 		usage(fetch_pack_usage);
 	}
 
@@ -170,15 +187,35 @@ int cmd_fetch_pack(int argc, const char **argv, const char *prefix)
 		int flags = args.verbose ? CONNECT_VERBOSE : 0;
 		if (args.diag_url)
 			flags |= CONNECT_DIAG_URL;
+		if (get_protocol_version_config() == protocol_v2)
+			flags |= CONNECT_PROTOCOL_V2;
 		conn = git_connect(fd, dest, args.uploadpack,
 				   flags);
 		if (!conn)
 			return args.diag_url ? 0 : 1;
 	}
 	get_remote_heads(fd[0], NULL, 0, &ref, 0, NULL, &shallow);
+	if (server_protocol_version() == protocol_v2) {
+		/*
+		 * Over stateless RPC, the helper has already listed the
+		 * refs and passes the response on after the capabilities.
+		 */
+		if (!args.stateless_rpc) {
+			struct argv_array ref_prefixes = ARGV_ARRAY_INIT;
+			struct strbuf req = STRBUF_INIT;
+
+			for (i = 0; !args.fetch_all && i < nr_sought; i++)
+				expand_ref_prefix(&ref_prefixes, sought[i]->name);
+			ls_refs_request(&req, &ref_prefixes);
+			write_or_die(fd[1], req.buf, req.len);
+			strbuf_release(&req);
+			argv_array_clear(&ref_prefixes);
+		}
+		get_remote_refs(fd[0], NULL, 0, &ref);
+	}
 
 	ref = fetch_pack(&args, fd, conn, ref, dest, sought, nr_sought,
-			 &shallow, pack_lockfile_ptr);
+			 &shallow, pack_lockfile_ptr, server_protocol_version());
 	if (pack_lockfile) {
 		printf("lock %s\n", pack_lockfile);
 		fflush(stdout);
@@ -15,6 +15,7 @@
 #include "submodule.h"
 #include "connected.h"
 #include "argv-array.h"
+#include "list-objects-filter.h"
 
 static const char * const builtin_fetch_usage[] = {
 	N_("git fetch [<options>] [<repository> [<refspec>...]]"),
@@ -40,6 +41,7 @@ static int tags = TAGS_DEFAULT, unshallow, update_shallow;
 static const char *depth;
 static const char *upload_pack;
 static struct strbuf default_rla = STRBUF_INIT;
+static struct list_objects_filter_options filter_options;
 static struct transport *gtransport;
 static struct transport *gsecondary;
 static const char *submodule_prefix = "";
@@ -124,6 +126,7 @@ static struct option builtin_fetch_options[] = {
 		 N_("accept refs that update .git/shallow")),
 	{ OPTION_CALLBACK, 0, "refmap", NULL, N_("refmap"),
 	  N_("specify fetch refmap"), PARSE_OPT_NONEG, parse_refmap_arg },
+	OPT_PARSE_LIST_OBJECTS_FILTER(&filter_options),
 	OPT_END()
 };
 
@@ -211,7 +214,7 @@ static void find_non_local_tags(struct transport *transport,
 	struct string_list_item *item = NULL;
 
 	for_each_ref(add_existing, &existing_refs);
-	for (ref = transport_get_remote_refs(transport); ref; ref = ref->next) {
+	for (ref = transport_get_remote_refs(transport, NULL); ref; ref = ref->next) {
 		if (!starts_with(ref->name, "refs/tags/"))
 			continue;
 
@@ -280,6 +283,57 @@ static void find_non_local_tags(struct transport *transport,
 	string_list_clear(&remote_refs, 0);
 }
 
+static void refspec_ref_prefixes(const struct refspec *refspecs, int nr,
+				 struct argv_array *ref_prefixes)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		const struct refspec *rs = &refspecs[i];
+
+		if (rs->exact_sha1)
+			continue;
+		if (!rs->src || !*rs->src)
+			argv_array_push(ref_prefixes, "HEAD");
+		else if (rs->pattern)
+			argv_array_pushf(ref_prefixes, "%.*s",
+					 (int)(strchr(rs->src, '*') - rs->src),
+					 rs->src);
+		else
+			expand_ref_prefix(ref_prefixes, rs->src);
+	}
+}
+
+/*
+ * The refs get_ref_map() may look at, so that a server that lets us
+ * ask only advertises those.
+ */
+static void get_ref_prefixes(struct transport *transport,
+			     struct refspec *refspecs, int refspec_count,
+			     int tags, struct argv_array *ref_prefixes)
+{
+	if (refspec_count)
+		refspec_ref_prefixes(refspecs, refspec_count, ref_prefixes);
+	else {
+		struct remote *remote = transport->remote;
+		struct branch *branch = branch_get(NULL);
+		int i;
+
+		if (remote)
+			refspec_ref_prefixes(remote->fetch,
+					     remote->fetch_refspec_nr,
+					     ref_prefixes);
+		if (branch_has_merge_config(branch) && remote &&
+		    !strcmp(branch->remote_name, remote->name))
+			for (i = 0; i < branch->merge_nr; i++)
+				expand_ref_prefix(ref_prefixes,
+						  branch->merge_name[i]);
+		argv_array_push(ref_prefixes, "HEAD");
+	}
+	if (tags != TAGS_UNSET)
+		argv_array_push(ref_prefixes, "refs/tags/");
+}
+
 static struct ref *get_ref_map(struct transport *transport,
 			       struct refspec *refspecs, int refspec_count,
 			       int tags, int *autotags)
@@ -292,7 +346,13 @@ static struct ref *get_ref_map(struct transport *transport,
 	/* opportunistically-updated references: */
 	struct ref *orefs = NULL, **oref_tail = &orefs;
 
-	const struct ref *remote_refs = transport_get_remote_refs(transport);
+	struct argv_array ref_prefixes = ARGV_ARRAY_INIT;
+	const struct ref *remote_refs;
+
+	get_ref_prefixes(transport, refspecs, refspec_count, tags,
+			 &ref_prefixes);
+	remote_refs = transport_get_remote_refs(transport, &ref_prefixes);
+	argv_array_clear(&ref_prefixes);
 
 	if (refspec_count) {
 		struct refspec *fetch_refspec;
@@ -828,6 +888,18 @@ static void set_option(struct transport *transport, const char *name, const char
 			name, transport->url);
 }
 
+/*
+ * The objects a partial clone left out are fetched from the remote
+ * named by extensions.partialClone; fetches from it are filtered too.
+ */
+static int is_promisor_remote(struct remote *remote)
+{
+	if (remote->promisor)
+		return 1;
+	return repository_format_partial_clone &&
+		!strcmp(remote->name, repository_format_partial_clone);
+}
+
 static struct transport *prepare_transport(struct remote *remote)
 {
 	struct transport *transport;
@@ -841,6 +913,14 @@ static struct transport *prepare_transport(struct remote *remote)
 		set_option(transport, TRANS_OPT_DEPTH, depth);
 	if (update_shallow)
 		set_option(transport, TRANS_OPT_UPDATE_SHALLOW, "yes");
+	if (is_promisor_remote(remote)) {
+		const char *spec = filter_options.filter_spec ?
+			filter_options.filter_spec : remote->partial_clone_filter;
+
+		set_option(transport, TRANS_OPT_FROM_PROMISOR, "1");
+		if (spec)
+			set_option(transport, TRANS_OPT_LIST_OBJECTS_FILTER, spec);
+	}
 	return transport;
 }
 
@@ -1021,6 +1101,8 @@ static void add_options_to_argv(struct argv_array *argv)
 		argv_array_push(argv, "-v");
 	else if (verbosity < 0)
 		argv_array_push(argv, "-q");
+	if (filter_options.filter_spec)
+		argv_array_pushf(argv, "--filter=%s", filter_options.filter_spec);
 
 }
 
@@ -1065,6 +1147,10 @@ static int fetch_one(struct remote *remote, int argc, const char **argv)
 		die(_("No remote repository specified.  Please, specify either a URL or a\n"
 		    "remote name from which new revisions should be fetched."));
 
+	if (filter_options.filter_spec && !is_promisor_remote(remote))
+		die(_("--filter can only be used with the remote configured "
+		      "in extensions.partialClone"));
+
 	gtransport = prepare_transport(remote);
 
 	if (prune < 0) {
@@ -1117,6 +1203,9 @@ int cmd_fetch(int argc, const char **argv, const char *prefix)
 
 	packet_trace_identity("fetch");
 
+	/* what we do not have yet is fetched by us, not lazily */
+	fetch_if_missing = 0;
+
 	/* Record the command line for the reflog */
 	strbuf_addstr(&default_rla, "fetch");
 	for (i = 1; i < argc; i++)
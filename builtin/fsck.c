@@ -103,7 +103,9 @@ static int mark_object(struct object *obj, int type, void *data)
 		return 0;
 	obj->flags |= REACHABLE;
 	if (!(obj->flags & HAS_OBJ)) {
-		if (parent && !has_sha1_file(obj->sha1)) {
+		if (parent && !has_sha1_file(obj->sha1) &&
+		    !(repository_format_partial_clone &&
+		      is_promisor_object(obj->sha1))) {
 			printf("broken link from %7s %s\n",
 				 typename(parent->type), sha1_to_hex(parent->sha1));
 			printf("              to %7s %s\n",
@@ -179,6 +181,9 @@ static void check_reachable_object(struct object *obj)
 	if (!(obj->flags & HAS_OBJ)) {
 		if (has_sha1_pack(obj->sha1))
 			return; /* it is in pack - forget about it */
+		if (repository_format_partial_clone &&
+		    is_promisor_object(obj->sha1))
+			return; /* the promisor remote has it */
 		printf("missing %s %s\n", typename(obj->type), sha1_to_hex(obj->sha1));
 		errors_found |= ERROR_REACHABLE;
 		return;
@@ -628,6 +633,8 @@ int cmd_fsck(int argc, const char **argv, const char *prefix)
 	int i, heads;
 	struct alternate_object_database *alt;
 
+	/* fsck checks what we have; it does not fetch what is missing */
+	fetch_if_missing = 0;
 	errors_found = 0;
 	check_replace_refs = 0;
 
@@ -711,6 +718,7 @@ int cmd_fsck(int argc, const char **argv, const char *prefix)
 	}
 
 	if (keep_cache_objects) {
+		force_verify_index_checksum = 1;
 		read_cache();
 		for (i = 0; i < active_nr; i++) {
 			unsigned int mode;
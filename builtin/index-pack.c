@@ -11,9 +11,10 @@
 #include "exec_cmd.h"
 #include "streaming.h"
 #include "thread-utils.h"
+#include "midx.h"
 
 static const char index_pack_usage[] =
-"git index-pack [-v] [-o <index-file>] [--keep | --keep=<msg>] [--verify] [--strict] (<pack-file> | --stdin [--fix-thin] [<pack-file>])";
+"git index-pack [-v] [-o <index-file>] [--keep | --keep=<msg>] [--promisor[=<msg>]] [--verify] [--strict] [--[no-]rev-index] (<pack-file> | --stdin [--fix-thin] [<pack-file>])";
 
 struct object_entry {
 	struct pack_idx_entry idx;
@@ -77,6 +78,8 @@ static int do_fsck_object;
 static int verbose;
 static int show_stat;
 static int check_self_contained_and_connected;
+/* objects a promisor pack links to may be missing */
+static int promisor_pack;
 
 static struct progress *progress;
 
@@ -165,6 +168,124 @@ static void cleanup_thread(void)
 	free(thread_data);
 }
 
+/*
+ * With threads, the first pass is a pipeline: the main thread reads
+ * the pack and inflates the objects; one thread writes out and
+ * checksums what was read, and another hashes and checks the inflated
+ * objects.  The queues between them are bounded, so that a slow stage
+ * holds up the main thread instead of piling up memory.
+ */
+static int pipelined;
+
+struct pipe_item {
+	void *data;
+	unsigned long size;
+	struct object_entry *obj;
+};
+
+struct pipe_queue {
+	struct pipe_item *items;
+	int alloc, first, nr;
+	unsigned long bytes, max_bytes;
+	int done;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static struct pipe_queue write_queue, hash_queue;
+
+static void pipe_queue_init(struct pipe_queue *q, int alloc,
+			    unsigned long max_bytes)
+{
+	memset(q, 0, sizeof(*q));
+	q->items = xmalloc(alloc * sizeof(*q->items));
+	q->alloc = alloc;
+	q->max_bytes = max_bytes;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->cond, NULL);
+}
+
+static void pipe_queue_push(struct pipe_queue *q, void *data,
+			    unsigned long size, struct object_entry *obj)
+{
+	struct pipe_item *item;
+
+	pthread_mutex_lock(&q->mutex);
+	while (q->nr == q->alloc ||
+	       (q->nr && q->bytes + size > q->max_bytes))
+		pthread_cond_wait(&q->cond, &q->mutex);
+	item = &q->items[(q->first + q->nr++) % q->alloc];
+	item->data = data;
+	item->size = size;
+	item->obj = obj;
+	q->bytes += size;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/* Returns 0 once the queue is finished and empty. */
+static int pipe_queue_pop(struct pipe_queue *q, struct pipe_item *item)
+{
+	pthread_mutex_lock(&q->mutex);
+	while (!q->nr && !q->done)
+		pthread_cond_wait(&q->cond, &q->mutex);
+	if (!q->nr) {
+		pthread_mutex_unlock(&q->mutex);
+		return 0;
+	}
+	*item = q->items[q->first];
+	q->first = (q->first + 1) % q->alloc;
+	q->nr--;
+	q->bytes -= item->size;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	return 1;
+}
+
+static void pipe_queue_finish(struct pipe_queue *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	q->done = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	pthread_join(q->thread, NULL);
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->mutex);
+	free(q->items);
+}
+
+/* What flush() has consumed, gathered before it goes to the writer. */
+static unsigned char *write_block;
+static unsigned long write_block_len;
+#define WRITE_BLOCK_SIZE (64 * 1024)
+
+static void queue_consumed(const unsigned char *buf, unsigned long len)
+{
+	if (!write_block)
+		write_block = xmalloc(WRITE_BLOCK_SIZE);
+	memcpy(write_block + write_block_len, buf, len);
+	write_block_len += len;
+	if (write_block_len + sizeof(input_buffer) > WRITE_BLOCK_SIZE) {
+		pipe_queue_push(&write_queue, write_block, write_block_len, NULL);
+		write_block = NULL;
+		write_block_len = 0;
+	}
+}
+
+static void *threaded_write(void *data)
+{
+	struct pipe_item item;
+
+	while (pipe_queue_pop(&write_queue, &item)) {
+		if (output_fd >= 0)
+			write_or_die(output_fd, item.data, item.size);
+		git_SHA1_Update(&input_ctx, item.data, item.size);
+		free(item.data);
+	}
+	return NULL;
+}
+
 #else
 
 #define read_lock()
@@ -179,6 +300,8 @@ static void cleanup_thread(void)
 #define deepest_delta_lock()
 #define deepest_delta_unlock()
 
+#define pipelined 0
+
 #endif
 
 
@@ -207,6 +330,10 @@ static unsigned check_object(struct object *obj)
 	if (!(obj->flags & FLAG_CHECKED)) {
 		unsigned long size;
 		int type = sha1_object_info(obj->sha1, &size);
+		if (type <= 0 && promisor_pack) {
+			obj->flags |= FLAG_CHECKED;
+			return 1;
+		}
 		if (type <= 0)
 			die(_("did not receive expected object %s"),
 			      sha1_to_hex(obj->sha1));
@@ -236,9 +363,16 @@ static unsigned check_objects(void)
 static void flush(void)
 {
 	if (input_offset) {
-		if (output_fd >= 0)
-			write_or_die(output_fd, input_buffer, input_offset);
-		git_SHA1_Update(&input_ctx, input_buffer, input_offset);
+#ifndef NO_PTHREADS
+		if (pipelined)
+			queue_consumed(input_buffer, input_offset);
+		else
+#endif
+		{
+			if (output_fd >= 0)
+				write_or_die(output_fd, input_buffer, input_offset);
+			git_SHA1_Update(&input_ctx, input_buffer, input_offset);
+		}
 		memmove(input_buffer, input_buffer + input_offset, input_len);
 		input_offset = 0;
 	}
@@ -430,17 +564,20 @@ static void *unpack_entry_data(unsigned long offset, unsigned long size,
 	char hdr[32];
 	int hdrlen;
 
-	if (!is_delta_type(type)) {
-		hdrlen = sprintf(hdr, "%s %lu", typename(type), size) + 1;
-		git_SHA1_Init(&c);
-		git_SHA1_Update(&c, hdr, hdrlen);
-	} else
-		sha1 = NULL;
 	if (type == OBJ_BLOB && size > big_file_threshold)
 		buf = fixed_buf;
 	else
 		buf = xmalloc(size);
 
+	/* in the pipeline, objects we keep are hashed by another thread */
+	if (is_delta_type(type) || (pipelined && buf != fixed_buf))
+		sha1 = NULL;
+	if (sha1) {
+		hdrlen = sprintf(hdr, "%s %lu", typename(type), size) + 1;
+		git_SHA1_Init(&c);
+		git_SHA1_Update(&c, hdr, hdrlen);
+	}
+
 	memset(&stream, 0, sizeof(stream));
 	git_inflate_init(&stream);
 	stream.next_out = buf;
@@ -862,8 +999,8 @@ static void resolve_delta(struct object_entry *delta_obj,
 			  struct base_data *base, struct base_data *result)
 {
 	void *base_data, *delta_data;
+	enum object_type real_type = base->obj->real_type;
 
-	delta_obj->real_type = base->obj->real_type;
 	if (show_stat) {
 		delta_obj->delta_depth = base->obj->delta_depth + 1;
 		deepest_delta_lock();
@@ -881,14 +1018,34 @@ static void resolve_delta(struct object_entry *delta_obj,
 	if (!result->data)
 		bad_object(delta_obj->idx.offset, _("failed to apply delta"));
 	hash_sha1_file(result->data, result->size,
-		       typename(delta_obj->real_type), delta_obj->idx.sha1);
-	sha1_object(result->data, NULL, result->size, delta_obj->real_type,
+		       typename(real_type), delta_obj->idx.sha1);
+	sha1_object(result->data, NULL, result->size, real_type,
 		    delta_obj->idx.sha1);
+	/* fix_unresolved_deltas() looks at real_type under the lock */
 	counter_lock();
+	delta_obj->real_type = real_type;
 	nr_resolved_deltas++;
 	counter_unlock();
 }
 
+/*
+ * When a thin pack is completed in threads, the same deltas can be
+ * found from an object of the pack and from a copy of it that was
+ * appended as a missing base (see threaded_fix_unresolved_deltas()).
+ * Only the first thread to claim a delta resolves it.
+ */
+static int claim_ref_delta(struct object_entry *delta_obj)
+{
+	int claimed;
+
+	counter_lock();
+	claimed = delta_obj->real_type == OBJ_REF_DELTA;
+	if (claimed)
+		delta_obj->real_type = OBJ_NONE; /* resolve_delta() sets it */
+	counter_unlock();
+	return claimed;
+}
+
 static struct base_data *find_unresolved_deltas_1(struct base_data *base,
 						  struct base_data *prev_base)
 {
@@ -912,11 +1069,15 @@ static struct base_data *find_unresolved_deltas_1(struct base_data *base,
 		link_base_data(prev_base, base);
 	}
 
-	if (base->ref_first <= base->ref_last) {
+	while (base->ref_first <= base->ref_last) {
 		struct object_entry *child = objects + deltas[base->ref_first].obj_no;
-		struct base_data *result = alloc_base_data();
+		struct base_data *result;
 
-		assert(child->real_type == OBJ_REF_DELTA);
+		if (!claim_ref_delta(child)) {
+			base->ref_first++;
+			continue;
+		}
+		result = alloc_base_data();
 		resolve_delta(child, base, result);
 		if (base->ref_first == base->ref_last && base->ofs_last == -1)
 			free_base_data(base);
@@ -1006,6 +1167,51 @@ static void *threaded_second_pass(void *data)
 }
 #endif
 
+#ifndef NO_PTHREADS
+static void *threaded_hash(void *data)
+{
+	struct pipe_item item;
+
+	while (pipe_queue_pop(&hash_queue, &item)) {
+		struct object_entry *obj = item.obj;
+
+		hash_sha1_file(item.data, item.size, typename(obj->type),
+			       obj->idx.sha1);
+		sha1_object(item.data, NULL, item.size, obj->type,
+			    obj->idx.sha1);
+		free(item.data);
+	}
+	return NULL;
+}
+
+static void start_pipeline(void)
+{
+	int ret;
+
+	pipelined = 1;
+	pipe_queue_init(&write_queue, 64, 8 * 1024 * 1024);
+	pipe_queue_init(&hash_queue, 4096, 32 * 1024 * 1024);
+	ret = pthread_create(&write_queue.thread, NULL, threaded_write, NULL);
+	if (!ret)
+		ret = pthread_create(&hash_queue.thread, NULL, threaded_hash, NULL);
+	if (ret)
+		die(_("unable to create thread: %s"), strerror(ret));
+}
+
+static void stop_pipeline(void)
+{
+	if (write_block_len)
+		pipe_queue_push(&write_queue, write_block, write_block_len, NULL);
+	else
+		free(write_block);
+	write_block = NULL;
+	write_block_len = 0;
+	pipe_queue_finish(&write_queue);
+	pipe_queue_finish(&hash_queue);
+	pipelined = 0;
+}
+#endif
+
 /*
  * First pass:
  * - find locations of all objects;
@@ -1022,6 +1228,10 @@ static void parse_pack_objects(unsigned char *sha1)
 		progress = start_progress(
 				from_stdin ? _("Receiving objects") : _("Indexing objects"),
 				nr_objects);
+#ifndef NO_PTHREADS
+	if (nr_threads > 1 || getenv("GIT_FORCE_THREADS"))
+		start_pipeline();
+#endif
 	for (i = 0; i < nr_objects; i++) {
 		struct object_entry *obj = &objects[i];
 		void *data = unpack_raw_entry(obj, &delta->base, obj->idx.sha1);
@@ -1034,7 +1244,15 @@ static void parse_pack_objects(unsigned char *sha1)
 			/* large blobs, check later */
 			obj->real_type = OBJ_BAD;
 			nr_delays++;
-		} else
+		}
+#ifndef NO_PTHREADS
+		else if (pipelined) {
+			/* the hashing thread frees it */
+			pipe_queue_push(&hash_queue, data, obj->size, obj);
+			data = NULL;
+		}
+#endif
+		else
 			sha1_object(data, NULL, obj->size, obj->type, obj->idx.sha1);
 		free(data);
 		display_progress(progress, i+1);
@@ -1044,6 +1262,10 @@ static void parse_pack_objects(unsigned char *sha1)
 
 	/* Check pack integrity */
 	flush();
+#ifndef NO_PTHREADS
+	if (pipelined)
+		stop_pipeline();
+#endif
 	git_SHA1_Final(sha1, &input_ctx);
 	if (hashcmp(fill(20), sha1))
 		die(_("pack is corrupted (SHA1 mismatch)"));
@@ -1123,7 +1345,7 @@ static void resolve_deltas(void)
  * - append objects to convert thin pack to full pack if required
  * - write the final 20-byte SHA-1
  */
-static void fix_unresolved_deltas(struct sha1file *f, int nr_unresolved);
+static void fix_unresolved_deltas(struct sha1file *f);
 static void conclude_pack(int fix_thin_pack, const char *curr_pack, unsigned char *pack_sha1)
 {
 	if (nr_deltas == nr_resolved_deltas) {
@@ -1147,7 +1369,7 @@ static void conclude_pack(int fix_thin_pack, const char *curr_pack, unsigned cha
 		memset(objects + nr_objects + 1, 0,
 		       nr_unresolved * sizeof(*objects));
 		f = sha1fd(output_fd, curr_pack);
-		fix_unresolved_deltas(f, nr_unresolved);
+		fix_unresolved_deltas(f);
 		strbuf_addf(&msg, _("completed with %d local objects"),
 			    nr_objects - nr_objects_initial);
 		stop_progress_msg(&progress, msg.buf);
@@ -1223,66 +1445,258 @@ static struct object_entry *append_obj_to_pack(struct sha1file *f,
 	return obj;
 }
 
-static int delta_pos_compare(const void *_a, const void *_b)
+/* A missing base of a thin pack and the first delta that wants it */
+struct thin_base {
+	const unsigned char *sha1;
+	int obj_no;
+};
+
+static int thin_base_pos_compare(const void *_a, const void *_b)
 {
-	struct delta_entry *a = *(struct delta_entry **)_a;
-	struct delta_entry *b = *(struct delta_entry **)_b;
+	const struct thin_base *a = _a;
+	const struct thin_base *b = _b;
 	return a->obj_no - b->obj_no;
 }
 
-static void fix_unresolved_deltas(struct sha1file *f, int nr_unresolved)
+/*
+ * Since many unresolved deltas may well be themselves base objects
+ * for more unresolved deltas, we really want to include the
+ * smallest number of base objects that would cover as much delta
+ * as possible by picking the
+ * trunc deltas first, allowing for other deltas to resolve without
+ * additional base objects.  Since most base objects are to be found
+ * before deltas depending on them, a good heuristic is to start
+ * resolving deltas in the same order as their position in the pack.
+ *
+ * The deltas are sorted by base, so the ones that want the same base
+ * are next to each other; list each base once, in the order of the
+ * first delta that wants it.
+ */
+static struct thin_base *list_thin_bases(int *nr)
 {
-	struct delta_entry **sorted_by_pos;
+	struct thin_base *bases;
 	int i, n = 0;
 
-	/*
-	 * Since many unresolved deltas may well be themselves base objects
-	 * for more unresolved deltas, we really want to include the
-	 * smallest number of base objects that would cover as much delta
-	 * as possible by picking the
-	 * trunc deltas first, allowing for other deltas to resolve without
-	 * additional base objects.  Since most base objects are to be found
-	 * before deltas depending on them, a good heuristic is to start
-	 * resolving deltas in the same order as their position in the pack.
-	 */
-	sorted_by_pos = xmalloc(nr_unresolved * sizeof(*sorted_by_pos));
+	bases = xmalloc((nr_deltas - nr_resolved_deltas) * sizeof(*bases));
 	for (i = 0; i < nr_deltas; i++) {
-		if (objects[deltas[i].obj_no].real_type != OBJ_REF_DELTA)
+		struct delta_entry *d = &deltas[i];
+
+		if (objects[d->obj_no].real_type != OBJ_REF_DELTA)
+			continue;
+		if (n && !hashcmp(bases[n - 1].sha1, d->base.sha1)) {
+			if (bases[n - 1].obj_no > d->obj_no)
+				bases[n - 1].obj_no = d->obj_no;
 			continue;
-		sorted_by_pos[n++] = &deltas[i];
+		}
+		bases[n].sha1 = d->base.sha1;
+		bases[n].obj_no = d->obj_no;
+		n++;
+	}
+	qsort(bases, n, sizeof(*bases), thin_base_pos_compare);
+	*nr = n;
+	return bases;
+}
+
+/* Were the deltas that want "base" resolved by the bases before it? */
+static int thin_base_resolved(struct thin_base *base)
+{
+	int resolved;
+
+	counter_lock();
+	resolved = objects[base->obj_no].real_type != OBJ_REF_DELTA;
+	counter_unlock();
+	return resolved;
+}
+
+/*
+ * Read the base from the repository; NULL if we do not have it, or if
+ * the deltas that want it were resolved by the bases before it.
+ */
+static struct base_data *read_thin_base(struct thin_base *base,
+					enum object_type *type)
+{
+	const unsigned char *sha1 = base->sha1;
+	struct base_data *base_obj;
+
+	if (thin_base_resolved(base))
+		return NULL;
+
+	base_obj = alloc_base_data();
+	read_lock();
+	base_obj->data = read_sha1_file(sha1, type, &base_obj->size);
+	read_unlock();
+	if (!base_obj->data) {
+		free(base_obj);
+		return NULL;
+	}
+	if (check_sha1_signature(sha1, base_obj->data,
+				 base_obj->size, typename(*type)))
+		die(_("local object %s is corrupt"), sha1_to_hex(sha1));
+	return base_obj;
+}
+
+#ifndef NO_PTHREADS
+/*
+ * The main thread appends the bases to the pack one after the other,
+ * and hands each of them to the threads to resolve the deltas that
+ * want it, while it goes on reading and appending the next ones.
+ *
+ * A base that turns out to be an object of the pack is only known
+ * once that object is resolved.  If the thread resolving it is late,
+ * a copy we happen to have is appended although it was not needed,
+ * as the serial code does when the object comes late in the pack; the
+ * threads then claim each delta wanting it from either the object or
+ * the copy, whichever comes first.  The sender rarely sends objects
+ * that we have, so in practice the pack comes out as with one thread.
+ */
+static struct base_data **thin_queue;
+static int thin_queued, thin_taken, thin_queue_done;
+static pthread_cond_t thin_queue_cond;
+
+static void *threaded_fix_thin_pack(void *data)
+{
+	set_thread_data(data);
+	for (;;) {
+		struct base_data *base_obj;
+
+		work_lock();
+		while (thin_taken == thin_queued && !thin_queue_done)
+			pthread_cond_wait(&thin_queue_cond, &work_mutex);
+		if (thin_taken == thin_queued) {
+			work_unlock();
+			break;
+		}
+		base_obj = thin_queue[thin_taken++];
+		pthread_cond_broadcast(&thin_queue_cond);
+		work_unlock();
+
+		find_unresolved_deltas(base_obj);
+		counter_lock();
+		display_progress(progress, nr_resolved_deltas);
+		counter_unlock();
+	}
+	return NULL;
+}
+
+static void threaded_fix_unresolved_deltas(struct sha1file *f,
+					   struct thin_base *bases, int nr)
+{
+	/* do not read much further ahead than the threads can take */
+	int max_ahead = 2 * nr_threads;
+	int i;
+
+	thin_queue = xmalloc(nr * sizeof(*thin_queue));
+	thin_queued = thin_taken = thin_queue_done = 0;
+	init_thread();
+	pthread_cond_init(&thin_queue_cond, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		int ret = pthread_create(&thread_data[i].thread, NULL,
+					 threaded_fix_thin_pack, thread_data + i);
+		if (ret)
+			die(_("unable to create thread: %s"), strerror(ret));
 	}
-	qsort(sorted_by_pos, n, sizeof(*sorted_by_pos), delta_pos_compare);
 
-	for (i = 0; i < n; i++) {
-		struct delta_entry *d = sorted_by_pos[i];
+	for (i = 0; i < nr; i++) {
 		enum object_type type;
-		struct base_data *base_obj = alloc_base_data();
+		struct base_data *base_obj = read_thin_base(&bases[i], &type);
 
-		if (objects[d->obj_no].real_type != OBJ_REF_DELTA)
+		if (!base_obj)
 			continue;
-		base_obj->data = read_sha1_file(d->base.sha1, &type, &base_obj->size);
-		if (!base_obj->data)
+		/* the threads may have got there while we were reading it */
+		if (thin_base_resolved(&bases[i])) {
+			free(base_obj->data);
+			free(base_obj);
 			continue;
+		}
+		base_obj->obj = append_obj_to_pack(f, bases[i].sha1,
+					base_obj->data, base_obj->size, type);
+
+		work_lock();
+		while (thin_queued - thin_taken >= max_ahead)
+			pthread_cond_wait(&thin_queue_cond, &work_mutex);
+		thin_queue[thin_queued++] = base_obj;
+		pthread_cond_broadcast(&thin_queue_cond);
+		work_unlock();
+	}
+
+	work_lock();
+	thin_queue_done = 1;
+	pthread_cond_broadcast(&thin_queue_cond);
+	work_unlock();
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(thread_data[i].thread, NULL);
+	pthread_cond_destroy(&thin_queue_cond);
+	cleanup_thread();
+	free(thin_queue);
+	thin_queue = NULL;
+}
+#endif
+
+static void fix_unresolved_deltas(struct sha1file *f)
+{
+	struct thin_base *bases;
+	int i, nr;
+
+	bases = list_thin_bases(&nr);
+
+#ifndef NO_PTHREADS
+	if (nr > 1 && (nr_threads > 1 || getenv("GIT_FORCE_THREADS"))) {
+		threaded_fix_unresolved_deltas(f, bases, nr);
+		free(bases);
+		return;
+	}
+#endif
 
-		if (check_sha1_signature(d->base.sha1, base_obj->data,
-				base_obj->size, typename(type)))
-			die(_("local object %s is corrupt"), sha1_to_hex(d->base.sha1));
-		base_obj->obj = append_obj_to_pack(f, d->base.sha1,
+	for (i = 0; i < nr; i++) {
+		enum object_type type;
+		struct base_data *base_obj = read_thin_base(&bases[i], &type);
+
+		if (!base_obj)
+			continue;
+		base_obj->obj = append_obj_to_pack(f, bases[i].sha1,
 					base_obj->data, base_obj->size, type);
 		find_unresolved_deltas(base_obj);
 		display_progress(progress, nr_resolved_deltas);
 	}
-	free(sorted_by_pos);
+	free(bases);
+}
+
+/*
+ * Mark the pack as coming from the promisor remote of a partial clone;
+ * see Documentation/technical/partial-clone.txt.
+ */
+static void write_promisor_file(const char *final_pack_name,
+				const char *promisor_msg, unsigned char *sha1)
+{
+	struct strbuf name = STRBUF_INIT;
+
+	if (!final_pack_name)
+		strbuf_addf(&name, "%s/pack/pack-%s.pack",
+			    get_object_directory(), sha1_to_hex(sha1));
+	else
+		strbuf_addstr(&name, final_pack_name);
+	if (!has_extension(name.buf, ".pack"))
+		die(_("packfile name '%s' does not end with '.pack'"), name.buf);
+	strbuf_setlen(&name, name.len - strlen(".pack"));
+	strbuf_addstr(&name, ".promisor");
+	if (*promisor_msg)
+		write_file(name.buf, 1, "%s\n", promisor_msg);
+	else
+		write_file(name.buf, 1, "%s", "");
+	strbuf_release(&name);
 }
 
 static void final(const char *final_pack_name, const char *curr_pack_name,
 		  const char *final_index_name, const char *curr_index_name,
+		  const char *final_rev_name, const char *curr_rev_name,
 		  const char *keep_name, const char *keep_msg,
-		  unsigned char *sha1)
+		  const char *promisor_msg, unsigned char *sha1)
 {
 	const char *report = "pack";
 	char name[PATH_MAX];
 	int err;
+	int into_odb = !final_pack_name && !final_index_name;
 
 	if (!from_stdin) {
 		close(input_fd);
@@ -1317,6 +1731,10 @@ static void final(const char *final_pack_name, const char *curr_pack_name,
 		}
 	}
 
+	/* before the pack appears, so that it is never taken for a normal one */
+	if (promisor_msg)
+		write_promisor_file(final_pack_name, promisor_msg, sha1);
+
 	if (final_pack_name != curr_pack_name) {
 		if (!final_pack_name) {
 			snprintf(name, sizeof(name), "%s/pack/pack-%s.pack",
@@ -1328,6 +1746,17 @@ static void final(const char *final_pack_name, const char *curr_pack_name,
 	} else if (from_stdin)
 		chmod(final_pack_name, 0444);
 
+	if (curr_rev_name && final_rev_name != curr_rev_name) {
+		if (!final_rev_name) {
+			snprintf(name, sizeof(name), "%s/pack/pack-%s.rev",
+				 get_object_directory(), sha1_to_hex(sha1));
+			final_rev_name = name;
+		}
+		if (move_temp_to_file(curr_rev_name, final_rev_name))
+			die(_("cannot store reverse index file"));
+	} else if (curr_rev_name)
+		chmod(final_rev_name, 0444);
+
 	if (final_index_name != curr_index_name) {
 		if (!final_index_name) {
 			snprintf(name, sizeof(name), "%s/pack/pack-%s.idx",
@@ -1339,6 +1768,10 @@ static void final(const char *final_pack_name, const char *curr_pack_name,
 	} else
 		chmod(final_index_name, 0444);
 
+	/* keep the multi-pack-index covering the pack we just stored */
+	if (into_odb && core_multi_pack_index)
+		write_midx_file(get_object_directory(), MIDX_KEEP_BITMAP);
+
 	if (!from_stdin) {
 		printf("%s\n", sha1_to_hex(sha1));
 	} else {
@@ -1371,6 +1804,13 @@ static int git_index_pack_config(const char *k, const char *v, void *cb)
 			die(_("bad pack.indexversion=%"PRIu32), opts->version);
 		return 0;
 	}
+	if (!strcmp(k, "pack.writereverseindex")) {
+		if (git_config_bool(k, v))
+			opts->flags |= WRITE_REV;
+		else
+			opts->flags &= ~WRITE_REV;
+		return 0;
+	}
 	if (!strcmp(k, "pack.threads")) {
 		nr_threads = git_config_int(k, v);
 		if (nr_threads < 0)
@@ -1503,10 +1943,11 @@ static void show_pack_info(int stat_only)
 int cmd_index_pack(int argc, const char **argv, const char *prefix)
 {
 	int i, fix_thin_pack = 0, verify = 0, stat_only = 0;
-	const char *curr_index;
-	const char *index_name = NULL, *pack_name = NULL;
+	const char *curr_index, *curr_rev = NULL;
+	const char *index_name = NULL, *pack_name = NULL, *rev_name = NULL;
 	const char *keep_name = NULL, *keep_msg = NULL;
-	char *index_name_buf = NULL, *keep_name_buf = NULL;
+	const char *promisor_msg = NULL;
+	char *index_name_buf = NULL, *keep_name_buf = NULL, *rev_name_buf = NULL;
 	struct pack_idx_entry **idx_objects;
 	struct pack_idx_option opts;
 	unsigned char pack_sha1[20];
@@ -1516,6 +1957,7 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 		usage(index_pack_usage);
 
 	check_replace_refs = 0;
+	fetch_if_missing = 0;
 
 	reset_pack_idx_option(&opts);
 	git_config(git_index_pack_config, &opts);
@@ -1536,6 +1978,10 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 			} else if (!strcmp(arg, "--check-self-contained-and-connected")) {
 				strict = 1;
 				check_self_contained_and_connected = 1;
+			} else if (!strcmp(arg, "--rev-index")) {
+				opts.flags |= WRITE_REV;
+			} else if (!strcmp(arg, "--no-rev-index")) {
+				opts.flags &= ~WRITE_REV;
 			} else if (!strcmp(arg, "--verify")) {
 				verify = 1;
 			} else if (!strcmp(arg, "--verify-stat")) {
@@ -1549,6 +1995,11 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 				keep_msg = "";
 			} else if (starts_with(arg, "--keep=")) {
 				keep_msg = arg + 7;
+			} else if (!strcmp(arg, "--promisor")) {
+				promisor_msg = "";
+				promisor_pack = 1;
+			} else if (skip_prefix(arg, "--promisor=", &promisor_msg)) {
+				promisor_pack = 1;
 			} else if (starts_with(arg, "--threads=")) {
 				char *end;
 				nr_threads = strtoul(arg+10, &end, 0);
@@ -1612,6 +2063,16 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 		strcpy(index_name_buf + len - 5, ".idx");
 		index_name = index_name_buf;
 	}
+	if ((opts.flags & WRITE_REV) && pack_name) {
+		int len = strlen(pack_name);
+		if (!has_extension(pack_name, ".pack"))
+			die(_("packfile name '%s' does not end with '.pack'"),
+			    pack_name);
+		rev_name_buf = xmalloc(len);
+		memcpy(rev_name_buf, pack_name, len - 5);
+		strcpy(rev_name_buf + len - 5, ".rev");
+		rev_name = rev_name_buf;
+	}
 	if (keep_msg && !keep_name && pack_name) {
 		int len = strlen(pack_name);
 		if (!has_extension(pack_name, ".pack"))
@@ -1658,18 +2119,26 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 	for (i = 0; i < nr_objects; i++)
 		idx_objects[i] = &objects[i].idx;
 	curr_index = write_idx_file(index_name, idx_objects, nr_objects, &opts, pack_sha1);
+	/* next to the pack; or into the odb with it, if that is where it goes */
+	if (!verify && (opts.flags & WRITE_REV) && (rev_name || !index_name))
+		curr_rev = write_rev_file(rev_name, idx_objects, nr_objects,
+					  pack_sha1);
 	free(idx_objects);
 
 	if (!verify)
 		final(pack_name, curr_pack,
 		      index_name, curr_index,
-		      keep_name, keep_msg,
+		      rev_name, curr_rev,
+		      keep_name, keep_msg, promisor_msg,
 		      pack_sha1);
 	else
 		close(input_fd);
 	free(objects);
 	free(index_name_buf);
 	free(keep_name_buf);
+	free(rev_name_buf);
+	if (rev_name == NULL)
+		free((void *) curr_rev);
 	if (pack_name == NULL)
 		free((void *) curr_pack);
 	if (index_name == NULL)
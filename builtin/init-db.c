@@ -237,6 +237,17 @@ static int create_default_files(const char *template_path)
 	reinit = (!access(path, R_OK)
 		  || readlink(path, junk, sizeof(junk)-1) != -1);
 	if (!reinit) {
+		if (ref_storage_format == REF_STORAGE_REFTABLE) {
+			/* an empty stack of tables */
+			int fd;
+			safe_create_dir(git_path("reftable"), 1);
+			fd = open(git_path("reftable/tables.list"),
+				  O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (fd < 0 || close(fd))
+				die_errno(_("cannot create %s"),
+					  git_path("reftable/tables.list"));
+			adjust_shared_perm(git_path("reftable/tables.list"));
+		}
 		if (create_symref("HEAD", "refs/heads/master", NULL) < 0)
 			exit(1);
 	}
@@ -244,6 +255,8 @@ static int create_default_files(const char *template_path)
 	/* This forces creation of new config file */
 	sprintf(repo_version_string, "%d", GIT_REPO_VERSION);
 	git_config_set("core.repositoryformatversion", repo_version_string);
+	if (!reinit && ref_storage_format == REF_STORAGE_REFTABLE)
+		git_config_set("core.refstorage", "reftable");
 
 	path[len] = 0;
 	strcpy(path + len, "config");
@@ -0,0 +1,72 @@
+#include "builtin.h"
+#include "cache.h"
+#include "parse-options.h"
+#include "midx.h"
+
+static const char * const builtin_multi_pack_index_usage[] = {
+	N_("git multi-pack-index [--object-dir=<dir>] [--bitmap] write"),
+	N_("git multi-pack-index [--object-dir=<dir>] read"),
+	NULL
+};
+
+static const char *object_dir;
+static int write_bitmap;
+
+static int midx_read(void)
+{
+	struct multi_pack_index *m = load_multi_pack_index(object_dir);
+	uint32_t i;
+
+	if (!m)
+		die(_("could not load multi-pack-index in '%s'"), object_dir);
+
+	printf("header: %08x %d %d %d\n",
+	       get_be32(m->data), m->data[4], m->data[5], m->data[6]);
+	printf("chunks:");
+	if (m->chunk_pack_names)
+		printf(" pack-names");
+	if (m->chunk_oid_fanout)
+		printf(" oid-fanout");
+	if (m->chunk_oid_lookup)
+		printf(" oid-lookup");
+	if (m->chunk_object_offsets)
+		printf(" object-offsets");
+	if (m->chunk_large_offsets)
+		printf(" large-offsets");
+	printf("\nnum_objects: %u\n", m->num_objects);
+	printf("packs:\n");
+	for (i = 0; i < m->num_packs; i++)
+		printf("%s\n", m->pack_names[i]);
+
+	close_midx(m);
+	return 0;
+}
+
+int cmd_multi_pack_index(int argc, const char **argv, const char *prefix)
+{
+	static struct option builtin_multi_pack_index_options[] = {
+		OPT_STRING(0, "object-dir", &object_dir, N_("dir"),
+			   N_("object directory containing set of packfile and pack-index pairs")),
+		OPT_BOOL(0, "bitmap", &write_bitmap,
+			 N_("write a reachability bitmap for the multi-pack-index")),
+		OPT_END(),
+	};
+
+	git_config(git_default_config, NULL);
+
+	argc = parse_options(argc, argv, prefix,
+			     builtin_multi_pack_index_options,
+			     builtin_multi_pack_index_usage, 0);
+
+	if (!object_dir)
+		object_dir = get_object_directory();
+
+	if (argc == 1 && !strcmp(argv[0], "write"))
+		return !!write_midx_file(object_dir,
+					 write_bitmap ? MIDX_WRITE_BITMAP : 0);
+	if (argc == 1 && !strcmp(argv[0], "read"))
+		return midx_read();
+
+	usage_with_options(builtin_multi_pack_index_usage,
+			   builtin_multi_pack_index_options);
+}
@@ -20,6 +20,8 @@
 #include "streaming.h"
 #include "thread-utils.h"
 #include "pack-bitmap.h"
+#include "list-objects-filter.h"
+#include "delta-islands.h"
 
 static const char *pack_usage[] = {
 	N_("git pack-objects --stdout [options...] [< ref-list | < object-list]"),
@@ -44,6 +46,8 @@ static unsigned long unpack_unreachable_expiration;
 static int local;
 static int incremental;
 static int ignore_packed_keep;
+static int use_delta_islands;
+static struct list_objects_filter_options filter_options;
 static int allow_ofs_delta;
 static struct pack_idx_option pack_idx_opts;
 static const char *base_name;
@@ -60,7 +64,7 @@ static int pack_compression_seen;
 
 static struct packed_git *reuse_packfile;
 static uint32_t reuse_packfile_objects;
-static off_t reuse_packfile_offset;
+static struct bitmap *reuse_packfile_bitmap;
 
 static int use_bitmap_index = 1;
 static int write_bitmap_index;
@@ -346,7 +350,8 @@ static unsigned long write_reuse_object(struct sha1file *f, struct object_entry
 {
 	struct packed_git *p = entry->in_pack;
 	struct pack_window *w_curs = NULL;
-	struct revindex_entry *revidx;
+	struct pack_revindex *pridx;
+	int pos;
 	off_t offset;
 	enum object_type type = entry->type;
 	unsigned long datalen;
@@ -359,10 +364,11 @@ static unsigned long write_reuse_object(struct sha1file *f, struct object_entry
 	hdrlen = encode_in_pack_object_header(type, entry->size, header);
 
 	offset = entry->in_pack_offset;
-	revidx = find_pack_revindex(p, offset);
-	datalen = revidx[1].offset - offset;
+	pos = find_pack_revindex(p, offset, &pridx);
+	datalen = revindex_offset(pridx, pos + 1) - offset;
 	if (!pack_to_stdout && p->index_version > 1 &&
-	    check_pack_crc(p, &w_curs, offset, datalen, revidx->nr)) {
+	    check_pack_crc(p, &w_curs, offset, datalen,
+			   revindex_nr(pridx, pos))) {
 		error("bad packed object CRC for %s", sha1_to_hex(entry->idx.sha1));
 		unuse_pack(&w_curs);
 		return write_no_reuse_object(f, entry, limit, usable_delta);
@@ -705,57 +711,148 @@ static struct object_entry **compute_write_order(void)
 	return wo;
 }
 
-static off_t write_reused_pack(struct sha1file *f)
-{
-	unsigned char buffer[8192];
-	off_t to_write, total;
-	int fd;
+/*
+ * The objects reused from reuse_packfile move up in the pack we write
+ * when objects before them are left out.  Each chunk records by how
+ * much, starting at the object at "original".
+ */
+static struct reused_chunk {
+	off_t original;
+	off_t difference;
+} *reused_chunks;
+static int reused_chunks_nr, reused_chunks_alloc;
 
-	if (!is_pack_valid(reuse_packfile))
-		die("packfile is invalid: %s", reuse_packfile->pack_name);
+static void record_reused_object(off_t where, off_t offset)
+{
+	if (reused_chunks_nr &&
+	    reused_chunks[reused_chunks_nr - 1].difference == offset)
+		return;
 
-	fd = git_open_noatime(reuse_packfile->pack_name);
-	if (fd < 0)
-		die_errno("unable to open packfile for reuse: %s",
-			  reuse_packfile->pack_name);
+	ALLOC_GROW(reused_chunks, reused_chunks_nr + 1, reused_chunks_alloc);
+	reused_chunks[reused_chunks_nr].original = where;
+	reused_chunks[reused_chunks_nr].difference = offset;
+	reused_chunks_nr++;
+}
 
-	if (lseek(fd, sizeof(struct pack_header), SEEK_SET) == -1)
-		die_errno("unable to seek in reused packfile");
+/* How much the reused object at "where" moved up. */
+static off_t find_reused_offset(off_t where)
+{
+	int lo = 0, hi = reused_chunks_nr;
 
-	if (reuse_packfile_offset < 0)
-		reuse_packfile_offset = reuse_packfile->pack_size - 20;
+	while (lo < hi) {
+		int mi = lo + (hi - lo) / 2;
+		if (where == reused_chunks[mi].original)
+			return reused_chunks[mi].difference;
+		if (where < reused_chunks[mi].original)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
 
-	total = to_write = reuse_packfile_offset - sizeof(struct pack_header);
+	/* the chunks start at the first object, so lo is at least 1 */
+	return reused_chunks[lo - 1].difference;
+}
 
-	while (to_write) {
-		int read_pack = xread(fd, buffer, sizeof(buffer));
+/*
+ * Reused objects that follow each other in reuse_packfile, and keep
+ * their deltas as they are, are copied as one range.
+ */
+struct reuse_range {
+	off_t start, end;
+};
 
-		if (read_pack <= 0)
-			die_errno("unable to read from reused packfile");
+static void flush_reuse_range(struct sha1file *f, struct reuse_range *range,
+			      struct pack_window **w_curs)
+{
+	if (range->end > range->start)
+		copy_pack_data(f, reuse_packfile, w_curs, range->start,
+			       range->end - range->start);
+	range->start = range->end = 0;
+}
 
-		if (read_pack > to_write)
-			read_pack = to_write;
+/*
+ * Write the object at "pos" in reuse_packfile, which will be at "out"
+ * in the pack we write.  Returns its size there.
+ */
+static off_t write_reused_pack_one(struct sha1file *f, struct pack_revindex *pridx,
+				   size_t pos, off_t out, struct reuse_range *range,
+				   struct pack_window **w_curs)
+{
+	off_t offset = revindex_offset(pridx, pos);
+	off_t next = revindex_offset(pridx, pos + 1);
+	off_t cur = offset, fixup = 0, base_offset;
+	enum object_type type;
+	unsigned long size;
 
-		sha1write(f, buffer, read_pack);
-		to_write -= read_pack;
+	record_reused_object(offset, offset - out);
 
-		/*
-		 * We don't know the actual number of objects written,
-		 * only how many bytes written, how many bytes total, and
-		 * how many objects total. So we can fake it by pretending all
-		 * objects we are writing are the same size. This gives us a
-		 * smooth progress meter, and at the end it matches the true
-		 * answer.
-		 */
-		written = reuse_packfile_objects *
-				(((double)(total - to_write)) / total);
-		display_progress(progress_state, written);
+	type = unpack_object_header(reuse_packfile, w_curs, &cur, &size);
+	if (type == OBJ_OFS_DELTA) {
+		base_offset = get_delta_base(reuse_packfile, w_curs, &cur,
+					     type, offset);
+		if (!base_offset)
+			die("bad delta base in reused packfile %s at %"PRIuMAX,
+			    reuse_packfile->pack_name, (uintmax_t)offset);
+		fixup = find_reused_offset(offset) -
+			find_reused_offset(base_offset);
+	}
+
+	if (!fixup) {
+		if (range->end != offset) {
+			flush_reuse_range(f, range, w_curs);
+			range->start = offset;
+		}
+		range->end = next;
+		return next - offset;
+	} else {
+		/* the object moved further than its base; rewrite the offset */
+		unsigned char header[10], dheader[10];
+		unsigned hdrlen, i;
+		off_t ofs = offset - base_offset - fixup;
+
+		flush_reuse_range(f, range, w_curs);
+		hdrlen = encode_in_pack_object_header(OBJ_OFS_DELTA, size, header);
+		i = sizeof(dheader) - 1;
+		dheader[i] = ofs & 127;
+		while (ofs >>= 7)
+			dheader[--i] = 128 | (--ofs & 127);
+		sha1write(f, header, hdrlen);
+		sha1write(f, dheader + i, sizeof(dheader) - i);
+		copy_pack_data(f, reuse_packfile, w_curs, cur, next - cur);
+		return hdrlen + sizeof(dheader) - i + next - cur;
 	}
+}
+
+static off_t write_reused_pack(struct sha1file *f)
+{
+	struct pack_revindex *pridx;
+	struct pack_window *w_curs = NULL;
+	struct reuse_range range = { 0, 0 };
+	off_t out = sizeof(struct pack_header);
+	size_t i;
+	uint32_t offset;
+
+	if (!is_pack_valid(reuse_packfile))
+		die("packfile is invalid: %s", reuse_packfile->pack_name);
+	pridx = revindex_for_pack(reuse_packfile);
+
+	for (i = 0; i < reuse_packfile_bitmap->word_alloc; i++) {
+		eword_t word = reuse_packfile_bitmap->words[i];
+		size_t pos = i * BITS_IN_WORD;
+
+		for (offset = 0; offset < BITS_IN_WORD; ++offset) {
+			if ((word >> offset) == 0)
+				break;
 
-	close(fd);
-	written = reuse_packfile_objects;
-	display_progress(progress_state, written);
-	return reuse_packfile_offset - sizeof(struct pack_header);
+			offset += ewah_bit_ctz64(word >> offset);
+			out += write_reused_pack_one(f, pridx, pos + offset,
+						     out, &range, &w_curs);
+			display_progress(progress_state, ++written);
+		}
+	}
+	flush_reuse_range(f, &range, &w_curs);
+	unuse_pack(&w_curs);
+	return out - sizeof(struct pack_header);
 }
 
 static void write_pack_file(void)
@@ -1324,6 +1421,38 @@ static void cleanup_preferred_base(void)
 	done_pbase_paths_num = done_pbase_paths_alloc = 0;
 }
 
+#ifndef NO_PTHREADS
+
+#define read_lock()		obj_read_lock()
+#define read_unlock()		obj_read_unlock()
+
+static pthread_mutex_t cache_mutex;
+#define cache_lock()		pthread_mutex_lock(&cache_mutex)
+#define cache_unlock()		pthread_mutex_unlock(&cache_mutex)
+
+static pthread_mutex_t progress_mutex;
+#define progress_lock()		pthread_mutex_lock(&progress_mutex)
+#define progress_unlock()	pthread_mutex_unlock(&progress_mutex)
+
+#else
+
+#define read_lock()		(void)0
+#define read_unlock()		(void)0
+#define cache_lock()		(void)0
+#define cache_unlock()		(void)0
+#define progress_lock()		(void)0
+#define progress_unlock()	(void)0
+
+#endif
+
+/*
+ * This may run in several threads at once (see ll_check_objects()).
+ * The pack windows and the object lookup are shared and only used under
+ * read_lock(); reading from a window we hold is not, so that the page
+ * faults of one thread do not hold up the others.  A delta we can reuse
+ * is only recorded in entry->delta; get_object_details() links it to
+ * its base afterwards.
+ */
 static void check_object(struct object_entry *entry)
 {
 	if (entry->in_pack) {
@@ -1336,7 +1465,9 @@ static void check_object(struct object_entry *entry)
 		off_t ofs;
 		unsigned char *buf, c;
 
+		read_lock();
 		buf = use_pack(p, &w_curs, entry->in_pack_offset, &avail);
+		read_unlock();
 
 		/*
 		 * We want in_pack_type even if we do not reuse delta
@@ -1360,17 +1491,24 @@ static void check_object(struct object_entry *entry)
 			entry->in_pack_header_size = used;
 			if (entry->type < OBJ_COMMIT || entry->type > OBJ_BLOB)
 				goto give_up;
+			read_lock();
 			unuse_pack(&w_curs);
+			read_unlock();
 			return;
 		case OBJ_REF_DELTA:
-			if (reuse_delta && !entry->preferred_base)
+			if (reuse_delta && !entry->preferred_base) {
+				read_lock();
 				base_ref = use_pack(p, &w_curs,
 						entry->in_pack_offset + used, NULL);
+				read_unlock();
+			}
 			entry->in_pack_header_size = used + 20;
 			break;
 		case OBJ_OFS_DELTA:
+			read_lock();
 			buf = use_pack(p, &w_curs,
 				       entry->in_pack_offset + used, NULL);
+			read_unlock();
 			used_0 = 0;
 			c = buf[used_0++];
 			ofs = c & 127;
@@ -1391,21 +1529,28 @@ static void check_object(struct object_entry *entry)
 				goto give_up;
 			}
 			if (reuse_delta && !entry->preferred_base) {
-				struct revindex_entry *revidx;
-				revidx = find_pack_revindex(p, ofs);
-				if (!revidx)
+				struct pack_revindex *pridx;
+				int pos;
+				read_lock();
+				pos = find_pack_revindex(p, ofs, &pridx);
+				read_unlock();
+				if (pos < 0)
 					goto give_up;
-				base_ref = nth_packed_object_sha1(p, revidx->nr);
+				base_ref = nth_packed_object_sha1(p,
+						revindex_nr(pridx, pos));
 			}
 			entry->in_pack_header_size = used + used_0;
 			break;
 		}
 
-		if (base_ref && (base_entry = packlist_find(&to_pack, base_ref, NULL))) {
+		if (base_ref && (base_entry = packlist_find(&to_pack, base_ref, NULL)) &&
+		    (!use_delta_islands ||
+		     in_same_island(entry->idx.sha1, base_entry->idx.sha1))) {
 			/*
 			 * If base_ref was set above that means we wish to
 			 * reuse delta data, and we even found that base
-			 * in the list of objects we want to pack. Goodie!
+			 * in the list of objects we want to pack (and in
+			 * the islands of the object). Goodie!
 			 *
 			 * Depth value does not matter - find_deltas() will
 			 * never consider reused delta as the base object to
@@ -1415,9 +1560,9 @@ static void check_object(struct object_entry *entry)
 			entry->type = entry->in_pack_type;
 			entry->delta = base_entry;
 			entry->delta_size = entry->size;
-			entry->delta_sibling = base_entry->delta_child;
-			base_entry->delta_child = entry;
+			read_lock();
 			unuse_pack(&w_curs);
+			read_unlock();
 			return;
 		}
 
@@ -1427,11 +1572,15 @@ static void check_object(struct object_entry *entry)
 			 * final object type is.  Let's extract the actual
 			 * object size from the delta header.
 			 */
+			read_lock();
 			entry->size = get_size_from_delta(p, &w_curs,
 					entry->in_pack_offset + entry->in_pack_header_size);
+			read_unlock();
 			if (entry->size == 0)
 				goto give_up;
+			read_lock();
 			unuse_pack(&w_curs);
+			read_unlock();
 			return;
 		}
 
@@ -1441,7 +1590,9 @@ static void check_object(struct object_entry *entry)
 		 * at this point...
 		 */
 		give_up:
+		read_lock();
 		unuse_pack(&w_curs);
+		read_unlock();
 	}
 
 	entry->type = sha1_object_info(entry->idx.sha1, &entry->size);
@@ -1470,26 +1621,6 @@ static int pack_offset_sort(const void *_a, const void *_b)
 			(a->in_pack_offset > b->in_pack_offset);
 }
 
-static void get_object_details(void)
-{
-	uint32_t i;
-	struct object_entry **sorted_by_offset;
-
-	sorted_by_offset = xcalloc(to_pack.nr_objects, sizeof(struct object_entry *));
-	for (i = 0; i < to_pack.nr_objects; i++)
-		sorted_by_offset[i] = to_pack.objects + i;
-	qsort(sorted_by_offset, to_pack.nr_objects, sizeof(*sorted_by_offset), pack_offset_sort);
-
-	for (i = 0; i < to_pack.nr_objects; i++) {
-		struct object_entry *entry = sorted_by_offset[i];
-		check_object(entry);
-		if (big_file_threshold < entry->size)
-			entry->no_try_delta = 1;
-	}
-
-	free(sorted_by_offset);
-}
-
 /*
  * We search for deltas in a list sorted by type, by filename hash, and then
  * by size, so that we see progressively smaller and smaller files.
@@ -1516,6 +1647,11 @@ static int type_size_sort(const void *_a, const void *_b)
 		return -1;
 	if (a->preferred_base < b->preferred_base)
 		return 1;
+	if (use_delta_islands) {
+		int cmp = island_delta_cmp(a->idx.sha1, b->idx.sha1);
+		if (cmp)
+			return cmp;
+	}
 	if (a->size > b->size)
 		return -1;
 	if (a->size < b->size)
@@ -1546,31 +1682,6 @@ static int delta_cacheable(unsigned long src_size, unsigned long trg_size,
 	return 0;
 }
 
-#ifndef NO_PTHREADS
-
-static pthread_mutex_t read_mutex;
-#define read_lock()		pthread_mutex_lock(&read_mutex)
-#define read_unlock()		pthread_mutex_unlock(&read_mutex)
-
-static pthread_mutex_t cache_mutex;
-#define cache_lock()		pthread_mutex_lock(&cache_mutex)
-#define cache_unlock()		pthread_mutex_unlock(&cache_mutex)
-
-static pthread_mutex_t progress_mutex;
-#define progress_lock()		pthread_mutex_lock(&progress_mutex)
-#define progress_unlock()	pthread_mutex_unlock(&progress_mutex)
-
-#else
-
-#define read_lock()		(void)0
-#define read_unlock()		(void)0
-#define cache_lock()		(void)0
-#define cache_unlock()		(void)0
-#define progress_lock()		(void)0
-#define progress_unlock()	(void)0
-
-#endif
-
 static int try_delta(struct unpacked *trg, struct unpacked *src,
 		     unsigned max_depth, unsigned long *mem_usage)
 {
@@ -1585,6 +1696,11 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 	if (trg_entry->type != src_entry->type)
 		return -1;
 
+	/* Nor against a base some of the islands of trg do not have */
+	if (use_delta_islands &&
+	    !in_same_island(trg_entry->idx.sha1, src_entry->idx.sha1))
+		return -1;
+
 	/*
 	 * We do not bother to try a delta that we discarded on an
 	 * earlier try, but only when reusing delta data.  Note that
@@ -1625,10 +1741,9 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 		return 0;
 
 	/* Load data if not already done */
+	/* read_sha1_file() locks by itself, and inflates without the lock */
 	if (!trg->data) {
-		read_lock();
 		trg->data = read_sha1_file(trg_entry->idx.sha1, &type, &sz);
-		read_unlock();
 		if (!trg->data)
 			die("object %s cannot be read",
 			    sha1_to_hex(trg_entry->idx.sha1));
@@ -1638,9 +1753,7 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 		*mem_usage += sz;
 	}
 	if (!src->data) {
-		read_lock();
 		src->data = read_sha1_file(src_entry->idx.sha1, &type, &sz);
-		read_unlock();
 		if (!src->data) {
 			if (src_entry->preferred_base) {
 				static int warned = 0;
@@ -1909,16 +2022,66 @@ struct thread_params {
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
 	unsigned *processed;
+
+	/* for GIT_TRACE_PACK_THREADS */
+	unsigned nr_units;
+	unsigned long nr_objects;
+	uint64_t weight_done;
+	uint64_t busy_ns;
 };
 
 static pthread_cond_t progress_cond;
 
+/*
+ * The work is split by weight rather than by the number of objects, as
+ * the time find_deltas() spends on an object grows with its size.
+ * delta_weight[i] is the total weight of the first i objects of the
+ * list ll_find_deltas() was given.
+ */
+static struct object_entry **delta_list;
+static uint64_t *delta_weight;
+
+static void init_delta_weight(struct object_entry **list, unsigned list_size)
+{
+	unsigned i;
+
+	delta_list = list;
+	delta_weight = xmalloc((list_size + 1) * sizeof(*delta_weight));
+	delta_weight[0] = 0;
+	for (i = 0; i < list_size; i++)
+		delta_weight[i + 1] = delta_weight[i] + list[i]->size + 1;
+}
+
+static uint64_t list_weight(struct object_entry **list, unsigned nr)
+{
+	unsigned start = list - delta_list;
+
+	return delta_weight[start + nr] - delta_weight[start];
+}
+
+/* The number of objects at the start of "list" that weigh "weight". */
+static unsigned split_by_weight(struct object_entry **list, unsigned nr,
+				uint64_t weight)
+{
+	unsigned start = list - delta_list;
+	unsigned lo = 0, hi = nr;
+
+	while (lo < hi) {
+		unsigned mi = lo + (hi - lo) / 2;
+		if (delta_weight[start + mi + 1] - delta_weight[start] < weight)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	return lo < nr ? lo + 1 : nr;
+}
+
 /*
  * Mutex and conditional variable can't be statically-initialized on Windows.
  */
 static void init_threaded_search(void)
 {
-	init_recursive_mutex(&read_mutex);
+	enable_obj_read_lock();
 	pthread_mutex_init(&cache_mutex, NULL);
 	pthread_mutex_init(&progress_mutex, NULL);
 	pthread_cond_init(&progress_cond, NULL);
@@ -1929,7 +2092,7 @@ static void cleanup_threaded_search(void)
 {
 	set_try_to_free_routine(old_try_to_free_routine);
 	pthread_cond_destroy(&progress_cond);
-	pthread_mutex_destroy(&read_mutex);
+	disable_obj_read_lock();
 	pthread_mutex_destroy(&cache_mutex);
 	pthread_mutex_destroy(&progress_mutex);
 }
@@ -1939,10 +2102,17 @@ static void *threaded_find_deltas(void *arg)
 	struct thread_params *me = arg;
 
 	while (me->remaining) {
+		uint64_t start = getnanotime();
+
 		find_deltas(me->list, &me->remaining,
 			    me->window, me->depth, me->processed);
 
 		progress_lock();
+		/* what was not stolen from us, we did */
+		me->nr_units++;
+		me->nr_objects += me->list_size;
+		me->weight_done += list_weight(me->list, me->list_size);
+		me->busy_ns += getnanotime() - start;
 		me->working = 0;
 		pthread_cond_signal(&progress_cond);
 		progress_unlock();
@@ -1970,6 +2140,7 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 {
 	struct thread_params *p;
 	int i, ret, active_threads = 0;
+	uint64_t start_ns;
 
 	init_threaded_search();
 
@@ -1984,10 +2155,14 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 		fprintf(stderr, "Delta compression using up to %d threads.\n",
 				delta_search_threads);
 	p = xcalloc(delta_search_threads, sizeof(*p));
+	init_delta_weight(list, list_size);
+	start_ns = getnanotime();
 
 	/* Partition the work amongst work threads. */
 	for (i = 0; i < delta_search_threads; i++) {
-		unsigned sub_size = list_size / (delta_search_threads - i);
+		uint64_t weight = list_weight(list, list_size);
+		unsigned sub_size = split_by_weight(list, list_size,
+				weight / (delta_search_threads - i));
 
 		/* don't use too small segments or no deltas will be found */
 		if (sub_size < 2*window && i+1 < delta_search_threads)
@@ -2028,15 +2203,16 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 
 	/*
 	 * Now let's wait for work completion.  Each time a thread is done
-	 * with its work, we steal half of the remaining work from the
-	 * thread with the largest number of unprocessed objects and give
-	 * it to that newly idle thread.  This ensure good load balancing
-	 * until the remaining object list segments are simply too short
-	 * to be worth splitting anymore.
+	 * with its work, we steal half of the remaining work, by weight,
+	 * from the thread with the most of it left and give it to that
+	 * newly idle thread.  This ensure good load balancing until the
+	 * remaining object list segments are simply too short to be worth
+	 * splitting anymore.
 	 */
 	while (active_threads) {
 		struct thread_params *target = NULL;
 		struct thread_params *victim = NULL;
+		uint64_t victim_weight = 0;
 		unsigned sub_size = 0;
 
 		progress_lock();
@@ -2049,12 +2225,30 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 			pthread_cond_wait(&progress_cond, &progress_mutex);
 		}
 
-		for (i = 0; i < delta_search_threads; i++)
-			if (p[i].remaining > 2*window &&
-			    (!victim || victim->remaining < p[i].remaining))
+		for (i = 0; i < delta_search_threads; i++) {
+			uint64_t weight;
+
+			if (p[i].remaining <= 2*window)
+				continue;
+			weight = list_weight(p[i].list + p[i].list_size -
+					     p[i].remaining, p[i].remaining);
+			if (!victim || victim_weight < weight) {
 				victim = &p[i];
+				victim_weight = weight;
+			}
+		}
 		if (victim) {
-			sub_size = victim->remaining / 2;
+			struct object_entry **rest = victim->list +
+				victim->list_size - victim->remaining;
+			unsigned half;
+
+			/* the victim keeps at least its next object */
+			half = victim->remaining -
+				split_by_weight(rest, victim->remaining,
+						victim_weight / 2);
+			if (!half)
+				half = victim->remaining / 2;
+			sub_size = half;
 			list = victim->list + victim->list_size - sub_size;
 			while (sub_size && list[0]->hash &&
 			       list[0]->hash == list[-1]->hash) {
@@ -2068,7 +2262,7 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 				 * might be found.  Let's just steal the
 				 * exact half in that case.
 				 */
-				sub_size = victim->remaining / 2;
+				sub_size = half;
 				list -= sub_size;
 			}
 			target->list = list;
@@ -2092,7 +2286,27 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 			active_threads--;
 		}
 	}
+
+	if (trace_want("GIT_TRACE_PACK_THREADS")) {
+		uint64_t wall_ns = getnanotime() - start_ns;
+
+		for (i = 0; i < delta_search_threads; i++)
+			trace_printf_key("GIT_TRACE_PACK_THREADS",
+					 "pack-objects: thread %d: %u units, "
+					 "%lu objects, %"PRIuMAX" bytes, "
+					 "%"PRIuMAX" ms busy\n", i,
+					 p[i].nr_units, p[i].nr_objects,
+					 (uintmax_t)p[i].weight_done,
+					 (uintmax_t)(p[i].busy_ns / 1000000));
+		trace_printf_key("GIT_TRACE_PACK_THREADS",
+				 "pack-objects: delta search took %"PRIuMAX" ms\n",
+				 (uintmax_t)(wall_ns / 1000000));
+	}
+
 	cleanup_threaded_search();
+	free(delta_weight);
+	delta_weight = NULL;
+	delta_list = NULL;
 	free(p);
 }
 
@@ -2100,6 +2314,131 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 #define ll_find_deltas(l, s, w, d, p)	find_deltas(l, &s, w, d, p)
 #endif
 
+/* below this many objects per thread, threads are not worth it */
+#define CHECK_OBJECTS_PER_THREAD 10000
+
+static void check_objects(struct object_entry **list, unsigned list_size,
+			  unsigned *processed)
+{
+	unsigned i, done = 0;
+
+	for (i = 0; i < list_size; i++) {
+		struct object_entry *entry = list[i];
+		check_object(entry);
+		if (big_file_threshold < entry->size)
+			entry->no_try_delta = 1;
+
+		/* do not fight over the progress meter for every object */
+		if (++done == 1024 || i + 1 == list_size) {
+			progress_lock();
+			*processed += done;
+			display_progress(progress_state, *processed);
+			progress_unlock();
+			done = 0;
+		}
+	}
+}
+
+#ifndef NO_PTHREADS
+
+struct check_objects_params {
+	pthread_t thread;
+	struct object_entry **list;
+	unsigned list_size;
+	unsigned *processed;
+};
+
+static void *threaded_check_objects(void *arg)
+{
+	struct check_objects_params *me = arg;
+
+	check_objects(me->list, me->list_size, me->processed);
+	return NULL;
+}
+
+/*
+ * The list is sorted by pack offset; every thread gets a contiguous
+ * part of it, so that each still reads its packs front to back.
+ */
+static void ll_check_objects(struct object_entry **list, unsigned list_size,
+			     unsigned *processed)
+{
+	struct check_objects_params *p;
+	int i, ret, nr_threads;
+
+	if (!delta_search_threads)	/* --threads=0 means autodetect */
+		delta_search_threads = online_cpus();
+	nr_threads = delta_search_threads;
+	if (nr_threads > list_size / CHECK_OBJECTS_PER_THREAD)
+		nr_threads = list_size / CHECK_OBJECTS_PER_THREAD;
+	if (nr_threads <= 1) {
+		check_objects(list, list_size, processed);
+		return;
+	}
+
+	p = xcalloc(nr_threads, sizeof(*p));
+	for (i = 0; i < nr_threads; i++) {
+		unsigned sub_size = list_size / (nr_threads - i);
+
+		p[i].list = list;
+		p[i].list_size = sub_size;
+		p[i].processed = processed;
+		ret = pthread_create(&p[i].thread, NULL,
+				     threaded_check_objects, &p[i]);
+		if (ret)
+			die("unable to create thread: %s", strerror(ret));
+
+		list += sub_size;
+		list_size -= sub_size;
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(p[i].thread, NULL);
+	free(p);
+}
+
+#else
+#define init_threaded_search()		(void)0
+#define cleanup_threaded_search()	(void)0
+#define ll_check_objects(l, s, p)	check_objects(l, s, p)
+#endif
+
+static void get_object_details(void)
+{
+	uint32_t i;
+	unsigned nr_done = 0;
+	struct object_entry **sorted_by_offset;
+
+	sorted_by_offset = xcalloc(to_pack.nr_objects, sizeof(struct object_entry *));
+	for (i = 0; i < to_pack.nr_objects; i++)
+		sorted_by_offset[i] = to_pack.objects + i;
+	qsort(sorted_by_offset, to_pack.nr_objects, sizeof(*sorted_by_offset), pack_offset_sort);
+
+	if (progress)
+		progress_state = start_progress_delay(_("Checking objects"),
+						      to_pack.nr_objects, 50, 1);
+	init_threaded_search();
+	ll_check_objects(sorted_by_offset, to_pack.nr_objects, &nr_done);
+	cleanup_threaded_search();
+	stop_progress(&progress_state);
+
+	/*
+	 * Link the deltas we are going to reuse to their bases in the
+	 * order of the list, so that the result does not depend on how
+	 * the work was split between the threads.
+	 */
+	for (i = 0; i < to_pack.nr_objects; i++) {
+		struct object_entry *entry = sorted_by_offset[i];
+		struct object_entry *base_entry = entry->delta;
+
+		if (!base_entry)
+			continue;
+		entry->delta_sibling = base_entry->delta_child;
+		base_entry->delta_child = entry;
+	}
+
+	free(sorted_by_offset);
+}
+
 static int add_ref_tag(const char *path, const unsigned char *sha1, int flag, void *cb_data)
 {
 	unsigned char peeled[20];
@@ -2242,6 +2581,13 @@ static int git_pack_config(const char *k, const char *v, void *cb)
 			    pack_idx_opts.version);
 		return 0;
 	}
+	if (!strcmp(k, "pack.writereverseindex")) {
+		if (git_config_bool(k, v))
+			pack_idx_opts.flags |= WRITE_REV;
+		else
+			pack_idx_opts.flags &= ~WRITE_REV;
+		return 0;
+	}
 	return git_default_config(k, v, cb);
 }
 
@@ -2285,6 +2631,9 @@ static void show_commit(struct commit *commit, void *data)
 
 	if (write_bitmap_index)
 		index_commit_for_bitmap(commit);
+
+	if (use_delta_islands)
+		propagate_island_marks(commit);
 }
 
 static void show_object(struct object *obj,
@@ -2356,7 +2705,7 @@ static void add_objects_in_unpacked_packs(struct rev_info *revs)
 		const unsigned char *sha1;
 		struct object *o;
 
-		if (!p->pack_local || p->pack_keep)
+		if (!p->pack_local || p->pack_keep || p->pack_promisor)
 			continue;
 		if (open_pack_index(p))
 			die("cannot open pack index");
@@ -2393,7 +2742,7 @@ static int has_sha1_pack_kept_or_nonlocal(const unsigned char *sha1)
 	p = (last_found != (void *)1) ? last_found : packed_git;
 
 	while (p) {
-		if ((!p->pack_local || p->pack_keep) &&
+		if ((!p->pack_local || p->pack_keep || p->pack_promisor) &&
 			find_pack_entry_one(sha1, p)) {
 			last_found = p;
 			return 1;
@@ -2415,7 +2764,7 @@ static void loosen_unused_packed_objects(struct rev_info *revs)
 	const unsigned char *sha1;
 
 	for (p = packed_git; p; p = p->next) {
-		if (!p->pack_local || p->pack_keep)
+		if (!p->pack_local || p->pack_keep || p->pack_promisor)
 			continue;
 
 		if (unpack_unreachable_expiration &&
@@ -2454,7 +2803,7 @@ static int get_object_list_from_bitmap(struct rev_info *revs)
 	    !reuse_partial_packfile_from_bitmap(
 			&reuse_packfile,
 			&reuse_packfile_objects,
-			&reuse_packfile_offset)) {
+			&reuse_packfile_bitmap)) {
 		assert(reuse_packfile_objects);
 		nr_result += reuse_packfile_objects;
 		display_progress(progress_state, nr_result);
@@ -2505,10 +2854,17 @@ static void get_object_list(int ac, const char **av)
 	if (use_bitmap_index && !get_object_list_from_bitmap(&revs))
 		return;
 
+	if (use_delta_islands)
+		load_delta_islands();
+
 	if (prepare_revision_walk(&revs))
 		die("revision walk setup failed");
 	mark_edges_uninteresting(&revs, show_edge);
-	traverse_commit_list(&revs, show_commit, show_object, NULL);
+	traverse_commit_list_filtered(&revs, show_commit, show_object, NULL,
+				      &filter_options, NULL);
+
+	if (use_delta_islands)
+		resolve_tree_islands(&to_pack);
 
 	if (keep_unreachable)
 		add_objects_in_unpacked_packs(&revs);
@@ -2568,9 +2924,10 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 	int use_internal_rev_list = 0;
 	int thin = 0;
 	int all_progress_implied = 0;
-	const char *rp_av[6];
+	const char *rp_av[8];
 	int rp_ac = 0;
 	int rev_list_unpacked = 0, rev_list_all = 0, rev_list_reflog = 0;
+	int exclude_promisor_objects = 0;
 	struct option pack_objects_options[] = {
 		OPT_SET_INT('q', "quiet", &progress,
 			    N_("do not show progress meter"), 0),
@@ -2638,6 +2995,11 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 			 N_("use a bitmap index if available to speed up counting objects")),
 		OPT_BOOL(0, "write-bitmap-index", &write_bitmap_index,
 			 N_("write a bitmap index together with the pack index")),
+		OPT_PARSE_LIST_OBJECTS_FILTER(&filter_options),
+		OPT_BOOL(0, "exclude-promisor-objects", &exclude_promisor_objects,
+			 N_("do not pack objects in promisor packfiles")),
+		OPT_BOOL(0, "delta-islands", &use_delta_islands,
+			 N_("respect islands during delta compression")),
 		OPT_END(),
 	};
 
@@ -2678,6 +3040,22 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 		use_internal_rev_list = 1;
 		rp_av[rp_ac++] = "--unpacked";
 	}
+	if (exclude_promisor_objects) {
+		use_internal_rev_list = 1;
+		rp_av[rp_ac++] = "--exclude-promisor-objects";
+	}
+	if (filter_options.choice) {
+		if (!pack_to_stdout)
+			die("cannot use --filter without --stdout.");
+		use_internal_rev_list = 1;
+	}
+	if (use_delta_islands && !use_internal_rev_list) {
+		warning("--delta-islands needs --revs or --all, ignoring it");
+		use_delta_islands = 0;
+	}
+	/* commits pass their islands on to their parents */
+	if (use_delta_islands)
+		rp_av[rp_ac++] = "--topo-order";
 
 	if (!reuse_object)
 		reuse_delta = 0;
@@ -2704,7 +3082,9 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 	if (keep_unreachable && unpack_unreachable)
 		die("--keep-unreachable and --unpack-unreachable are incompatible.");
 
-	if (!use_internal_rev_list || !pack_to_stdout || is_repository_shallow())
+	/* islands are found while walking the history */
+	if (!use_internal_rev_list || !pack_to_stdout || is_repository_shallow() ||
+	    filter_options.choice || use_delta_islands)
 		use_bitmap_index = 0;
 
 	if (pack_to_stdout || !rev_list_all)
@@ -2735,7 +3115,9 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 	write_pack_file();
 	if (progress)
 		fprintf(stderr, "Total %"PRIu32" (delta %"PRIu32"),"
-			" reused %"PRIu32" (delta %"PRIu32")\n",
-			written, written_delta, reused, reused_delta);
+			" reused %"PRIu32" (delta %"PRIu32"),"
+			" pack-reused %"PRIu32"\n",
+			written, written_delta, reused, reused_delta,
+			reuse_packfile_objects);
 	return 0;
 }
@@ -7,6 +7,7 @@
 #include "strbuf.h"
 #include "string-list.h"
 #include "argv-array.h"
+#include "midx.h"
 
 static int delta_base_offset = 1;
 static int pack_kept_objects = -1;
@@ -76,7 +77,7 @@ static void remove_pack_on_signal(int signo)
 
 /*
  * Adds all packs hex strings to the fname list, which do not
- * have a corresponding .keep file.
+ * have a corresponding .keep or .promisor file.
  */
 static void get_non_kept_pack_filenames(struct string_list *fname_list)
 {
@@ -95,7 +96,8 @@ static void get_non_kept_pack_filenames(struct string_list *fname_list)
 		len = strlen(e->d_name) - strlen(".pack");
 		fname = xmemdupz(e->d_name, len);
 
-		if (!file_exists(mkpath("%s/%s.keep", packdir, fname)))
+		if (!file_exists(mkpath("%s/%s.keep", packdir, fname)) &&
+		    !file_exists(mkpath("%s/%s.promisor", packdir, fname)))
 			string_list_append_nodup(fname_list, fname);
 		else
 			free(fname);
@@ -105,7 +107,7 @@ static void get_non_kept_pack_filenames(struct string_list *fname_list)
 
 static void remove_redundant_pack(const char *dir_name, const char *base_name)
 {
-	const char *exts[] = {".pack", ".idx", ".keep", ".bitmap"};
+	const char *exts[] = {".pack", ".idx", ".keep", ".bitmap", ".rev"};
 	int i;
 	struct strbuf buf = STRBUF_INIT;
 	size_t plen;
@@ -131,6 +133,7 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 		unsigned optional:1;
 	} exts[] = {
 		{".pack"},
+		{".rev", 1},
 		{".idx"},
 		{".bitmap", 1},
 	};
@@ -155,6 +158,7 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 	int no_update_server_info = 0;
 	int quiet = 0;
 	int local = 0;
+	int use_delta_islands = 0;
 
 	struct option builtin_repack_options[] = {
 		OPT_BIT('a', NULL, &pack_everything,
@@ -175,6 +179,8 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 				N_("pass --local to git-pack-objects")),
 		OPT_BOOL('b', "write-bitmap-index", &write_bitmaps,
 				N_("write bitmap index")),
+		OPT_BOOL('i', "delta-islands", &use_delta_islands,
+				N_("pass --delta-islands to git-pack-objects")),
 		OPT_STRING(0, "unpack-unreachable", &unpack_unreachable, N_("approxidate"),
 				N_("with -A, do not loosen objects older than this")),
 		OPT_STRING(0, "window", &window, N_("n"),
@@ -210,6 +216,8 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 	argv_array_push(&cmd_args, "--non-empty");
 	argv_array_push(&cmd_args, "--all");
 	argv_array_push(&cmd_args, "--reflog");
+	if (repository_format_partial_clone)
+		argv_array_push(&cmd_args, "--exclude-promisor-objects");
 	if (window)
 		argv_array_pushf(&cmd_args, "--window=%s", window);
 	if (window_memory)
@@ -222,7 +230,14 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 		argv_array_pushf(&cmd_args, "--no-reuse-delta");
 	if (no_reuse_object)
 		argv_array_pushf(&cmd_args, "--no-reuse-object");
-	if (write_bitmaps)
+	if (use_delta_islands)
+		argv_array_push(&cmd_args, "--delta-islands");
+	/*
+	 * An incremental repack leaves objects in the other packs; the
+	 * bitmap is then written for the multi-pack-index, if any.
+	 */
+	if (write_bitmaps &&
+	    (pack_everything & ALL_INTO_ONE || !core_multi_pack_index))
 		argv_array_push(&cmd_args, "--write-bitmap-index");
 
 	if (pack_everything & ALL_INTO_ONE) {
@@ -402,6 +417,11 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 		argv_array_clear(&cmd_args);
 	}
 
+	if (core_multi_pack_index)
+		write_midx_file(get_object_directory(),
+				write_bitmaps && !(pack_everything & ALL_INTO_ONE) ?
+				MIDX_WRITE_BITMAP : 0);
+
 	if (!no_update_server_info) {
 		argv_array_push(&cmd_args, "update-server-info");
 		memset(&cmd, 0, sizeof(cmd));
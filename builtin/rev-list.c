@@ -9,6 +9,8 @@
 #include "log-tree.h"
 #include "graph.h"
 #include "bisect.h"
+#include "list-objects-filter.h"
+#include "sha1-array.h"
 
 static const char rev_list_usage[] =
 "git rev-list [OPTION] <commit-id>... [ -- paths... ]\n"
@@ -37,6 +39,7 @@ static const char rev_list_usage[] =
 "    --parents\n"
 "    --children\n"
 "    --objects | --objects-edge\n"
+"    --filter=<filter-spec> [--filter-print-omitted]\n"
 "    --unpacked\n"
 "    --header | --pretty\n"
 "    --abbrev=<n> | --no-abbrev\n"
@@ -106,7 +109,7 @@ static void show_commit(struct commit *commit, void *data)
 	else
 		putchar('\n');
 
-	if (revs->verbose_header && get_cached_commit_buffer(commit, NULL)) {
+	if (revs->verbose_header) {
 		struct strbuf buf = STRBUF_INIT;
 		struct pretty_print_context ctx = {0};
 		ctx.abbrev = revs->abbrev;
@@ -198,6 +201,11 @@ static void show_object(struct object *obj,
 	show_object_with_name(stdout, obj, path, component);
 }
 
+static void print_omitted_object(const unsigned char sha1[20], void *data)
+{
+	printf("~%s\n", sha1_to_hex(sha1));
+}
+
 static void show_edge(struct commit *commit)
 {
 	printf("-%s\n", sha1_to_hex(commit->object.sha1));
@@ -279,8 +287,27 @@ int cmd_rev_list(int argc, const char **argv, const char *prefix)
 	int bisect_show_vars = 0;
 	int bisect_find_all = 0;
 	int use_bitmap_index = 0;
+	struct list_objects_filter_options filter_options;
+	struct sha1_array omitted = SHA1_ARRAY_INIT;
+	int print_omitted = 0;
 
+	memset(&filter_options, 0, sizeof(filter_options));
 	git_config(git_default_config, NULL);
+
+	/*
+	 * Objects named on the command line or read by --stdin are
+	 * looked up while the options are parsed, so this has to be
+	 * known before we get there.
+	 */
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--"))
+			break;
+		if (!strcmp(argv[i], "--exclude-promisor-objects")) {
+			fetch_if_missing = 0;
+			break;
+		}
+	}
+
 	init_revisions(&revs, prefix);
 	revs.abbrev = DEFAULT_ABBREV;
 	revs.commit_format = CMIT_FMT_UNSPECIFIED;
@@ -324,6 +351,20 @@ int cmd_rev_list(int argc, const char **argv, const char *prefix)
 			use_bitmap_index = 1;
 			continue;
 		}
+		if (starts_with(arg, "--filter=")) {
+			if (parse_list_objects_filter(&filter_options,
+						      arg + strlen("--filter=")))
+				usage(rev_list_usage);
+			continue;
+		}
+		if (!strcmp(arg, "--no-filter")) {
+			list_objects_filter_release(&filter_options);
+			continue;
+		}
+		if (!strcmp(arg, "--filter-print-omitted")) {
+			print_omitted = 1;
+			continue;
+		}
 		if (!strcmp(arg, "--test-bitmap")) {
 			test_bitmap_walk(&revs);
 			return 0;
@@ -355,6 +396,10 @@ int cmd_rev_list(int argc, const char **argv, const char *prefix)
 	if (bisect_list)
 		revs.limited = 1;
 
+	/* the bitmaps know nothing about filters */
+	if (filter_options.choice)
+		use_bitmap_index = 0;
+
 	if (use_bitmap_index) {
 		if (revs.count && !revs.left_right && !revs.cherry_mark) {
 			uint32_t commit_count;
@@ -386,7 +431,15 @@ int cmd_rev_list(int argc, const char **argv, const char *prefix)
 			return show_bisect_vars(&info, reaches, all);
 	}
 
-	traverse_commit_list(&revs, show_commit, show_object, &info);
+	traverse_commit_list_filtered(&revs, show_commit, show_object, &info,
+				      &filter_options,
+				      print_omitted ? &omitted : NULL);
+
+	if (print_omitted) {
+		sha1_array_for_each_unique(&omitted, print_omitted_object, NULL);
+		sha1_array_clear(&omitted);
+	}
+	list_objects_filter_release(&filter_options);
 
 	if (revs.count) {
 		if (revs.left_right && revs.cherry_mark)
@@ -13,6 +13,7 @@
 #include "parse-options.h"
 #include "pathspec.h"
 #include "dir.h"
+#include "split-index.h"
 
 /*
  * Default to not allowing changes to the list of files. The
@@ -741,6 +742,8 @@ int cmd_update_index(int argc, const char **argv, const char *prefix)
 	int prefix_length = prefix ? strlen(prefix) : 0;
 	int preferred_index_format = 0;
 	char set_executable_bit = 0;
+	int split_index = -1;
+	int untracked_cache = -1;
 	struct refresh_params refresh_args = {0, &has_errors};
 	int lock_error = 0;
 	struct lock_file *lock_file;
@@ -825,6 +828,10 @@ int cmd_update_index(int argc, const char **argv, const char *prefix)
 			resolve_undo_clear_callback},
 		OPT_INTEGER(0, "index-version", &preferred_index_format,
 			N_("write index in this format")),
+		OPT_BOOL(0, "split-index", &split_index,
+			N_("enable or disable split index")),
+		OPT_BOOL(0, "untracked-cache", &untracked_cache,
+			N_("enable/disable untracked cache")),
 		OPT_END()
 	};
 
@@ -896,6 +903,29 @@ int cmd_update_index(int argc, const char **argv, const char *prefix)
 		the_index.version = preferred_index_format;
 	}
 
+	if (split_index > 0) {
+		/*
+		 * Splitting an already split index writes a new shared
+		 * index holding all current entries.
+		 */
+		if (the_index.split_index)
+			discard_split_index(&the_index);
+		init_split_index(&the_index);
+		active_cache_changed = 1;
+	} else if (!split_index && the_index.split_index) {
+		discard_split_index(&the_index);
+		active_cache_changed = 1;
+	}
+
+	if (untracked_cache > 0) {
+		setup_work_tree();
+		add_untracked_cache(&the_index);
+	} else if (!untracked_cache && the_index.untracked) {
+		free_untracked_cache(the_index.untracked);
+		the_index.untracked = NULL;
+		active_cache_changed = 1;
+	}
+
 	if (read_from_stdin) {
 		struct strbuf buf = STRBUF_INIT, nbuf = STRBUF_INIT;
 
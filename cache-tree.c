@@ -98,6 +98,14 @@ struct cache_tree_sub *cache_tree_sub(struct cache_tree *it, const char *path)
 	return find_subtree(it, path, pathlen, 1);
 }
 
+/* The cache tree of the subdirectory "path" of "it", if it has one. */
+struct cache_tree *cache_tree_subtree(struct cache_tree *it,
+				      const char *path, int pathlen)
+{
+	struct cache_tree_sub *sub = find_subtree(it, path, pathlen, 0);
+	return sub ? sub->cache_tree : NULL;
+}
+
 void cache_tree_invalidate_path(struct cache_tree *it, const char *path)
 {
 	/* a/b/c
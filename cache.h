@@ -74,6 +74,12 @@ unsigned long git_deflate_bound(git_zstream *, unsigned long);
 #define S_IFGITLINK	0160000
 #define S_ISGITLINK(m)	(((m) & S_IFMT) == S_IFGITLINK)
 
+/*
+ * Directories of a sparse index are stored as entries for their trees
+ * (see sparse-index.h).
+ */
+#define S_ISSPARSEDIR(m)	((m) == S_IFDIR)
+
 /*
  * Some mode bits are also used internally for computations.
  *
@@ -150,6 +156,7 @@ struct cache_entry {
 	unsigned int ce_mode;
 	unsigned int ce_flags;
 	unsigned int ce_namelen;
+	unsigned int index;	/* for link extension */
 	unsigned char sha1[20];
 	char name[FLEX_ARRAY]; /* more */
 };
@@ -174,6 +181,7 @@ struct cache_entry {
 #define CE_ADDED             (1 << 19)
 
 #define CE_HASHED            (1 << 20)
+#define CE_FSMONITOR_VALID   (1 << 21)
 #define CE_WT_REMOVE         (1 << 22) /* remove in work directory */
 #define CE_CONFLICTED        (1 << 23)
 
@@ -283,15 +291,28 @@ static inline unsigned int canon_mode(unsigned int mode)
 
 #define cache_entry_size(len) (offsetof(struct cache_entry,name) + (len) + 1)
 
+struct split_index;
+struct untracked_cache;
+struct ewah_bitmap;
+
 struct index_state {
 	struct cache_entry **cache;
 	unsigned int version;
 	unsigned int cache_nr, cache_alloc, cache_changed;
 	struct string_list *resolve_undo;
 	struct cache_tree *cache_tree;
+	struct split_index *split_index;
 	struct cache_time timestamp;
+	struct untracked_cache *untracked;
+	uint64_t fsmonitor_last_update;
+	struct ewah_bitmap *fsmonitor_dirty;
 	unsigned name_hash_initialized : 1,
 		 initialized : 1;
+	/*
+	 * Not a bitfield: the extension reader sets it while the threads
+	 * loading the entries update name_hash_initialized.
+	 */
+	unsigned sparse_index;
 	struct hashmap name_hash;
 	struct hashmap dir_hash;
 	unsigned char sha1[20];
@@ -371,6 +392,7 @@ static inline enum object_type object_type(unsigned int mode)
 #define INDEX_ENVIRONMENT "GIT_INDEX_FILE"
 #define GRAFT_ENVIRONMENT "GIT_GRAFT_FILE"
 #define GIT_SHALLOW_FILE_ENVIRONMENT "GIT_SHALLOW_FILE"
+#define GIT_PROTOCOL_ENVIRONMENT "GIT_PROTOCOL"
 #define TEMPLATE_DIR_ENVIRONMENT "GIT_TEMPLATE_DIR"
 #define CONFIG_ENVIRONMENT "GIT_CONFIG"
 #define CONFIG_DATA_ENVIRONMENT "GIT_CONFIG_PARAMETERS"
@@ -476,8 +498,11 @@ extern int daemonize(void);
 	} while (0)
 
 /* Initialize and use the cache information */
+extern int force_verify_index_checksum;
 extern int read_index(struct index_state *);
 extern int read_index_preload(struct index_state *, const struct pathspec *pathspec);
+extern int do_read_index(struct index_state *istate, const char *path,
+			 int must_exist); /* for testing only! */
 extern int read_index_from(struct index_state *, const char *path);
 extern int is_index_unborn(struct index_state *);
 extern int read_index_unmerged(struct index_state *);
@@ -542,6 +567,8 @@ extern void fill_stat_data(struct stat_data *sd, struct stat *st);
  * INODE_CHANGED, and DATA_CHANGED.
  */
 extern int match_stat_data(const struct stat_data *sd, struct stat *st);
+extern int match_stat_data_racy(const struct index_state *istate,
+				const struct stat_data *sd, struct stat *st);
 
 extern void fill_stat_cache_info(struct cache_entry *ce, struct stat *st);
 
@@ -614,6 +641,13 @@ extern int check_replace_refs;
 
 extern int fsync_object_files;
 extern int core_preload_index;
+extern int core_commit_graph;
+extern int core_multi_pack_index;
+extern const char *core_fsmonitor;
+extern int split_index_max_percent_change;
+extern const char *split_index_shared_expire;
+extern int use_sparse_index;
+extern int command_requires_full_index;
 extern int core_apply_sparse_checkout;
 extern int precomposed_unicode;
 extern int git_db_env, git_index_env, git_graft_env, git_common_dir_env;
@@ -661,6 +695,14 @@ enum object_creation_mode {
 
 extern enum object_creation_mode object_creation_mode;
 
+enum ref_storage_format {
+	REF_STORAGE_FILES = 0,
+	REF_STORAGE_REFTABLE = 1
+};
+
+/* The format new repositories (and "git pack-refs") store refs in */
+extern enum ref_storage_format ref_storage_format;
+
 extern char *notes_ref_name;
 
 extern int grafts_replace_parents;
@@ -669,6 +711,19 @@ extern int grafts_replace_parents;
 extern int repository_format_version;
 extern int check_repository_format(void);
 
+/*
+ * The remote that promised to give us the objects missing from this
+ * partial clone (extensions.partialClone), or NULL.
+ */
+extern char *repository_format_partial_clone;
+
+/*
+ * Whether a missing object should be fetched from the promisor remote
+ * when it is read.  Commands that deal with missing objects themselves
+ * (e.g. fetch-pack, index-pack, fsck) turn this off.
+ */
+extern int fetch_if_missing;
+
 #define MTIME_CHANGED	0x0001
 #define CTIME_CHANGED	0x0002
 #define OWNER_CHANGED	0x0004
@@ -841,6 +896,20 @@ static inline void *read_sha1_file(const unsigned char *sha1, enum object_type *
 	return read_sha1_file_extended(sha1, type, size, LOOKUP_REPLACE_OBJECT);
 }
 
+/*
+ * Threads that read objects at the same time call
+ * enable_obj_read_lock() first.  read_sha1_file() and
+ * sha1_object_info() then take the object read lock themselves, and
+ * let go of it while they inflate and apply deltas, so that several
+ * objects are unpacked at once.  Any other use of the object store
+ * (pack windows, the delta base cache, ...) from those threads must
+ * hold obj_read_lock(); it nests.
+ */
+extern void enable_obj_read_lock(void);
+extern void disable_obj_read_lock(void);
+extern void obj_read_lock(void);
+extern void obj_read_unlock(void);
+
 /*
  * This internal function is only declared here for the benefit of
  * lookup_replace_object().  Please do not call it directly.
@@ -867,6 +936,35 @@ static inline const unsigned char *lookup_replace_object_extended(const unsigned
 	return lookup_replace_object(sha1);
 }
 
+/*
+ * Visiting many objects at once: for_each_object_in_pack_order() calls
+ * "fn" on the objects added to the batch in the order they are stored
+ * -- pack by pack and by offset, then the loose and missing ones -- so
+ * that reading them sweeps each pack from front to back instead of
+ * seeking all over it; "fn" reads what it needs of each.  A non-zero return from "fn" stops the batch
+ * and is returned.
+ */
+struct object_batch_entry {
+	unsigned char sha1[20];
+	void *util;
+	int pack_order;	/* -1 when not packed */
+	off_t offset;
+	int nr;		/* the order it was added in */
+};
+
+struct object_batch {
+	struct object_batch_entry *entries;
+	int nr, alloc;
+};
+#define OBJECT_BATCH_INIT { NULL, 0, 0 }
+
+typedef int (*object_batch_fn)(const unsigned char *sha1, void *util,
+			       void *cb_data);
+
+extern void object_batch_add(struct object_batch *, const unsigned char *sha1, void *util);
+extern int for_each_object_in_pack_order(struct object_batch *, object_batch_fn fn, void *cb_data);
+extern void object_batch_clear(struct object_batch *);
+
 /* Read and unpack a sha1 file into memory, write memory to a sha1 file */
 extern int sha1_object_info(const unsigned char *, unsigned long *);
 extern int hash_sha1_file(const void *buf, unsigned long len, const char *type, unsigned char *sha1);
@@ -1000,6 +1098,14 @@ extern int get_sha1_mb(const char *str, unsigned char *sha1);
  */
 extern int refname_match(const char *abbrev_name, const char *full_name);
 
+/*
+ * Add to "prefixes" every full refname that "prefix" could be an
+ * abbreviation of according to ref_rev_parse_rules, e.g. to ask a
+ * server for only the refs a refspec may match.
+ */
+struct argv_array;
+extern void expand_ref_prefix(struct argv_array *prefixes, const char *prefix);
+
 extern int create_symref(const char *ref, const char *refs_heads_master, const char *logmsg);
 extern int validate_headref(const char *ref);
 
@@ -1107,6 +1213,7 @@ extern int has_symlink_leading_path(const char *name, int len);
 extern int threaded_has_symlink_leading_path(struct cache_def *, const char *, int);
 extern int check_leading_path(const char *name, int len);
 extern int has_dirs_only_path(const char *name, int len, int prefix_len);
+extern void invalidate_lstat_cache(void);
 extern void schedule_dir_for_removal(const char *name, int len);
 extern void remove_scheduled_dirs(void);
 
@@ -1142,9 +1249,12 @@ extern struct packed_git {
 	int index_version;
 	time_t mtime;
 	int pack_fd;
+	int order;	/* position in packed_git, see for_each_object_in_pack_order() */
 	unsigned pack_local:1,
 		 pack_keep:1,
-		 do_not_close:1;
+		 pack_promisor:1,
+		 do_not_close:1,
+		 multi_pack_index:1;
 	unsigned char sha1[20];
 	/* something like ".git/objects/pack/xxxxx.pack" */
 	char pack_name[FLEX_ARRAY]; /* more */
@@ -1158,6 +1268,12 @@ struct pack_entry {
 
 extern struct packed_git *parse_pack_index(unsigned char *sha1, const char *idx_path);
 
+/*
+ * Whether the object is in a promisor pack or referenced by an object
+ * in one, i.e. the promisor remote has promised to give it to us.
+ */
+extern int is_promisor_object(const unsigned char *sha1);
+
 /* A hook for count-objects to report invalid files in pack directory */
 extern void (*report_garbage)(const char *desc, const char *path);
 
@@ -1215,6 +1331,15 @@ extern unsigned long unpack_object_header_buffer(const unsigned char *buf, unsig
 extern unsigned long get_size_from_delta(struct packed_git *, struct pack_window **, off_t);
 extern int unpack_object_header(struct packed_git *, struct pack_window **, off_t *, unsigned long *);
 
+/*
+ * Read the base reference of the delta at "delta_obj_offset", whose
+ * header has been parsed up to "*curpos", and move "*curpos" past it.
+ * Returns the offset of the base in "p", or 0 if it cannot be found.
+ */
+extern off_t get_delta_base(struct packed_git *p, struct pack_window **w_curs,
+			    off_t *curpos, enum object_type type,
+			    off_t delta_obj_offset);
+
 struct object_info {
 	/* Request */
 	enum object_type *typep;
@@ -1395,6 +1520,7 @@ extern int trace_want(const char *key);
 __attribute__((format (printf, 2, 3)))
 extern void trace_printf_key(const char *key, const char *fmt, ...);
 extern void trace_strbuf(const char *key, const struct strbuf *buf);
+extern uint64_t getnanotime(void);
 
 void packet_trace_identity(const char *prog);
 
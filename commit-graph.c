@@ -0,0 +1,632 @@
+#include "cache.h"
+#include "commit.h"
+#include "refs.h"
+#include "sha1-array.h"
+#include "sha1-lookup.h"
+#include "csum-file.h"
+#include "commit-graph.h"
+
+#define GRAPH_SIGNATURE 0x43475048 /* "CGPH" */
+#define GRAPH_CHUNKID_OIDFANOUT 0x4f494446 /* "OIDF" */
+#define GRAPH_CHUNKID_OIDLOOKUP 0x4f49444c /* "OIDL" */
+#define GRAPH_CHUNKID_DATA 0x43444154 /* "CDAT" */
+#define GRAPH_CHUNKID_EXTRAEDGES 0x45444745 /* "EDGE" */
+
+#define GRAPH_VERSION 1
+#define GRAPH_OID_VERSION 1 /* SHA-1 */
+#define GRAPH_OID_LEN 20
+
+#define GRAPH_FANOUT_SIZE (4 * 256)
+#define GRAPH_CHUNKLOOKUP_WIDTH 12
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_DATA_WIDTH (GRAPH_OID_LEN + 16)
+#define GRAPH_MIN_SIZE (GRAPH_HEADER_SIZE + 4 * GRAPH_CHUNKLOOKUP_WIDTH + \
+			GRAPH_FANOUT_SIZE + GRAPH_OID_LEN)
+
+#define GRAPH_PARENT_NONE 0x70000000
+#define GRAPH_OCTOPUS_EDGES_NEEDED 0x80000000
+#define GRAPH_EDGE_LAST_MASK 0x7fffffff
+#define GRAPH_LAST_EDGE 0x80000000
+
+/* Used to de-duplicate commits while computing the closure to write */
+#define GRAPH_SEEN (1u<<23)
+
+static struct commit_graph *commit_graph;
+static int commit_graph_prepared;
+
+char *get_commit_graph_filename(const char *obj_dir)
+{
+	return xstrfmt("%s/info/commit-graph", obj_dir);
+}
+
+void free_commit_graph(struct commit_graph *g)
+{
+	if (!g)
+		return;
+	if (g->data)
+		munmap((void *)g->data, g->data_len);
+	free(g);
+}
+
+struct commit_graph *load_commit_graph_one(const char *graph_file)
+{
+	struct stat st;
+	unsigned char *data;
+	size_t data_len;
+	struct commit_graph *graph;
+	uint32_t num_chunks, i;
+	uint64_t last_chunk_offset = 0;
+	uint32_t last_chunk_id = 0;
+	int fd = git_open_noatime(graph_file);
+
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+	data_len = xsize_t(st.st_size);
+	if (data_len < GRAPH_MIN_SIZE) {
+		close(fd);
+		error("commit-graph file %s is too small", graph_file);
+		return NULL;
+	}
+	data = xmmap(NULL, data_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	graph = xcalloc(1, sizeof(*graph));
+	graph->data = data;
+	graph->data_len = data_len;
+
+	if (get_be32(data) != GRAPH_SIGNATURE) {
+		error("commit-graph signature %X does not match signature %X",
+		      get_be32(data), GRAPH_SIGNATURE);
+		goto cleanup_fail;
+	}
+	if (data[4] != GRAPH_VERSION) {
+		error("commit-graph version %X does not match version %X",
+		      data[4], GRAPH_VERSION);
+		goto cleanup_fail;
+	}
+	if (data[5] != GRAPH_OID_VERSION) {
+		error("commit-graph hash version %X does not match version %X",
+		      data[5], GRAPH_OID_VERSION);
+		goto cleanup_fail;
+	}
+
+	num_chunks = data[6];
+	if (GRAPH_HEADER_SIZE + (num_chunks + 1) * GRAPH_CHUNKLOOKUP_WIDTH >
+	    data_len - GRAPH_OID_LEN) {
+		error("commit-graph chunk lookup table is truncated");
+		goto cleanup_fail;
+	}
+
+	for (i = 0; i <= num_chunks; i++) {
+		const unsigned char *chunk_lookup = data + GRAPH_HEADER_SIZE +
+			i * GRAPH_CHUNKLOOKUP_WIDTH;
+		uint32_t chunk_id = get_be32(chunk_lookup);
+		uint64_t chunk_offset = ((uint64_t)get_be32(chunk_lookup + 4) << 32) |
+					get_be32(chunk_lookup + 8);
+
+		if (chunk_offset > data_len - GRAPH_OID_LEN ||
+		    chunk_offset < last_chunk_offset) {
+			error("commit-graph improper chunk offset %08"PRIx32"%08"PRIx32,
+			      (uint32_t)(chunk_offset >> 32), (uint32_t)chunk_offset);
+			goto cleanup_fail;
+		}
+
+		switch (last_chunk_id) {
+		case GRAPH_CHUNKID_OIDFANOUT:
+			if (chunk_offset - last_chunk_offset != GRAPH_FANOUT_SIZE) {
+				error("commit-graph fanout chunk has wrong size");
+				goto cleanup_fail;
+			}
+			graph->chunk_oid_fanout = data + last_chunk_offset;
+			break;
+		case GRAPH_CHUNKID_OIDLOOKUP:
+			graph->chunk_oid_lookup = data + last_chunk_offset;
+			graph->num_commits = (chunk_offset - last_chunk_offset) /
+					     GRAPH_OID_LEN;
+			break;
+		case GRAPH_CHUNKID_DATA:
+			graph->chunk_commit_data = data + last_chunk_offset;
+			if (chunk_offset - last_chunk_offset !=
+			    (uint64_t)graph->num_commits * GRAPH_DATA_WIDTH) {
+				error("commit-graph commit data chunk has wrong size");
+				goto cleanup_fail;
+			}
+			break;
+		case GRAPH_CHUNKID_EXTRAEDGES:
+			graph->chunk_extra_edges = data + last_chunk_offset;
+			break;
+		}
+
+		last_chunk_id = chunk_id;
+		last_chunk_offset = chunk_offset;
+	}
+
+	if (!graph->chunk_oid_fanout || !graph->chunk_oid_lookup ||
+	    !graph->chunk_commit_data) {
+		error("commit-graph is missing a required chunk");
+		goto cleanup_fail;
+	}
+	if (get_be32(graph->chunk_oid_fanout + 4 * 255) != graph->num_commits) {
+		error("commit-graph fanout does not match the number of commits");
+		goto cleanup_fail;
+	}
+
+	return graph;
+
+cleanup_fail:
+	free_commit_graph(graph);
+	return NULL;
+}
+
+static int count_graft(const struct commit_graft *graft, void *cb_data)
+{
+	return 1;
+}
+
+static int count_replace_ref(const char *refname, const unsigned char *sha1,
+			     int flags, void *cb_data)
+{
+	return 1;
+}
+
+/*
+ * Grafts and replacement objects rewrite the parents we would read
+ * from the graph, so the graph cannot be trusted when any are present.
+ */
+static int commit_graph_compatible(void)
+{
+	prepare_commit_graft();
+	if (for_each_commit_graft(count_graft, NULL))
+		return 0;
+	if (check_replace_refs && for_each_replace_ref(count_replace_ref, NULL))
+		return 0;
+	return 1;
+}
+
+static struct commit_graph *prepare_commit_graph(void)
+{
+	char *graph_name;
+
+	if (commit_graph_prepared)
+		return commit_graph;
+	commit_graph_prepared = 1;
+
+	if (!core_commit_graph || !commit_graph_compatible())
+		return NULL;
+
+	graph_name = get_commit_graph_filename(get_object_directory());
+	commit_graph = load_commit_graph_one(graph_name);
+	free(graph_name);
+	return commit_graph;
+}
+
+void close_commit_graph(void)
+{
+	free_commit_graph(commit_graph);
+	commit_graph = NULL;
+	commit_graph_prepared = 0;
+}
+
+static int bsearch_graph(struct commit_graph *g, const unsigned char *sha1,
+			 uint32_t *pos)
+{
+	uint32_t lo = 0, hi;
+
+	if (sha1[0])
+		lo = get_be32(g->chunk_oid_fanout + 4 * (sha1[0] - 1));
+	hi = get_be32(g->chunk_oid_fanout + 4 * sha1[0]);
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = hashcmp(sha1, g->chunk_oid_lookup + GRAPH_OID_LEN * mi);
+
+		if (!cmp) {
+			*pos = mi;
+			return 1;
+		}
+		if (cmp > 0)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	return 0;
+}
+
+static struct commit_list **insert_parent_or_die(struct commit_graph *g,
+						 uint32_t pos,
+						 struct commit_list **pptr)
+{
+	struct commit *c;
+
+	if (pos >= g->num_commits)
+		die("invalid parent position %"PRIu32" in commit-graph", pos);
+	c = lookup_commit(g->chunk_oid_lookup + GRAPH_OID_LEN * pos);
+	if (!c)
+		die("could not find commit %s",
+		    sha1_to_hex(g->chunk_oid_lookup + GRAPH_OID_LEN * pos));
+	return &commit_list_insert(c, pptr)->next;
+}
+
+static void fill_commit_in_graph(struct commit *item, struct commit_graph *g,
+				 uint32_t pos)
+{
+	const unsigned char *commit_data = g->chunk_commit_data +
+					   GRAPH_DATA_WIDTH * pos;
+	struct commit_list **pptr = &item->parents;
+	uint32_t edge_value;
+	uint64_t date_high, date_low;
+
+	item->object.parsed = 1;
+	item->tree = lookup_tree(commit_data);
+
+	date_high = get_be32(commit_data + GRAPH_OID_LEN + 8) & 0x3;
+	date_low = get_be32(commit_data + GRAPH_OID_LEN + 12);
+	item->date = (unsigned long)((date_high << 32) | date_low);
+	item->generation = get_be32(commit_data + GRAPH_OID_LEN + 8) >> 2;
+
+	edge_value = get_be32(commit_data + GRAPH_OID_LEN);
+	if (edge_value == GRAPH_PARENT_NONE)
+		return;
+	pptr = insert_parent_or_die(g, edge_value, pptr);
+
+	edge_value = get_be32(commit_data + GRAPH_OID_LEN + 4);
+	if (edge_value == GRAPH_PARENT_NONE)
+		return;
+	if (!(edge_value & GRAPH_OCTOPUS_EDGES_NEEDED)) {
+		insert_parent_or_die(g, edge_value, pptr);
+		return;
+	}
+
+	if (!g->chunk_extra_edges)
+		die("commit-graph is missing the extra edges chunk");
+	edge_value &= GRAPH_EDGE_LAST_MASK;
+	do {
+		const unsigned char *edge = g->chunk_extra_edges + 4 * edge_value++;
+
+		if (edge + 4 > g->data + g->data_len - GRAPH_OID_LEN)
+			die("commit-graph extra edges chunk is truncated");
+		pptr = insert_parent_or_die(g, get_be32(edge) & GRAPH_EDGE_LAST_MASK,
+					    pptr);
+		if (get_be32(edge) & GRAPH_LAST_EDGE)
+			break;
+	} while (1);
+}
+
+int parse_commit_in_graph(struct commit *item)
+{
+	struct commit_graph *g = prepare_commit_graph();
+	uint32_t pos;
+
+	if (!g)
+		return 0;
+	if (item->object.parsed)
+		return 1;
+	if (lookup_commit_graft(item->object.sha1))
+		return 0;
+	if (!bsearch_graph(g, item->object.sha1, &pos))
+		return 0;
+	fill_commit_in_graph(item, g, pos);
+	return 1;
+}
+
+void load_commit_graph_info(struct commit *item)
+{
+	struct commit_graph *g = prepare_commit_graph();
+	uint32_t pos;
+
+	if (!g || lookup_commit_graft(item->object.sha1))
+		return;
+	if (bsearch_graph(g, item->object.sha1, &pos))
+		item->generation = get_be32(g->chunk_commit_data +
+					    GRAPH_DATA_WIDTH * pos +
+					    GRAPH_OID_LEN + 8) >> 2;
+}
+
+/* Writing */
+
+static const unsigned char *commit_sha1_access(size_t index, void *table)
+{
+	struct commit **commits = table;
+	return commits[index]->object.sha1;
+}
+
+static int commit_compare(const void *a_, const void *b_)
+{
+	const struct commit *a = *(const struct commit **)a_;
+	const struct commit *b = *(const struct commit **)b_;
+	return hashcmp(a->object.sha1, b->object.sha1);
+}
+
+struct graph_commit_list {
+	struct commit **list;
+	int nr, alloc;
+};
+
+static void add_graph_commit(struct graph_commit_list *commits,
+			     struct commit *c)
+{
+	if (c->object.flags & GRAPH_SEEN)
+		return;
+	c->object.flags |= GRAPH_SEEN;
+	ALLOC_GROW(commits->list, commits->nr + 1, commits->alloc);
+	commits->list[commits->nr++] = c;
+}
+
+static void add_start_commit(const unsigned char sha1[20], void *data)
+{
+	struct commit *c = lookup_commit_reference_gently(sha1, 1);
+
+	if (c)
+		add_graph_commit(data, c);
+}
+
+static int graph_pos(struct graph_commit_list *commits, struct commit *c)
+{
+	int pos = sha1_pos(c->object.sha1, commits->list, commits->nr,
+			   commit_sha1_access);
+	if (pos < 0)
+		die("BUG: commit %s missing from commit-graph closure",
+		    sha1_to_hex(c->object.sha1));
+	return pos;
+}
+
+static void compute_generations(struct graph_commit_list *commits,
+				uint32_t *generation)
+{
+	uint32_t *stack = NULL;
+	int stack_nr = 0, stack_alloc = 0;
+	int i;
+
+	for (i = 0; i < commits->nr; i++) {
+		if (generation[i])
+			continue;
+
+		ALLOC_GROW(stack, stack_nr + 1, stack_alloc);
+		stack[stack_nr++] = i;
+
+		while (stack_nr) {
+			uint32_t cur = stack[stack_nr - 1];
+			struct commit_list *parent;
+			uint32_t max_generation = 0;
+			int all_parents_done = 1;
+
+			if (generation[cur]) {
+				stack_nr--;
+				continue;
+			}
+
+			for (parent = commits->list[cur]->parents; parent;
+			     parent = parent->next) {
+				int pos = graph_pos(commits, parent->item);
+
+				if (!generation[pos]) {
+					ALLOC_GROW(stack, stack_nr + 1, stack_alloc);
+					stack[stack_nr++] = pos;
+					all_parents_done = 0;
+				} else if (generation[pos] > max_generation) {
+					max_generation = generation[pos];
+				}
+			}
+
+			if (all_parents_done) {
+				if (max_generation >= GENERATION_NUMBER_MAX)
+					generation[cur] = GENERATION_NUMBER_MAX;
+				else
+					generation[cur] = max_generation + 1;
+				stack_nr--;
+			}
+		}
+	}
+	free(stack);
+}
+
+static void write_graph_chunk_fanout(struct sha1file *f,
+				     struct graph_commit_list *commits)
+{
+	int i, count = 0;
+	unsigned char fanout[GRAPH_FANOUT_SIZE];
+
+	for (i = 0; i < 256; i++) {
+		while (count < commits->nr &&
+		       commits->list[count]->object.sha1[0] <= i)
+			count++;
+		put_be32(fanout + 4 * i, count);
+	}
+	sha1write(f, fanout, sizeof(fanout));
+}
+
+static void write_graph_chunk_oids(struct sha1file *f,
+				   struct graph_commit_list *commits)
+{
+	int i;
+
+	for (i = 0; i < commits->nr; i++)
+		sha1write(f, commits->list[i]->object.sha1, GRAPH_OID_LEN);
+}
+
+static void write_graph_chunk_data(struct sha1file *f,
+				   struct graph_commit_list *commits,
+				   uint32_t *generation)
+{
+	int i;
+	uint32_t num_extra_edges = 0;
+
+	for (i = 0; i < commits->nr; i++) {
+		struct commit *c = commits->list[i];
+		struct commit_list *parent = c->parents;
+		unsigned char data[GRAPH_DATA_WIDTH];
+		uint64_t date = c->date;
+
+		hashcpy(data, c->tree->object.sha1);
+
+		if (!parent)
+			put_be32(data + GRAPH_OID_LEN, GRAPH_PARENT_NONE);
+		else {
+			put_be32(data + GRAPH_OID_LEN, graph_pos(commits, parent->item));
+			parent = parent->next;
+		}
+
+		if (!parent)
+			put_be32(data + GRAPH_OID_LEN + 4, GRAPH_PARENT_NONE);
+		else if (!parent->next)
+			put_be32(data + GRAPH_OID_LEN + 4,
+				 graph_pos(commits, parent->item));
+		else {
+			put_be32(data + GRAPH_OID_LEN + 4,
+				 GRAPH_OCTOPUS_EDGES_NEEDED | num_extra_edges);
+			for (; parent; parent = parent->next)
+				num_extra_edges++;
+		}
+
+		if (sizeof(c->date) > 4)
+			put_be32(data + GRAPH_OID_LEN + 8,
+				 (generation[i] << 2) | ((date >> 32) & 0x3));
+		else
+			put_be32(data + GRAPH_OID_LEN + 8, generation[i] << 2);
+		put_be32(data + GRAPH_OID_LEN + 12, (uint32_t)date);
+
+		sha1write(f, data, sizeof(data));
+	}
+}
+
+static void write_graph_chunk_extra_edges(struct sha1file *f,
+					  struct graph_commit_list *commits)
+{
+	int i;
+
+	for (i = 0; i < commits->nr; i++) {
+		struct commit_list *parent = commits->list[i]->parents;
+
+		if (!parent || !parent->next || !parent->next->next)
+			continue;
+		for (parent = parent->next; parent; parent = parent->next) {
+			unsigned char edge[4];
+			uint32_t pos = graph_pos(commits, parent->item);
+
+			if (!parent->next)
+				pos |= GRAPH_LAST_EDGE;
+			put_be32(edge, pos);
+			sha1write(f, edge, sizeof(edge));
+		}
+	}
+}
+
+static uint32_t count_extra_edges(struct graph_commit_list *commits)
+{
+	uint32_t count = 0;
+	int i;
+
+	for (i = 0; i < commits->nr; i++) {
+		struct commit_list *parent = commits->list[i]->parents;
+		int nr_parents = 0;
+
+		for (; parent; parent = parent->next)
+			nr_parents++;
+		if (nr_parents > 2)
+			count += nr_parents - 1;
+	}
+	return count;
+}
+
+void write_commit_graph(const char *obj_dir, struct sha1_array *start)
+{
+	struct graph_commit_list commits = { NULL, 0, 0 };
+	uint32_t *generation;
+	uint32_t chunk_ids[5];
+	uint64_t chunk_offsets[5];
+	uint32_t num_extra_edges;
+	int num_chunks, i, fd;
+	unsigned char header[GRAPH_HEADER_SIZE];
+	struct strbuf tmp_file = STRBUF_INIT;
+	char *graph_name;
+	struct sha1file *f;
+
+	if (!commit_graph_compatible())
+		die("cannot write a commit-graph with grafts or replace refs");
+
+	sha1_array_for_each_unique(start, add_start_commit, &commits);
+
+	/* Close the set under parents; the list grows as we walk it. */
+	for (i = 0; i < commits.nr; i++) {
+		struct commit_list *parent;
+
+		if (parse_commit(commits.list[i]))
+			die("unable to parse commit %s",
+			    sha1_to_hex(commits.list[i]->object.sha1));
+		for (parent = commits.list[i]->parents; parent; parent = parent->next)
+			add_graph_commit(&commits, parent->item);
+	}
+	for (i = 0; i < commits.nr; i++)
+		commits.list[i]->object.flags &= ~GRAPH_SEEN;
+
+	if (commits.nr >= GRAPH_PARENT_NONE)
+		die("too many commits to write a commit-graph");
+	qsort(commits.list, commits.nr, sizeof(*commits.list), commit_compare);
+
+	generation = xcalloc(commits.nr ? commits.nr : 1, sizeof(*generation));
+	compute_generations(&commits, generation);
+	num_extra_edges = count_extra_edges(&commits);
+
+	chunk_ids[0] = GRAPH_CHUNKID_OIDFANOUT;
+	chunk_ids[1] = GRAPH_CHUNKID_OIDLOOKUP;
+	chunk_ids[2] = GRAPH_CHUNKID_DATA;
+	num_chunks = 3;
+	if (num_extra_edges)
+		chunk_ids[num_chunks++] = GRAPH_CHUNKID_EXTRAEDGES;
+	chunk_ids[num_chunks] = 0;
+
+	chunk_offsets[0] = GRAPH_HEADER_SIZE +
+			   (num_chunks + 1) * GRAPH_CHUNKLOOKUP_WIDTH;
+	chunk_offsets[1] = chunk_offsets[0] + GRAPH_FANOUT_SIZE;
+	chunk_offsets[2] = chunk_offsets[1] + (uint64_t)GRAPH_OID_LEN * commits.nr;
+	chunk_offsets[3] = chunk_offsets[2] + (uint64_t)GRAPH_DATA_WIDTH * commits.nr;
+	chunk_offsets[4] = chunk_offsets[3] + 4 * (uint64_t)num_extra_edges;
+
+	strbuf_addf(&tmp_file, "%s/info/tmp_graph_XXXXXX", obj_dir);
+	safe_create_leading_directories(tmp_file.buf);
+	fd = git_mkstemp_mode(tmp_file.buf, 0444);
+	if (fd < 0)
+		die_errno("unable to create '%s'", tmp_file.buf);
+	f = sha1fd(fd, tmp_file.buf);
+
+	put_be32(header, GRAPH_SIGNATURE);
+	header[4] = GRAPH_VERSION;
+	header[5] = GRAPH_OID_VERSION;
+	header[6] = num_chunks;
+	header[7] = 0; /* unused */
+	sha1write(f, header, sizeof(header));
+
+	for (i = 0; i <= num_chunks; i++) {
+		unsigned char chunk_write[GRAPH_CHUNKLOOKUP_WIDTH];
+
+		put_be32(chunk_write, chunk_ids[i]);
+		put_be32(chunk_write + 4, chunk_offsets[i] >> 32);
+		put_be32(chunk_write + 8, chunk_offsets[i]);
+		sha1write(f, chunk_write, sizeof(chunk_write));
+	}
+
+	write_graph_chunk_fanout(f, &commits);
+	write_graph_chunk_oids(f, &commits);
+	write_graph_chunk_data(f, &commits, generation);
+	if (num_extra_edges)
+		write_graph_chunk_extra_edges(f, &commits);
+
+	sha1close(f, NULL, CSUM_FSYNC);
+
+	if (adjust_shared_perm(tmp_file.buf))
+		die_errno("unable to make temporary commit-graph file readable");
+
+	graph_name = get_commit_graph_filename(obj_dir);
+	if (rename(tmp_file.buf, graph_name))
+		die_errno("unable to rename temporary commit-graph file to '%s'",
+			  graph_name);
+
+	free(graph_name);
+	free(generation);
+	free(commits.list);
+	strbuf_release(&tmp_file);
+}
@@ -0,0 +1,58 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include "commit.h"
+
+struct sha1_array;
+
+/*
+ * A read-only view of an on-disk commit-graph file.  All chunk
+ * pointers point into the mmap()ed file.
+ */
+struct commit_graph {
+	const unsigned char *data;
+	size_t data_len;
+
+	uint32_t num_commits;
+
+	const unsigned char *chunk_oid_fanout;
+	const unsigned char *chunk_oid_lookup;
+	const unsigned char *chunk_commit_data;
+	const unsigned char *chunk_extra_edges;
+};
+
+extern char *get_commit_graph_filename(const char *obj_dir);
+
+/*
+ * Open and validate the commit-graph file at "graph_file". Returns
+ * NULL (after reporting an error for a corrupt file) if it cannot be
+ * used.
+ */
+extern struct commit_graph *load_commit_graph_one(const char *graph_file);
+extern void free_commit_graph(struct commit_graph *g);
+
+/*
+ * Fill in the tree, parents, date and generation number of "item"
+ * from the commit-graph of the repository, if core.commitGraph is
+ * enabled and the commit is present in it.  Returns 1 if the commit
+ * was parsed this way, 0 if the caller must parse the object itself.
+ */
+extern int parse_commit_in_graph(struct commit *item);
+
+/*
+ * Record the generation number of an already-parsed commit, so that
+ * commits parsed from their object buffer still order correctly
+ * against those parsed from the commit-graph.
+ */
+extern void load_commit_graph_info(struct commit *item);
+
+/* Forget the loaded commit-graph, e.g. before rewriting it. */
+extern void close_commit_graph(void);
+
+/*
+ * Write a commit-graph file into "obj_dir/info/" containing the
+ * commits named in "commits" and everything reachable from them.
+ */
+extern void write_commit_graph(const char *obj_dir, struct sha1_array *commits);
+
+#endif
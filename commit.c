@@ -11,6 +11,7 @@
 #include "commit-slab.h"
 #include "prio-queue.h"
 #include "sha1-lookup.h"
+#include "commit-graph.h"
 
 static struct commit_extra_header *read_commit_extra_header_lines(const char *buf, size_t len, const char **);
 
@@ -200,7 +201,7 @@ static int read_graft_file(const char *graft_file)
 	return 0;
 }
 
-static void prepare_commit_graft(void)
+void prepare_commit_graft(void)
 {
 	static int commit_graft_prepared;
 	char *graft_file;
@@ -366,6 +367,7 @@ int parse_commit_buffer(struct commit *item, const void *buffer, unsigned long s
 		}
 	}
 	item->date = parse_commit_date(bufptr, tail);
+	load_commit_graph_info(item);
 
 	return 0;
 }
@@ -381,6 +383,8 @@ int parse_commit(struct commit *item)
 		return -1;
 	if (item->object.parsed)
 		return 0;
+	if (parse_commit_in_graph(item))
+		return 0;
 	buffer = read_sha1_file(item->object.sha1, &type, &size);
 	if (!buffer)
 		return error("Could not read %s",
@@ -662,6 +666,19 @@ int compare_commits_by_commit_date(const void *a_, const void *b_, void *unused)
 	return 0;
 }
 
+int compare_commits_by_gen_then_commit_date(const void *a_, const void *b_, void *unused)
+{
+	const struct commit *a = a_, *b = b_;
+	uint32_t a_gen = commit_generation(a), b_gen = commit_generation(b);
+
+	/* higher generation first, then newer commits first */
+	if (a_gen < b_gen)
+		return 1;
+	else if (a_gen > b_gen)
+		return -1;
+	return compare_commits_by_commit_date(a_, b_, unused);
+}
+
 /*
  * Performs an in-place topological sort on the list supplied.
  */
@@ -798,20 +815,43 @@ static struct commit *interesting(struct commit_list *list)
 	return NULL;
 }
 
-/* all input commits in one and twos[] must have been parsed! */
-static struct commit_list *paint_down_to_common(struct commit *one, int n, struct commit **twos)
+static struct commit_list *insert_by_generation(struct commit *item,
+						struct commit_list **list)
+{
+	struct commit_list **pp = list;
+	struct commit_list *p;
+
+	while ((p = *pp) != NULL) {
+		if (compare_commits_by_gen_then_commit_date(p->item, item, NULL) > 0)
+			break;
+		pp = &p->next;
+	}
+	return commit_list_insert(item, pp);
+}
+
+/*
+ * All input commits in one and twos[] must have been parsed!
+ *
+ * Commits are visited in decreasing generation number (falling back
+ * to commit date for commits outside the commit-graph).  Nothing below
+ * "min_generation" can reach a commit at that generation, so the walk
+ * stops there; pass 0 to paint the whole common history.
+ */
+static struct commit_list *paint_down_to_common(struct commit *one, int n,
+						struct commit **twos,
+						uint32_t min_generation)
 {
 	struct commit_list *list = NULL;
 	struct commit_list *result = NULL;
 	int i;
 
 	one->object.flags |= PARENT1;
-	commit_list_insert_by_date(one, &list);
+	insert_by_generation(one, &list);
 	if (!n)
 		return list;
 	for (i = 0; i < n; i++) {
 		twos[i]->object.flags |= PARENT2;
-		commit_list_insert_by_date(twos[i], &list);
+		insert_by_generation(twos[i], &list);
 	}
 
 	while (interesting(list)) {
@@ -821,6 +861,8 @@ static struct commit_list *paint_down_to_common(struct commit *one, int n, struc
 		int flags;
 
 		commit = list->item;
+		if (commit_generation(commit) < min_generation)
+			break;
 		next = list->next;
 		free(list);
 		list = next;
@@ -843,7 +885,7 @@ static struct commit_list *paint_down_to_common(struct commit *one, int n, struc
 			if (parse_commit(p))
 				return NULL;
 			p->object.flags |= flags;
-			commit_list_insert_by_date(p, &list);
+			insert_by_generation(p, &list);
 		}
 	}
 
@@ -873,7 +915,7 @@ static struct commit_list *merge_bases_many(struct commit *one, int n, struct co
 			return NULL;
 	}
 
-	list = paint_down_to_common(one, n, twos);
+	list = paint_down_to_common(one, n, twos, 0);
 
 	while (list) {
 		struct commit_list *next = list->next;
@@ -942,7 +984,7 @@ static int remove_redundant(struct commit **array, int cnt)
 			filled_index[filled] = j;
 			work[filled++] = array[j];
 		}
-		common = paint_down_to_common(array[i], filled, work);
+		common = paint_down_to_common(array[i], filled, work, 0);
 		if (array[i]->object.flags & PARENT2)
 			redundant[i] = 1;
 		for (j = 0; j < filled; j++)
@@ -1045,14 +1087,27 @@ int in_merge_bases_many(struct commit *commit, int nr_reference, struct commit *
 {
 	struct commit_list *bases;
 	int ret = 0, i;
+	uint32_t max_generation = 0;
 
 	if (parse_commit(commit))
 		return ret;
-	for (i = 0; i < nr_reference; i++)
+	for (i = 0; i < nr_reference; i++) {
 		if (parse_commit(reference[i]))
 			return ret;
+		if (commit_generation(reference[i]) > max_generation)
+			max_generation = commit_generation(reference[i]);
+	}
+
+	/*
+	 * An ancestor always has a smaller generation than its
+	 * descendants, so "commit" cannot be reached from any reference
+	 * that is older than it; give up only if all of them are.
+	 */
+	if (commit_generation(commit) > max_generation)
+		return ret;
 
-	bases = paint_down_to_common(commit, nr_reference, reference);
+	bases = paint_down_to_common(commit, nr_reference, reference,
+				     commit_generation(commit));
 	if (commit->object.flags & PARENT2)
 		ret = 1;
 	clear_commit_marks(commit, all_flags);
@@ -17,11 +17,26 @@ struct commit {
 	struct object object;
 	void *util;
 	unsigned int index;
+	/* from the commit-graph; 0 when not loaded from there */
+	uint32_t generation;
 	unsigned long date;
 	struct commit_list *parents;
 	struct tree *tree;
 };
 
+#define GENERATION_NUMBER_INFINITY 0xFFFFFFFF
+#define GENERATION_NUMBER_MAX 0x3FFFFFFF
+
+/*
+ * Generation number of a commit: one more than the maximum
+ * generation of its parents, or GENERATION_NUMBER_INFINITY if it is
+ * not known (i.e. the commit was not parsed from the commit-graph).
+ */
+static inline uint32_t commit_generation(const struct commit *commit)
+{
+	return commit->generation ? commit->generation : GENERATION_NUMBER_INFINITY;
+}
+
 extern int save_commit_buffer;
 extern const char *commit_type;
 
@@ -221,6 +236,7 @@ typedef int (*each_commit_graft_fn)(const struct commit_graft *, void *);
 
 struct commit_graft *read_graft_line(char *buf, int len);
 int register_commit_graft(struct commit_graft *, int);
+void prepare_commit_graft(void);
 struct commit_graft *lookup_commit_graft(const unsigned char *sha1);
 
 extern struct commit_list *get_merge_bases(struct commit *rev1, struct commit *rev2, int cleanup);
@@ -341,6 +357,7 @@ extern void print_commit_list(struct commit_list *list,
 extern void check_commit_signature(const struct commit* commit, struct signature_check *sigc);
 
 int compare_commits_by_commit_date(const void *a_, const void *b_, void *unused);
+int compare_commits_by_gen_then_commit_date(const void *a_, const void *b_, void *unused);
 
 LAST_ARG_MUST_BE_NULL
 extern int run_commit_hook(int editor_is_used, const char *index_file, const char *name, ...);
@@ -854,6 +854,19 @@ static int git_default_core_config(const char *var, const char *value)
 		return 0;
 	}
 
+	if (!strcmp(var, "core.commitgraph")) {
+		core_commit_graph = git_config_bool(var, value);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.multipackindex")) {
+		core_multi_pack_index = git_config_bool(var, value);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.fsmonitor"))
+		return git_config_string(&core_fsmonitor, var, value);
+
 	if (!strcmp(var, "core.createobject")) {
 		if (!strcmp(value, "rename"))
 			object_creation_mode = OBJECT_CREATION_USES_RENAMES;
@@ -864,6 +877,18 @@ static int git_default_core_config(const char *var, const char *value)
 		return 0;
 	}
 
+	if (!strcmp(var, "core.refstorage")) {
+		if (!value)
+			return config_error_nonbool(var);
+		if (!strcmp(value, "files"))
+			ref_storage_format = REF_STORAGE_FILES;
+		else if (!strcmp(value, "reftable"))
+			ref_storage_format = REF_STORAGE_REFTABLE;
+		else
+			return error("unknown ref storage format '%s'", value);
+		return 0;
+	}
+
 	if (!strcmp(var, "core.sparsecheckout")) {
 		core_apply_sparse_checkout = git_config_bool(var, value);
 		return 0;
@@ -992,6 +1017,22 @@ int git_default_config(const char *var, const char *value, void *dummy)
 		pack_size_limit_cfg = git_config_ulong(var, value);
 		return 0;
 	}
+
+	if (!strcmp(var, "splitindex.maxpercentchange")) {
+		int pct = git_config_int(var, value);
+		if (pct < 0 || pct > 100)
+			return error("%s should be between 0 and 100", var);
+		split_index_max_percent_change = pct;
+		return 0;
+	}
+
+	if (!strcmp(var, "splitindex.sharedindexexpire"))
+		return git_config_string(&split_index_shared_expire, var, value);
+
+	if (!strcmp(var, "index.sparse")) {
+		use_sparse_index = git_config_bool(var, value);
+		return 0;
+	}
 	/* Add other config variables here and to Documentation/config.txt. */
 	return 0;
 }
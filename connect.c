@@ -9,8 +9,13 @@
 #include "url.h"
 #include "string-list.h"
 #include "sha1-array.h"
+#include "argv-array.h"
+#include "version.h"
+#include "protocol.h"
 
 static char *server_capabilities;
+static struct argv_array server_capabilities_v2 = ARGV_ARRAY_INIT;
+static enum protocol_version server_version = protocol_v0;
 static const char *parse_feature_value(const char *, const char *, int *);
 
 static int check_ref(const char *name, int len, unsigned int flags)
@@ -111,6 +116,35 @@ static void annotate_refs_with_symref_info(struct ref *ref)
 	string_list_clear(&symref, 0);
 }
 
+/*
+ * Read a packet of a protocol v2 section; NULL at the flush ending it.
+ */
+static char *read_line_v2(int in, char **src_buf, size_t *src_len)
+{
+	enum packet_read_status status;
+	char *line = packet_read_line_status(in, src_buf, src_len, &status);
+
+	if (status == PACKET_READ_EOF)
+		die("The remote end hung up unexpectedly");
+	if (status == PACKET_READ_DELIM)
+		die("protocol error: unexpected delimiter packet");
+	return line;
+}
+
+/*
+ * Read the capabilities a protocol v2 server advertises after its
+ * "version 2" line, up to the flush packet.
+ */
+static void read_capabilities_v2(int in, char **src_buf, size_t *src_len)
+{
+	char *line;
+
+	server_version = protocol_v2;
+	argv_array_clear(&server_capabilities_v2);
+	while ((line = read_line_v2(in, src_buf, src_len)))
+		argv_array_push(&server_capabilities_v2, line);
+}
+
 /*
  * Read all the refs from the other end
  */
@@ -123,6 +157,7 @@ struct ref **get_remote_heads(int in, char *src_buf, size_t src_len,
 	int got_at_least_one_head = 0;
 
 	*list = NULL;
+	server_version = protocol_v0;
 	for (;;) {
 		struct ref *ref;
 		unsigned char old_sha1[20];
@@ -144,6 +179,11 @@ struct ref **get_remote_heads(int in, char *src_buf, size_t src_len,
 		if (len > 4 && skip_prefix(buffer, "ERR ", &arg))
 			die("remote error: %s", arg);
 
+		if (!got_at_least_one_head && !strcmp(buffer, "version 2")) {
+			read_capabilities_v2(in, &src_buf, &src_len);
+			return list;
+		}
+
 		if (len == 48 && skip_prefix(buffer, "shallow ", &arg)) {
 			if (get_sha1_hex(arg, old_sha1))
 				die("protocol error: expected shallow sha-1, got '%s'", arg);
@@ -235,6 +275,105 @@ int server_supports(const char *feature)
 	return !!server_feature_value(feature, NULL);
 }
 
+enum protocol_version server_protocol_version(void)
+{
+	return server_version;
+}
+
+int server_supports_v2(const char *capability, const char **value)
+{
+	int i;
+
+	for (i = 0; i < server_capabilities_v2.argc; i++) {
+		const char *out;
+		if (skip_prefix(server_capabilities_v2.argv[i], capability, &out) &&
+		    (!*out || *out == '=')) {
+			if (value)
+				*value = *out ? out + 1 : NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int server_supports_feature(const char *capability, const char *feature)
+{
+	const char *value;
+
+	if (!server_supports_v2(capability, &value) || !value)
+		return 0;
+	return parse_feature_request(value, feature);
+}
+
+void ls_refs_request(struct strbuf *req, const struct argv_array *ref_prefixes)
+{
+	int i;
+
+	if (!server_supports_v2("ls-refs", NULL))
+		die("server does not support the ls-refs command");
+	packet_buf_write(req, "command=ls-refs\n");
+	if (server_supports_v2("agent", NULL))
+		packet_buf_write(req, "agent=%s\n", git_user_agent_sanitized());
+	packet_buf_delim(req);
+	packet_buf_write(req, "symrefs\n");
+	packet_buf_write(req, "peel\n");
+	for (i = 0; ref_prefixes && i < ref_prefixes->argc; i++)
+		packet_buf_write(req, "ref-prefix %s\n", ref_prefixes->argv[i]);
+	packet_buf_flush(req);
+}
+
+static struct ref **add_remote_ref_v2(struct ref **list, char *line)
+{
+	unsigned char sha1[20];
+	struct ref *ref;
+	char *name, *attr;
+
+	if (get_sha1_hex(line, sha1) || line[40] != ' ')
+		die("protocol error: expected sha/ref, got '%s'", line);
+	name = line + 41;
+	attr = strchr(name, ' ');
+	if (attr)
+		*attr++ = '\0';
+
+	ref = alloc_ref(name);
+	hashcpy(ref->old_sha1, sha1);
+	*list = ref;
+	list = &ref->next;
+
+	while (attr) {
+		char *next = strchr(attr, ' ');
+		const char *arg;
+
+		if (next)
+			*next++ = '\0';
+		if (skip_prefix(attr, "symref-target:", &arg))
+			ref->symref = xstrdup(arg);
+		else if (skip_prefix(attr, "peeled:", &arg)) {
+			/* list the peeled value like the v0 advertisement */
+			char *peeled_name = xstrfmt("%s^{}", name);
+			struct ref *peeled = alloc_ref(peeled_name);
+			free(peeled_name);
+			if (get_sha1_hex(arg, peeled->old_sha1))
+				die("protocol error: bad peeled value '%s'", arg);
+			*list = peeled;
+			list = &peeled->next;
+		}
+		attr = next;
+	}
+	return list;
+}
+
+struct ref **get_remote_refs(int in, char *src_buf, size_t src_len,
+			     struct ref **list)
+{
+	char *line;
+
+	*list = NULL;
+	while ((line = read_line_v2(in, &src_buf, &src_len)))
+		list = add_remote_ref_v2(list, line);
+	return list;
+}
+
 enum protocol {
 	PROTO_LOCAL = 1,
 	PROTO_FILE,
@@ -643,6 +782,21 @@ static enum protocol parse_connect_url(const char *url_orig, char **ret_host,
 
 static struct child_process no_fork;
 
+/*
+ * The environment for a child we ask to speak protocol v2: "base" (if
+ * not NULL) and GIT_PROTOCOL set accordingly.
+ */
+static const char **protocol_v2_env(const char *const *base)
+{
+	static struct argv_array env = ARGV_ARRAY_INIT;
+
+	argv_array_clear(&env);
+	for (; base && *base; base++)
+		argv_array_push(&env, *base);
+	argv_array_push(&env, GIT_PROTOCOL_ENVIRONMENT "=version=2");
+	return env.argv;
+}
+
 /*
  * This returns a dummy child_process if the transport protocol does not
  * need fork(2), or a struct child_process object if it does.  Once done,
@@ -689,11 +843,20 @@ struct child_process *git_connect(int fd[2], const char *url,
 		 *
 		 * Note: Do not add any other headers here!  Doing so
 		 * will cause older git-daemon servers to crash.
+		 * Parameters for the service like the protocol version
+		 * go after a second NUL byte instead, which older
+		 * servers take for the end of the request.
 		 */
-		packet_write(fd[1],
-			     "%s %s%chost=%s%c",
-			     prog, path, 0,
-			     target_host, 0);
+		if (flags & CONNECT_PROTOCOL_V2)
+			packet_write(fd[1],
+				     "%s %s%chost=%s%c%cversion=2%c",
+				     prog, path, 0,
+				     target_host, 0, 0, 0);
+		else
+			packet_write(fd[1],
+				     "%s %s%chost=%s%c",
+				     prog, path, 0,
+				     target_host, 0);
 		free(target_host);
 	} else {
 		conn = xcalloc(1, sizeof(*conn));
@@ -716,6 +879,13 @@ struct child_process *git_connect(int fd[2], const char *url,
 			argv_array_push(&conn->args, ssh);
 			if (putty && !strcasestr(ssh, "tortoiseplink"))
 				argv_array_push(&conn->args, "-batch");
+			if ((flags & CONNECT_PROTOCOL_V2) && !putty) {
+				/* the server only sees it if it accepts it */
+				argv_array_push(&conn->args, "-o");
+				argv_array_push(&conn->args,
+						"SendEnv=" GIT_PROTOCOL_ENVIRONMENT);
+				conn->env = protocol_v2_env(NULL);
+			}
 			if (port) {
 				/* P is for PuTTY, p is for OpenSSH */
 				argv_array_push(&conn->args, putty ? "-P" : "-p");
@@ -725,6 +895,8 @@ struct child_process *git_connect(int fd[2], const char *url,
 		} else {
 			/* remove repo-local variables from the environment */
 			conn->env = local_repo_env;
+			if (flags & CONNECT_PROTOCOL_V2)
+				conn->env = protocol_v2_env(local_repo_env);
 			conn->use_shell = 1;
 		}
 		argv_array_push(&conn->args, cmd.buf);
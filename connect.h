@@ -1,8 +1,12 @@
 #ifndef CONNECT_H
 #define CONNECT_H
 
+#include "protocol.h"
+
 #define CONNECT_VERBOSE       (1u << 0)
 #define CONNECT_DIAG_URL      (1u << 1)
+/* ask the server to speak protocol v2 */
+#define CONNECT_PROTOCOL_V2   (1u << 2)
 extern struct child_process *git_connect(int fd[2], const char *url, const char *prog, int flags);
 extern int finish_connect(struct child_process *conn);
 extern int git_connection_is_socket(struct child_process *conn);
@@ -11,4 +15,33 @@ extern int parse_feature_request(const char *features, const char *feature);
 extern const char *server_feature_value(const char *feature, int *len_ret);
 extern int url_is_local_not_ssh(const char *url);
 
+/*
+ * The protocol version of the advertisement last read by
+ * get_remote_heads().  A protocol v2 server only advertises its
+ * capabilities; its refs are listed with the ls-refs command.
+ */
+enum protocol_version server_protocol_version(void);
+
+/*
+ * Did the protocol v2 server advertise "capability"?  If so, and value
+ * is not NULL, point it at the value of the capability (the part after
+ * "="), or NULL if it has none.
+ */
+extern int server_supports_v2(const char *capability, const char **value);
+
+/*
+ * Is "feature" among the space-separated values of "capability", like
+ * "shallow" in "fetch=shallow"?
+ */
+extern int server_supports_feature(const char *capability, const char *feature);
+
+/*
+ * Append to "req" an ls-refs command asking for the refs starting with
+ * one of the prefixes (or all of them if there are none), with their
+ * symref targets and peeled values.  The response is read with
+ * get_remote_refs() (see remote.h).
+ */
+struct argv_array;
+extern void ls_refs_request(struct strbuf *req, const struct argv_array *ref_prefixes);
+
 #endif
@@ -26,7 +26,7 @@ static int check_everything_connected_real(sha1_iterate_fn fn,
 					   const char *shallow_file)
 {
 	struct child_process rev_list;
-	const char *argv[9];
+	const char *argv[10];
 	char commit[41];
 	unsigned char sha1[20];
 	int err = 0, ac = 0;
@@ -58,6 +58,9 @@ static int check_everything_connected_real(sha1_iterate_fn fn,
 	argv[ac++] = "--all";
 	if (quiet)
 		argv[ac++] = "--quiet";
+	/* a partial clone misses what the promisor remote promised */
+	if (repository_format_partial_clone)
+		argv[ac++] = "--exclude-promisor-objects";
 	argv[ac] = NULL;
 
 	memset(&rev_list, 0, sizeof(rev_list));
@@ -4,6 +4,7 @@
 #include "run-command.h"
 #include "strbuf.h"
 #include "string-list.h"
+#include "argv-array.h"
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 256
@@ -61,6 +62,9 @@ static char *canon_hostname;
 static char *ip_address;
 static char *tcp_port;
 
+/* "key=value" pairs the client sent after the host, joined by colons */
+static struct strbuf git_protocol = STRBUF_INIT;
+
 static void logreport(int priority, const char *err, va_list params)
 {
 	if (log_syslog) {
@@ -407,20 +411,31 @@ static void copy_to_log(int fd)
 static int run_service_command(const char **argv)
 {
 	struct child_process cld;
+	struct argv_array env = ARGV_ARRAY_INIT;
+	int ret;
+
+	if (git_protocol.len)
+		argv_array_pushf(&env, GIT_PROTOCOL_ENVIRONMENT "=%s",
+				 git_protocol.buf);
 
 	memset(&cld, 0, sizeof(cld));
 	cld.argv = argv;
+	cld.env = env.argv;
 	cld.git_cmd = 1;
 	cld.err = -1;
-	if (start_command(&cld))
+	if (start_command(&cld)) {
+		argv_array_clear(&env);
 		return -1;
+	}
 
 	close(0);
 	close(1);
 
 	copy_to_log(cld.err);
 
-	return finish_command(&cld);
+	ret = finish_command(&cld);
+	argv_array_clear(&env);
+	return ret;
 }
 
 static int upload_pack(void)
@@ -505,7 +520,8 @@ static void parse_host_and_port(char *hostport, char **host,
 }
 
 /*
- * Read the host as supplied by the client connection.
+ * Read the host as supplied by the client connection, and the extra
+ * parameters that may follow it after another NUL.
  */
 static void parse_host_arg(char *extra_args, int buflen)
 {
@@ -538,6 +554,21 @@ static void parse_host_arg(char *extra_args, int buflen)
 			die("Invalid request");
 	}
 
+	/*
+	 * "\0key=value\0key=value\0...", e.g. "version=2"; older daemons
+	 * stop at the empty string and ignore them.
+	 */
+	if (extra_args < end && !*extra_args) {
+		for (extra_args++; extra_args < end;
+		     extra_args += strlen(extra_args) + 1) {
+			if (!*extra_args)
+				continue;
+			if (git_protocol.len)
+				strbuf_addch(&git_protocol, ':');
+			strbuf_addstr(&git_protocol, extra_args);
+		}
+	}
+
 	/*
 	 * Locate canonical hostname and its IP address.
 	 */
@@ -620,6 +651,7 @@ static int execute(void)
 	free(ip_address);
 	free(tcp_port);
 	hostname = canon_hostname = ip_address = tcp_port = NULL;
+	strbuf_reset(&git_protocol);
 
 	if (len != pktlen)
 		parse_host_arg(line + len + 1, pktlen - len - 1);
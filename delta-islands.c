@@ -0,0 +1,315 @@
+#include "cache.h"
+#include "refs.h"
+#include "object.h"
+#include "commit.h"
+#include "tag.h"
+#include "tree.h"
+#include "tree-walk.h"
+#include "blob.h"
+#include "khash.h"
+#include "string-list.h"
+#include "sha1-array.h"
+#include "pack.h"
+#include "pack-objects.h"
+#include "delta-islands.h"
+
+/*
+ * The islands an object is in, one bit per island.  Objects of the
+ * same islands share their bitmap; it is copied before it is changed.
+ */
+struct island_bitmap {
+	uint32_t refcount;
+	uint32_t bits[FLEX_ARRAY];
+};
+
+static khash_sha1 *island_marks;
+static uint32_t island_bitmap_size;
+
+static regex_t *island_regexes;
+static int island_regexes_nr, island_regexes_alloc;
+
+/* island name -> sha1_array of the objects its refs point at */
+static struct string_list islands = STRING_LIST_INIT_DUP;
+
+static struct island_bitmap *island_bitmap_new(const struct island_bitmap *old)
+{
+	size_t size = sizeof(struct island_bitmap) + island_bitmap_size * 4;
+	struct island_bitmap *b = xcalloc(1, size);
+
+	if (old)
+		memcpy(b, old, size);
+	b->refcount = 1;
+	return b;
+}
+
+static int island_bitmap_is_subset(const struct island_bitmap *self,
+				   const struct island_bitmap *super)
+{
+	uint32_t i;
+
+	if (self == super)
+		return 1;
+	for (i = 0; i < island_bitmap_size; i++)
+		if ((self->bits[i] & super->bits[i]) != self->bits[i])
+			return 0;
+	return 1;
+}
+
+static void island_bitmap_or(struct island_bitmap *self,
+			     const struct island_bitmap *other)
+{
+	uint32_t i;
+
+	for (i = 0; i < island_bitmap_size; i++)
+		self->bits[i] |= other->bits[i];
+}
+
+static struct island_bitmap *get_island_marks(const unsigned char *sha1)
+{
+	khiter_t pos;
+
+	if (!island_marks)
+		return NULL;
+	pos = kh_get_sha1(island_marks, sha1);
+	if (pos >= kh_end(island_marks))
+		return NULL;
+	return kh_value(island_marks, pos);
+}
+
+/*
+ * Add the islands of "marks" to those of "obj".  Returns 1 if that
+ * gave "obj" a new island.
+ */
+static int set_island_marks(struct object *obj, struct island_bitmap *marks)
+{
+	struct island_bitmap *b;
+	khiter_t pos;
+	int hash_ret;
+
+	pos = kh_put_sha1(island_marks, obj->sha1, &hash_ret);
+	if (hash_ret) {
+		/* a new entry; share the bitmap */
+		marks->refcount++;
+		kh_value(island_marks, pos) = marks;
+		return 1;
+	}
+
+	b = kh_value(island_marks, pos);
+	if (island_bitmap_is_subset(marks, b))
+		return 0;
+	if (b->refcount > 1) {
+		b->refcount--;
+		b = island_bitmap_new(b);
+		kh_value(island_marks, pos) = b;
+	}
+	island_bitmap_or(b, marks);
+	return 1;
+}
+
+static int island_config_callback(const char *k, const char *v, void *cb)
+{
+	if (!strcmp(k, "pack.island")) {
+		if (!v)
+			return config_error_nonbool(k);
+		ALLOC_GROW(island_regexes, island_regexes_nr + 1,
+			   island_regexes_alloc);
+		if (regcomp(&island_regexes[island_regexes_nr], v, REG_EXTENDED))
+			die("failed to load island regex for '%s': %s", k, v);
+		island_regexes_nr++;
+	}
+	return 0;
+}
+
+static int find_island_for_ref(const char *refname, const unsigned char *sha1,
+			       int flags, void *data)
+{
+	/* the groups of the regex name the island; up to 8 of them */
+	regmatch_t matches[9];
+	struct strbuf name = STRBUF_INIT;
+	struct string_list_item *item;
+	int i, m;
+
+	/* the last regex that matches at the start of the name wins */
+	for (i = island_regexes_nr - 1; i >= 0; i--)
+		if (!regexec(&island_regexes[i], refname,
+			     ARRAY_SIZE(matches), matches, 0) &&
+		    !matches[0].rm_so)
+			break;
+	if (i < 0)
+		return 0;
+
+	for (m = 1; m < ARRAY_SIZE(matches); m++) {
+		regmatch_t *match = &matches[m];
+
+		if (match->rm_so == -1)
+			continue;
+		if (name.len)
+			strbuf_addch(&name, '-');
+		strbuf_add(&name, refname + match->rm_so,
+			   match->rm_eo - match->rm_so);
+	}
+
+	item = string_list_insert(&islands, name.buf);
+	if (!item->util)
+		item->util = xcalloc(1, sizeof(struct sha1_array));
+	sha1_array_append(item->util, sha1);
+	strbuf_release(&name);
+	return 0;
+}
+
+static void mark_island_tips(struct sha1_array *tips, int island)
+{
+	struct island_bitmap *marks = island_bitmap_new(NULL);
+	int i;
+
+	marks->bits[island / 32] |= 1u << (island % 32);
+	for (i = 0; i < tips->nr; i++) {
+		struct object *obj = parse_object(tips->sha1[i]);
+
+		/* a tag is in the island, and so is what it points at */
+		while (obj) {
+			set_island_marks(obj, marks);
+			if (obj->type != OBJ_TAG || !((struct tag *)obj)->tagged)
+				break;
+			obj = parse_object(((struct tag *)obj)->tagged->sha1);
+		}
+	}
+	if (!--marks->refcount)
+		free(marks);
+}
+
+void load_delta_islands(void)
+{
+	int i;
+
+	git_config(island_config_callback, NULL);
+	if (!island_regexes_nr)
+		return;
+
+	for_each_ref(find_island_for_ref, NULL);
+
+	island_marks = kh_init_sha1();
+	island_bitmap_size = (islands.nr + 31) / 32;
+	for (i = 0; i < islands.nr; i++) {
+		mark_island_tips(islands.items[i].util, i);
+		sha1_array_clear(islands.items[i].util);
+	}
+	string_list_clear(&islands, 1);
+
+	for (i = 0; i < island_regexes_nr; i++)
+		regfree(&island_regexes[i]);
+	free(island_regexes);
+	island_regexes = NULL;
+	island_regexes_nr = island_regexes_alloc = 0;
+}
+
+void propagate_island_marks(struct commit *commit)
+{
+	struct island_bitmap *marks = get_island_marks(commit->object.sha1);
+	struct commit_list *p;
+
+	if (!marks)
+		return;
+	for (p = commit->parents; p; p = p->next)
+		set_island_marks(&p->item->object, marks);
+}
+
+/*
+ * Give the entries of "tree" the islands of "marks".  A tree that
+ * gains no new island has passed them on already.
+ */
+static void mark_tree_islands(struct packing_data *to_pack,
+			      struct tree *tree, struct island_bitmap *marks)
+{
+	struct tree_desc desc;
+	struct name_entry entry;
+	enum object_type type;
+	unsigned long size;
+	void *buf;
+
+	if (!set_island_marks(&tree->object, marks))
+		return;
+
+	buf = read_sha1_file(tree->object.sha1, &type, &size);
+	if (!buf || type != OBJ_TREE) {
+		free(buf);
+		return;
+	}
+	init_tree_desc(&desc, buf, size);
+	while (tree_entry(&desc, &entry)) {
+		if (S_ISGITLINK(entry.mode))
+			continue;
+		/* what is not in the pack does not need an island */
+		if (!packlist_find(to_pack, entry.sha1, NULL))
+			continue;
+		if (S_ISDIR(entry.mode)) {
+			struct tree *subtree = lookup_tree(entry.sha1);
+
+			if (subtree)
+				mark_tree_islands(to_pack, subtree, marks);
+		} else {
+			struct blob *blob = lookup_blob(entry.sha1);
+
+			if (blob)
+				set_island_marks(&blob->object, marks);
+		}
+	}
+	free(buf);
+}
+
+void resolve_tree_islands(struct packing_data *to_pack)
+{
+	uint32_t i;
+
+	if (!island_marks)
+		return;
+
+	for (i = 0; i < to_pack->nr_objects; i++) {
+		struct object_entry *entry = &to_pack->objects[i];
+		struct island_bitmap *marks;
+		struct commit *commit;
+
+		if (entry->type != OBJ_COMMIT)
+			continue;
+		marks = get_island_marks(entry->idx.sha1);
+		if (!marks)
+			continue;
+		commit = lookup_commit(entry->idx.sha1);
+		if (!commit || !commit->tree)
+			continue;
+		mark_tree_islands(to_pack, commit->tree, marks);
+	}
+}
+
+int in_same_island(const unsigned char *trg, const unsigned char *src)
+{
+	struct island_bitmap *trg_marks, *src_marks;
+
+	if (!island_marks)
+		return 1;
+
+	/* an object that is in no island may use any base */
+	trg_marks = get_island_marks(trg);
+	if (!trg_marks)
+		return 1;
+	src_marks = get_island_marks(src);
+	if (!src_marks)
+		return 0;
+	return island_bitmap_is_subset(trg_marks, src_marks);
+}
+
+int island_delta_cmp(const unsigned char *a, const unsigned char *b)
+{
+	struct island_bitmap *a_marks, *b_marks;
+
+	if (!island_marks)
+		return 0;
+
+	a_marks = get_island_marks(a);
+	b_marks = get_island_marks(b);
+	if (a_marks && (!b_marks || !island_bitmap_is_subset(a_marks, b_marks)))
+		return -1;
+	if (b_marks && (!a_marks || !island_bitmap_is_subset(b_marks, a_marks)))
+		return 1;
+	return 0;
+}
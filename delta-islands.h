@@ -0,0 +1,41 @@
+#ifndef DELTA_ISLANDS_H
+#define DELTA_ISLANDS_H
+
+struct commit;
+struct packing_data;
+
+/*
+ * Delta islands keep pack-objects from storing an object as a delta
+ * against a base that is not reachable from all the refs the object
+ * itself is reachable from.  The refs are grouped into islands by
+ * the regexes of "pack.island"; see Documentation/git-pack-objects.txt.
+ */
+
+/*
+ * Read the "pack.island" config and give the objects the refs point
+ * at the islands of those refs.  Call before the object walk.
+ */
+extern void load_delta_islands(void);
+
+/* Let the parents of "commit" inherit its islands; call in show_commit. */
+extern void propagate_island_marks(struct commit *commit);
+
+/*
+ * After the walk, pass the islands of the commits down to the trees
+ * and blobs of "to_pack".
+ */
+extern void resolve_tree_islands(struct packing_data *to_pack);
+
+/*
+ * Whether "trg" may be stored as a delta against "src": "src" has to
+ * be in every island "trg" is in.
+ */
+extern int in_same_island(const unsigned char *trg, const unsigned char *src);
+
+/*
+ * qsort()-style comparison that puts objects of the same islands next
+ * to each other, so that they meet in the delta search window.
+ */
+extern int island_delta_cmp(const unsigned char *a, const unsigned char *b);
+
+#endif
@@ -12,6 +12,8 @@
 #include "refs.h"
 #include "wildmatch.h"
 #include "pathspec.h"
+#include "varint.h"
+#include "convert.h"
 
 struct path_simplify {
 	int len;
@@ -31,8 +33,22 @@ enum path_treatment {
 	path_untracked
 };
 
+/*
+ * Support data structure for our opendir/readdir/closedir wrappers
+ */
+struct cached_dir {
+	DIR *fdir;
+	struct untracked_cache_dir *untracked;
+	int nr_files;
+	int nr_dirs;
+
+	struct dirent *de;
+	const char *file;
+	struct untracked_cache_dir *ucd;
+};
+
 static enum path_treatment read_directory_recursive(struct dir_struct *dir,
-	const char *path, int len,
+	const char *path, int len, struct untracked_cache_dir *untracked,
 	int check_only, const struct path_simplify *simplify);
 static int get_dtype(struct dirent *de, const char *path, int len);
 
@@ -466,7 +482,8 @@ void add_exclude(const char *string, const char *base,
 	x->el = el;
 }
 
-static void *read_skip_worktree_file_from_index(const char *path, size_t *size)
+static void *read_skip_worktree_file_from_index(const char *path, size_t *size,
+						struct sha1_stat *sha1_stat)
 {
 	int pos, len;
 	unsigned long sz;
@@ -485,6 +502,10 @@ static void *read_skip_worktree_file_from_index(const char *path, size_t *size)
 		return NULL;
 	}
 	*size = xsize_t(sz);
+	if (sha1_stat) {
+		memset(&sha1_stat->stat, 0, sizeof(sha1_stat->stat));
+		hashcpy(sha1_stat->sha1, active_cache[pos]->sha1);
+	}
 	return data;
 }
 
@@ -529,16 +550,50 @@ static void trim_trailing_spaces(char *buf)
 		*last_space = '\0';
 }
 
-int add_excludes_from_file_to_list(const char *fname,
-				   const char *base,
-				   int baselen,
-				   struct exclude_list *el,
-				   int check_index)
+/*
+ * Parse the exclude patterns in "buf", which must end with a newline,
+ * and add them to "el", which takes ownership of the buffer.
+ */
+static void add_excludes_from_buffer(char *buf, size_t size,
+				     const char *base, int baselen,
+				     struct exclude_list *el)
+{
+	int lineno = 1;
+	size_t i;
+	char *entry;
+
+	el->filebuf = buf;
+	entry = buf;
+	for (i = 0; i < size; i++) {
+		if (buf[i] == '\n') {
+			if (entry != buf + i && entry[0] != '#') {
+				buf[i - (i && buf[i-1] == '\r')] = 0;
+				trim_trailing_spaces(entry);
+				add_exclude(entry, base, baselen, el, lineno);
+			}
+			lineno++;
+			entry = buf + i + 1;
+		}
+	}
+}
+
+/*
+ * Given a file with name "fname", read it (either from disk, or from
+ * the index if "check_index" is non-zero), parse it and store the
+ * exclude rules in "el".
+ *
+ * If "sha1_stat" is not NULL, compute SHA-1 of the exclude file and fill
+ * stat data from disk (only valid if add_excludes returns zero). If
+ * sha1_stat.valid is non-zero, sha1_stat must contain good value as input.
+ */
+static int add_excludes(const char *fname, const char *base, int baselen,
+			struct exclude_list *el, int check_index,
+			struct sha1_stat *sha1_stat)
 {
 	struct stat st;
-	int fd, i, lineno = 1;
+	int fd;
 	size_t size = 0;
-	char *buf, *entry;
+	char *buf;
 
 	fd = open(fname, O_RDONLY);
 	if (fd < 0 || fstat(fd, &st) < 0) {
@@ -547,7 +602,7 @@ int add_excludes_from_file_to_list(const char *fname,
 		if (0 <= fd)
 			close(fd);
 		if (!check_index ||
-		    (buf = read_skip_worktree_file_from_index(fname, &size)) == NULL)
+		    (buf = read_skip_worktree_file_from_index(fname, &size, sha1_stat)) == NULL)
 			return -1;
 		if (size == 0) {
 			free(buf);
@@ -561,6 +616,11 @@ int add_excludes_from_file_to_list(const char *fname,
 	else {
 		size = xsize_t(st.st_size);
 		if (size == 0) {
+			if (sha1_stat) {
+				fill_stat_data(&sha1_stat->stat, &st);
+				hashcpy(sha1_stat->sha1, EMPTY_BLOB_SHA1_BIN);
+				sha1_stat->valid = 1;
+			}
 			close(fd);
 			return 0;
 		}
@@ -570,23 +630,61 @@ int add_excludes_from_file_to_list(const char *fname,
 			close(fd);
 			return -1;
 		}
-		buf[size++] = '\n';
 		close(fd);
+		if (sha1_stat) {
+			int pos;
+			if (sha1_stat->valid &&
+			    !match_stat_data_racy(&the_index, &sha1_stat->stat, &st))
+				; /* no content change, ss->sha1 still good */
+			else if (check_index &&
+				 (pos = cache_name_pos(fname, strlen(fname))) >= 0 &&
+				 !ce_stage(active_cache[pos]) &&
+				 ce_uptodate(active_cache[pos]) &&
+				 !would_convert_to_git(fname, buf, size, 0))
+				hashcpy(sha1_stat->sha1, active_cache[pos]->sha1);
+			else
+				hash_sha1_file(buf, size, "blob", sha1_stat->sha1);
+			fill_stat_data(&sha1_stat->stat, &st);
+			sha1_stat->valid = 1;
+		}
+		buf[size++] = '\n';
 	}
 
-	el->filebuf = buf;
-	entry = buf;
-	for (i = 0; i < size; i++) {
-		if (buf[i] == '\n') {
-			if (entry != buf + i && entry[0] != '#') {
-				buf[i - (i && buf[i-1] == '\r')] = 0;
-				trim_trailing_spaces(entry);
-				add_exclude(entry, base, baselen, el, lineno);
-			}
-			lineno++;
-			entry = buf + i + 1;
-		}
+	add_excludes_from_buffer(buf, size, base, baselen, el);
+	return 0;
+}
+
+int add_excludes_from_file_to_list(const char *fname, const char *base,
+				   int baselen, struct exclude_list *el,
+				   int check_index)
+{
+	return add_excludes(fname, base, baselen, el, check_index, NULL);
+}
+
+int add_excludes_from_blob_to_list(const unsigned char *sha1,
+				   const char *base, int baselen,
+				   struct exclude_list *el)
+{
+	enum object_type type;
+	unsigned long size;
+	char *buf;
+
+	buf = read_sha1_file(sha1, &type, &size);
+	if (!buf)
+		return -1;
+	if (type != OBJ_BLOB) {
+		free(buf);
+		return -1;
 	}
+	if (!size) {
+		free(buf);
+		return 0;
+	}
+	if (buf[size - 1] != '\n') {
+		buf = xrealloc(buf, size + 1);
+		buf[size++] = '\n';
+	}
+	add_excludes_from_buffer(buf, size, base, baselen, el);
 	return 0;
 }
 
@@ -607,14 +705,28 @@ struct exclude_list *add_exclude_list(struct dir_struct *dir,
 /*
  * Used to set up core.excludesfile and .git/info/exclude lists.
  */
-void add_excludes_from_file(struct dir_struct *dir, const char *fname)
+static void add_excludes_from_file_1(struct dir_struct *dir, const char *fname,
+				     struct sha1_stat *sha1_stat)
 {
 	struct exclude_list *el;
+	/*
+	 * catch setup_standard_excludes() that's called before
+	 * dir->untracked is assigned. That function behaves
+	 * differently when dir->untracked is non-NULL.
+	 */
+	if (!dir->untracked)
+		dir->unmanaged_exclude_files++;
 	el = add_exclude_list(dir, EXC_FILE, fname);
-	if (add_excludes_from_file_to_list(fname, "", 0, el, 0) < 0)
+	if (add_excludes(fname, "", 0, el, 0, sha1_stat) < 0)
 		die("cannot use %s as an exclude file", fname);
 }
 
+void add_excludes_from_file(struct dir_struct *dir, const char *fname)
+{
+	dir->unmanaged_exclude_files++; /* see validate_untracked_cache() */
+	add_excludes_from_file_1(dir, fname, NULL);
+}
+
 int match_basename(const char *basename, int basenamelen,
 		   const char *pattern, int prefix, int patternlen,
 		   int flags)
@@ -780,6 +892,99 @@ static struct exclude *last_exclude_matching_from_lists(struct dir_struct *dir,
 	return NULL;
 }
 
+/*
+ * Find the child "name" (of length "len", a trailing slash is
+ * ignored) of the cached directory "dir". Returns the position where
+ * it was found, or -1 - the position where it should be inserted.
+ */
+static int untracked_dir_pos(struct untracked_cache_dir *dir,
+			     const char *name, int len)
+{
+	int first, last;
+
+	if (len && name[len - 1] == '/')
+		len--;
+	first = 0;
+	last = dir->dirs_nr;
+	while (last > first) {
+		int cmp, next = (last + first) >> 1;
+		struct untracked_cache_dir *d = dir->dirs[next];
+		cmp = strncmp(name, d->name, len);
+		if (!cmp && d->name[len])
+			cmp = -1;
+		if (!cmp)
+			return next;
+		if (cmp < 0) {
+			last = next;
+			continue;
+		}
+		first = next+1;
+	}
+	return -first - 1;
+}
+
+static struct untracked_cache_dir *lookup_untracked(struct untracked_cache *uc,
+						    struct untracked_cache_dir *dir,
+						    const char *name, int len)
+{
+	int pos;
+	struct untracked_cache_dir *d;
+
+	if (!dir)
+		return NULL;
+	pos = untracked_dir_pos(dir, name, len);
+	if (pos >= 0)
+		return dir->dirs[pos];
+	pos = -pos - 1;
+
+	if (len && name[len - 1] == '/')
+		len--;
+	uc->dir_created++;
+	d = xcalloc(1, sizeof(*d) + len + 1);
+	memcpy(d->name, name, len);
+	d->name[len] = '\0';
+
+	ALLOC_GROW(dir->dirs, dir->dirs_nr + 1, dir->dirs_alloc);
+	memmove(dir->dirs + pos + 1, dir->dirs + pos,
+		(dir->dirs_nr - pos) * sizeof(*dir->dirs));
+	dir->dirs_nr++;
+	dir->dirs[pos] = d;
+	return d;
+}
+
+static void clear_untracked_names(struct untracked_cache_dir *dir)
+{
+	int i;
+
+	for (i = 0; i < dir->untracked_nr; i++)
+		free(dir->untracked[i]);
+	dir->untracked_nr = 0;
+}
+
+static void do_invalidate_gitignore(struct untracked_cache_dir *dir)
+{
+	int i;
+	dir->valid = 0;
+	clear_untracked_names(dir);
+	for (i = 0; i < dir->dirs_nr; i++)
+		do_invalidate_gitignore(dir->dirs[i]);
+}
+
+static void invalidate_gitignore(struct untracked_cache *uc,
+				 struct untracked_cache_dir *dir)
+{
+	uc->gitignore_invalidated++;
+	do_invalidate_gitignore(dir);
+}
+
+static void invalidate_directory(struct untracked_cache *uc,
+				 struct untracked_cache_dir *dir)
+{
+	uc->dir_invalidated++;
+	dir->valid = 0;
+	clear_untracked_names(dir);
+}
+
 /*
  * Loads the per-directory exclude list for the substring of base
  * which has a char length of baselen.
@@ -789,6 +994,7 @@ static void prep_exclude(struct dir_struct *dir, const char *base, int baselen)
 	struct exclude_list_group *group;
 	struct exclude_list *el;
 	struct exclude_stack *stk = NULL;
+	struct untracked_cache_dir *untracked;
 	int current;
 
 	group = &dir->exclude_list_group[EXC_DIRS];
@@ -815,8 +1021,14 @@ static void prep_exclude(struct dir_struct *dir, const char *base, int baselen)
 
 	/* Read from the parent directories and push them down. */
 	current = stk ? stk->baselen : -1;
+	if (dir->untracked)
+		untracked = stk ? stk->ucd : dir->untracked->root;
+	else
+		untracked = NULL;
+
 	while (current < baselen) {
 		struct exclude_stack *stk = xcalloc(1, sizeof(*stk));
+		struct sha1_stat sha1_stat;
 		const char *cp;
 
 		if (current < 0) {
@@ -828,10 +1040,15 @@ static void prep_exclude(struct dir_struct *dir, const char *base, int baselen)
 			if (!cp)
 				die("oops in prep_exclude");
 			cp++;
+			untracked =
+				lookup_untracked(dir->untracked, untracked,
+						 base + current,
+						 cp - base - current);
 		}
 		stk->prev = dir->exclude_stack;
 		stk->baselen = cp - base;
 		stk->exclude_ix = group->nr;
+		stk->ucd = untracked;
 		el = add_exclude_list(dir, EXC_DIRS, NULL);
 		memcpy(dir->basebuf + current, base + current,
 		       stk->baselen - current);
@@ -855,8 +1072,20 @@ static void prep_exclude(struct dir_struct *dir, const char *base, int baselen)
 		}
 
 		/* Try to read per-directory file unless path is too long */
+		hashclr(sha1_stat.sha1);
+		sha1_stat.valid = 0;
 		if (dir->exclude_per_dir &&
-		    stk->baselen + strlen(dir->exclude_per_dir) < PATH_MAX) {
+		    stk->baselen + strlen(dir->exclude_per_dir) < PATH_MAX &&
+		    /*
+		     * If we know that no files have been added in
+		     * this directory (i.e. valid_cached_dir() has
+		     * been executed and set untracked->valid) and
+		     * .gitignore did not exist before (i.e. null
+		     * exclude_sha1), we can skip loading .gitignore,
+		     * which would result in ENOENT anyway.
+		     */
+		    (!untracked || !untracked->valid ||
+		     !is_null_sha1(untracked->exclude_sha1))) {
 			strcpy(dir->basebuf + stk->baselen,
 					dir->exclude_per_dir);
 			/*
@@ -868,8 +1097,13 @@ static void prep_exclude(struct dir_struct *dir, const char *base, int baselen)
 			 * strdup() and free() here in the caller.
 			 */
 			el->src = strdup(dir->basebuf);
-			add_excludes_from_file_to_list(dir->basebuf,
-					dir->basebuf, stk->baselen, el, 1);
+			add_excludes(dir->basebuf, dir->basebuf, stk->baselen,
+				     el, 1, untracked ? &sha1_stat : NULL);
+		}
+		if (untracked &&
+		    hashcmp(sha1_stat.sha1, untracked->exclude_sha1)) {
+			invalidate_gitignore(dir->untracked, untracked);
+			hashcpy(untracked->exclude_sha1, sha1_stat.sha1);
 		}
 		dir->exclude_stack = stk;
 		current = stk->baselen;
@@ -1050,7 +1284,8 @@ static enum exist_status directory_exists_in_index(const char *dirname, int len)
  *  (c) otherwise, we recurse into it.
  */
 static enum path_treatment treat_directory(struct dir_struct *dir,
-	const char *dirname, int len, int exclude,
+	struct untracked_cache_dir *untracked,
+	const char *dirname, int len, int baselen, int exclude,
 	const struct path_simplify *simplify)
 {
 	/* The "len-1" is to strip the final '/' */
@@ -1077,7 +1312,10 @@ static enum path_treatment treat_directory(struct dir_struct *dir,
 	if (!(dir->flags & DIR_HIDE_EMPTY_DIRECTORIES))
 		return exclude ? path_excluded : path_untracked;
 
-	return read_directory_recursive(dir, dirname, len, 1, simplify);
+	untracked = lookup_untracked(dir->untracked, untracked,
+				     dirname + baselen, len - baselen);
+	return read_directory_recursive(dir, dirname, len,
+					untracked, 1, simplify);
 }
 
 /*
@@ -1193,7 +1431,9 @@ static int get_dtype(struct dirent *de, const char *path, int len)
 }
 
 static enum path_treatment treat_one_path(struct dir_struct *dir,
+					  struct untracked_cache_dir *untracked,
 					  struct strbuf *path,
+					  int baselen,
 					  const struct path_simplify *simplify,
 					  int dtype, struct dirent *de)
 {
@@ -1245,22 +1485,59 @@ static enum path_treatment treat_one_path(struct dir_struct *dir,
 		return path_none;
 	case DT_DIR:
 		strbuf_addch(path, '/');
-		return treat_directory(dir, path->buf, path->len, exclude,
-			simplify);
+		return treat_directory(dir, untracked, path->buf, path->len,
+				       baselen, exclude, simplify);
 	case DT_REG:
 	case DT_LNK:
 		return exclude ? path_excluded : path_untracked;
 	}
 }
 
+static enum path_treatment treat_path_fast(struct dir_struct *dir,
+					   struct untracked_cache_dir *untracked,
+					   struct cached_dir *cdir,
+					   struct strbuf *path,
+					   int baselen,
+					   const struct path_simplify *simplify)
+{
+	strbuf_setlen(path, baselen);
+	if (!cdir->ucd) {
+		strbuf_addstr(path, cdir->file);
+		return path_untracked;
+	}
+	strbuf_addstr(path, cdir->ucd->name);
+	/* treat_one_path() does this before it calls treat_directory() */
+	strbuf_addch(path, '/');
+	if (cdir->ucd->check_only)
+		/*
+		 * check_only is set as a result of treat_directory() getting
+		 * to its bottom. Verify again the same set of directories
+		 * with check_only set.
+		 */
+		return read_directory_recursive(dir, path->buf, path->len,
+						cdir->ucd, 1, simplify);
+	/*
+	 * We get path_recurse in the first run when
+	 * directory_exists_in_index() returns index_nonexistent. We
+	 * are sure that new changes in the index does not impact the
+	 * outcome. Return now.
+	 */
+	return path_recurse;
+}
+
 static enum path_treatment treat_path(struct dir_struct *dir,
-				      struct dirent *de,
+				      struct untracked_cache_dir *untracked,
+				      struct cached_dir *cdir,
 				      struct strbuf *path,
 				      int baselen,
 				      const struct path_simplify *simplify)
 {
 	int dtype;
+	struct dirent *de = cdir->de;
 
+	if (!de)
+		return treat_path_fast(dir, untracked, cdir, path,
+				       baselen, simplify);
 	if (is_dot_or_dotdot(de->d_name) || !strcmp(de->d_name, ".git"))
 		return path_none;
 	strbuf_setlen(path, baselen);
@@ -1269,7 +1546,157 @@ static enum path_treatment treat_path(struct dir_struct *dir,
 		return path_none;
 
 	dtype = DTYPE(de);
-	return treat_one_path(dir, path, simplify, dtype, de);
+	return treat_one_path(dir, untracked, path, baselen, simplify, dtype, de);
+}
+
+static void add_untracked(struct untracked_cache_dir *dir, const char *name)
+{
+	if (!dir)
+		return;
+	ALLOC_GROW(dir->untracked, dir->untracked_nr + 1,
+		   dir->untracked_alloc);
+	dir->untracked[dir->untracked_nr++] = xstrdup(name);
+}
+
+/*
+ * Is "name" (a directory, with its trailing slash) listed because of
+ * a subdirectory we have just recursed into? Such a directory is
+ * replayed from its own cache node (which may change without the
+ * parent directory changing), so it must not be recorded as a plain
+ * untracked name in the parent.
+ */
+static int untracked_in_subdir(struct untracked_cache_dir *dir,
+			       const char *name, int len)
+{
+	int pos;
+
+	if (!dir || !len || name[len - 1] != '/')
+		return 0;
+	pos = untracked_dir_pos(dir, name, len);
+	return pos >= 0 && dir->dirs[pos]->recurse;
+}
+
+static int valid_cached_dir(struct dir_struct *dir,
+			    struct untracked_cache_dir *untracked,
+			    struct strbuf *path,
+			    int check_only)
+{
+	struct stat st;
+
+	if (!untracked)
+		return 0;
+
+	/*
+	 * With fsmonitor, we can trust the untracked cache's valid field:
+	 * changed paths invalidated their directories already.
+	 */
+	if (dir->untracked->use_fsmonitor && untracked->valid)
+		goto skip_stat;
+
+	if (stat(path->len ? path->buf : ".", &st)) {
+		invalidate_directory(dir->untracked, untracked);
+		memset(&untracked->stat_data, 0, sizeof(untracked->stat_data));
+		return 0;
+	}
+	if (!untracked->valid ||
+	    match_stat_data_racy(&the_index, &untracked->stat_data, &st)) {
+		if (untracked->valid)
+			invalidate_directory(dir->untracked, untracked);
+		fill_stat_data(&untracked->stat_data, &st);
+		return 0;
+	}
+
+skip_stat:
+	if (untracked->check_only != !!check_only) {
+		invalidate_directory(dir->untracked, untracked);
+		return 0;
+	}
+
+	/*
+	 * prep_exclude will be called eventually on this directory,
+	 * but it's called much later in last_exclude_matching(). We
+	 * need it now to determine the validity of the cache for this
+	 * path. The next calls will be nearly no-op, the way
+	 * prep_exclude() is designed.
+	 */
+	if (path->len && path->buf[path->len - 1] != '/') {
+		strbuf_addch(path, '/');
+		prep_exclude(dir, path->buf, path->len);
+		strbuf_setlen(path, path->len - 1);
+	} else
+		prep_exclude(dir, path->buf, path->len);
+
+	/* hopefully prep_exclude() haven't invalidated this entry... */
+	return untracked->valid;
+}
+
+static int open_cached_dir(struct cached_dir *cdir,
+			   struct dir_struct *dir,
+			   struct untracked_cache_dir *untracked,
+			   struct strbuf *path,
+			   int check_only)
+{
+	memset(cdir, 0, sizeof(*cdir));
+	cdir->untracked = untracked;
+	if (valid_cached_dir(dir, untracked, path, check_only))
+		return 0;
+	if (untracked) {
+		int i;
+
+		/*
+		 * The directory is read from scratch: forget what we
+		 * knew about it and only keep the subdirectories that
+		 * are visited again.
+		 */
+		clear_untracked_names(untracked);
+		for (i = 0; i < untracked->dirs_nr; i++)
+			untracked->dirs[i]->recurse = 0;
+	}
+	cdir->fdir = opendir(path->len ? path->buf : ".");
+	if (dir->untracked)
+		dir->untracked->dir_opened++;
+	if (!cdir->fdir)
+		return -1;
+	return 0;
+}
+
+static int read_cached_dir(struct cached_dir *cdir)
+{
+	if (cdir->fdir) {
+		cdir->de = readdir(cdir->fdir);
+		if (!cdir->de)
+			return -1;
+		return 0;
+	}
+	while (cdir->nr_dirs < cdir->untracked->dirs_nr) {
+		struct untracked_cache_dir *d = cdir->untracked->dirs[cdir->nr_dirs];
+		cdir->nr_dirs++;
+		if (!d->recurse)
+			continue;
+		cdir->ucd = d;
+		return 0;
+	}
+	cdir->ucd = NULL;
+	if (cdir->nr_files < cdir->untracked->untracked_nr) {
+		struct untracked_cache_dir *d = cdir->untracked;
+		cdir->file = d->untracked[cdir->nr_files++];
+		return 0;
+	}
+	return -1;
+}
+
+static void close_cached_dir(struct cached_dir *cdir)
+{
+	if (cdir->fdir)
+		closedir(cdir->fdir);
+	/*
+	 * We have gone through this directory and recorded what is
+	 * untracked in it. Mark it valid.
+	 */
+	if (cdir->untracked) {
+		cdir->untracked->valid = 1;
+		cdir->untracked->recurse = 1;
+	}
 }
 
 /*
@@ -1285,38 +1712,49 @@ static enum path_treatment treat_path(struct dir_struct *dir,
  */
 static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 				    const char *base, int baselen,
+				    struct untracked_cache_dir *untracked,
 				    int check_only,
 				    const struct path_simplify *simplify)
 {
-	DIR *fdir;
+	struct cached_dir cdir;
 	enum path_treatment state, subdir_state, dir_state = path_none;
-	struct dirent *de;
 	struct strbuf path = STRBUF_INIT;
 
 	strbuf_add(&path, base, baselen);
 
-	fdir = opendir(path.len ? path.buf : ".");
-	if (!fdir)
+	if (open_cached_dir(&cdir, dir, untracked, &path, check_only))
 		goto out;
 
-	while ((de = readdir(fdir)) != NULL) {
+	if (untracked)
+		untracked->check_only = !!check_only;
+
+	while (!read_cached_dir(&cdir)) {
 		/* check how the file or directory should be treated */
-		state = treat_path(dir, de, &path, baselen, simplify);
+		state = treat_path(dir, untracked, &cdir, &path, baselen, simplify);
 		if (state > dir_state)
 			dir_state = state;
 
 		/* recurse into subdir if instructed by treat_path */
 		if (state == path_recurse) {
+			struct untracked_cache_dir *ud;
+			ud = lookup_untracked(dir->untracked, untracked,
+					      path.buf + baselen,
+					      path.len - baselen);
 			subdir_state = read_directory_recursive(dir, path.buf,
-				path.len, check_only, simplify);
+				path.len, ud, check_only, simplify);
 			if (subdir_state > dir_state)
 				dir_state = subdir_state;
 		}
 
 		if (check_only) {
 			/* abort early if maximum state has been reached */
-			if (dir_state == path_untracked)
+			if (dir_state == path_untracked) {
+				if (cdir.fdir &&
+				    !untracked_in_subdir(untracked, path.buf + baselen,
+							 path.len - baselen))
+					add_untracked(untracked, path.buf + baselen);
 				break;
+			}
 			/* skip the dir_add_* part */
 			continue;
 		}
@@ -1334,15 +1772,20 @@ static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 			break;
 
 		case path_untracked:
-			if (!(dir->flags & DIR_SHOW_IGNORED))
-				dir_add_name(dir, path.buf, path.len);
+			if (dir->flags & DIR_SHOW_IGNORED)
+				break;
+			dir_add_name(dir, path.buf, path.len);
+			if (cdir.fdir &&
+			    !untracked_in_subdir(untracked, path.buf + baselen,
+						 path.len - baselen))
+				add_untracked(untracked, path.buf + baselen);
 			break;
 
 		default:
 			break;
 		}
 	}
-	closedir(fdir);
+	close_cached_dir(&cdir);
  out:
 	strbuf_release(&path);
 
@@ -1412,7 +1855,7 @@ static int treat_leading_path(struct dir_struct *dir,
 			break;
 		if (simplify_away(sb.buf, sb.len, simplify))
 			break;
-		if (treat_one_path(dir, &sb, simplify,
+		if (treat_one_path(dir, NULL, &sb, 0, simplify,
 				   DT_DIR, NULL) == path_none)
 			break; /* do not recurse into it */
 		if (len <= baselen) {
@@ -1425,9 +1868,127 @@ static int treat_leading_path(struct dir_struct *dir,
 	return rc;
 }
 
+static const char *get_ident_string(void)
+{
+	static struct strbuf sb = STRBUF_INIT;
+	struct utsname uts;
+
+	if (sb.len)
+		return sb.buf;
+	if (uname(&uts))
+		die_errno(_("failed to get kernel name and information"));
+	strbuf_addf(&sb, "Location %s, system %s %s", get_git_work_tree(),
+		    uts.sysname, uts.release);
+	return sb.buf;
+}
+
+static int ident_in_untracked(const struct untracked_cache *uc)
+{
+	return !strcmp(uc->ident.buf, get_ident_string());
+}
+
+void add_untracked_cache(struct index_state *istate)
+{
+	struct untracked_cache *uc;
+
+	if (istate->untracked)
+		return;
+	uc = xcalloc(1, sizeof(*uc));
+	strbuf_init(&uc->ident, 100);
+	strbuf_addstr(&uc->ident, get_ident_string());
+	uc->exclude_per_dir = xstrdup(".gitignore");
+	/* should be the same flags used by git-status */
+	uc->dir_flags = DIR_SHOW_OTHER_DIRECTORIES | DIR_HIDE_EMPTY_DIRECTORIES;
+	istate->untracked = uc;
+	istate->cache_changed = 1;
+}
+
+static struct untracked_cache_dir *validate_untracked_cache(struct dir_struct *dir,
+						      int base_len,
+						      const struct pathspec *pathspec)
+{
+	struct untracked_cache_dir *root;
+
+	if (!dir->untracked || getenv("GIT_DISABLE_UNTRACKED_CACHE"))
+		return NULL;
+
+	/*
+	 * We only support $GIT_DIR/info/exclude and core.excludesfile
+	 * as the global ignore rule files. Any other additions
+	 * (e.g. from command line) invalidate the cache. This
+	 * condition also catches running setup_standard_excludes()
+	 * before setting dir->untracked!
+	 */
+	if (dir->unmanaged_exclude_files)
+		return NULL;
+
+	/*
+	 * Optimize for the main use case only: whole-tree git
+	 * status. More work involved in treat_leading_path() if we
+	 * use cache on just a subset of the worktree. pathspec
+	 * support could make the matter even worse.
+	 */
+	if (base_len || (pathspec && pathspec->nr))
+		return NULL;
+
+	/* Different set of flags may produce different results */
+	if (dir->flags != dir->untracked->dir_flags ||
+	    /*
+	     * See treat_directory(), case index_nonexistent. Without
+	     * this flag, we may need to also cache .git file content
+	     * for the resolve_gitlink_ref() call, which we don't.
+	     */
+	    !(dir->flags & DIR_SHOW_OTHER_DIRECTORIES) ||
+	    /* We don't support collecting ignore files */
+	    (dir->flags & (DIR_SHOW_IGNORED | DIR_SHOW_IGNORED_TOO |
+			   DIR_COLLECT_IGNORED)))
+		return NULL;
+
+	/*
+	 * If we use .gitignore in the cache and now you change it to
+	 * .gitexclude, everything will go wrong.
+	 */
+	if (!dir->exclude_per_dir ||
+	    strcmp(dir->exclude_per_dir, dir->untracked->exclude_per_dir))
+		return NULL;
+
+	/*
+	 * EXC_CMDL is not considered in the cache. If people set it,
+	 * skip the cache.
+	 */
+	if (dir->exclude_list_group[EXC_CMDL].nr)
+		return NULL;
+
+	if (!ident_in_untracked(dir->untracked)) {
+		warning(_("Untracked cache is disabled on this system."));
+		return NULL;
+	}
+
+	if (!dir->untracked->root)
+		dir->untracked->root = xcalloc(1, sizeof(*dir->untracked->root));
+
+	/* Validate $GIT_DIR/info/exclude and core.excludesfile */
+	root = dir->untracked->root;
+	if (hashcmp(dir->ss_info_exclude.sha1,
+		    dir->untracked->ss_info_exclude.sha1)) {
+		invalidate_gitignore(dir->untracked, root);
+		dir->untracked->ss_info_exclude = dir->ss_info_exclude;
+	}
+	if (hashcmp(dir->ss_excludes_file.sha1,
+		    dir->untracked->ss_excludes_file.sha1)) {
+		invalidate_gitignore(dir->untracked, root);
+		dir->untracked->ss_excludes_file = dir->ss_excludes_file;
+	}
+
+	/* Make sure this directory is not dropped out at saving phase */
+	root->recurse = 1;
+	return root;
+}
+
 int read_directory(struct dir_struct *dir, const char *path, int len, const struct pathspec *pathspec)
 {
 	struct path_simplify *simplify;
+	struct untracked_cache_dir *untracked;
 
 	/*
 	 * Check out create_simplify()
@@ -1451,11 +2012,34 @@ int read_directory(struct dir_struct *dir, const char *path, int len, const stru
 	 * create_simplify().
 	 */
 	simplify = create_simplify(pathspec ? pathspec->_raw : NULL);
+	untracked = validate_untracked_cache(dir, len, pathspec);
+	if (!untracked)
+		/*
+		 * make sure untracked cache code path is disabled,
+		 * e.g. prep_exclude()
+		 */
+		dir->untracked = NULL;
 	if (!len || treat_leading_path(dir, path, len, simplify))
-		read_directory_recursive(dir, path, len, 0, simplify);
+		read_directory_recursive(dir, path, len, untracked, 0, simplify);
 	free_simplify(simplify);
 	qsort(dir->entries, dir->nr, sizeof(struct dir_entry *), cmp_name);
 	qsort(dir->ignored, dir->ignored_nr, sizeof(struct dir_entry *), cmp_name);
+	if (dir->untracked) {
+		trace_printf_key("GIT_TRACE_UNTRACKED_STATS",
+				 "node creation: %u\n"
+				 "gitignore invalidation: %u\n"
+				 "directory invalidation: %u\n"
+				 "opendir: %u\n",
+				 dir->untracked->dir_created,
+				 dir->untracked->gitignore_invalidated,
+				 dir->untracked->dir_invalidated,
+				 dir->untracked->dir_opened);
+		if (dir->untracked == the_index.untracked &&
+		    (dir->untracked->dir_opened ||
+		     dir->untracked->gitignore_invalidated ||
+		     dir->untracked->dir_invalidated))
+			the_index.cache_changed = 1;
+	}
 	return dir->nr;
 }
 
@@ -1619,9 +2203,11 @@ void setup_standard_excludes(struct dir_struct *dir)
 		excludes_file = xdg_path;
 	}
 	if (!access_or_warn(path, R_OK, 0))
-		add_excludes_from_file(dir, path);
+		add_excludes_from_file_1(dir, path,
+					 dir->untracked ? &dir->ss_info_exclude : NULL);
 	if (excludes_file && !access_or_warn(excludes_file, R_OK, 0))
-		add_excludes_from_file(dir, excludes_file);
+		add_excludes_from_file_1(dir, excludes_file,
+					 dir->untracked ? &dir->ss_excludes_file : NULL);
 }
 
 int remove_path(const char *name)
@@ -1672,3 +2258,293 @@ void clear_directory(struct dir_struct *dir)
 		stk = prev;
 	}
 }
+
+/* Untracked cache ("UNTR" index extension) */
+
+#define UNTRACKED_DIR_VALID 01
+#define UNTRACKED_DIR_CHECK_ONLY 02
+
+static void free_untracked(struct untracked_cache_dir *ucd)
+{
+	int i;
+	if (!ucd)
+		return;
+	for (i = 0; i < ucd->dirs_nr; i++)
+		free_untracked(ucd->dirs[i]);
+	clear_untracked_names(ucd);
+	free(ucd->untracked);
+	free(ucd->dirs);
+	free(ucd);
+}
+
+void free_untracked_cache(struct untracked_cache *uc)
+{
+	if (!uc)
+		return;
+	free_untracked(uc->root);
+	free((char *)uc->exclude_per_dir);
+	strbuf_release(&uc->ident);
+	free(uc);
+}
+
+static void stat_data_to_disk(struct strbuf *out, const struct stat_data *sd)
+{
+	unsigned char buf[36];
+
+	put_be32(buf +  0, sd->sd_ctime.sec);
+	put_be32(buf +  4, sd->sd_ctime.nsec);
+	put_be32(buf +  8, sd->sd_mtime.sec);
+	put_be32(buf + 12, sd->sd_mtime.nsec);
+	put_be32(buf + 16, sd->sd_dev);
+	put_be32(buf + 20, sd->sd_ino);
+	put_be32(buf + 24, sd->sd_uid);
+	put_be32(buf + 28, sd->sd_gid);
+	put_be32(buf + 32, sd->sd_size);
+	strbuf_add(out, buf, sizeof(buf));
+}
+
+static void stat_data_from_disk(struct stat_data *sd, const unsigned char *data)
+{
+	sd->sd_ctime.sec  = get_be32(data +  0);
+	sd->sd_ctime.nsec = get_be32(data +  4);
+	sd->sd_mtime.sec  = get_be32(data +  8);
+	sd->sd_mtime.nsec = get_be32(data + 12);
+	sd->sd_dev        = get_be32(data + 16);
+	sd->sd_ino        = get_be32(data + 20);
+	sd->sd_uid        = get_be32(data + 24);
+	sd->sd_gid        = get_be32(data + 28);
+	sd->sd_size       = get_be32(data + 32);
+}
+
+static void add_varint(struct strbuf *out, uintmax_t value)
+{
+	unsigned char buf[16];
+	int len = encode_varint(value, buf);
+	strbuf_add(out, buf, len);
+}
+
+static int count_recursed_dirs(const struct untracked_cache_dir *ucd)
+{
+	int i, nr = 0;
+	for (i = 0; i < ucd->dirs_nr; i++)
+		if (ucd->dirs[i]->recurse)
+			nr++;
+	return nr;
+}
+
+static void write_one_dir(struct strbuf *out,
+			  const struct untracked_cache_dir *ucd)
+{
+	int i;
+	unsigned flags = 0;
+
+	if (ucd->valid)
+		flags |= UNTRACKED_DIR_VALID;
+	if (ucd->check_only)
+		flags |= UNTRACKED_DIR_CHECK_ONLY;
+	add_varint(out, ucd->untracked_nr);
+	add_varint(out, count_recursed_dirs(ucd));
+	add_varint(out, flags);
+	strbuf_add(out, ucd->name, strlen(ucd->name) + 1);
+	for (i = 0; i < ucd->untracked_nr; i++)
+		strbuf_add(out, ucd->untracked[i],
+			   strlen(ucd->untracked[i]) + 1);
+	if (ucd->valid)
+		stat_data_to_disk(out, &ucd->stat_data);
+	strbuf_add(out, ucd->exclude_sha1, 20);
+
+	/* only directories visited by the last traversal are kept */
+	for (i = 0; i < ucd->dirs_nr; i++)
+		if (ucd->dirs[i]->recurse)
+			write_one_dir(out, ucd->dirs[i]);
+}
+
+void write_untracked_extension(struct strbuf *out, struct untracked_cache *untracked)
+{
+	unsigned char buf[4];
+
+	add_varint(out, untracked->ident.len);
+	strbuf_addbuf(out, &untracked->ident);
+
+	stat_data_to_disk(out, &untracked->ss_info_exclude.stat);
+	stat_data_to_disk(out, &untracked->ss_excludes_file.stat);
+	put_be32(buf, untracked->dir_flags);
+	strbuf_add(out, buf, 4);
+	strbuf_add(out, untracked->ss_info_exclude.sha1, 20);
+	strbuf_add(out, untracked->ss_excludes_file.sha1, 20);
+	strbuf_add(out, untracked->exclude_per_dir,
+		   strlen(untracked->exclude_per_dir) + 1);
+
+	if (untracked->root)
+		write_one_dir(out, untracked->root);
+}
+
+struct read_data {
+	const unsigned char *data;
+	const unsigned char *end;
+};
+
+static int read_varint(struct read_data *rd, uintmax_t *value)
+{
+	const unsigned char *p = rd->data;
+
+	/* a varint never needs more than 10 bytes for a uintmax_t */
+	while (p < rd->end && (*p & 0x80) && p - rd->data < 10)
+		p++;
+	if (p >= rd->end || (*p & 0x80))
+		return -1;
+	*value = decode_varint(&rd->data);
+	return 0;
+}
+
+static const char *read_string(struct read_data *rd)
+{
+	const unsigned char *eos = memchr(rd->data, '\0', rd->end - rd->data);
+	const char *s = (const char *)rd->data;
+
+	if (!eos)
+		return NULL;
+	rd->data = eos + 1;
+	return s;
+}
+
+static struct untracked_cache_dir *read_one_dir(struct read_data *rd)
+{
+	struct untracked_cache_dir *ucd;
+	uintmax_t untracked_nr, dirs_nr, flags;
+	const char *name;
+	int i;
+
+	if (read_varint(rd, &untracked_nr) ||
+	    read_varint(rd, &dirs_nr) ||
+	    read_varint(rd, &flags) ||
+	    !(name = read_string(rd)) ||
+	    untracked_nr > rd->end - rd->data ||
+	    dirs_nr > rd->end - rd->data)
+		return NULL;
+
+	ucd = xcalloc(1, sizeof(*ucd) + strlen(name) + 1);
+	strcpy(ucd->name, name);
+	ucd->valid = !!(flags & UNTRACKED_DIR_VALID);
+	ucd->check_only = !!(flags & UNTRACKED_DIR_CHECK_ONLY);
+	ucd->recurse = 1;
+
+	ALLOC_GROW(ucd->untracked, untracked_nr, ucd->untracked_alloc);
+	for (i = 0; i < untracked_nr; i++) {
+		const char *s = read_string(rd);
+		if (!s)
+			goto fail;
+		ucd->untracked[ucd->untracked_nr++] = xstrdup(s);
+	}
+	if (ucd->valid) {
+		if (rd->end - rd->data < 36)
+			goto fail;
+		stat_data_from_disk(&ucd->stat_data, rd->data);
+		rd->data += 36;
+	}
+	if (rd->end - rd->data < 20)
+		goto fail;
+	hashcpy(ucd->exclude_sha1, rd->data);
+	rd->data += 20;
+
+	ALLOC_GROW(ucd->dirs, dirs_nr, ucd->dirs_alloc);
+	for (i = 0; i < dirs_nr; i++) {
+		struct untracked_cache_dir *d = read_one_dir(rd);
+		if (!d)
+			goto fail;
+		ucd->dirs[ucd->dirs_nr++] = d;
+	}
+	return ucd;
+
+fail:
+	free_untracked(ucd);
+	return NULL;
+}
+
+struct untracked_cache *read_untracked_extension(const void *data, unsigned long sz)
+{
+	struct untracked_cache *uc;
+	struct read_data rd;
+	uintmax_t ident_len;
+	const char *exclude_per_dir;
+
+	rd.data = data;
+	rd.end = rd.data + sz;
+	if (read_varint(&rd, &ident_len) ||
+	    ident_len > rd.end - rd.data)
+		return NULL;
+
+	uc = xcalloc(1, sizeof(*uc));
+	strbuf_init(&uc->ident, ident_len);
+	strbuf_add(&uc->ident, rd.data, ident_len);
+	rd.data += ident_len;
+
+	if (rd.end - rd.data < 2 * 36 + 4 + 2 * 20)
+		goto fail;
+	stat_data_from_disk(&uc->ss_info_exclude.stat, rd.data);
+	rd.data += 36;
+	stat_data_from_disk(&uc->ss_excludes_file.stat, rd.data);
+	rd.data += 36;
+	uc->dir_flags = get_be32(rd.data);
+	rd.data += 4;
+	hashcpy(uc->ss_info_exclude.sha1, rd.data);
+	rd.data += 20;
+	hashcpy(uc->ss_excludes_file.sha1, rd.data);
+	rd.data += 20;
+	exclude_per_dir = read_string(&rd);
+	if (!exclude_per_dir)
+		goto fail;
+	uc->exclude_per_dir = xstrdup(exclude_per_dir);
+
+	if (rd.data < rd.end) {
+		uc->root = read_one_dir(&rd);
+		if (!uc->root || rd.data != rd.end)
+			goto fail;
+	}
+	return uc;
+
+fail:
+	free_untracked_cache(uc);
+	return NULL;
+}
+
+static int invalidate_one_component(struct untracked_cache *uc,
+				    struct untracked_cache_dir *dir,
+				    const char *path)
+{
+	const char *rest = strchr(path, '/');
+
+	if (rest) {
+		int pos = untracked_dir_pos(dir, path, rest - path);
+		/*
+		 * A directory we know nothing about may still be
+		 * listed as untracked in its parent, so treat it as
+		 * a change of the parent.
+		 */
+		int ret = pos < 0 ||
+			invalidate_one_component(uc, dir->dirs[pos], rest + 1);
+		if (ret)
+			invalidate_directory(uc, dir);
+		return ret;
+	}
+
+	invalidate_directory(uc, dir);
+	return uc->dir_flags & DIR_SHOW_OTHER_DIRECTORIES;
+}
+
+void untracked_cache_invalidate_path(struct index_state *istate,
+				     const char *path)
+{
+	if (!istate->untracked || !istate->untracked->root)
+		return;
+	invalidate_one_component(istate->untracked, istate->untracked->root,
+				 path);
+}
+
+void untracked_cache_invalidate_all(struct index_state *istate)
+{
+	if (!istate->untracked)
+		return;
+	free_untracked(istate->untracked->root);
+	istate->untracked->root = NULL;
+}
@@ -25,6 +25,8 @@ int log_all_ref_updates = -1; /* unspecified */
 int warn_ambiguous_refs = 1;
 int warn_on_object_refname_ambiguity = 1;
 int repository_format_version;
+char *repository_format_partial_clone;
+int fetch_if_missing = 1;
 const char *git_commit_encoding;
 const char *git_log_output_encoding;
 int shared_repository = PERM_UMASK;
@@ -56,6 +58,7 @@ enum push_default_type push_default = PUSH_DEFAULT_UNSPECIFIED;
 #define OBJECT_CREATION_MODE OBJECT_CREATION_USES_HARDLINKS
 #endif
 enum object_creation_mode object_creation_mode = OBJECT_CREATION_MODE;
+enum ref_storage_format ref_storage_format = REF_STORAGE_FILES;
 char *notes_ref_name;
 int grafts_replace_parents = 1;
 int core_apply_sparse_checkout;
@@ -74,6 +77,25 @@ int auto_comment_line_char;
 /* Parallel index stat data preload? */
 int core_preload_index = 1;
 
+/* Consult objects/info/commit-graph when parsing commits? */
+int core_commit_graph;
+
+/* Look objects up through objects/pack/multi-pack-index? */
+int core_multi_pack_index;
+
+/* Hook listing the paths changed since a given time */
+const char *core_fsmonitor;
+
+/* Percent of the shared index that may change before it is rewritten */
+int split_index_max_percent_change = 20;
+/* Shared index files unused since this date are removed */
+const char *split_index_shared_expire = "2.weeks.ago";
+
+/* Collapse directories outside the sparse checkout in the index? */
+int use_sparse_index;
+/* Cleared by commands that can work on a sparse index as it is */
+int command_requires_full_index = 1;
+
 /* This is set by setup_git_dir_gently() and/or git_default_config() */
 char *git_work_tree_cfg;
 static char *work_tree;
@@ -101,6 +123,7 @@ const char * const local_repo_env[] = {
 	NO_REPLACE_OBJECTS_ENVIRONMENT,
 	GIT_PREFIX_ENVIRONMENT,
 	GIT_SHALLOW_FILE_ENVIRONMENT,
+	GIT_PROTOCOL_ENVIRONMENT,
 	NULL
 };
 
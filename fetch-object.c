@@ -0,0 +1,56 @@
+#include "cache.h"
+#include "remote.h"
+#include "transport.h"
+#include "sha1-array.h"
+#include "fetch-object.h"
+
+static void fetch_refs(const char *remote_name, struct ref *ref)
+{
+	struct remote *remote;
+	struct transport *transport;
+	int original_fetch_if_missing = fetch_if_missing;
+
+	/* whatever the fetch finds missing is not to be fetched again */
+	fetch_if_missing = 0;
+	remote = remote_get(remote_name);
+	if (!remote || !remote->url_nr)
+		die(_("promisor remote '%s' has no URL"), remote_name);
+	transport = transport_get(remote, remote->url[0]);
+	transport_set_option(transport, TRANS_OPT_FROM_PROMISOR, "1");
+	transport_set_option(transport, TRANS_OPT_NO_DEPENDENTS, "1");
+	transport_fetch_refs(transport, ref);
+	transport_unlock_pack(transport);
+	transport_disconnect(transport);
+	reprepare_packed_git();
+	fetch_if_missing = original_fetch_if_missing;
+}
+
+static void add_ref(const unsigned char sha1[20], void *data)
+{
+	struct ref ***tail = data;
+	struct ref *ref = alloc_ref(sha1_to_hex(sha1));
+
+	hashcpy(ref->old_sha1, sha1);
+	**tail = ref;
+	*tail = &ref->next;
+}
+
+void fetch_object(const char *remote_name, const unsigned char *sha1)
+{
+	struct ref *ref = NULL, **tail = &ref;
+
+	add_ref(sha1, &tail);
+	fetch_refs(remote_name, ref);
+	free_refs(ref);
+}
+
+void fetch_objects(const char *remote_name, const struct sha1_array *to_fetch)
+{
+	struct ref *ref = NULL, **tail = &ref;
+	int i;
+
+	for (i = 0; i < to_fetch->nr; i++)
+		add_ref(to_fetch->sha1[i], &tail);
+	fetch_refs(remote_name, ref);
+	free_refs(ref);
+}
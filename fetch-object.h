@@ -0,0 +1,14 @@
+#ifndef FETCH_OBJECT_H
+#define FETCH_OBJECT_H
+
+/*
+ * Fetch missing objects from "remote_name", the promisor remote of a
+ * partial clone, without the objects they refer to.
+ */
+extern void fetch_object(const char *remote_name, const unsigned char *sha1);
+
+struct sha1_array;
+extern void fetch_objects(const char *remote_name,
+			  const struct sha1_array *to_fetch);
+
+#endif
@@ -228,6 +228,42 @@ static void insert_one_alternate_ref(const struct ref *ref, void *unused)
 	rev_list_insert_ref(NULL, ref->old_sha1, 0, NULL);
 }
 
+static void receive_shallow_line(const char *line)
+{
+	const char *arg;
+	unsigned char sha1[20];
+
+	if (skip_prefix(line, "shallow ", &arg)) {
+		if (get_sha1_hex(arg, sha1))
+			die("invalid shallow line: %s", line);
+		register_shallow(sha1);
+		return;
+	}
+	if (skip_prefix(line, "unshallow ", &arg)) {
+		if (get_sha1_hex(arg, sha1))
+			die("invalid unshallow line: %s", line);
+		if (!lookup_object(sha1))
+			die("object not found: %s", line);
+		/* make sure that it is parsed as shallow */
+		if (!parse_object(sha1))
+			die("error in object: %s", line);
+		if (unregister_shallow(sha1))
+			die("no shallow found: %s", line);
+		return;
+	}
+	die("expected shallow/unshallow, got %s", line);
+}
+
+static void mark_tips(void)
+{
+	if (marked)
+		for_each_ref(clear_marks, NULL);
+	marked = 1;
+
+	for_each_ref(rev_list_insert_ref, NULL);
+	for_each_alternate_ref(insert_one_alternate_ref, NULL);
+}
+
 #define INITIAL_FLUSH 16
 #define PIPESAFE_FLUSH 32
 #define LARGE_FLUSH 1024
@@ -258,12 +294,11 @@ static int find_common(struct fetch_pack_args *args,
 
 	if (args->stateless_rpc && multi_ack == 1)
 		die("--stateless-rpc requires multi_ack_detailed");
-	if (marked)
-		for_each_ref(clear_marks, NULL);
-	marked = 1;
-
-	for_each_ref(rev_list_insert_ref, NULL);
-	for_each_alternate_ref(insert_one_alternate_ref, NULL);
+	if (args->no_dependents)
+		/* no haves; the server only sends what we asked for */
+		clear_prio_queue(&rev_list);
+	else
+		mark_tips();
 
 	fetching = 0;
 	for ( ; refs ; refs = refs->next) {
@@ -317,36 +352,18 @@ static int find_common(struct fetch_pack_args *args,
 		write_shallow_commits(&req_buf, 1, NULL);
 	if (args->depth > 0)
 		packet_buf_write(&req_buf, "deepen %d", args->depth);
+	if (args->filter_options.choice)
+		packet_buf_write(&req_buf, "filter %s",
+				 args->filter_options.filter_spec);
 	packet_buf_flush(&req_buf);
 	state_len = req_buf.len;
 
 	if (args->depth > 0) {
 		char *line;
-		const char *arg;
-		unsigned char sha1[20];
 
 		send_request(args, fd[1], &req_buf);
-		while ((line = packet_read_line(fd[0], NULL))) {
-			if (skip_prefix(line, "shallow ", &arg)) {
-				if (get_sha1_hex(arg, sha1))
-					die("invalid shallow line: %s", line);
-				register_shallow(sha1);
-				continue;
-			}
-			if (skip_prefix(line, "unshallow ", &arg)) {
-				if (get_sha1_hex(arg, sha1))
-					die("invalid unshallow line: %s", line);
-				if (!lookup_object(sha1))
-					die("object not found: %s", line);
-				/* make sure that it is parsed as shallow */
-				if (!parse_object(sha1))
-					die("error in object: %s", line);
-				if (unregister_shallow(sha1))
-					die("no shallow found: %s", line);
-				continue;
-			}
-			die("expected shallow/unshallow, got %s", line);
-		}
+		while ((line = packet_read_line(fd[0], NULL)))
+			receive_shallow_line(line);
 	} else if (!args->stateless_rpc)
 		send_request(args, fd[1], &req_buf);
 
@@ -702,6 +719,9 @@ static int get_pack(struct fetch_pack_args *args,
 		else
 			do_keep = 1;
 	}
+	/* the pack must stay to be recognized as a promisor pack */
+	if (args->from_promisor)
+		do_keep = 1;
 
 	if (alternate_shallow_file) {
 		*av++ = "--shallow-file";
@@ -717,6 +737,8 @@ static int get_pack(struct fetch_pack_args *args,
 			*av++ = "-v";
 		if (args->use_thin_pack)
 			*av++ = "--fix-thin";
+		if (args->from_promisor)
+			*av++ = "--promisor";
 		if (args->lock_pack || unpack_limit) {
 			int s = sprintf(keep_arg,
 					"--keep=fetch-pack %"PRIuMAX " on ", (uintmax_t) getpid());
@@ -829,6 +851,10 @@ static struct ref *do_fetch_pack(struct fetch_pack_args *args,
 		args->no_progress = 0;
 	if (!server_supports("include-tag"))
 		args->include_tag = 0;
+	if (args->filter_options.choice && !server_supports("filter")) {
+		warning("filtering not recognized by server, ignoring");
+		args->filter_options.choice = LOFC_DISABLED;
+	}
 	if (server_supports("ofs-delta")) {
 		if (args->verbose)
 			fprintf(stderr, "Server supports ofs-delta\n");
@@ -869,6 +895,217 @@ static struct ref *do_fetch_pack(struct fetch_pack_args *args,
 	return ref;
 }
 
+/*
+ * Protocol v2 fetch: each request is a complete "fetch" command; see
+ * Documentation/technical/protocol-v2.txt.  Returns 1 if the request
+ * said "done".
+ */
+static int send_fetch_request(struct fetch_pack_args *args, int fd_out,
+			      const struct ref *wants,
+			      const struct sha1_array *common,
+			      int haves_to_send, unsigned *in_vain)
+{
+	struct strbuf req = STRBUF_INIT;
+	int i, done = 0;
+
+	packet_buf_write(&req, "command=fetch\n");
+	if (server_supports_v2("agent", NULL))
+		packet_buf_write(&req, "agent=%s\n", git_user_agent_sanitized());
+	packet_buf_delim(&req);
+	if (args->use_thin_pack)
+		packet_buf_write(&req, "thin-pack\n");
+	if (args->no_progress)
+		packet_buf_write(&req, "no-progress\n");
+	if (args->include_tag)
+		packet_buf_write(&req, "include-tag\n");
+	if (prefer_ofs_delta)
+		packet_buf_write(&req, "ofs-delta\n");
+	if (is_repository_shallow())
+		write_shallow_commits(&req, 1, NULL);
+	if (args->depth > 0)
+		packet_buf_write(&req, "deepen %d\n", args->depth);
+	if (args->filter_options.choice)
+		packet_buf_write(&req, "filter %s\n",
+				 args->filter_options.filter_spec);
+
+	for (; wants; wants = wants->next) {
+		struct object *o = lookup_object(wants->old_sha1);
+		if (o && (o->flags & COMPLETE))
+			continue;
+		packet_buf_write(&req, "want %s\n", sha1_to_hex(wants->old_sha1));
+	}
+
+	/* a stateless server has forgotten what we have in common */
+	if (args->stateless_rpc)
+		for (i = 0; i < common->nr; i++)
+			packet_buf_write(&req, "have %s\n",
+					 sha1_to_hex(common->sha1[i]));
+	for (i = 0; i < haves_to_send; i++) {
+		const unsigned char *sha1 = get_rev();
+		if (!sha1) {
+			done = 1;
+			break;
+		}
+		packet_buf_write(&req, "have %s\n", sha1_to_hex(sha1));
+		if (args->verbose)
+			fprintf(stderr, "have %s\n", sha1_to_hex(sha1));
+	}
+	*in_vain += i;
+	if (common->nr && MAX_IN_VAIN < *in_vain) {
+		if (args->verbose)
+			fprintf(stderr, "giving up\n");
+		done = 1;
+	}
+	if (done)
+		packet_buf_write(&req, "done\n");
+	packet_buf_flush(&req);
+
+	send_request(args, fd_out, &req);
+	strbuf_release(&req);
+	return done;
+}
+
+static char *read_section_line(int fd, enum packet_read_status *status)
+{
+	char *line = packet_read_line_status(fd, NULL, NULL, status);
+	if (*status == PACKET_READ_EOF)
+		die("git fetch-pack: unexpected end of the response");
+	return line;
+}
+
+static void expect_section(int fd, const char *name)
+{
+	enum packet_read_status status;
+	char *line = read_section_line(fd, &status);
+
+	if (!line || strcmp(line, name))
+		die("git fetch-pack: expected '%s', got '%s'", name,
+		    line ? line : "a flush or delimiter");
+}
+
+/*
+ * Read the acknowledgments section, remembering the common commits.
+ * Returns 1 if the server is ready to send the pack.
+ */
+static int process_acks(struct fetch_pack_args *args, int fd,
+			struct sha1_array *common, unsigned *in_vain)
+{
+	enum packet_read_status status;
+	int ready = 0;
+	char *line;
+
+	expect_section(fd, "acknowledgments");
+	while ((line = read_section_line(fd, &status))) {
+		unsigned char sha1[20];
+		const char *arg;
+
+		if (!strcmp(line, "NAK"))
+			continue;
+		if (!strcmp(line, "ready")) {
+			ready = 1;
+			continue;
+		}
+		if (skip_prefix(line, "ACK ", &arg) && !get_sha1_hex(arg, sha1)) {
+			struct commit *commit = lookup_commit(sha1);
+			if (!commit)
+				die("invalid commit %s", sha1_to_hex(sha1));
+			if (args->verbose)
+				fprintf(stderr, "got ack %s\n", sha1_to_hex(sha1));
+			if (!(commit->object.flags & COMMON))
+				sha1_array_append(common, sha1);
+			mark_common(commit, 0, 1);
+			*in_vain = 0;
+			continue;
+		}
+		die("git fetch-pack: expected ACK/NAK, got '%s'", line);
+	}
+
+	/* a delimiter means that more sections follow */
+	if (ready != (status == PACKET_READ_DELIM))
+		die("git fetch-pack: unexpected end of acknowledgments");
+	return ready;
+}
+
+static struct ref *do_fetch_pack_v2(struct fetch_pack_args *args,
+				    int fd[2],
+				    const struct ref *orig_ref,
+				    struct ref **sought, int nr_sought,
+				    struct shallow_info *si,
+				    char **pack_lockfile)
+{
+	struct ref *ref = copy_ref_list(orig_ref);
+	struct sha1_array common = SHA1_ARRAY_INIT;
+	int haves_to_send = INITIAL_FLUSH;
+	unsigned in_vain = 0;
+	enum packet_read_status status;
+	char *line;
+
+	sort_ref_list(&ref, ref_compare_name);
+	qsort(sought, nr_sought, sizeof(*sought), cmp_ref_by_name);
+
+	if (!server_supports_v2("fetch", NULL))
+		die("Server does not support the fetch command");
+	if ((is_repository_shallow() || args->depth > 0) &&
+	    !server_supports_feature("fetch", "shallow"))
+		die("Server does not support shallow clients");
+	if (args->filter_options.choice &&
+	    !server_supports_feature("fetch", "filter")) {
+		warning("filtering not recognized by server, ignoring");
+		args->filter_options.choice = LOFC_DISABLED;
+	}
+	/* the server checks wants that are not tips itself */
+	allow_tip_sha1_in_want = 1;
+	use_sideband = 2;
+
+	if (everything_local(args, &ref, sought, nr_sought)) {
+		packet_flush(fd[1]);
+		goto all_done;
+	}
+
+	if (args->no_dependents)
+		clear_prio_queue(&rev_list);
+	else
+		mark_tips();
+	for (;;) {
+		if (send_fetch_request(args, fd[1], ref, &common,
+				       haves_to_send, &in_vain))
+			break;
+		if (process_acks(args, fd[0], &common, &in_vain)) {
+			clear_prio_queue(&rev_list);
+			break;
+		}
+		haves_to_send = next_flush(args, haves_to_send);
+	}
+	/* no more requests */
+	packet_flush(fd[1]);
+
+	line = read_section_line(fd[0], &status);
+	if (line && !strcmp(line, "shallow-info")) {
+		while ((line = read_section_line(fd[0], &status)))
+			receive_shallow_line(line);
+		if (status != PACKET_READ_DELIM)
+			die("git fetch-pack: expected packfile after shallow-info");
+		line = read_section_line(fd[0], &status);
+	}
+	if (!line || strcmp(line, "packfile"))
+		die("git fetch-pack: expected 'packfile', got '%s'",
+		    line ? line : "a flush or delimiter");
+
+	if (args->depth > 0)
+		setup_alternate_shallow(&shallow_lock, &alternate_shallow_file,
+					NULL);
+	else if (si->nr_ours || si->nr_theirs)
+		alternate_shallow_file = setup_temporary_shallow(si->shallow);
+	else
+		alternate_shallow_file = NULL;
+	if (get_pack(args, fd, pack_lockfile))
+		die("git fetch-pack: fetch failed.");
+
+ all_done:
+	sha1_array_clear(&common);
+	return ref;
+}
+
 static int fetch_pack_config(const char *var, const char *value, void *cb)
 {
 	if (strcmp(var, "fetch.unpacklimit") == 0) {
@@ -1033,7 +1270,8 @@ struct ref *fetch_pack(struct fetch_pack_args *args,
 		       const char *dest,
 		       struct ref **sought, int nr_sought,
 		       struct sha1_array *shallow,
-		       char **pack_lockfile)
+		       char **pack_lockfile,
+		       enum protocol_version version)
 {
 	struct ref *ref_cpy;
 	struct shallow_info si;
@@ -1046,9 +1284,19 @@ struct ref *fetch_pack(struct fetch_pack_args *args,
 		packet_flush(fd[1]);
 		die("no matching remote head");
 	}
+	/*
+	 * The bases of a thin pack may be objects a partial clone
+	 * left out.
+	 */
+	if (args->filter_options.choice || args->from_promisor)
+		args->use_thin_pack = 0;
 	prepare_shallow_info(&si, shallow);
-	ref_cpy = do_fetch_pack(args, fd, ref, sought, nr_sought,
-				&si, pack_lockfile);
+	if (version == protocol_v2)
+		ref_cpy = do_fetch_pack_v2(args, fd, ref, sought, nr_sought,
+					   &si, pack_lockfile);
+	else
+		ref_cpy = do_fetch_pack(args, fd, ref, sought, nr_sought,
+					&si, pack_lockfile);
 	reprepare_packed_git();
 	update_shallow(args, sought, nr_sought, &si);
 	clear_shallow_info(&si);
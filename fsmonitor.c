@@ -0,0 +1,300 @@
+#include "cache.h"
+#include "dir.h"
+#include "ewah/ewok.h"
+#include "fsmonitor.h"
+#include "run-command.h"
+#include "strbuf.h"
+
+#define INDEX_EXTENSION_VERSION	(1)
+#define HOOK_INTERFACE_VERSION	(1)
+
+static void put_be64(unsigned char *buf, uint64_t value)
+{
+	put_be32(buf, (uint32_t)(value >> 32));
+	put_be32(buf + 4, (uint32_t)value);
+}
+
+static uint64_t get_be64(const unsigned char *buf)
+{
+	return ((uint64_t)get_be32(buf) << 32) | get_be32(buf + 4);
+}
+
+int read_fsmonitor_extension(struct index_state *istate, const void *data,
+			     unsigned long sz)
+{
+	const unsigned char *index = data;
+	uint32_t hdr_version;
+	uint32_t ewah_size;
+	struct ewah_bitmap *fsmonitor_dirty;
+	int ret;
+
+	if (sz < sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t))
+		return error("corrupt fsmonitor extension (too short)");
+
+	hdr_version = get_be32(index);
+	index += sizeof(uint32_t);
+	if (hdr_version != INDEX_EXTENSION_VERSION)
+		return error("bad fsmonitor version %d", hdr_version);
+
+	istate->fsmonitor_last_update = get_be64(index);
+	index += sizeof(uint64_t);
+
+	ewah_size = get_be32(index);
+	index += sizeof(uint32_t);
+	if (ewah_size > sz - (index - (const unsigned char *)data))
+		return error("corrupt fsmonitor extension (ewah too long)");
+
+	fsmonitor_dirty = ewah_new();
+	ret = ewah_read_mmap(fsmonitor_dirty, (void *)index, ewah_size);
+	if (ret != ewah_size) {
+		ewah_free(fsmonitor_dirty);
+		return error("failed to parse ewah bitmap reading fsmonitor index extension");
+	}
+	ewah_free(istate->fsmonitor_dirty);
+	istate->fsmonitor_dirty = fsmonitor_dirty;
+	return 0;
+}
+
+void fill_fsmonitor_bitmap(struct index_state *istate)
+{
+	int i;
+
+	ewah_free(istate->fsmonitor_dirty);
+	istate->fsmonitor_dirty = ewah_new();
+	for (i = 0; i < istate->cache_nr; i++)
+		if (!(istate->cache[i]->ce_flags & CE_FSMONITOR_VALID))
+			ewah_set(istate->fsmonitor_dirty, i);
+}
+
+static int write_to_strbuf(void *data, const void *buf, size_t len)
+{
+	strbuf_add(data, buf, len);
+	return len;
+}
+
+void write_fsmonitor_extension(struct strbuf *sb, struct index_state *istate)
+{
+	unsigned char buf[8];
+	size_t fixup;
+	int ewah_size;
+
+	put_be32(buf, INDEX_EXTENSION_VERSION);
+	strbuf_add(sb, buf, 4);
+
+	put_be64(buf, istate->fsmonitor_last_update);
+	strbuf_add(sb, buf, 8);
+
+	/* the size of the bitmap is filled in below */
+	fixup = sb->len;
+	strbuf_add(sb, buf, 4);
+
+	ewah_size = ewah_serialize_to(istate->fsmonitor_dirty,
+				      write_to_strbuf, sb);
+	put_be32((unsigned char *)sb->buf + fixup, ewah_size);
+}
+
+/*
+ * Call the query-fsmonitor hook passing the time of the last saved
+ * results.  The hook prints the NUL separated paths that changed
+ * since then, relative to the top of the work tree.
+ */
+static int query_fsmonitor(int version, uint64_t last_update,
+			   struct strbuf *query_result)
+{
+	struct child_process cp;
+	int ret;
+
+	memset(&cp, 0, sizeof(cp));
+	argv_array_push(&cp.args, core_fsmonitor);
+	argv_array_pushf(&cp.args, "%d", version);
+	argv_array_pushf(&cp.args, "%"PRIuMAX, (uintmax_t)last_update);
+	cp.use_shell = 1;
+	cp.dir = get_git_work_tree();
+	cp.no_stdin = 1;
+	cp.out = -1;
+
+	if (start_command(&cp)) {
+		argv_array_clear(&cp.args);
+		return -1;
+	}
+	ret = strbuf_read(query_result, cp.out, 1024) < 0;
+	close(cp.out);
+	ret |= finish_command(&cp) != 0;
+	argv_array_clear(&cp.args);
+	return ret ? -1 : 0;
+}
+
+static void fsmonitor_refresh_callback(struct index_state *istate,
+				       const char *name, int len)
+{
+	int pos;
+
+	/* a trailing slash names a directory */
+	if (len && name[len - 1] == '/')
+		len--;
+	pos = index_name_pos(istate, name, len);
+	if (pos >= 0) {
+		mark_fsmonitor_invalid(istate, istate->cache[pos]);
+	} else {
+		/* anything below "name/" may have changed, too */
+		for (pos = -pos - 1; pos < istate->cache_nr; pos++) {
+			struct cache_entry *ce = istate->cache[pos];
+			if (ce_namelen(ce) <= len ||
+			    strncmp(ce->name, name, len))
+				break;
+			if (ce->name[len] < '/')
+				continue;
+			if (ce->name[len] > '/')
+				break;
+			mark_fsmonitor_invalid(istate, ce);
+		}
+	}
+
+	/*
+	 * The untracked cache takes a NUL terminated path; the
+	 * directory containing it is examined again.
+	 */
+	if (istate->untracked) {
+		char *path = xmemdupz(name, len);
+		untracked_cache_invalidate_path(istate, path);
+		free(path);
+	}
+}
+
+static void invalidate_all(struct index_state *istate)
+{
+	int i;
+
+	for (i = 0; i < istate->cache_nr; i++)
+		mark_fsmonitor_invalid(istate, istate->cache[i]);
+	if (istate->untracked)
+		istate->untracked->use_fsmonitor = 0;
+}
+
+static void refresh_fsmonitor(struct index_state *istate)
+{
+	struct strbuf query_result = STRBUF_INIT;
+	int query_success;
+	uint64_t last_update = getnanotime();
+	const char *buf, *end;
+
+	/*
+	 * Take the time before running the hook so that changes made
+	 * while it runs are reported again by the next query.
+	 */
+	query_success = !query_fsmonitor(HOOK_INTERFACE_VERSION,
+					 istate->fsmonitor_last_update,
+					 &query_result);
+	trace_printf_key("GIT_TRACE_FSMONITOR",
+			 "fsmonitor: query %s, %d bytes\n",
+			 query_success ? "succeeded" : "failed",
+			 (int)query_result.len);
+
+	/* a path of "/" tells us that everything may have changed */
+	if (query_success &&
+	    (query_result.len < 2 || query_result.buf[0] != '/' ||
+	     query_result.buf[1] != '\0')) {
+		buf = query_result.buf;
+		end = buf + query_result.len;
+		while (buf < end) {
+			const char *eos = memchr(buf, '\0', end - buf);
+			int len = eos ? eos - buf : end - buf;
+			if (len)
+				fsmonitor_refresh_callback(istate, buf, len);
+			buf += len + 1;
+		}
+		if (istate->untracked)
+			istate->untracked->use_fsmonitor = 1;
+	} else {
+		invalidate_all(istate);
+	}
+	/*
+	 * Only bother rewriting the index when there is something new
+	 * to remember; an older timestamp merely makes the next query
+	 * report a few more paths.
+	 */
+	if (!query_success || query_result.len)
+		istate->cache_changed = 1;
+	strbuf_release(&query_result);
+
+	istate->fsmonitor_last_update = last_update;
+}
+
+static void apply_fsmonitor_dirty_bit(size_t pos, void *is)
+{
+	struct index_state *istate = is;
+
+	if (pos < istate->cache_nr)
+		mark_fsmonitor_invalid(istate, istate->cache[pos]);
+}
+
+static int fsmonitor_config(const char *var, const char *value, void *cb)
+{
+	if (!strcmp(var, "core.fsmonitor"))
+		return git_config_string(&core_fsmonitor, var, value);
+	return 0;
+}
+
+/*
+ * Some commands read the index before they parse the configuration
+ * (e.g. through gitmodules_config()); make sure core.fsmonitor is
+ * known before deciding to drop the extension.
+ */
+static void read_fsmonitor_config(void)
+{
+	static int done;
+
+	if (done || core_fsmonitor)
+		return;
+	done = 1;
+	git_config(fsmonitor_config, NULL);
+}
+
+void tweak_fsmonitor(struct index_state *istate)
+{
+	int i;
+
+	read_fsmonitor_config();
+	if (!core_fsmonitor) {
+		/*
+		 * Nobody is watching: forget the extension, and look at
+		 * every entry again.
+		 */
+		if (istate->fsmonitor_last_update) {
+			discard_fsmonitor(istate);
+			for (i = 0; i < istate->cache_nr; i++)
+				mark_fsmonitor_invalid(istate, istate->cache[i]);
+			istate->cache_changed = 1;
+		}
+		return;
+	}
+
+	if (!istate->fsmonitor_last_update) {
+		/*
+		 * First use: nothing is known to be clean yet; start
+		 * watching from now on.
+		 */
+		invalidate_all(istate);
+		istate->fsmonitor_last_update = getnanotime();
+		istate->cache_changed = 1;
+		return;
+	}
+
+	/* Entries not in the dirty bitmap were clean when it was written */
+	for (i = 0; i < istate->cache_nr; i++)
+		mark_fsmonitor_valid(istate, istate->cache[i]);
+	if (istate->fsmonitor_dirty) {
+		ewah_each_bit(istate->fsmonitor_dirty,
+			      apply_fsmonitor_dirty_bit, istate);
+		ewah_free(istate->fsmonitor_dirty);
+		istate->fsmonitor_dirty = NULL;
+	}
+	refresh_fsmonitor(istate);
+}
+
+void discard_fsmonitor(struct index_state *istate)
+{
+	ewah_free(istate->fsmonitor_dirty);
+	istate->fsmonitor_dirty = NULL;
+	istate->fsmonitor_last_update = 0;
+}
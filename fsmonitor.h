@@ -0,0 +1,57 @@
+#ifndef FSMONITOR_H
+#define FSMONITOR_H
+
+struct index_state;
+struct strbuf;
+
+/*
+ * A file system monitor is a hook (core.fsmonitor) that, given the
+ * time of its previous invocation, lists the paths that may have
+ * changed since then.  Index entries that the monitor did not report
+ * are marked CE_FSMONITOR_VALID and are not lstat()ed by
+ * refresh_index(); directories of the untracked cache containing no
+ * reported path are not stat()ed by read_directory().
+ *
+ * The time of the last query and the entries that were not known to
+ * be clean are kept in the "FSMN" index extension.
+ */
+
+int read_fsmonitor_extension(struct index_state *istate, const void *data,
+			     unsigned long sz);
+void fill_fsmonitor_bitmap(struct index_state *istate);
+void write_fsmonitor_extension(struct strbuf *sb, struct index_state *istate);
+
+/*
+ * Apply the extension to a freshly read index and ask the hook what
+ * changed since it was written (or drop it if core.fsmonitor is not
+ * set).
+ */
+void tweak_fsmonitor(struct index_state *istate);
+
+/* Release the fsmonitor data of an index being discarded. */
+void discard_fsmonitor(struct index_state *istate);
+
+/* Should the extension be written for this index? */
+static inline int fsmonitor_is_active(struct index_state *istate)
+{
+	return core_fsmonitor && istate->fsmonitor_last_update;
+}
+
+/*
+ * Mark an index entry as clean (e.g. after refresh_index() verified
+ * it), or as needing to be examined again.
+ */
+static inline void mark_fsmonitor_valid(struct index_state *istate,
+					struct cache_entry *ce)
+{
+	if (fsmonitor_is_active(istate) && !S_ISGITLINK(ce->ce_mode))
+		ce->ce_flags |= CE_FSMONITOR_VALID;
+}
+
+static inline void mark_fsmonitor_invalid(struct index_state *istate,
+					  struct cache_entry *ce)
+{
+	ce->ce_flags &= ~CE_FSMONITOR_VALID;
+}
+
+#endif
@@ -1168,11 +1168,6 @@ static inline void grep_attr_unlock(void)
 		pthread_mutex_unlock(&grep_attr_mutex);
 }
 
-/*
- * Same as git_attr_mutex, but protecting the thread-unsafe object db access.
- */
-pthread_mutex_t grep_read_mutex;
-
 #else
 #define grep_attr_lock()
 #define grep_attr_unlock()
@@ -1695,9 +1690,7 @@ static int grep_source_load_sha1(struct grep_source *gs)
 {
 	enum object_type type;
 
-	grep_read_lock();
 	gs->buf = read_sha1_file(gs->identifier, &type, &gs->size);
-	grep_read_unlock();
 
 	if (!gs->buf)
 		return error(_("'%s': unable to read %s"),
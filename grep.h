@@ -190,23 +190,13 @@ extern int grep_threads_ok(const struct grep_opt *opt);
  */
 extern int grep_use_locks;
 extern pthread_mutex_t grep_attr_mutex;
-extern pthread_mutex_t grep_read_mutex;
-
-static inline void grep_read_lock(void)
-{
-	if (grep_use_locks)
-		pthread_mutex_lock(&grep_read_mutex);
-}
-
-static inline void grep_read_unlock(void)
-{
-	if (grep_use_locks)
-		pthread_mutex_unlock(&grep_read_mutex);
-}
-
-#else
-#define grep_read_lock()
-#define grep_read_unlock()
 #endif
 
+/*
+ * Around object db access that read_sha1_file() does not lock by
+ * itself; see enable_obj_read_lock().
+ */
+#define grep_read_lock() obj_read_lock()
+#define grep_read_unlock() obj_read_unlock()
+
 #endif
@@ -12,6 +12,7 @@ extern unsigned int strhash(const char *buf);
 extern unsigned int strihash(const char *buf);
 extern unsigned int memhash(const void *buf, size_t len);
 extern unsigned int memihash(const void *buf, size_t len);
+extern unsigned int memihash_cont(unsigned int hash, const void *buf, size_t len);
 
 /* data structures */
 
@@ -27,6 +28,7 @@ struct hashmap {
 	struct hashmap_entry **table;
 	hashmap_cmp_fn cmpfn;
 	unsigned int size, tablesize, grow_at, shrink_at;
+	unsigned int do_count_items : 1;
 };
 
 struct hashmap_iter {
@@ -57,6 +59,10 @@ extern void *hashmap_put(struct hashmap *map, void *entry);
 extern void *hashmap_remove(struct hashmap *map, const void *key,
 		const void *keydata);
 
+extern unsigned int hashmap_bucket(const struct hashmap *map, unsigned int hash);
+extern void hashmap_disable_item_counting(struct hashmap *map);
+extern void hashmap_enable_item_counting(struct hashmap *map);
+
 /* hashmap_iter functions */
 
 extern void hashmap_iter_init(struct hashmap *map, struct hashmap_iter *iter);
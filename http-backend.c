@@ -321,6 +321,7 @@ static void run_service(const char **argv)
 	const char *encoding = getenv("HTTP_CONTENT_ENCODING");
 	const char *user = getenv("REMOTE_USER");
 	const char *host = getenv("REMOTE_ADDR");
+	const char *protocol = getenv("HTTP_GIT_PROTOCOL");
 	struct argv_array env = ARGV_ARRAY_INIT;
 	int gzipped_request = 0;
 	struct child_process cld;
@@ -340,6 +341,9 @@ static void run_service(const char **argv)
 	if (!getenv("GIT_COMMITTER_EMAIL"))
 		argv_array_pushf(&env, "GIT_COMMITTER_EMAIL=%s@http.%s",
 				 user, host);
+	/* the "Git-Protocol" header requests a protocol version */
+	if (protocol)
+		argv_array_pushf(&env, GIT_PROTOCOL_ENVIRONMENT "=%s", protocol);
 
 	memset(&cld, 0, sizeof(cld));
 	cld.argv = argv;
@@ -9,6 +9,7 @@
 #include "strbuf.h"
 #include "remote.h"
 #include "url.h"
+#include "string-list.h"
 
 /*
  * We detect based on the cURL version if multi-transfer is
@@ -163,6 +164,9 @@ struct http_get_options {
 	 * for details.
 	 */
 	struct strbuf *base_url;
+
+	/* If non-NULL, additional HTTP headers ("Name: value") to send. */
+	struct string_list *extra_headers;
 };
 
 /* Return values for http_get_*() */
@@ -0,0 +1,300 @@
+#include "cache.h"
+#include "dir.h"
+#include "tag.h"
+#include "commit.h"
+#include "tree.h"
+#include "blob.h"
+#include "decorate.h"
+#include "parse-options.h"
+#include "sha1-array.h"
+#include "list-objects-filter.h"
+
+/* objects a filter decided to show; see list_objects_filter_free() */
+#define FILTER_SHOWN (1u<<24)
+
+int parse_list_objects_filter(struct list_objects_filter_options *filter_options,
+			      const char *spec)
+{
+	const char *v;
+
+	list_objects_filter_release(filter_options);
+
+	if (!strcmp(spec, "blob:none")) {
+		filter_options->choice = LOFC_BLOB_NONE;
+	} else if (skip_prefix(spec, "blob:limit=", &v)) {
+		if (!git_parse_ulong(v, &filter_options->blob_limit_value))
+			return error("invalid blob size limit in filter '%s'", spec);
+		filter_options->choice = LOFC_BLOB_LIMIT;
+	} else if (skip_prefix(spec, "tree:", &v)) {
+		char *end;
+
+		if (!isdigit(*v))
+			return error("invalid tree depth in filter '%s'", spec);
+		filter_options->tree_depth = strtoul(v, &end, 10);
+		if (*end)
+			return error("invalid tree depth in filter '%s'", spec);
+		filter_options->choice = LOFC_TREE_DEPTH;
+	} else if (skip_prefix(spec, "sparse:oid=", &v)) {
+		if (!*v)
+			return error("missing object in filter '%s'", spec);
+		filter_options->sparse_oid_value = xstrdup(v);
+		filter_options->choice = LOFC_SPARSE_OID;
+	} else {
+		return error("invalid filter-spec '%s'", spec);
+	}
+
+	filter_options->filter_spec = xstrdup(spec);
+	return 0;
+}
+
+void list_objects_filter_release(struct list_objects_filter_options *filter_options)
+{
+	free(filter_options->filter_spec);
+	free(filter_options->sparse_oid_value);
+	memset(filter_options, 0, sizeof(*filter_options));
+}
+
+int opt_parse_list_objects_filter(const struct option *opt,
+				  const char *arg, int unset)
+{
+	struct list_objects_filter_options *filter_options = opt->value;
+
+	if (unset || !arg) {
+		list_objects_filter_release(filter_options);
+		return 0;
+	}
+	return parse_list_objects_filter(filter_options, arg);
+}
+
+struct sparse_frame {
+	int included;
+};
+
+struct list_objects_filter {
+	struct list_objects_filter_options *options;
+	struct sha1_array *omitted;
+
+	/* tree:<depth>; "depth" is that of the entries of the current tree */
+	unsigned long depth;
+	struct decoration walked_depth;
+
+	/* sparse:oid=<blob> */
+	struct exclude_list el;
+	struct sparse_frame *frames;
+	int nr_frames, alloc_frames;
+};
+
+static void omit(struct list_objects_filter *filter, struct object *obj)
+{
+	if (filter->omitted)
+		sha1_array_append(filter->omitted, obj->sha1);
+}
+
+static enum list_objects_filter_result show(struct object *obj,
+					    enum list_objects_filter_result r)
+{
+	if (obj->flags & FILTER_SHOWN)
+		return r;
+	obj->flags |= FILTER_SHOWN;
+	return r | LOFR_DO_SHOW;
+}
+
+static enum list_objects_filter_result filter_blob_none(
+	struct list_objects_filter *filter,
+	enum list_objects_filter_situation situation,
+	struct object *obj)
+{
+	switch (situation) {
+	case LOFS_BEGIN_TREE:
+		return show(obj, LOFR_MARK_SEEN);
+	case LOFS_BLOB:
+		omit(filter, obj);
+		return LOFR_MARK_SEEN;
+	default:
+		return LOFR_ZERO;
+	}
+}
+
+static enum list_objects_filter_result filter_blob_limit(
+	struct list_objects_filter *filter,
+	enum list_objects_filter_situation situation,
+	struct object *obj)
+{
+	unsigned long size;
+
+	switch (situation) {
+	case LOFS_BEGIN_TREE:
+		return show(obj, LOFR_MARK_SEEN);
+	case LOFS_BLOB:
+		/*
+		 * A blob whose size we cannot find out is shown, so that
+		 * the caller gets to complain about it.
+		 */
+		if (sha1_object_info(obj->sha1, &size) == OBJ_BLOB &&
+		    size >= filter->options->blob_limit_value) {
+			omit(filter, obj);
+			return LOFR_MARK_SEEN;
+		}
+		return show(obj, LOFR_MARK_SEEN);
+	default:
+		return LOFR_ZERO;
+	}
+}
+
+/*
+ * The root tree is at depth 0.  Trees are never marked SEEN, because a
+ * tree first met deep down may be met again closer to the root, where
+ * more of its entries are within the limit; instead we remember the
+ * smallest depth each tree has been walked at.
+ */
+static enum list_objects_filter_result filter_tree_depth(
+	struct list_objects_filter *filter,
+	enum list_objects_filter_situation situation,
+	struct object *obj)
+{
+	unsigned long limit = filter->options->tree_depth;
+	uintptr_t walked;
+
+	switch (situation) {
+	case LOFS_BEGIN_TREE:
+		if (filter->depth >= limit) {
+			omit(filter, obj);
+			return LOFR_SKIP_TREE;
+		}
+		walked = (uintptr_t)lookup_decoration(&filter->walked_depth, obj);
+		if (walked && walked - 1 <= filter->depth)
+			return LOFR_SKIP_TREE;
+		add_decoration(&filter->walked_depth, obj,
+			       (void *)(uintptr_t)(filter->depth + 1));
+		filter->depth++;
+		return show(obj, LOFR_ZERO);
+	case LOFS_END_TREE:
+		filter->depth--;
+		return LOFR_ZERO;
+	case LOFS_BLOB:
+		if (filter->depth >= limit) {
+			omit(filter, obj);
+			return LOFR_ZERO;
+		}
+		return show(obj, LOFR_MARK_SEEN);
+	}
+	return LOFR_ZERO;
+}
+
+/*
+ * Paths are matched against the patterns like in a sparse checkout:
+ * a path that matches is included, a directory that matches includes
+ * everything below it that is not matched otherwise.  As the same tree
+ * or blob may be found at a path that is included and at one that is
+ * not, neither is marked SEEN.
+ */
+static enum list_objects_filter_result filter_sparse(
+	struct list_objects_filter *filter,
+	enum list_objects_filter_situation situation,
+	struct object *obj, const char *pathname, const char *filename)
+{
+	int dtype, val;
+	int parent = filter->nr_frames ?
+		filter->frames[filter->nr_frames - 1].included : 0;
+
+	switch (situation) {
+	case LOFS_BEGIN_TREE:
+		val = parent;
+		if (filter->nr_frames) {
+			dtype = DT_DIR;
+			val = is_excluded_from_list(pathname, strlen(pathname),
+						    filename, &dtype, &filter->el);
+			if (val < 0)
+				val = parent;
+		}
+		ALLOC_GROW(filter->frames, filter->nr_frames + 1,
+			   filter->alloc_frames);
+		filter->frames[filter->nr_frames++].included = val;
+		return show(obj, LOFR_ZERO);
+	case LOFS_END_TREE:
+		filter->nr_frames--;
+		return LOFR_ZERO;
+	case LOFS_BLOB:
+		dtype = DT_REG;
+		val = is_excluded_from_list(pathname, strlen(pathname),
+					    filename, &dtype, &filter->el);
+		if (val < 0)
+			val = parent;
+		if (val > 0)
+			return show(obj, LOFR_MARK_SEEN);
+		omit(filter, obj);
+		return LOFR_ZERO;
+	}
+	return LOFR_ZERO;
+}
+
+struct list_objects_filter *list_objects_filter_init(
+	struct list_objects_filter_options *filter_options,
+	struct sha1_array *omitted)
+{
+	struct list_objects_filter *filter;
+
+	if (!filter_options || filter_options->choice == LOFC_DISABLED)
+		return NULL;
+
+	filter = xcalloc(1, sizeof(*filter));
+	filter->options = filter_options;
+	filter->omitted = omitted;
+
+	if (filter_options->choice == LOFC_SPARSE_OID) {
+		unsigned char sha1[20];
+
+		if (get_sha1(filter_options->sparse_oid_value, sha1))
+			die("unable to resolve sparse filter object '%s'",
+			    filter_options->sparse_oid_value);
+		if (add_excludes_from_blob_to_list(sha1, "", 0, &filter->el) < 0)
+			die("unable to read sparse filter blob '%s'",
+			    filter_options->sparse_oid_value);
+	}
+	return filter;
+}
+
+enum list_objects_filter_result list_objects_filter_object(
+	struct list_objects_filter *filter,
+	enum list_objects_filter_situation situation,
+	struct object *obj, const char *pathname, const char *filename)
+{
+	switch (filter->options->choice) {
+	case LOFC_BLOB_NONE:
+		return filter_blob_none(filter, situation, obj);
+	case LOFC_BLOB_LIMIT:
+		return filter_blob_limit(filter, situation, obj);
+	case LOFC_TREE_DEPTH:
+		return filter_tree_depth(filter, situation, obj);
+	case LOFC_SPARSE_OID:
+		return filter_sparse(filter, situation, obj, pathname, filename);
+	default:
+		die("BUG: unknown filter choice %d", filter->options->choice);
+	}
+}
+
+static void keep_if_not_shown(const unsigned char sha1[20], void *data)
+{
+	struct object *obj = lookup_object(sha1);
+
+	if (!obj || !(obj->flags & FILTER_SHOWN))
+		sha1_array_append(data, sha1);
+}
+
+void list_objects_filter_free(struct list_objects_filter *filter)
+{
+	if (!filter)
+		return;
+	if (filter->omitted) {
+		struct sha1_array all = *filter->omitted;
+
+		memset(filter->omitted, 0, sizeof(*filter->omitted));
+		sha1_array_for_each_unique(&all, keep_if_not_shown,
+					   filter->omitted);
+		sha1_array_clear(&all);
+	}
+	free(filter->walked_depth.hash);
+	clear_exclude_list(&filter->el);
+	free(filter->frames);
+	free(filter);
+}
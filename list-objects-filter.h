@@ -0,0 +1,95 @@
+#ifndef LIST_OBJECTS_FILTER_H
+#define LIST_OBJECTS_FILTER_H
+
+struct object;
+struct option;
+struct sha1_array;
+
+enum list_objects_filter_choice {
+	LOFC_DISABLED = 0,
+	LOFC_BLOB_NONE,
+	LOFC_BLOB_LIMIT,
+	LOFC_TREE_DEPTH,
+	LOFC_SPARSE_OID
+};
+
+struct list_objects_filter_options {
+	/*
+	 * The filter as given by the user, e.g. "blob:limit=1m"; it is
+	 * passed on as-is to the other side of a fetch.
+	 */
+	char *filter_spec;
+
+	enum list_objects_filter_choice choice;
+
+	unsigned long blob_limit_value;
+	unsigned long tree_depth;
+
+	/*
+	 * The blob holding the sparse patterns; only resolved when the
+	 * objects are walked, as the repository that gives the spec
+	 * need not have it.
+	 */
+	char *sparse_oid_value;
+};
+
+#define LIST_OBJECTS_FILTER_OPTIONS_INIT { NULL, LOFC_DISABLED }
+
+/*
+ * Parse "spec" into "filter_options".  Returns 0 on success, or -1 with
+ * an error message printed when the spec is not understood.
+ */
+extern int parse_list_objects_filter(struct list_objects_filter_options *filter_options,
+				     const char *spec);
+extern void list_objects_filter_release(struct list_objects_filter_options *filter_options);
+
+extern int opt_parse_list_objects_filter(const struct option *, const char *, int);
+
+#define OPT_PARSE_LIST_OBJECTS_FILTER(fo) \
+	{ OPTION_CALLBACK, 0, "filter", (fo), N_("args"), \
+	  N_("object filtering"), 0, opt_parse_list_objects_filter }
+
+/*
+ * The interface between the filters and traverse_commit_list_filtered().
+ * The filter is told when the traversal enters and leaves a tree and
+ * when it meets a blob, and answers what to do with the object.
+ */
+enum list_objects_filter_situation {
+	LOFS_BEGIN_TREE,
+	LOFS_END_TREE,
+	LOFS_BLOB
+};
+
+enum list_objects_filter_result {
+	LOFR_ZERO      = 0,
+	LOFR_MARK_SEEN = 1 << 0,
+	LOFR_DO_SHOW   = 1 << 1,
+	LOFR_SKIP_TREE = 1 << 2
+};
+
+struct list_objects_filter;
+
+/*
+ * Set up a filter; the objects it leaves out are appended to "omitted"
+ * if that is not NULL.  Returns NULL when no filtering is asked for.
+ */
+extern struct list_objects_filter *list_objects_filter_init(
+	struct list_objects_filter_options *filter_options,
+	struct sha1_array *omitted);
+
+/*
+ * "pathname" is the path of the object from the root tree, "filename"
+ * its last component; both are NULL for LOFS_END_TREE.
+ */
+extern enum list_objects_filter_result list_objects_filter_object(
+	struct list_objects_filter *filter,
+	enum list_objects_filter_situation situation,
+	struct object *obj, const char *pathname, const char *filename);
+
+/*
+ * Free the filter.  Objects that were left out at one place but shown
+ * at another are removed from the "omitted" array first.
+ */
+extern void list_objects_filter_free(struct list_objects_filter *filter);
+
+#endif
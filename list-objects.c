@@ -7,15 +7,19 @@
 #include "tree-walk.h"
 #include "revision.h"
 #include "list-objects.h"
+#include "list-objects-filter.h"
 
 static void process_blob(struct rev_info *revs,
 			 struct blob *blob,
 			 show_object_fn show,
 			 struct name_path *path,
+			 struct strbuf *base,
 			 const char *name,
+			 struct list_objects_filter *filter,
 			 void *cb_data)
 {
 	struct object *obj = &blob->object;
+	enum list_objects_filter_result r = LOFR_MARK_SEEN | LOFR_DO_SHOW;
 
 	if (!revs->blob_objects)
 		return;
@@ -23,8 +27,21 @@ static void process_blob(struct rev_info *revs,
 		die("bad blob object");
 	if (obj->flags & (UNINTERESTING | SEEN))
 		return;
-	obj->flags |= SEEN;
-	show(obj, path, name, cb_data);
+	if (revs->exclude_promisor_objects && !has_sha1_file(obj->sha1) &&
+	    is_promisor_object(obj->sha1))
+		return;
+	if (filter) {
+		int baselen = base->len;
+
+		strbuf_addstr(base, name);
+		r = list_objects_filter_object(filter, LOFS_BLOB, obj,
+					       base->buf, name);
+		strbuf_setlen(base, baselen);
+	}
+	if (r & LOFR_MARK_SEEN)
+		obj->flags |= SEEN;
+	if (r & LOFR_DO_SHOW)
+		show(obj, path, name, cb_data);
 }
 
 /*
@@ -65,6 +82,7 @@ static void process_tree(struct rev_info *revs,
 			 struct name_path *path,
 			 struct strbuf *base,
 			 const char *name,
+			 struct list_objects_filter *filter,
 			 void *cb_data)
 {
 	struct object *obj = &tree->object;
@@ -73,6 +91,7 @@ static void process_tree(struct rev_info *revs,
 	struct name_path me;
 	enum interesting match = revs->diffopt.pathspec.nr == 0 ?
 		all_entries_interesting: entry_not_interesting;
+	enum list_objects_filter_result r = LOFR_MARK_SEEN | LOFR_DO_SHOW;
 	int baselen = base->len;
 
 	if (!revs->tree_objects)
@@ -81,18 +100,40 @@ static void process_tree(struct rev_info *revs,
 		die("bad tree object");
 	if (obj->flags & (UNINTERESTING | SEEN))
 		return;
+	if (revs->exclude_promisor_objects && !has_sha1_file(obj->sha1) &&
+	    is_promisor_object(obj->sha1))
+		return;
+	if (filter) {
+		/*
+		 * Ask before parsing, so that a tree the filter leaves
+		 * out does not have to be present.
+		 */
+		strbuf_addstr(base, name);
+		r = list_objects_filter_object(filter, LOFS_BEGIN_TREE, obj,
+					       base->buf, name);
+		strbuf_setlen(base, baselen);
+		if (r & LOFR_SKIP_TREE) {
+			if (r & LOFR_MARK_SEEN)
+				obj->flags |= SEEN;
+			if (r & LOFR_DO_SHOW)
+				show(obj, path, name, cb_data);
+			return;
+		}
+	}
 	if (parse_tree(tree) < 0) {
 		if (revs->ignore_missing_links)
 			return;
 		die("bad tree object %s", sha1_to_hex(obj->sha1));
 	}
-	obj->flags |= SEEN;
-	show(obj, path, name, cb_data);
+	if (r & LOFR_MARK_SEEN)
+		obj->flags |= SEEN;
+	if (r & LOFR_DO_SHOW)
+		show(obj, path, name, cb_data);
 	me.up = path;
 	me.elem = name;
 	me.elem_len = strlen(name);
 
-	if (!match) {
+	if (!match || filter) {
 		strbuf_addstr(base, name);
 		if (base->len)
 			strbuf_addch(base, '/');
@@ -114,7 +155,7 @@ static void process_tree(struct rev_info *revs,
 			process_tree(revs,
 				     lookup_tree(entry.sha1),
 				     show, &me, base, entry.path,
-				     cb_data);
+				     filter, cb_data);
 		else if (S_ISGITLINK(entry.mode))
 			process_gitlink(revs, entry.sha1,
 					show, &me, entry.path,
@@ -122,9 +163,12 @@ static void process_tree(struct rev_info *revs,
 		else
 			process_blob(revs,
 				     lookup_blob(entry.sha1),
-				     show, &me, entry.path,
-				     cb_data);
+				     show, &me, base, entry.path,
+				     filter, cb_data);
 	}
+	if (filter)
+		list_objects_filter_object(filter, LOFS_END_TREE, obj,
+					   NULL, NULL);
 	strbuf_setlen(base, baselen);
 	free_tree_buffer(tree);
 }
@@ -185,15 +229,19 @@ static void add_pending_tree(struct rev_info *revs, struct tree *tree)
 	add_pending_object(revs, &tree->object, "");
 }
 
-void traverse_commit_list(struct rev_info *revs,
-			  show_commit_fn show_commit,
-			  show_object_fn show_object,
-			  void *data)
+void traverse_commit_list_filtered(struct rev_info *revs,
+				   show_commit_fn show_commit,
+				   show_object_fn show_object,
+				   void *data,
+				   struct list_objects_filter_options *filter_options,
+				   struct sha1_array *omitted)
 {
 	int i;
 	struct commit *commit;
 	struct strbuf base;
+	struct list_objects_filter *filter;
 
+	filter = list_objects_filter_init(filter_options, omitted);
 	strbuf_init(&base, PATH_MAX);
 	while ((commit = get_revision(revs)) != NULL) {
 		/*
@@ -217,12 +265,12 @@ void traverse_commit_list(struct rev_info *revs,
 		}
 		if (obj->type == OBJ_TREE) {
 			process_tree(revs, (struct tree *)obj, show_object,
-				     NULL, &base, name, data);
+				     NULL, &base, name, filter, data);
 			continue;
 		}
 		if (obj->type == OBJ_BLOB) {
 			process_blob(revs, (struct blob *)obj, show_object,
-				     NULL, name, data);
+				     NULL, &base, name, filter, data);
 			continue;
 		}
 		die("unknown pending object %s (%s)",
@@ -235,4 +283,14 @@ void traverse_commit_list(struct rev_info *revs,
 		revs->pending.objects = NULL;
 	}
 	strbuf_release(&base);
+	list_objects_filter_free(filter);
+}
+
+void traverse_commit_list(struct rev_info *revs,
+			  show_commit_fn show_commit,
+			  show_object_fn show_object,
+			  void *data)
+{
+	traverse_commit_list_filtered(revs, show_commit, show_object, data,
+				      NULL, NULL);
 }
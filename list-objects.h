@@ -5,6 +5,18 @@ typedef void (*show_commit_fn)(struct commit *, void *);
 typedef void (*show_object_fn)(struct object *, const struct name_path *, const char *, void *);
 void traverse_commit_list(struct rev_info *, show_commit_fn, show_object_fn, void *);
 
+struct list_objects_filter_options;
+struct sha1_array;
+
+/*
+ * Like traverse_commit_list(), but leave out the trees and blobs the
+ * filter does not want; their names are appended to "omitted" if that
+ * is not NULL.
+ */
+void traverse_commit_list_filtered(struct rev_info *, show_commit_fn, show_object_fn,
+				   void *, struct list_objects_filter_options *,
+				   struct sha1_array *omitted);
+
 typedef void (*show_edge_fn)(struct commit *);
 void mark_edges_uninteresting(struct rev_info *, show_edge_fn);
 
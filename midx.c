@@ -0,0 +1,958 @@
+#include "cache.h"
+#include "dir.h"
+#include "csum-file.h"
+#include "midx.h"
+#include "pack.h"
+#include "commit.h"
+#include "revision.h"
+#include "list-objects.h"
+#include "pack-objects.h"
+#include "pack-bitmap.h"
+
+#define MIDX_SIGNATURE 0x4d494458 /* "MIDX" */
+#define MIDX_VERSION 1
+#define MIDX_HASH_VERSION 1 /* SHA-1 */
+#define MIDX_HASH_LEN 20
+#define MIDX_HEADER_SIZE 12
+#define MIDX_MIN_SIZE (MIDX_HEADER_SIZE + MIDX_HASH_LEN)
+
+#define MIDX_MAX_CHUNKS 5
+#define MIDX_CHUNK_ALIGNMENT 4
+#define MIDX_CHUNKID_PACKNAMES 0x504e414d /* "PNAM" */
+#define MIDX_CHUNKID_OIDFANOUT 0x4f494446 /* "OIDF" */
+#define MIDX_CHUNKID_OIDLOOKUP 0x4f49444c /* "OIDL" */
+#define MIDX_CHUNKID_OBJECTOFFSETS 0x4f4f4646 /* "OOFF" */
+#define MIDX_CHUNKID_LARGEOFFSETS 0x4c4f4646 /* "LOFF" */
+#define MIDX_CHUNKLOOKUP_WIDTH 12
+#define MIDX_CHUNK_FANOUT_SIZE (4 * 256)
+#define MIDX_CHUNK_OFFSET_WIDTH 8
+#define MIDX_CHUNK_LARGE_OFFSET_WIDTH 8
+#define MIDX_LARGE_OFFSET_NEEDED 0x80000000
+
+char *get_midx_filename(const char *object_dir)
+{
+	return xstrfmt("%s/pack/multi-pack-index", object_dir);
+}
+
+struct multi_pack_index *load_multi_pack_index(const char *object_dir)
+{
+	struct multi_pack_index *m = NULL;
+	int fd;
+	struct stat st;
+	size_t midx_size;
+	unsigned char *midx_map;
+	char *midx_name = get_midx_filename(object_dir);
+	uint32_t i;
+	const char *cur_pack_name;
+
+	fd = git_open_noatime(midx_name);
+	if (fd < 0)
+		goto cleanup_fail;
+	if (fstat(fd, &st)) {
+		error("failed to read %s", midx_name);
+		goto cleanup_fail;
+	}
+
+	midx_size = xsize_t(st.st_size);
+	if (midx_size < MIDX_MIN_SIZE) {
+		error("multi-pack-index file %s is too small", midx_name);
+		goto cleanup_fail;
+	}
+
+	midx_map = xmmap(NULL, midx_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	fd = -1;
+
+	m = xcalloc(1, sizeof(*m) + strlen(object_dir) + 1);
+	strcpy(m->object_dir, object_dir);
+	m->data = midx_map;
+	m->data_len = midx_size;
+
+	if (get_be32(m->data) != MIDX_SIGNATURE) {
+		error("multi-pack-index signature 0x%08x does not match signature 0x%08x",
+		      get_be32(m->data), MIDX_SIGNATURE);
+		goto cleanup_fail;
+	}
+	if (m->data[4] != MIDX_VERSION) {
+		error("multi-pack-index version %d not recognized", m->data[4]);
+		goto cleanup_fail;
+	}
+	if (m->data[5] != MIDX_HASH_VERSION) {
+		error("multi-pack-index hash version %d not recognized", m->data[5]);
+		goto cleanup_fail;
+	}
+	m->num_chunks = m->data[6];
+	/* m->data[7] is the number of base multi-pack-index files: unused */
+	m->num_packs = get_be32(m->data + 8);
+
+	if (MIDX_HEADER_SIZE + (m->num_chunks + 1) * MIDX_CHUNKLOOKUP_WIDTH >
+	    midx_size - MIDX_HASH_LEN) {
+		error("multi-pack-index chunk lookup table is truncated");
+		goto cleanup_fail;
+	}
+
+	for (i = 0; i < m->num_chunks; i++) {
+		const unsigned char *lookup = m->data + MIDX_HEADER_SIZE +
+					      MIDX_CHUNKLOOKUP_WIDTH * i;
+		uint32_t chunk_id = get_be32(lookup);
+		uint64_t chunk_offset = ((uint64_t)get_be32(lookup + 4) << 32) |
+					get_be32(lookup + 8);
+
+		if (chunk_offset > midx_size - MIDX_HASH_LEN) {
+			error("multi-pack-index chunk offset is out of bounds");
+			goto cleanup_fail;
+		}
+
+		switch (chunk_id) {
+		case MIDX_CHUNKID_PACKNAMES:
+			m->chunk_pack_names = m->data + chunk_offset;
+			break;
+		case MIDX_CHUNKID_OIDFANOUT:
+			m->chunk_oid_fanout = m->data + chunk_offset;
+			break;
+		case MIDX_CHUNKID_OIDLOOKUP:
+			m->chunk_oid_lookup = m->data + chunk_offset;
+			break;
+		case MIDX_CHUNKID_OBJECTOFFSETS:
+			m->chunk_object_offsets = m->data + chunk_offset;
+			break;
+		case MIDX_CHUNKID_LARGEOFFSETS:
+			m->chunk_large_offsets = m->data + chunk_offset;
+			break;
+		default:
+			/* ignore unknown chunks */
+			break;
+		}
+	}
+
+	if (!m->chunk_pack_names || !m->chunk_oid_fanout ||
+	    !m->chunk_oid_lookup || !m->chunk_object_offsets) {
+		error("multi-pack-index is missing a required chunk");
+		goto cleanup_fail;
+	}
+
+	m->num_objects = get_be32(m->chunk_oid_fanout + 4 * 255);
+	if (m->chunk_oid_lookup + (uint64_t)m->num_objects * MIDX_HASH_LEN >
+	    m->data + midx_size - MIDX_HASH_LEN ||
+	    m->chunk_object_offsets +
+	    (uint64_t)m->num_objects * MIDX_CHUNK_OFFSET_WIDTH >
+	    m->data + midx_size - MIDX_HASH_LEN) {
+		error("multi-pack-index object tables are truncated");
+		goto cleanup_fail;
+	}
+
+	m->pack_names = xcalloc(m->num_packs ? m->num_packs : 1,
+				sizeof(*m->pack_names));
+	m->packs = xcalloc(m->num_packs ? m->num_packs : 1, sizeof(*m->packs));
+
+	cur_pack_name = (const char *)m->chunk_pack_names;
+	for (i = 0; i < m->num_packs; i++) {
+		const char *end = memchr(cur_pack_name, '\0',
+					 (const char *)m->data + midx_size -
+					 cur_pack_name);
+		if (!end) {
+			error("multi-pack-index pack names are truncated");
+			goto cleanup_fail;
+		}
+		m->pack_names[i] = cur_pack_name;
+		if (i && strcmp(m->pack_names[i - 1], m->pack_names[i]) >= 0) {
+			error("multi-pack-index pack names out of order: '%s' before '%s'",
+			      m->pack_names[i - 1], m->pack_names[i]);
+			goto cleanup_fail;
+		}
+		cur_pack_name = end + 1;
+	}
+
+	free(midx_name);
+	return m;
+
+cleanup_fail:
+	if (fd >= 0)
+		close(fd);
+	close_midx(m);
+	free(midx_name);
+	return NULL;
+}
+
+void close_midx(struct multi_pack_index *m)
+{
+	if (!m)
+		return;
+	munmap((void *)m->data, m->data_len);
+	free(m->pack_names);
+	free(m->packs);
+	free(m);
+}
+
+int midx_pack_pos(struct multi_pack_index *m, const char *idx_name)
+{
+	uint32_t first = 0, last = m->num_packs;
+
+	while (first < last) {
+		uint32_t mid = first + (last - first) / 2;
+		int cmp = strcmp(idx_name, m->pack_names[mid]);
+
+		if (!cmp)
+			return mid;
+		if (cmp > 0)
+			first = mid + 1;
+		else
+			last = mid;
+	}
+	return -1;
+}
+
+int bsearch_midx(struct multi_pack_index *m, const unsigned char *sha1,
+		 uint32_t *result)
+{
+	uint32_t lo = 0, hi;
+
+	if (sha1[0])
+		lo = get_be32(m->chunk_oid_fanout + 4 * (sha1[0] - 1));
+	hi = get_be32(m->chunk_oid_fanout + 4 * sha1[0]);
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = hashcmp(sha1, m->chunk_oid_lookup + MIDX_HASH_LEN * mi);
+
+		if (!cmp) {
+			*result = mi;
+			return 1;
+		}
+		if (cmp > 0)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	return 0;
+}
+
+const unsigned char *nth_midxed_object_sha1(struct multi_pack_index *m,
+					    uint32_t pos)
+{
+	return m->chunk_oid_lookup + MIDX_HASH_LEN * pos;
+}
+
+off_t nth_midxed_offset(struct multi_pack_index *m, uint32_t pos)
+{
+	const unsigned char *offset_data;
+	uint32_t offset32;
+
+	offset_data = m->chunk_object_offsets + pos * MIDX_CHUNK_OFFSET_WIDTH;
+	offset32 = get_be32(offset_data + 4);
+
+	if (m->chunk_large_offsets && offset32 & MIDX_LARGE_OFFSET_NEEDED) {
+		const unsigned char *large = m->chunk_large_offsets +
+			MIDX_CHUNK_LARGE_OFFSET_WIDTH *
+			(offset32 ^ MIDX_LARGE_OFFSET_NEEDED);
+
+		if (large + MIDX_CHUNK_LARGE_OFFSET_WIDTH >
+		    m->data + m->data_len - MIDX_HASH_LEN)
+			die("multi-pack-index stores a 64-bit offset, but the table is too small");
+		return ((uint64_t)get_be32(large) << 32) | get_be32(large + 4);
+	}
+
+	return offset32;
+}
+
+uint32_t nth_midxed_pack_int_id(struct multi_pack_index *m, uint32_t pos)
+{
+	return get_be32(m->chunk_object_offsets + pos * MIDX_CHUNK_OFFSET_WIDTH);
+}
+
+int fill_midx_entry(const unsigned char *sha1, struct pack_entry *e,
+		    struct multi_pack_index *m)
+{
+	uint32_t pos, pack_int_id;
+	struct packed_git *p;
+
+	if (!bsearch_midx(m, sha1, &pos))
+		return 0;
+
+	pack_int_id = nth_midxed_pack_int_id(m, pos);
+	if (pack_int_id >= m->num_packs)
+		die("bad pack-int-id: %u (%u total packs)",
+		    pack_int_id, m->num_packs);
+
+	p = m->packs[pack_int_id];
+	if (!p)
+		return -1;
+
+	if (p->num_bad_objects) {
+		uint32_t i;
+		for (i = 0; i < p->num_bad_objects; i++)
+			if (!hashcmp(sha1, p->bad_object_sha1 + 20 * i))
+				return -1;
+	}
+
+	/*
+	 * The pack may have been deleted since the index was
+	 * written; make sure it can still be accessed.
+	 */
+	if (!is_pack_valid(p))
+		return -1;
+
+	e->offset = nth_midxed_offset(m, pos);
+	e->p = p;
+	hashcpy(e->sha1, sha1);
+	return 1;
+}
+
+const unsigned char *get_midx_checksum(struct multi_pack_index *m)
+{
+	return m->data + m->data_len - MIDX_HASH_LEN;
+}
+
+char *get_midx_bitmap_filename(const char *object_dir,
+			       const unsigned char *midx_sha1)
+{
+	return xstrfmt("%s/pack/multi-pack-index-%s.bitmap",
+		       object_dir, sha1_to_hex(midx_sha1));
+}
+
+/*
+ * The pseudo-pack order: objects sorted by pack-int-id, then by their
+ * offset in that pack. It only depends on the contents of the
+ * multi-pack-index, so that the writer and the readers of a bitmap
+ * agree on it.
+ */
+static const uint32_t *pack_order_pack_int_id;
+static const uint64_t *pack_order_offset;
+
+static int pack_order_cmp(const void *a_, const void *b_)
+{
+	uint32_t a = *(const uint32_t *)a_, b = *(const uint32_t *)b_;
+
+	if (pack_order_pack_int_id[a] != pack_order_pack_int_id[b])
+		return pack_order_pack_int_id[a] < pack_order_pack_int_id[b] ? -1 : 1;
+	if (pack_order_offset[a] != pack_order_offset[b])
+		return pack_order_offset[a] < pack_order_offset[b] ? -1 : 1;
+	return 0;
+}
+
+static uint32_t *sort_pack_order(uint32_t *pack_int_ids, uint64_t *offsets,
+				 uint32_t nr)
+{
+	uint32_t *order = xmalloc(sizeof(*order) * (nr ? nr : 1));
+	uint32_t i;
+
+	for (i = 0; i < nr; i++)
+		order[i] = i;
+	pack_order_pack_int_id = pack_int_ids;
+	pack_order_offset = offsets;
+	qsort(order, nr, sizeof(*order), pack_order_cmp);
+	pack_order_pack_int_id = NULL;
+	pack_order_offset = NULL;
+	return order;
+}
+
+uint32_t *midx_pack_order(struct multi_pack_index *m)
+{
+	uint32_t *pack_int_ids, *order;
+	uint64_t *offsets;
+	uint32_t i;
+
+	pack_int_ids = xmalloc(sizeof(*pack_int_ids) *
+			       (m->num_objects ? m->num_objects : 1));
+	offsets = xmalloc(sizeof(*offsets) *
+			  (m->num_objects ? m->num_objects : 1));
+	for (i = 0; i < m->num_objects; i++) {
+		pack_int_ids[i] = nth_midxed_pack_int_id(m, i);
+		offsets[i] = nth_midxed_offset(m, i);
+	}
+	order = sort_pack_order(pack_int_ids, offsets, m->num_objects);
+	free(pack_int_ids);
+	free(offsets);
+	return order;
+}
+
+/* Writing */
+
+struct midx_pack {
+	char *name;
+	struct packed_git *p;
+	/* pack-int-id in the existing multi-pack-index, or -1 */
+	int32_t old_id;
+};
+
+struct pack_midx_entry {
+	unsigned char sha1[20];
+	uint32_t pack_int_id;
+	time_t pack_mtime;
+	uint64_t offset;
+};
+
+static int midx_pack_compare(const void *a_, const void *b_)
+{
+	const struct midx_pack *a = a_, *b = b_;
+	return strcmp(a->name, b->name);
+}
+
+static int midx_oid_compare(const void *a_, const void *b_)
+{
+	const struct pack_midx_entry *a = a_, *b = b_;
+	int cmp = hashcmp(a->sha1, b->sha1);
+
+	if (cmp)
+		return cmp;
+
+	/* prefer the copy in the newest pack */
+	if (a->pack_mtime > b->pack_mtime)
+		return -1;
+	else if (a->pack_mtime < b->pack_mtime)
+		return 1;
+
+	return a->pack_int_id - b->pack_int_id;
+}
+
+static uint32_t pack_fanout(struct packed_git *p, int value)
+{
+	const uint32_t *level1_ofs = p->index_data;
+
+	if (p->index_version > 1)
+		level1_ofs += 2;
+	return ntohl(level1_ofs[value]);
+}
+
+static void collect_packs(const char *object_dir, struct multi_pack_index *m,
+			  struct midx_pack **packs_p, uint32_t *nr_p)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct midx_pack *packs = NULL;
+	uint32_t nr = 0, alloc = 0;
+	size_t dirlen;
+	struct dirent *de;
+	DIR *dir;
+
+	strbuf_addf(&path, "%s/pack", object_dir);
+	dir = opendir(path.buf);
+	if (!dir) {
+		if (errno != ENOENT)
+			error("unable to open object pack directory: %s: %s",
+			      path.buf, strerror(errno));
+		strbuf_release(&path);
+		*packs_p = NULL;
+		*nr_p = 0;
+		return;
+	}
+	strbuf_addch(&path, '/');
+	dirlen = path.len;
+
+	while ((de = readdir(dir)) != NULL) {
+		struct packed_git *p;
+		int old_id = -1;
+
+		if (!has_extension(de->d_name, ".idx"))
+			continue;
+
+		strbuf_setlen(&path, dirlen);
+		strbuf_addstr(&path, de->d_name);
+
+		p = add_packed_git(path.buf, path.len, 1);
+		if (!p)
+			continue;
+		if (m)
+			old_id = midx_pack_pos(m, de->d_name);
+		if (old_id < 0 && open_pack_index(p)) {
+			warning("failed to open pack-index '%s'", path.buf);
+			free(p);
+			continue;
+		}
+
+		ALLOC_GROW(packs, nr + 1, alloc);
+		packs[nr].name = xstrdup(de->d_name);
+		packs[nr].p = p;
+		packs[nr].old_id = old_id;
+		nr++;
+	}
+	closedir(dir);
+	strbuf_release(&path);
+
+	qsort(packs, nr, sizeof(*packs), midx_pack_compare);
+	*packs_p = packs;
+	*nr_p = nr;
+}
+
+/*
+ * Merge the sorted object tables one fanout bucket at a time, so that
+ * only a single bucket of duplicates is sorted at once.
+ */
+static struct pack_midx_entry *get_sorted_entries(struct multi_pack_index *m,
+						  struct midx_pack *packs,
+						  uint32_t nr_packs,
+						  uint32_t *nr_objects)
+{
+	uint32_t cur_fanout, cur_pack, cur_object;
+	uint32_t alloc_fanout = 0, alloc_objects = 0, nr_fanout;
+	uint32_t *old_to_new = NULL;
+	struct pack_midx_entry *entries_by_fanout = NULL;
+	struct pack_midx_entry *deduplicated = NULL;
+
+	*nr_objects = 0;
+
+	if (m) {
+		old_to_new = xmalloc(sizeof(*old_to_new) *
+				     (m->num_packs ? m->num_packs : 1));
+		for (cur_pack = 0; cur_pack < m->num_packs; cur_pack++)
+			old_to_new[cur_pack] = nr_packs;
+		for (cur_pack = 0; cur_pack < nr_packs; cur_pack++)
+			if (packs[cur_pack].old_id >= 0)
+				old_to_new[packs[cur_pack].old_id] = cur_pack;
+	}
+
+	for (cur_fanout = 0; cur_fanout < 256; cur_fanout++) {
+		nr_fanout = 0;
+
+		if (m) {
+			uint32_t start = 0, end;
+
+			if (cur_fanout)
+				start = get_be32(m->chunk_oid_fanout + 4 * (cur_fanout - 1));
+			end = get_be32(m->chunk_oid_fanout + 4 * cur_fanout);
+
+			for (cur_object = start; cur_object < end; cur_object++) {
+				uint32_t id = old_to_new[nth_midxed_pack_int_id(m, cur_object)];
+				struct pack_midx_entry *e;
+
+				if (id >= nr_packs)
+					continue; /* the pack is gone */
+
+				ALLOC_GROW(entries_by_fanout, nr_fanout + 1, alloc_fanout);
+				e = &entries_by_fanout[nr_fanout++];
+				hashcpy(e->sha1, m->chunk_oid_lookup +
+					MIDX_HASH_LEN * cur_object);
+				e->pack_int_id = id;
+				e->pack_mtime = packs[id].p->mtime;
+				e->offset = nth_midxed_offset(m, cur_object);
+			}
+		}
+
+		for (cur_pack = 0; cur_pack < nr_packs; cur_pack++) {
+			struct packed_git *p = packs[cur_pack].p;
+			uint32_t start = 0, end;
+
+			if (packs[cur_pack].old_id >= 0)
+				continue;
+
+			if (cur_fanout)
+				start = pack_fanout(p, cur_fanout - 1);
+			end = pack_fanout(p, cur_fanout);
+
+			for (cur_object = start; cur_object < end; cur_object++) {
+				struct pack_midx_entry *e;
+
+				ALLOC_GROW(entries_by_fanout, nr_fanout + 1, alloc_fanout);
+				e = &entries_by_fanout[nr_fanout++];
+				hashcpy(e->sha1, nth_packed_object_sha1(p, cur_object));
+				e->pack_int_id = cur_pack;
+				e->pack_mtime = p->mtime;
+				e->offset = nth_packed_object_offset(p, cur_object);
+			}
+		}
+
+		qsort(entries_by_fanout, nr_fanout, sizeof(*entries_by_fanout),
+		      midx_oid_compare);
+
+		for (cur_object = 0; cur_object < nr_fanout; cur_object++) {
+			if (cur_object &&
+			    !hashcmp(entries_by_fanout[cur_object - 1].sha1,
+				     entries_by_fanout[cur_object].sha1))
+				continue;
+
+			ALLOC_GROW(deduplicated, *nr_objects + 1, alloc_objects);
+			memcpy(&deduplicated[*nr_objects],
+			       &entries_by_fanout[cur_object],
+			       sizeof(struct pack_midx_entry));
+			(*nr_objects)++;
+		}
+	}
+
+	free(old_to_new);
+	free(entries_by_fanout);
+	return deduplicated;
+}
+
+static size_t write_midx_pack_names(struct sha1file *f,
+				    struct midx_pack *packs, uint32_t nr)
+{
+	unsigned char padding[MIDX_CHUNK_ALIGNMENT];
+	size_t written = 0;
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		size_t len = strlen(packs[i].name) + 1;
+		sha1write(f, packs[i].name, len);
+		written += len;
+	}
+
+	i = MIDX_CHUNK_ALIGNMENT - (written % MIDX_CHUNK_ALIGNMENT);
+	if (i < MIDX_CHUNK_ALIGNMENT) {
+		memset(padding, 0, sizeof(padding));
+		sha1write(f, padding, i);
+		written += i;
+	}
+	return written;
+}
+
+static size_t pack_names_size(struct midx_pack *packs, uint32_t nr)
+{
+	size_t size = 0;
+	uint32_t i;
+
+	for (i = 0; i < nr; i++)
+		size += strlen(packs[i].name) + 1;
+	if (size % MIDX_CHUNK_ALIGNMENT)
+		size += MIDX_CHUNK_ALIGNMENT - (size % MIDX_CHUNK_ALIGNMENT);
+	return size;
+}
+
+static void write_midx_oid_fanout(struct sha1file *f,
+				  struct pack_midx_entry *objects,
+				  uint32_t nr_objects)
+{
+	unsigned char fanout[MIDX_CHUNK_FANOUT_SIZE];
+	uint32_t i, count = 0;
+
+	for (i = 0; i < 256; i++) {
+		while (count < nr_objects && objects[count].sha1[0] <= i)
+			count++;
+		put_be32(fanout + 4 * i, count);
+	}
+	sha1write(f, fanout, sizeof(fanout));
+}
+
+static void write_midx_oid_lookup(struct sha1file *f,
+				  struct pack_midx_entry *objects,
+				  uint32_t nr_objects)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr_objects; i++)
+		sha1write(f, objects[i].sha1, MIDX_HASH_LEN);
+}
+
+static void write_midx_object_offsets(struct sha1file *f,
+				      struct pack_midx_entry *objects,
+				      uint32_t nr_objects)
+{
+	uint32_t i, nr_large_offset = 0;
+
+	for (i = 0; i < nr_objects; i++) {
+		unsigned char data[MIDX_CHUNK_OFFSET_WIDTH];
+
+		put_be32(data, objects[i].pack_int_id);
+		if (objects[i].offset >> 31)
+			put_be32(data + 4,
+				 MIDX_LARGE_OFFSET_NEEDED | nr_large_offset++);
+		else
+			put_be32(data + 4, (uint32_t)objects[i].offset);
+		sha1write(f, data, sizeof(data));
+	}
+}
+
+static void write_midx_large_offsets(struct sha1file *f,
+				     struct pack_midx_entry *objects,
+				     uint32_t nr_objects)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr_objects; i++) {
+		unsigned char data[MIDX_CHUNK_LARGE_OFFSET_WIDTH];
+
+		if (!(objects[i].offset >> 31))
+			continue;
+		put_be32(data, objects[i].offset >> 32);
+		put_be32(data + 4, (uint32_t)objects[i].offset);
+		sha1write(f, data, sizeof(data));
+	}
+}
+
+struct midx_bitmap_data {
+	struct packing_data *to_pack;
+	struct commit **commits;
+	uint32_t commits_nr, commits_alloc;
+	const unsigned char *missing;
+};
+
+static void midx_bitmap_show_commit(struct commit *commit, void *data_)
+{
+	struct midx_bitmap_data *data = data_;
+
+	if (!packlist_find(data->to_pack, commit->object.sha1, NULL)) {
+		if (!data->missing)
+			data->missing = commit->object.sha1;
+		return;
+	}
+	ALLOC_GROW(data->commits, data->commits_nr + 1, data->commits_alloc);
+	data->commits[data->commits_nr++] = commit;
+}
+
+static void midx_bitmap_show_object(struct object *object,
+				    const struct name_path *path,
+				    const char *last, void *data_)
+{
+	struct midx_bitmap_data *data = data_;
+	struct object_entry *entry;
+	char *name;
+
+	entry = packlist_find(data->to_pack, object->sha1, NULL);
+	if (!entry) {
+		if (!data->missing)
+			data->missing = object->sha1;
+		return;
+	}
+	name = path_name(path, last);
+	entry->hash = pack_name_hash(name);
+	free(name);
+}
+
+/*
+ * Write a reachability bitmap for the multi-pack-index "midx_sha1"
+ * made of "entries". Bit positions follow the pseudo-pack order; the
+ * commits to bitmap are selected among those reachable from refs,
+ * which must all be covered by the multi-pack-index.
+ */
+static int write_midx_bitmap(const char *object_dir,
+			     const unsigned char *midx_sha1,
+			     struct pack_midx_entry *entries,
+			     uint32_t nr_entries)
+{
+	struct packing_data to_pack;
+	struct pack_idx_entry **index;
+	struct midx_bitmap_data data;
+	struct rev_info revs;
+	const char *argv[] = { NULL, "--all", NULL };
+	uint32_t *pack_int_ids, *order, *bit_of, i;
+	uint64_t *offsets;
+	char *bitmap_name;
+
+	pack_int_ids = xmalloc(sizeof(*pack_int_ids) * (nr_entries ? nr_entries : 1));
+	offsets = xmalloc(sizeof(*offsets) * (nr_entries ? nr_entries : 1));
+	for (i = 0; i < nr_entries; i++) {
+		pack_int_ids[i] = entries[i].pack_int_id;
+		offsets[i] = entries[i].offset;
+	}
+	order = sort_pack_order(pack_int_ids, offsets, nr_entries);
+	free(pack_int_ids);
+	free(offsets);
+
+	/* to_pack.objects[] is in bit order */
+	memset(&to_pack, 0, sizeof(to_pack));
+	bit_of = xmalloc(sizeof(*bit_of) * (nr_entries ? nr_entries : 1));
+	for (i = 0; i < nr_entries; i++) {
+		const unsigned char *sha1 = entries[order[i]].sha1;
+		uint32_t index_pos;
+
+		packlist_find(&to_pack, sha1, &index_pos);
+		packlist_alloc(&to_pack, sha1, index_pos);
+		bit_of[order[i]] = i;
+	}
+	free(order);
+
+	memset(&data, 0, sizeof(data));
+	data.to_pack = &to_pack;
+	init_revisions(&revs, NULL);
+	setup_revisions(2, argv, &revs, NULL);
+	revs.tag_objects = 1;
+	revs.tree_objects = 1;
+	revs.blob_objects = 1;
+	if (prepare_revision_walk(&revs))
+		die("revision walk setup failed");
+	traverse_commit_list(&revs, midx_bitmap_show_commit,
+			     midx_bitmap_show_object, &data);
+	reset_revision_walk();
+
+	if (data.missing) {
+		error("not writing a multi-pack bitmap: object %s is not in any "
+		      "pack covered by the multi-pack-index",
+		      sha1_to_hex(data.missing));
+		free(bit_of);
+		free(data.commits);
+		free(to_pack.objects);
+		free(to_pack.index);
+		return -1;
+	}
+
+	index = xmalloc(sizeof(*index) * (nr_entries ? nr_entries : 1));
+	for (i = 0; i < nr_entries; i++)
+		index[i] = &to_pack.objects[i].idx;
+	bitmap_writer_build_type_index(index, nr_entries);
+
+	bitmap_writer_set_checksum((unsigned char *)midx_sha1);
+	bitmap_writer_reuse_bitmaps(&to_pack);
+	bitmap_writer_select_commits(data.commits, data.commits_nr, -1);
+	bitmap_writer_build(&to_pack);
+
+	/* the entries are written in the SHA-1 order of the index */
+	for (i = 0; i < nr_entries; i++)
+		index[i] = &to_pack.objects[bit_of[i]].idx;
+	bitmap_name = get_midx_bitmap_filename(object_dir, midx_sha1);
+	bitmap_writer_finish(index, nr_entries, bitmap_name,
+			     BITMAP_OPT_HASH_CACHE);
+
+	free(bitmap_name);
+	free(index);
+	free(bit_of);
+	free(data.commits);
+	free(to_pack.objects);
+	free(to_pack.index);
+	return 0;
+}
+
+/*
+ * A bitmap is only valid for the multi-pack-index it was written
+ * for; remove the others.
+ */
+static void remove_stale_midx_bitmaps(const char *object_dir,
+				      const unsigned char *midx_sha1)
+{
+	struct strbuf path = STRBUF_INIT;
+	char *keep = midx_sha1 ? xstrfmt("multi-pack-index-%s.bitmap",
+					 sha1_to_hex(midx_sha1)) : NULL;
+	struct dirent *de;
+	size_t dirlen;
+	DIR *dir;
+
+	strbuf_addf(&path, "%s/pack", object_dir);
+	dir = opendir(path.buf);
+	if (!dir) {
+		strbuf_release(&path);
+		free(keep);
+		return;
+	}
+	strbuf_addch(&path, '/');
+	dirlen = path.len;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (!starts_with(de->d_name, "multi-pack-index-") ||
+		    !has_extension(de->d_name, ".bitmap"))
+			continue;
+		if (keep && !strcmp(de->d_name, keep))
+			continue;
+		strbuf_setlen(&path, dirlen);
+		strbuf_addstr(&path, de->d_name);
+		unlink_or_warn(path.buf);
+	}
+	closedir(dir);
+	strbuf_release(&path);
+	free(keep);
+}
+
+int write_midx_file(const char *object_dir, unsigned flags)
+{
+	struct multi_pack_index *m = load_multi_pack_index(object_dir);
+	unsigned char midx_sha1[20];
+	struct midx_pack *packs;
+	struct pack_midx_entry *entries;
+	uint32_t nr_packs, nr_entries, nr_large_offset = 0, i;
+	uint32_t chunk_ids[MIDX_MAX_CHUNKS + 1];
+	uint64_t chunk_offsets[MIDX_MAX_CHUNKS + 1];
+	unsigned char header[MIDX_HEADER_SIZE];
+	int num_chunks, fd;
+	struct strbuf tmp_file = STRBUF_INIT;
+	char *midx_name;
+	struct sha1file *f;
+	int ret = 0;
+
+	if (m && (flags & MIDX_KEEP_BITMAP)) {
+		char *bitmap_name = get_midx_bitmap_filename(object_dir,
+							     get_midx_checksum(m));
+		int has_bitmap = !access(bitmap_name, F_OK);
+
+		free(bitmap_name);
+		if (has_bitmap) {
+			close_midx(m);
+			return 0;
+		}
+	}
+
+	collect_packs(object_dir, m, &packs, &nr_packs);
+	entries = get_sorted_entries(m, packs, nr_packs, &nr_entries);
+
+	for (i = 0; i < nr_entries; i++)
+		if (entries[i].offset >> 31)
+			nr_large_offset++;
+
+	chunk_ids[0] = MIDX_CHUNKID_PACKNAMES;
+	chunk_offsets[0] = MIDX_HEADER_SIZE;
+	chunk_ids[1] = MIDX_CHUNKID_OIDFANOUT;
+	chunk_offsets[1] = chunk_offsets[0] + pack_names_size(packs, nr_packs);
+	chunk_ids[2] = MIDX_CHUNKID_OIDLOOKUP;
+	chunk_offsets[2] = chunk_offsets[1] + MIDX_CHUNK_FANOUT_SIZE;
+	chunk_ids[3] = MIDX_CHUNKID_OBJECTOFFSETS;
+	chunk_offsets[3] = chunk_offsets[2] + (uint64_t)nr_entries * MIDX_HASH_LEN;
+	chunk_offsets[4] = chunk_offsets[3] +
+			   (uint64_t)nr_entries * MIDX_CHUNK_OFFSET_WIDTH;
+	num_chunks = 4;
+	if (nr_large_offset) {
+		chunk_ids[num_chunks] = MIDX_CHUNKID_LARGEOFFSETS;
+		chunk_offsets[num_chunks + 1] = chunk_offsets[num_chunks] +
+			(uint64_t)nr_large_offset * MIDX_CHUNK_LARGE_OFFSET_WIDTH;
+		num_chunks++;
+	}
+	chunk_ids[num_chunks] = 0;
+
+	/* the chunk lookup table sits between the header and the chunks */
+	for (i = 0; i <= num_chunks; i++)
+		chunk_offsets[i] += (num_chunks + 1) * MIDX_CHUNKLOOKUP_WIDTH;
+
+	strbuf_addf(&tmp_file, "%s/pack/tmp_midx_XXXXXX", object_dir);
+	safe_create_leading_directories(tmp_file.buf);
+	fd = git_mkstemp_mode(tmp_file.buf, 0444);
+	if (fd < 0)
+		die_errno("unable to create '%s'", tmp_file.buf);
+	f = sha1fd(fd, tmp_file.buf);
+
+	put_be32(header, MIDX_SIGNATURE);
+	header[4] = MIDX_VERSION;
+	header[5] = MIDX_HASH_VERSION;
+	header[6] = num_chunks;
+	header[7] = 0; /* no base multi-pack-index files */
+	put_be32(header + 8, nr_packs);
+	sha1write(f, header, sizeof(header));
+
+	for (i = 0; i <= num_chunks; i++) {
+		unsigned char chunk_write[MIDX_CHUNKLOOKUP_WIDTH];
+
+		put_be32(chunk_write, chunk_ids[i]);
+		put_be32(chunk_write + 4, chunk_offsets[i] >> 32);
+		put_be32(chunk_write + 8, chunk_offsets[i]);
+		sha1write(f, chunk_write, sizeof(chunk_write));
+	}
+
+	write_midx_pack_names(f, packs, nr_packs);
+	write_midx_oid_fanout(f, entries, nr_entries);
+	write_midx_oid_lookup(f, entries, nr_entries);
+	write_midx_object_offsets(f, entries, nr_entries);
+	if (nr_large_offset)
+		write_midx_large_offsets(f, entries, nr_entries);
+
+	sha1close(f, midx_sha1, CSUM_FSYNC);
+
+	if (adjust_shared_perm(tmp_file.buf))
+		die_errno("unable to make temporary multi-pack-index readable");
+
+	/* the old index may still be mapped; we are done reading it */
+	close_midx(m);
+
+	midx_name = get_midx_filename(object_dir);
+	if (rename(tmp_file.buf, midx_name))
+		die_errno("unable to rename temporary multi-pack-index to '%s'",
+			  midx_name);
+
+	if ((flags & MIDX_WRITE_BITMAP) &&
+	    write_midx_bitmap(object_dir, midx_sha1, entries, nr_entries))
+		ret = -1;
+	remove_stale_midx_bitmaps(object_dir, ret ? NULL : midx_sha1);
+
+	for (i = 0; i < nr_packs; i++) {
+		free(packs[i].name);
+		close_pack_index(packs[i].p);
+		free(packs[i].p);
+	}
+	free(packs);
+	free(entries);
+	free(midx_name);
+	strbuf_release(&tmp_file);
+	return ret;
+}
@@ -0,0 +1,98 @@
+#ifndef MIDX_H
+#define MIDX_H
+
+/*
+ * A multi-pack-index merges the sorted object tables of all packs in
+ * an object directory into a single fanout + lookup table, so that
+ * finding (or failing to find) an object costs one binary search no
+ * matter how many packs there are.
+ */
+struct multi_pack_index {
+	const unsigned char *data;
+	size_t data_len;
+
+	uint32_t num_packs;
+	uint32_t num_objects;
+	unsigned char num_chunks;
+
+	const unsigned char *chunk_pack_names;
+	const unsigned char *chunk_oid_fanout;
+	const unsigned char *chunk_oid_lookup;
+	const unsigned char *chunk_object_offsets;
+	const unsigned char *chunk_large_offsets;
+
+	/* ".idx" names, sorted; these define the pack-int-ids */
+	const char **pack_names;
+	/* the installed packs, filled in as they are found */
+	struct packed_git **packs;
+
+	char object_dir[FLEX_ARRAY];
+};
+
+extern char *get_midx_filename(const char *object_dir);
+extern struct multi_pack_index *load_multi_pack_index(const char *object_dir);
+extern void close_midx(struct multi_pack_index *m);
+
+/*
+ * Return the pack-int-id of the pack with the given ".idx" basename,
+ * or -1 if it is not covered by the multi-pack-index.
+ */
+extern int midx_pack_pos(struct multi_pack_index *m, const char *idx_name);
+
+/*
+ * Look up "sha1" in the multi-pack-index. Returns 1 and fills "e" if
+ * found in a usable pack, 0 if the object is not in the index and -1
+ * if the index names a pack that cannot be used (e.g. it was deleted
+ * or the object is known to be corrupt there).
+ */
+extern int fill_midx_entry(const unsigned char *sha1, struct pack_entry *e,
+			   struct multi_pack_index *m);
+
+/*
+ * Find "sha1" among the objects of the multi-pack-index; on success
+ * "*result" is its position in SHA-1 order.
+ */
+extern int bsearch_midx(struct multi_pack_index *m, const unsigned char *sha1,
+			uint32_t *result);
+extern const unsigned char *nth_midxed_object_sha1(struct multi_pack_index *m,
+						   uint32_t pos);
+extern off_t nth_midxed_offset(struct multi_pack_index *m, uint32_t pos);
+extern uint32_t nth_midxed_pack_int_id(struct multi_pack_index *m, uint32_t pos);
+
+/* The trailing checksum, which names the file's reachability bitmap */
+extern const unsigned char *get_midx_checksum(struct multi_pack_index *m);
+extern char *get_midx_bitmap_filename(const char *object_dir,
+				      const unsigned char *midx_sha1);
+
+/*
+ * Return the positions (in SHA-1 order) of the objects sorted in the
+ * "pseudo-pack" order used by multi-pack bitmaps: by pack-int-id, then
+ * by offset within the pack. The caller frees the array.
+ */
+extern uint32_t *midx_pack_order(struct multi_pack_index *m);
+
+/*
+ * The multi-pack-index of the local object directory as used for
+ * object lookups (see core.multiPackIndex), or NULL.
+ */
+extern struct multi_pack_index *get_local_multi_pack_index(void);
+
+/*
+ * Write "object_dir/pack/multi-pack-index" covering every pack in
+ * that directory. Entries of packs already covered by an existing
+ * multi-pack-index are taken from it instead of re-reading their
+ * ".idx" files.
+ *
+ * With MIDX_WRITE_BITMAP, also write a reachability bitmap covering
+ * the objects of all the packs; this fails (leaving the new index
+ * without bitmap) unless they contain every object reachable from the
+ * refs. With
+ * MIDX_KEEP_BITMAP, leave an existing multi-pack-index alone if it has
+ * a bitmap: rewriting it would invalidate the bitmap, while the new
+ * packs can still be used without being indexed.
+ */
+#define MIDX_WRITE_BITMAP 1
+#define MIDX_KEEP_BITMAP 2
+extern int write_midx_file(const char *object_dir, unsigned flags);
+
+#endif
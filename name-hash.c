@@ -7,6 +7,7 @@
  */
 #define NO_THE_INDEX_COMPATIBILITY_MACROS
 #include "cache.h"
+#include "thread-utils.h"
 
 struct dir_entry {
 	struct hashmap_entry ent;
@@ -121,17 +122,273 @@ static int cache_entry_cmp(const struct cache_entry *ce1,
 	return remove ? !(ce1 == ce2) : 0;
 }
 
-static void lazy_init_name_hash(struct index_state *istate)
+/*
+ * Building the hashes in one go.  The index is sorted, so an entry
+ * mostly lives in the directories of the entry before it: those are
+ * taken over without looking them up again, and the hash of a new
+ * directory or of a name continues the hash of the directory it is
+ * in instead of hashing the whole path again.
+ *
+ * Large indexes are split among threads at changes of the leading
+ * path component, so that most directories are only ever seen by one
+ * thread.  The threads add to hashmaps that were sized in advance and
+ * do not count their items, so that adding only touches a bucket;
+ * the buckets are guarded by a lock per stripe of them, which also
+ * guards the counts of the directories in those buckets.
+ */
+#define LAZY_THREAD_COST (2000)
+#define LAZY_MAX_THREADS (20)
+#define LAZY_NR_LOCKS (64)
+
+#ifndef NO_PTHREADS
+static int lazy_use_locks;
+static pthread_mutex_t lazy_name_locks[LAZY_NR_LOCKS];
+static pthread_mutex_t lazy_dir_locks[LAZY_NR_LOCKS];
+#endif
+
+static void lock_bucket(struct hashmap *map, unsigned int hash, int dirs)
 {
-	int nr;
+#ifndef NO_PTHREADS
+	if (lazy_use_locks) {
+		unsigned int n = hashmap_bucket(map, hash) % LAZY_NR_LOCKS;
+		pthread_mutex_lock(dirs ? &lazy_dir_locks[n] : &lazy_name_locks[n]);
+	}
+#endif
+}
+
+static void unlock_bucket(struct hashmap *map, unsigned int hash, int dirs)
+{
+#ifndef NO_PTHREADS
+	if (lazy_use_locks) {
+		unsigned int n = hashmap_bucket(map, hash) % LAZY_NR_LOCKS;
+		pthread_mutex_unlock(dirs ? &lazy_dir_locks[n] : &lazy_name_locks[n]);
+	}
+#endif
+}
+
+/*
+ * Find the directory that is the first "namelen" bytes of the name of
+ * "ce", which hash to "hash", or add it under "parent".
+ */
+static struct dir_entry *lazy_dir_entry(struct index_state *istate,
+		struct cache_entry *ce, unsigned int namelen,
+		unsigned int hash, struct dir_entry *parent)
+{
+	struct dir_entry key, *dir;
 
+	lock_bucket(&istate->dir_hash, hash, 1);
+	hashmap_entry_init(&key, hash);
+	key.namelen = namelen;
+	dir = hashmap_get(&istate->dir_hash, &key, ce->name);
+	if (!dir) {
+		dir = xcalloc(1, sizeof(struct dir_entry));
+		hashmap_entry_init(dir, hash);
+		dir->namelen = namelen;
+		dir->ce = ce;
+		dir->parent = parent;
+		hashmap_add(&istate->dir_hash, dir);
+	}
+	unlock_bucket(&istate->dir_hash, hash, 1);
+	return dir;
+}
+
+/* Like add_dir_entry(), counting a new file in "dir". */
+static void lazy_count_dir_entry(struct index_state *istate,
+				 struct dir_entry *dir)
+{
+	while (dir) {
+		unsigned int hash = dir->ent.hash;
+		int was_empty;
+
+		lock_bucket(&istate->dir_hash, hash, 1);
+		was_empty = !dir->nr++;
+		unlock_bucket(&istate->dir_hash, hash, 1);
+		if (!was_empty)
+			break;
+		dir = dir->parent;
+	}
+}
+
+static void lazy_hash_entries(struct index_state *istate, int start, int end)
+{
+	/* the directories of the entry before, outermost first */
+	struct dir_entry **dirs = NULL;
+	int nr_dirs = 0, alloc_dirs = 0;
+	const struct cache_entry *prev = NULL;
+	int k;
+
+	for (k = start; k < end; k++) {
+		struct cache_entry *ce = istate->cache[k];
+		const char *name = ce->name;
+		unsigned int namelen = ce_namelen(ce), len = 0, hash;
+		struct dir_entry *dir = NULL;
+		int depth = 0;
+
+		if (ce->ce_flags & CE_HASHED)
+			continue;
+		ce->ce_flags |= CE_HASHED;
+
+		if (!ignore_case) {
+			hash = memihash(name, namelen);
+			goto add_name;
+		}
+
+		/* keep the directories it shares with the entry before */
+		while (depth < nr_dirs) {
+			unsigned int dirlen = dirs[depth]->namelen;
+
+			if (dirlen >= namelen || name[dirlen] != '/' ||
+			    memcmp(name + len, prev->name + len, dirlen - len))
+				break;
+			len = dirlen + 1;
+			dir = dirs[depth++];
+		}
+
+		/* and add those it does not */
+		for (; len < namelen; len++) {
+			unsigned int dirhash;
+
+			if (name[len] != '/')
+				continue;
+			if (dir)
+				dirhash = memihash_cont(dir->ent.hash,
+						name + dir->namelen,
+						len - dir->namelen);
+			else
+				dirhash = memihash(name, len);
+			dir = lazy_dir_entry(istate, ce, len, dirhash, dir);
+			ALLOC_GROW(dirs, depth + 1, alloc_dirs);
+			dirs[depth++] = dir;
+		}
+		nr_dirs = depth;
+		prev = ce;
+
+		if (dir)
+			hash = memihash_cont(dir->ent.hash, name + dir->namelen,
+					     namelen - dir->namelen);
+		else
+			hash = memihash(name, namelen);
+		lazy_count_dir_entry(istate, dir);
+
+	add_name:
+		hashmap_entry_init(ce, hash);
+		lock_bucket(&istate->name_hash, hash, 0);
+		hashmap_add(&istate->name_hash, ce);
+		unlock_bucket(&istate->name_hash, hash, 0);
+	}
+	free(dirs);
+}
+
+#ifndef NO_PTHREADS
+struct lazy_thread_data {
+	pthread_t pthread;
+	struct index_state *istate;
+	int start, end;
+};
+
+static void *lazy_hash_thread(void *_data)
+{
+	struct lazy_thread_data *p = _data;
+
+	lazy_hash_entries(p->istate, p->start, p->end);
+	return NULL;
+}
+
+/* Whether "a" and "b" have the same leading path component. */
+static int same_leading_dir(const struct cache_entry *a,
+			    const struct cache_entry *b)
+{
+	const char *slash = strchr(a->name, '/');
+	int len;
+
+	if (!slash)
+		return 0;
+	len = slash - a->name + 1;
+	return ce_namelen(b) >= len && !memcmp(a->name, b->name, len);
+}
+
+static int lazy_nr_threads(struct index_state *istate)
+{
+	int nr_threads;
+
+	if (getenv("GIT_FORCE_THREADS"))
+		nr_threads = istate->cache_nr;
+	else
+		nr_threads = istate->cache_nr / LAZY_THREAD_COST;
+	if (nr_threads > LAZY_MAX_THREADS)
+		nr_threads = LAZY_MAX_THREADS;
+	if (!getenv("GIT_FORCE_THREADS") && nr_threads > online_cpus())
+		nr_threads = online_cpus();
+	return nr_threads;
+}
+
+static int lazy_hash_entries_threaded(struct index_state *istate)
+{
+	struct lazy_thread_data data[LAZY_MAX_THREADS];
+	int nr_threads = lazy_nr_threads(istate);
+	int i, err, start = 0, nr = 0;
+
+	if (nr_threads < 2)
+		return -1;
+
+	hashmap_disable_item_counting(&istate->name_hash);
+	hashmap_disable_item_counting(&istate->dir_hash);
+	for (i = 0; i < LAZY_NR_LOCKS; i++) {
+		pthread_mutex_init(&lazy_name_locks[i], NULL);
+		pthread_mutex_init(&lazy_dir_locks[i], NULL);
+	}
+	lazy_use_locks = 1;
+
+	for (i = 0; i < nr_threads && start < istate->cache_nr; i++) {
+		struct lazy_thread_data *p = &data[nr];
+		int end = istate->cache_nr;
+
+		if (i < nr_threads - 1) {
+			end = (int)((uint64_t)istate->cache_nr * (i + 1) / nr_threads);
+			if (end < start + 1)
+				end = start + 1;
+			/* do not split a leading directory */
+			while (end < istate->cache_nr &&
+			       same_leading_dir(istate->cache[end - 1],
+						istate->cache[end]))
+				end++;
+		}
+		p->istate = istate;
+		p->start = start;
+		p->end = end;
+		err = pthread_create(&p->pthread, NULL, lazy_hash_thread, p);
+		if (err)
+			die(_("unable to create name hash thread: %s"),
+			    strerror(err));
+		nr++;
+		start = end;
+	}
+	for (i = 0; i < nr; i++)
+		pthread_join(data[i].pthread, NULL);
+
+	lazy_use_locks = 0;
+	for (i = 0; i < LAZY_NR_LOCKS; i++) {
+		pthread_mutex_destroy(&lazy_name_locks[i]);
+		pthread_mutex_destroy(&lazy_dir_locks[i]);
+	}
+	hashmap_enable_item_counting(&istate->name_hash);
+	hashmap_enable_item_counting(&istate->dir_hash);
+	return 0;
+}
+#endif
+
+static void lazy_init_name_hash(struct index_state *istate)
+{
 	if (istate->name_hash_initialized)
 		return;
 	hashmap_init(&istate->name_hash, (hashmap_cmp_fn) cache_entry_cmp,
 			istate->cache_nr);
-	hashmap_init(&istate->dir_hash, (hashmap_cmp_fn) dir_entry_cmp, 0);
-	for (nr = 0; nr < istate->cache_nr; nr++)
-		hash_index_entry(istate, istate->cache[nr]);
+	hashmap_init(&istate->dir_hash, (hashmap_cmp_fn) dir_entry_cmp,
+			ignore_case ? istate->cache_nr : 0);
+#ifndef NO_PTHREADS
+	if (lazy_hash_entries_threaded(istate))
+#endif
+		lazy_hash_entries(istate, 0, istate->cache_nr);
 	istate->name_hash_initialized = 1;
 }
 
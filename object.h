@@ -38,6 +38,8 @@ struct object_array {
  * http-push.c:                            16-----19
  * commit.c:                               16-----19
  * sha1_name.c:                                     20
+ * commit-graph.c:                                        23
+ * list-objects-filter.c:                                      24
  */
 #define FLAG_BITS  27
 
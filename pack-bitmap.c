@@ -9,6 +9,7 @@
 #include "pack-bitmap.h"
 #include "pack-revindex.h"
 #include "pack-objects.h"
+#include "midx.h"
 
 /*
  * An entry on the bitmap index, representing the bitmap for a given
@@ -28,20 +29,27 @@ struct stored_bitmap {
  *
  * If there is more than one bitmap index available (e.g. because of alternates),
  * the active bitmap index is the largest one.
+ *
+ * A bitmap written for the multi-pack-index covers all the packs it
+ * indexes, and is preferred over the bitmap of a single pack.
  */
 static struct bitmap_index {
 	/* Packfile to which this bitmap index belongs to */
 	struct packed_git *pack;
 
-	/* reverse index for the packfile */
-	struct pack_revindex *reverse_index;
-
 	/*
-	 * Mark the first `reuse_objects` in the packfile as reused:
-	 * they will be sent as-is without using them for repacking
-	 * calculations
+	 * Or the multi-pack-index it belongs to. Bit positions then
+	 * follow the pseudo-pack order (see midx_pack_order()).
 	 */
-	uint32_t reuse_objects;
+	struct multi_pack_index *midx;
+	uint32_t *midx_order; /* bit position -> position in the midx */
+	uint32_t *midx_bit; /* position in the midx -> bit position */
+
+	/* Number of objects in the pack or multi-pack-index */
+	uint32_t num_objects;
+
+	/* reverse index for the packfile */
+	struct pack_revindex *reverse_index;
 
 	/* mmapped buffer of the whole bitmap index */
 	unsigned char *map;
@@ -158,10 +166,14 @@ static int load_bitmap_header(struct bitmap_index *index)
 
 		if (flags & BITMAP_OPT_HASH_CACHE) {
 			unsigned char *end = index->map + index->map_size - 20;
-			index->hashes = ((uint32_t *)end) - index->pack->num_objects;
+			index->hashes = ((uint32_t *)end) - index->num_objects;
 		}
 	}
 
+	if (index->midx &&
+	    hashcmp(header->checksum, get_midx_checksum(index->midx)))
+		return error("multi-pack bitmap does not match the multi-pack-index");
+
 	index->entry_count = ntohl(header->entry_count);
 	index->map_pos += sizeof(*header);
 	return 0;
@@ -218,7 +230,12 @@ static int load_bitmap_entries_v1(struct bitmap_index *index)
 		index->map_pos += sizeof(struct bitmap_disk_entry);
 
 		commit_idx_pos = ntohl(entry->object_pos);
-		sha1 = nth_packed_object_sha1(index->pack, commit_idx_pos);
+		if (commit_idx_pos >= index->num_objects)
+			return error("Corrupted bitmap pack index");
+		if (index->midx)
+			sha1 = nth_midxed_object_sha1(index->midx, commit_idx_pos);
+		else
+			sha1 = nth_packed_object_sha1(index->pack, commit_idx_pos);
 
 		xor_offset = (int)entry->xor_offset;
 		flags = (int)entry->flags;
@@ -272,6 +289,43 @@ static int open_pack_bitmap_1(struct packed_git *packfile)
 	}
 
 	bitmap_git.pack = packfile;
+	bitmap_git.num_objects = packfile->num_objects;
+	bitmap_git.map_size = xsize_t(st.st_size);
+	bitmap_git.map = xmmap(NULL, bitmap_git.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	bitmap_git.map_pos = 0;
+	close(fd);
+
+	if (load_bitmap_header(&bitmap_git) < 0) {
+		munmap(bitmap_git.map, bitmap_git.map_size);
+		bitmap_git.map = NULL;
+		bitmap_git.map_size = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int open_midx_bitmap_1(struct multi_pack_index *midx)
+{
+	int fd;
+	struct stat st;
+	char *bitmap_name;
+
+	bitmap_name = get_midx_bitmap_filename(midx->object_dir,
+					       get_midx_checksum(midx));
+	fd = git_open_noatime(bitmap_name);
+	free(bitmap_name);
+
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	bitmap_git.midx = midx;
+	bitmap_git.num_objects = midx->num_objects;
 	bitmap_git.map_size = xsize_t(st.st_size);
 	bitmap_git.map = xmmap(NULL, bitmap_git.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
 	bitmap_git.map_pos = 0;
@@ -281,6 +335,8 @@ static int open_pack_bitmap_1(struct packed_git *packfile)
 		munmap(bitmap_git.map, bitmap_git.map_size);
 		bitmap_git.map = NULL;
 		bitmap_git.map_size = 0;
+		bitmap_git.midx = NULL;
+		bitmap_git.hashes = NULL;
 		return -1;
 	}
 
@@ -293,7 +349,17 @@ static int load_pack_bitmap(void)
 
 	bitmap_git.bitmaps = kh_init_sha1();
 	bitmap_git.ext_index.positions = kh_init_sha1_pos();
-	bitmap_git.reverse_index = revindex_for_pack(bitmap_git.pack);
+	if (bitmap_git.midx) {
+		uint32_t i;
+
+		bitmap_git.midx_order = midx_pack_order(bitmap_git.midx);
+		bitmap_git.midx_bit = xmalloc(sizeof(uint32_t) *
+					      (bitmap_git.num_objects ?
+					       bitmap_git.num_objects : 1));
+		for (i = 0; i < bitmap_git.num_objects; i++)
+			bitmap_git.midx_bit[bitmap_git.midx_order[i]] = i;
+	} else
+		bitmap_git.reverse_index = revindex_for_pack(bitmap_git.pack);
 
 	if (!(bitmap_git.commits = read_bitmap_1(&bitmap_git)) ||
 		!(bitmap_git.trees = read_bitmap_1(&bitmap_git)) ||
@@ -330,12 +396,17 @@ char *pack_bitmap_filename(struct packed_git *p)
 
 static int open_pack_bitmap(void)
 {
+	struct multi_pack_index *midx;
 	struct packed_git *p;
 	int ret = -1;
 
 	assert(!bitmap_git.map && !bitmap_git.loaded);
 
 	prepare_packed_git();
+	midx = get_local_multi_pack_index();
+	if (midx && !open_midx_bitmap_1(midx))
+		return 0;
+
 	for (p = packed_git; p; p = p->next) {
 		if (open_pack_bitmap_1(p) == 0)
 			ret = 0;
@@ -367,7 +438,7 @@ static inline int bitmap_position_extended(const unsigned char *sha1)
 
 	if (pos < kh_end(positions)) {
 		int bitmap_pos = kh_value(positions, pos);
-		return bitmap_pos + bitmap_git.pack->num_objects;
+		return bitmap_pos + bitmap_git.num_objects;
 	}
 
 	return -1;
@@ -375,7 +446,17 @@ static inline int bitmap_position_extended(const unsigned char *sha1)
 
 static inline int bitmap_position_packfile(const unsigned char *sha1)
 {
-	off_t offset = find_pack_entry_one(sha1, bitmap_git.pack);
+	off_t offset;
+
+	if (bitmap_git.midx) {
+		uint32_t pos;
+
+		if (!bsearch_midx(bitmap_git.midx, sha1, &pos))
+			return -1;
+		return bitmap_git.midx_bit[pos];
+	}
+
+	offset = find_pack_entry_one(sha1, bitmap_git.pack);
 	if (!offset)
 		return -1;
 
@@ -415,7 +496,37 @@ static int ext_index_add_object(struct object *object, const char *name)
 		bitmap_pos = kh_value(eindex->positions, hash_pos);
 	}
 
-	return bitmap_pos + bitmap_git.pack->num_objects;
+	return bitmap_pos + bitmap_git.num_objects;
+}
+
+/*
+ * Return the name of the object at bit position "pos", and where it can
+ * be found: the pack ("*pack" is NULL if it is not available) and the
+ * offset in it, and its position in the SHA-1 sorted index (which is
+ * where its name-hash is stored).
+ */
+static const unsigned char *nth_bitmap_object(uint32_t pos,
+					      struct packed_git **pack,
+					      off_t *offset,
+					      uint32_t *index_pos)
+{
+	if (bitmap_git.midx) {
+		struct multi_pack_index *m = bitmap_git.midx;
+		uint32_t midx_pos = bitmap_git.midx_order[pos];
+		uint32_t pack_int_id = nth_midxed_pack_int_id(m, midx_pos);
+
+		*pack = pack_int_id < m->num_packs ? m->packs[pack_int_id] : NULL;
+		*offset = *pack ? nth_midxed_offset(m, midx_pos) : 0;
+		*index_pos = midx_pos;
+		return nth_midxed_object_sha1(m, midx_pos);
+	} else {
+		struct pack_revindex *pridx = bitmap_git.reverse_index;
+
+		*pack = bitmap_git.pack;
+		*offset = revindex_offset(pridx, pos);
+		*index_pos = revindex_nr(pridx, pos);
+		return nth_packed_object_sha1(bitmap_git.pack, *index_pos);
+	}
 }
 
 static void show_object(struct object *object, const struct name_path *path,
@@ -590,7 +701,7 @@ static void show_extended_objects(struct bitmap *objects,
 	for (i = 0; i < eindex->count; ++i) {
 		struct object *obj;
 
-		if (!bitmap_get(objects, bitmap_git.pack->num_objects + i))
+		if (!bitmap_get(objects, bitmap_git.num_objects + i))
 			continue;
 
 		obj = eindex->objects[i];
@@ -610,9 +721,6 @@ static void show_objects_for_type(
 	struct ewah_iterator it;
 	eword_t filter;
 
-	if (bitmap_git.reuse_objects == bitmap_git.pack->num_objects)
-		return;
-
 	ewah_iterator_init(&it, type_filter);
 
 	while (i < objects->word_alloc && ewah_iterator_next(&filter, &it)) {
@@ -620,7 +728,9 @@ static void show_objects_for_type(
 
 		for (offset = 0; offset < BITS_IN_WORD; ++offset) {
 			const unsigned char *sha1;
-			struct revindex_entry *entry;
+			struct packed_git *pack;
+			off_t pack_offset;
+			uint32_t index_pos;
 			uint32_t hash = 0;
 
 			if ((word >> offset) == 0)
@@ -628,16 +738,13 @@ static void show_objects_for_type(
 
 			offset += ewah_bit_ctz64(word >> offset);
 
-			if (pos + offset < bitmap_git.reuse_objects)
-				continue;
-
-			entry = &bitmap_git.reverse_index->revindex[pos + offset];
-			sha1 = nth_packed_object_sha1(bitmap_git.pack, entry->nr);
+			sha1 = nth_bitmap_object(pos + offset, &pack,
+						 &pack_offset, &index_pos);
 
 			if (bitmap_git.hashes)
-				hash = ntohl(bitmap_git.hashes[entry->nr]);
+				hash = ntohl(bitmap_git.hashes[index_pos]);
 
-			show_reach(sha1, object_type, 0, hash, bitmap_git.pack, entry->offset);
+			show_reach(sha1, object_type, 0, hash, pack, pack_offset);
 		}
 
 		pos += BITS_IN_WORD;
@@ -651,7 +758,12 @@ static int in_bitmapped_pack(struct object_list *roots)
 		struct object *object = roots->item;
 		roots = roots->next;
 
-		if (find_pack_entry_one(object->sha1, bitmap_git.pack) > 0)
+		if (bitmap_git.midx) {
+			uint32_t pos;
+
+			if (bsearch_midx(bitmap_git.midx, object->sha1, &pos))
+				return 1;
+		} else if (find_pack_entry_one(object->sha1, bitmap_git.pack) > 0)
 			return 1;
 	}
 
@@ -750,64 +862,103 @@ int prepare_bitmap_walk(struct rev_info *revs)
 	return 0;
 }
 
+/*
+ * Mark the object at "pos" in the pack for reuse if it can be sent
+ * as it is.  A delta can only be sent along with its base, which must
+ * come before it in the pack, so that it can be found in "reuse"
+ * already.
+ */
+static void try_partial_reuse(size_t pos, struct bitmap *reuse,
+			      struct pack_window **w_curs)
+{
+	struct packed_git *pack = bitmap_git.pack;
+	enum object_type type;
+	unsigned long size;
+	off_t offset, obj_offset;
+
+	if (pos >= pack->num_objects)
+		return; /* in the extended index, not in the pack */
+
+	obj_offset = offset = revindex_offset(bitmap_git.reverse_index, pos);
+	type = unpack_object_header(pack, w_curs, &offset, &size);
+	if (type < 0)
+		return; /* broken pack; let the slow path complain */
+
+	if (type == OBJ_OFS_DELTA || type == OBJ_REF_DELTA) {
+		off_t base_offset;
+		int base_pos;
+
+		base_offset = get_delta_base(pack, w_curs, &offset, type,
+					     obj_offset);
+		if (!base_offset)
+			return;
+		base_pos = find_revindex_position(bitmap_git.reverse_index,
+						  base_offset);
+		if (base_pos < 0 || base_pos >= pos)
+			return;
+		if (!bitmap_get(reuse, base_pos))
+			return;
+	}
+
+	bitmap_set(reuse, pos);
+}
+
 int reuse_partial_packfile_from_bitmap(struct packed_git **packfile,
 				       uint32_t *entries,
-				       off_t *up_to)
+				       struct bitmap **reuse_out)
 {
-	/*
-	 * Reuse the packfile content if we need more than
-	 * 90% of its objects
-	 */
-	static const double REUSE_PERCENT = 0.9;
-
 	struct bitmap *result = bitmap_git.result;
-	uint32_t reuse_threshold;
-	uint32_t i, reuse_objects = 0;
+	struct bitmap *reuse;
+	struct pack_window *w_curs = NULL;
+	size_t i = 0;
+	uint32_t offset;
 
 	assert(result);
 
-	for (i = 0; i < result->word_alloc; ++i) {
-		if (result->words[i] != (eword_t)~0) {
-			reuse_objects += ewah_bit_ctz64(~result->words[i]);
-			break;
-		}
-
-		reuse_objects += BITS_IN_WORD;
-	}
+	/*
+	 * The pseudo-pack order of a multi-pack bitmap does not match
+	 * the layout of any single packfile.
+	 */
+	if (bitmap_git.midx)
+		return -1;
 
-#ifdef GIT_BITMAP_DEBUG
-	{
-		const unsigned char *sha1;
-		struct revindex_entry *entry;
+	/*
+	 * Whole words of wanted objects at the start of the pack are
+	 * taken without looking at them: the base of a delta in a pack
+	 * we bitmapped comes before it, so it is wanted as well.
+	 */
+	while (i < result->word_alloc && result->words[i] == (eword_t)~0)
+		i++;
+	if (i > bitmap_git.pack->num_objects / BITS_IN_WORD)
+		i = bitmap_git.pack->num_objects / BITS_IN_WORD;
 
-		entry = &bitmap_git.reverse_index->revindex[reuse_objects];
-		sha1 = nth_packed_object_sha1(bitmap_git.pack, entry->nr);
+	reuse = bitmap_word_alloc(i ? i : 1);
+	memset(reuse->words, 0xFF, i * sizeof(eword_t));
 
-		fprintf(stderr, "Failed to reuse at %d (%016llx)\n",
-			reuse_objects, result->words[i]);
-		fprintf(stderr, " %s\n", sha1_to_hex(sha1));
-	}
-#endif
+	for (; i < result->word_alloc; ++i) {
+		eword_t word = result->words[i];
+		size_t pos = i * BITS_IN_WORD;
 
-	if (!reuse_objects)
-		return -1;
+		for (offset = 0; offset < BITS_IN_WORD; ++offset) {
+			if ((word >> offset) == 0)
+				break;
 
-	if (reuse_objects >= bitmap_git.pack->num_objects) {
-		bitmap_git.reuse_objects = *entries = bitmap_git.pack->num_objects;
-		*up_to = -1; /* reuse the full pack */
-		*packfile = bitmap_git.pack;
-		return 0;
+			offset += ewah_bit_ctz64(word >> offset);
+			try_partial_reuse(pos + offset, reuse, &w_curs);
+		}
 	}
+	unuse_pack(&w_curs);
 
-	reuse_threshold = bitmap_popcount(bitmap_git.result) * REUSE_PERCENT;
-
-	if (reuse_objects < reuse_threshold)
+	*entries = bitmap_popcount(reuse);
+	if (!*entries) {
+		bitmap_free(reuse);
 		return -1;
+	}
 
-	bitmap_git.reuse_objects = *entries = reuse_objects;
-	*up_to = bitmap_git.reverse_index->revindex[reuse_objects].offset;
+	/* the reused objects need not be shown by the traversal */
+	bitmap_and_not(result, reuse);
 	*packfile = bitmap_git.pack;
-
+	*reuse_out = reuse;
 	return 0;
 }
 
@@ -867,7 +1018,7 @@ static uint32_t count_object_type(struct bitmap *objects,
 
 	for (i = 0; i < eindex->count; ++i) {
 		if (eindex->objects[i]->type == type &&
-			bitmap_get(objects, bitmap_git.pack->num_objects + i))
+			bitmap_get(objects, bitmap_git.num_objects + i))
 			count++;
 	}
 
@@ -1029,16 +1180,17 @@ int rebuild_existing_bitmaps(struct packing_data *mapping,
 	if (prepare_bitmap_git() < 0)
 		return -1;
 
-	num_objects = bitmap_git.pack->num_objects;
+	num_objects = bitmap_git.num_objects;
 	reposition = xcalloc(num_objects, sizeof(uint32_t));
 
 	for (i = 0; i < num_objects; ++i) {
 		const unsigned char *sha1;
-		struct revindex_entry *entry;
+		struct packed_git *pack;
+		off_t offset;
+		uint32_t index_pos;
 		struct object_entry *oe;
 
-		entry = &bitmap_git.reverse_index->revindex[i];
-		sha1 = nth_packed_object_sha1(bitmap_git.pack, entry->nr);
+		sha1 = nth_bitmap_object(i, &pack, &offset, &index_pos);
 		oe = packlist_find(mapping, sha1, NULL);
 
 		if (oe)
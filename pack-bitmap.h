@@ -46,7 +46,14 @@ void traverse_bitmap_commit_list(show_reachable_fn show_reachable);
 void test_bitmap_walk(struct rev_info *revs);
 char *pack_bitmap_filename(struct packed_git *p);
 int prepare_bitmap_walk(struct rev_info *revs);
-int reuse_partial_packfile_from_bitmap(struct packed_git **packfile, uint32_t *entries, off_t *up_to);
+/*
+ * Find the wanted objects of the last bitmap walk that can be copied
+ * from the bitmapped pack as they are, and take them out of the walk.
+ * "reuse" gets a bit set for each of them, by position in the pack.
+ */
+int reuse_partial_packfile_from_bitmap(struct packed_git **packfile,
+				       uint32_t *entries,
+				       struct bitmap **reuse);
 int rebuild_existing_bitmaps(struct packing_data *mapping, khash_sha1 *reused_bitmaps, int show_progress);
 
 void bitmap_writer_show_progress(int show);
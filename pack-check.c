@@ -176,6 +176,7 @@ int verify_pack(struct packed_git *p, verify_fn fn,
 
 	err |= verify_packfile(p, &w_curs, fn, progress, base_count);
 	unuse_pack(&w_curs);
+	err |= verify_pack_revindex(p);
 
 	return err;
 }
@@ -14,6 +14,9 @@
  * ordered by offset, so if you know the offset of an object, next offset
  * is where its packed representation ends and the index_nr can be used to
  * get the object sha1 from the main index.
+ *
+ * A pack written with pack.writeReverseIndex has the same list, minus
+ * the offsets, in its ".rev" file; we mmap that instead of sorting.
  */
 
 static struct pack_revindex *pack_revindex;
@@ -196,6 +199,71 @@ static void create_pack_revindex(struct pack_revindex *rix)
 	sort_revindex(rix->revindex, num_ent, p->pack_size);
 }
 
+/*
+ * The ".rev" file: a header, the .idx position of each object in pack
+ * order, the checksum of the pack and the checksum of the file itself.
+ */
+static int rev_file_name(struct packed_git *p, struct strbuf *name)
+{
+	if (!has_extension(p->pack_name, ".pack"))
+		return -1;
+	strbuf_add(name, p->pack_name, strlen(p->pack_name) - 5);
+	strbuf_addstr(name, ".rev");
+	return 0;
+}
+
+static int load_pack_revindex_file(struct pack_revindex *rix)
+{
+	struct packed_git *p = rix->p;
+	struct strbuf name = STRBUF_INIT;
+	const unsigned char *data;
+	size_t size;
+	struct stat st;
+	int fd, ret = -1;
+
+	if (rev_file_name(p, &name))
+		goto out;
+
+	fd = git_open_noatime(name.buf);
+	if (fd < 0)
+		goto out;
+	if (fstat(fd, &st)) {
+		close(fd);
+		goto out;
+	}
+	size = xsize_t(st.st_size);
+	if (size != PACK_REV_HEADER_SIZE + 4 * (size_t)p->num_objects + 40) {
+		close(fd);
+		error("reverse index file %s has the wrong size", name.buf);
+		goto out;
+	}
+	data = xmmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (get_be32(data) != PACK_REV_SIGNATURE ||
+	    get_be32(data + 4) != PACK_REV_VERSION ||
+	    get_be32(data + 8) != PACK_REV_HASH_SHA1) {
+		error("reverse index file %s has an unknown format", name.buf);
+		munmap((void *)data, size);
+		goto out;
+	}
+	/* the pack checksum, which the .idx records as well */
+	if (hashcmp(data + size - 40,
+		    (const unsigned char *)p->index_data + p->index_size - 40)) {
+		error("reverse index file %s does not match its pack", name.buf);
+		munmap((void *)data, size);
+		goto out;
+	}
+
+	rix->revindex_map = (void *)data;
+	rix->revindex_map_size = size;
+	rix->revindex_data = (const uint32_t *)(data + PACK_REV_HEADER_SIZE);
+	ret = 0;
+out:
+	strbuf_release(&name);
+	return ret;
+}
+
 struct pack_revindex *revindex_for_pack(struct packed_git *p)
 {
 	int num;
@@ -209,23 +277,105 @@ struct pack_revindex *revindex_for_pack(struct packed_git *p)
 		die("internal error: pack revindex fubar");
 
 	rix = &pack_revindex[num];
-	if (!rix->revindex)
+	if (!rix->revindex && !rix->revindex_data &&
+	    load_pack_revindex_file(rix))
 		create_pack_revindex(rix);
 
 	return rix;
 }
 
+/* The .idx position at "pos" of the ".rev" file, which we do not trust. */
+static uint32_t rev_file_nr(struct pack_revindex *pridx, unsigned pos)
+{
+	uint32_t nr = ntohl(pridx->revindex_data[pos]);
+
+	if (nr >= pridx->p->num_objects)
+		die("reverse index file for %s is corrupt: "
+		    "entry %u is out of range", pridx->p->pack_name, pos);
+	return nr;
+}
+
+off_t revindex_offset(struct pack_revindex *pridx, unsigned pos)
+{
+	struct packed_git *p = pridx->p;
+
+	if (pridx->revindex)
+		return pridx->revindex[pos].offset;
+	if (pos == p->num_objects)
+		return p->pack_size - 20;
+	return nth_packed_object_offset(p, rev_file_nr(pridx, pos));
+}
+
+uint32_t revindex_nr(struct pack_revindex *pridx, unsigned pos)
+{
+	if (pridx->revindex)
+		return pridx->revindex[pos].nr;
+	if (pos == pridx->p->num_objects)
+		return -1;
+	return rev_file_nr(pridx, pos);
+}
+
+int verify_pack_revindex(struct packed_git *p)
+{
+	struct strbuf name = STRBUF_INIT;
+	struct pack_revindex *rix;
+	const unsigned char *map;
+	git_SHA_CTX ctx;
+	unsigned char sha1[20];
+	off_t prev = 0;
+	uint32_t i;
+	int missing, err = 0;
+
+	missing = rev_file_name(p, &name) || access(name.buf, F_OK);
+	strbuf_release(&name);
+	if (missing)
+		return 0;
+
+	rix = revindex_for_pack(p);
+	if (!rix->revindex_data)
+		return error("reverse index file for %s is unusable",
+			     p->pack_name);
+
+	for (i = 0; i < p->num_objects; i++) {
+		uint32_t nr = ntohl(rix->revindex_data[i]);
+		off_t ofs;
+
+		if (nr >= p->num_objects) {
+			err = error("reverse index file for %s has entry %u "
+				    "out of range", p->pack_name, i);
+			break;
+		}
+		ofs = nth_packed_object_offset(p, nr);
+		if (i && ofs <= prev) {
+			err = error("reverse index file for %s is not in "
+				    "pack order at entry %u", p->pack_name, i);
+			break;
+		}
+		prev = ofs;
+	}
+
+	map = rix->revindex_map;
+	git_SHA1_Init(&ctx);
+	git_SHA1_Update(&ctx, map, rix->revindex_map_size - 20);
+	git_SHA1_Final(sha1, &ctx);
+	if (hashcmp(sha1, map + rix->revindex_map_size - 20))
+		err = error("reverse index file for %s SHA1 mismatch",
+			    p->pack_name);
+	return err;
+}
+
 int find_revindex_position(struct pack_revindex *pridx, off_t ofs)
 {
 	int lo = 0;
 	int hi = pridx->p->num_objects + 1;
-	struct revindex_entry *revindex = pridx->revindex;
 
 	do {
 		unsigned mi = lo + (hi - lo) / 2;
-		if (revindex[mi].offset == ofs) {
+		off_t mi_ofs = revindex_offset(pridx, mi);
+
+		if (mi_ofs == ofs) {
 			return mi;
-		} else if (ofs < revindex[mi].offset)
+		} else if (ofs < mi_ofs)
 			hi = mi;
 		else
 			lo = mi + 1;
@@ -235,13 +385,9 @@ int find_revindex_position(struct pack_revindex *pridx, off_t ofs)
 	return -1;
 }
 
-struct revindex_entry *find_pack_revindex(struct packed_git *p, off_t ofs)
+int find_pack_revindex(struct packed_git *p, off_t ofs,
+		       struct pack_revindex **pridx)
 {
-	struct pack_revindex *pridx = revindex_for_pack(p);
-	int pos = find_revindex_position(pridx, ofs);
-
-	if (pos < 0)
-		return NULL;
-
-	return pridx->revindex + pos;
+	*pridx = revindex_for_pack(p);
+	return find_revindex_position(*pridx, ofs);
 }
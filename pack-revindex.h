@@ -1,6 +1,20 @@
 #ifndef PACK_REVINDEX_H
 #define PACK_REVINDEX_H
 
+/*
+ * The reverse index of a pack lists its objects in the order they
+ * appear in the pack.  A "position" is an index into that list; the
+ * position after the last object stands for the pack trailer.
+ *
+ * The list is read from the ".rev" file next to the pack when there
+ * is one, and otherwise computed from the ".idx" on first use.
+ */
+
+#define PACK_REV_SIGNATURE 0x52494458	/* "RIDX" */
+#define PACK_REV_VERSION 1
+#define PACK_REV_HASH_SHA1 1
+#define PACK_REV_HEADER_SIZE 12
+
 struct revindex_entry {
 	off_t offset;
 	unsigned int nr;
@@ -8,12 +22,29 @@ struct revindex_entry {
 
 struct pack_revindex {
 	struct packed_git *p;
+	/* computed in memory ... */
 	struct revindex_entry *revindex;
+	/* ... or the index positions of the mmap'd ".rev" file */
+	const uint32_t *revindex_data;
+	void *revindex_map;
+	size_t revindex_map_size;
 };
 
 struct pack_revindex *revindex_for_pack(struct packed_git *p);
 int find_revindex_position(struct pack_revindex *pridx, off_t ofs);
 
-struct revindex_entry *find_pack_revindex(struct packed_git *p, off_t ofs);
+/* The offset and the .idx position of the object at "pos". */
+off_t revindex_offset(struct pack_revindex *pridx, unsigned pos);
+uint32_t revindex_nr(struct pack_revindex *pridx, unsigned pos);
+
+/* Check the ".rev" file of "p", if it has one. */
+int verify_pack_revindex(struct packed_git *p);
+
+/*
+ * Find the object at "ofs" in "p"; returns its position and sets
+ * "*pridx", or returns -1.
+ */
+int find_pack_revindex(struct packed_git *p, off_t ofs,
+		       struct pack_revindex **pridx);
 
 #endif
@@ -1,6 +1,7 @@
 #include "cache.h"
 #include "pack.h"
 #include "csum-file.h"
+#include "pack-revindex.h"
 
 void reset_pack_idx_option(struct pack_idx_option *opts)
 {
@@ -176,6 +177,63 @@ const char *write_idx_file(const char *index_name, struct pack_idx_entry **objec
 	return index_name;
 }
 
+static struct pack_idx_entry **rev_objects;
+
+static int pack_order_cmp(const void *a_, const void *b_)
+{
+	off_t a = rev_objects[*(uint32_t *)a_]->offset;
+	off_t b = rev_objects[*(uint32_t *)b_]->offset;
+
+	return (a < b) ? -1 : (a != b);
+}
+
+/*
+ * Write the reverse index of a pack: the position in "objects" of each
+ * object, in the order of the pack.  "objects" must be sorted as the
+ * .idx is, which write_idx_file() leaves it; "sha1" is the pack hash.
+ */
+const char *write_rev_file(const char *rev_name, struct pack_idx_entry **objects,
+			   uint32_t nr_objects, const unsigned char *sha1)
+{
+	struct sha1file *f;
+	uint32_t *pack_order;
+	uint32_t i, hdr[3];
+	int fd;
+
+	pack_order = xmalloc(nr_objects * sizeof(*pack_order));
+	for (i = 0; i < nr_objects; i++)
+		pack_order[i] = i;
+	rev_objects = objects;
+	qsort(pack_order, nr_objects, sizeof(*pack_order), pack_order_cmp);
+	rev_objects = NULL;
+
+	if (!rev_name) {
+		static char tmp_file[PATH_MAX];
+		fd = odb_mkstemp(tmp_file, sizeof(tmp_file), "pack/tmp_rev_XXXXXX");
+		rev_name = xstrdup(tmp_file);
+	} else {
+		unlink(rev_name);
+		fd = open(rev_name, O_CREAT|O_EXCL|O_WRONLY, 0600);
+	}
+	if (fd < 0)
+		die_errno("unable to create '%s'", rev_name);
+	f = sha1fd(fd, rev_name);
+
+	hdr[0] = htonl(PACK_REV_SIGNATURE);
+	hdr[1] = htonl(PACK_REV_VERSION);
+	hdr[2] = htonl(PACK_REV_HASH_SHA1);
+	sha1write(f, hdr, sizeof(hdr));
+	for (i = 0; i < nr_objects; i++) {
+		uint32_t nr = htonl(pack_order[i]);
+		sha1write(f, &nr, 4);
+	}
+	sha1write(f, sha1, 20);
+	sha1close(f, NULL, CSUM_FSYNC);
+
+	free(pack_order);
+	return rev_name;
+}
+
 off_t write_pack_header(struct sha1file *f, uint32_t nr_entries)
 {
 	struct pack_header hdr;
@@ -343,7 +401,7 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 			 struct pack_idx_option *pack_idx_opts,
 			 unsigned char sha1[])
 {
-	const char *idx_tmp_name;
+	const char *idx_tmp_name, *rev_tmp_name = NULL;
 	int basename_len = name_buffer->len;
 
 	if (adjust_shared_perm(pack_tmp_name))
@@ -354,6 +412,13 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 	if (adjust_shared_perm(idx_tmp_name))
 		die_errno("unable to make temporary index file readable");
 
+	if (pack_idx_opts->flags & WRITE_REV) {
+		rev_tmp_name = write_rev_file(NULL, written_list, nr_written,
+					      sha1);
+		if (adjust_shared_perm(rev_tmp_name))
+			die_errno("unable to make temporary reverse index file readable");
+	}
+
 	strbuf_addf(name_buffer, "%s.pack", sha1_to_hex(sha1));
 	free_pack_by_name(name_buffer->buf);
 
@@ -362,6 +427,14 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 
 	strbuf_setlen(name_buffer, basename_len);
 
+	/* before the .idx, which is what makes the pack visible */
+	if (rev_tmp_name) {
+		strbuf_addf(name_buffer, "%s.rev", sha1_to_hex(sha1));
+		if (rename(rev_tmp_name, name_buffer->buf))
+			die_errno("unable to rename temporary reverse index file");
+		strbuf_setlen(name_buffer, basename_len);
+	}
+
 	strbuf_addf(name_buffer, "%s.idx", sha1_to_hex(sha1));
 	if (rename(idx_tmp_name, name_buffer->buf))
 		die_errno("unable to rename temporary index file");
@@ -369,4 +442,5 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 	strbuf_setlen(name_buffer, basename_len);
 
 	free((void *)idx_tmp_name);
+	free((void *)rev_tmp_name);
 }
@@ -0,0 +1,320 @@
+#include "cache.h"
+#include "convert.h"
+#include "parallel-checkout.h"
+#include "progress.h"
+#include "thread-utils.h"
+
+/*
+ * What became of a queued entry: written by a worker, left for the
+ * serial checkout, or failed with an error to report.
+ */
+enum pc_status {
+	PC_PENDING = 0,
+	PC_WRITTEN,
+	PC_SERIAL,
+	PC_READ_ERROR,
+	PC_OPEN_ERROR,
+	PC_WRITE_ERROR
+};
+
+struct pc_item {
+	struct cache_entry *ce;
+	char *path;
+	enum pc_status status;
+	int saved_errno;
+	int fstat_done;
+	struct stat st;
+};
+
+static struct parallel_checkout {
+	int active;
+	struct pc_item *items;
+	int nr, alloc;
+	int next;
+	int refresh_cache;
+	struct progress *progress;
+	unsigned *progress_cnt;
+} parallel_checkout;
+
+static int checkout_workers = 1;
+static int checkout_threshold = 100;
+
+static int parallel_checkout_config(const char *var, const char *value, void *cb)
+{
+	if (!strcmp(var, "checkout.workers")) {
+		checkout_workers = git_config_int(var, value);
+		if (checkout_workers < 0)
+			return error("%s cannot be negative", var);
+		return 0;
+	}
+	if (!strcmp(var, "checkout.thresholdforparallelism")) {
+		checkout_threshold = git_config_int(var, value);
+		return 0;
+	}
+	return 0;
+}
+
+void init_parallel_checkout(void)
+{
+	static int config_read;
+
+	if (!config_read) {
+		git_config(parallel_checkout_config, NULL);
+		config_read = 1;
+	}
+#ifndef NO_PTHREADS
+	if (!checkout_workers)
+		checkout_workers = online_cpus();
+	if (checkout_workers > 1)
+		parallel_checkout.active = 1;
+#endif
+}
+
+/*
+ * Only regular files whose contents go to the working tree as they
+ * are stored can be written without looking at the attributes, which
+ * the workers cannot do.
+ */
+static int is_eligible(const struct cache_entry *ce)
+{
+	struct stream_filter *filter;
+	int eligible;
+
+	if ((ce->ce_mode & S_IFMT) != S_IFREG)
+		return 0;
+	filter = get_stream_filter(ce->name, ce->sha1);
+	if (!filter)
+		return 0;
+	eligible = is_null_stream_filter(filter);
+	free_stream_filter(filter);
+	return eligible;
+}
+
+int enqueue_checkout(struct cache_entry *ce, const char *path)
+{
+	struct pc_item *item;
+
+	if (!parallel_checkout.active || !is_eligible(ce))
+		return -1;
+
+	ALLOC_GROW(parallel_checkout.items, parallel_checkout.nr + 1,
+		   parallel_checkout.alloc);
+	item = &parallel_checkout.items[parallel_checkout.nr++];
+	memset(item, 0, sizeof(*item));
+	item->ce = ce;
+	item->path = xstrdup(path);
+	return 0;
+}
+
+int parallel_checkout_queue_size(void)
+{
+	return parallel_checkout.nr;
+}
+
+static void write_item(struct pc_item *item)
+{
+	struct cache_entry *ce = item->ce;
+	enum object_type type;
+	unsigned long size;
+	void *buf;
+	int fd;
+	size_t wrote;
+
+	/* big blobs are streamed out by the serial checkout */
+	if (sha1_object_info(ce->sha1, &size) == OBJ_BLOB &&
+	    size > big_file_threshold) {
+		item->status = PC_SERIAL;
+		return;
+	}
+
+	buf = read_sha1_file(ce->sha1, &type, &size);
+	if (!buf || type != OBJ_BLOB) {
+		free(buf);
+		item->status = PC_READ_ERROR;
+		return;
+	}
+
+	fd = open(item->path, O_WRONLY | O_CREAT | O_EXCL,
+		  (ce->ce_mode & 0100) ? 0777 : 0666);
+	if (fd < 0) {
+		free(buf);
+		/*
+		 * Another queued path took its place, e.g. one that
+		 * differs only in case; leave it to the serial checkout,
+		 * which knows how to deal with what is in the way.
+		 */
+		if (errno == EEXIST) {
+			item->status = PC_SERIAL;
+			return;
+		}
+		item->saved_errno = errno;
+		item->status = PC_OPEN_ERROR;
+		return;
+	}
+
+	wrote = write_in_full(fd, buf, size);
+	if (parallel_checkout.refresh_cache && fstat_is_reliable() &&
+	    !fstat(fd, &item->st))
+		item->fstat_done = 1;
+	close(fd);
+	free(buf);
+	item->status = wrote == size ? PC_WRITTEN : PC_WRITE_ERROR;
+}
+
+/*
+ * Count an item the workers are done with, unless it is left for the
+ * serial checkout, which counts it once it is written.  The workers
+ * call this under queue_mutex.
+ */
+static void item_done(struct pc_item *item)
+{
+	if (item->status != PC_SERIAL)
+		display_progress(parallel_checkout.progress,
+				 ++*parallel_checkout.progress_cnt);
+}
+
+#ifndef NO_PTHREADS
+static pthread_mutex_t queue_mutex;
+
+static void *checkout_worker(void *data)
+{
+	struct pc_item *item = NULL;
+
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&queue_mutex);
+		if (item)
+			item_done(item);
+		i = parallel_checkout.next++;
+		pthread_mutex_unlock(&queue_mutex);
+		if (i >= parallel_checkout.nr)
+			break;
+		item = &parallel_checkout.items[i];
+		if (item->status == PC_PENDING)
+			write_item(item);
+	}
+	return NULL;
+}
+
+static void try_to_free_from_threads(size_t size)
+{
+	obj_read_lock();
+	release_pack_memory(size);
+	obj_read_unlock();
+}
+
+static void write_items_in_threads(int nr_workers)
+{
+	pthread_t *workers = xcalloc(nr_workers, sizeof(*workers));
+	try_to_free_t old_try_to_free_routine;
+	int i, err;
+
+	pthread_mutex_init(&queue_mutex, NULL);
+	enable_obj_read_lock();
+	old_try_to_free_routine = set_try_to_free_routine(try_to_free_from_threads);
+
+	for (i = 0; i < nr_workers; i++) {
+		err = pthread_create(&workers[i], NULL, checkout_worker, NULL);
+		if (err)
+			die(_("unable to create checkout thread: %s"),
+			    strerror(err));
+	}
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	set_try_to_free_routine(old_try_to_free_routine);
+	disable_obj_read_lock();
+	pthread_mutex_destroy(&queue_mutex);
+	free(workers);
+}
+#endif
+
+int run_parallel_checkout(const struct checkout *state,
+			  struct progress *progress, unsigned *progress_cnt)
+{
+	int i, errs = 0;
+
+	if (!parallel_checkout.active)
+		return 0;
+	parallel_checkout.active = 0;
+	parallel_checkout.refresh_cache = state->refresh_cache &&
+					  !state->base_dir_len;
+	parallel_checkout.next = 0;
+	parallel_checkout.progress = progress;
+	parallel_checkout.progress_cnt = progress_cnt;
+
+	/*
+	 * What the serial checkout wrote after a path was queued may have
+	 * replaced one of its leading directories, e.g. a symlink "a"
+	 * checked out after "A/file" on a case-insensitive filesystem;
+	 * the workers would then write through it.  Leave such paths to
+	 * the serial checkout, which deals with what is in the way.
+	 */
+	invalidate_lstat_cache();
+	for (i = 0; i < parallel_checkout.nr; i++) {
+		struct pc_item *item = &parallel_checkout.items[i];
+		const char *slash = strrchr(item->path, '/');
+
+		if (slash && !has_dirs_only_path(item->path, slash - item->path,
+						 state->base_dir_len))
+			item->status = PC_SERIAL;
+	}
+
+#ifndef NO_PTHREADS
+	if (parallel_checkout.nr >= checkout_threshold) {
+		int nr_workers = checkout_workers;
+
+		if (nr_workers > parallel_checkout.nr)
+			nr_workers = parallel_checkout.nr;
+		write_items_in_threads(nr_workers);
+	}
+#endif
+	/* too few to be worth the threads; write them here */
+	for (i = 0; i < parallel_checkout.nr; i++) {
+		struct pc_item *item = &parallel_checkout.items[i];
+
+		if (item->status == PC_PENDING) {
+			write_item(item);
+			item_done(item);
+		}
+	}
+
+	for (i = 0; i < parallel_checkout.nr; i++) {
+		struct pc_item *item = &parallel_checkout.items[i];
+
+		switch (item->status) {
+		case PC_WRITTEN:
+			if (state->refresh_cache) {
+				if (!item->fstat_done)
+					lstat(item->ce->name, &item->st);
+				fill_stat_cache_info(item->ce, &item->st);
+			}
+			break;
+		case PC_SERIAL:
+			errs |= checkout_entry(item->ce, state, NULL);
+			display_progress(progress, ++*progress_cnt);
+			break;
+		case PC_READ_ERROR:
+			errs |= error("unable to read sha1 file of %s (%s)",
+				      item->path, sha1_to_hex(item->ce->sha1));
+			break;
+		case PC_OPEN_ERROR:
+			errs |= error("unable to create file %s (%s)",
+				      item->path, strerror(item->saved_errno));
+			break;
+		case PC_WRITE_ERROR:
+			errs |= error("unable to write file %s", item->path);
+			break;
+		default:
+			die("BUG: parallel checkout left %s pending",
+			    item->path);
+		}
+		free(item->path);
+	}
+
+	free(parallel_checkout.items);
+	parallel_checkout.items = NULL;
+	parallel_checkout.nr = parallel_checkout.alloc = 0;
+	return errs;
+}
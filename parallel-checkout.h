@@ -0,0 +1,42 @@
+#ifndef PARALLEL_CHECKOUT_H
+#define PARALLEL_CHECKOUT_H
+
+struct cache_entry;
+struct checkout;
+struct progress;
+
+/*
+ * Parallel checkout: while it is active, checkout_entry() prepares the
+ * path of a regular file that needs no conversion (no filter driver,
+ * no "ident", no end-of-line conversion) and queues it instead of
+ * writing it.  run_parallel_checkout() then has "checkout.workers"
+ * threads read and write the queued files, and checks out serially
+ * whatever they could not write: files above core.bigFileThreshold,
+ * which are streamed, and paths that turned out to collide with
+ * another one, e.g. on a case-insensitive filesystem, or whose leading
+ * directories were replaced after they were queued.
+ */
+
+/* Start queueing, if "checkout.workers" asks for more than one worker. */
+extern void init_parallel_checkout(void);
+
+/*
+ * Queue "ce" to be written to "path" if parallel checkout is active
+ * and "ce" is eligible.  Returns 0 if it was queued, -1 otherwise.
+ */
+extern int enqueue_checkout(struct cache_entry *ce, const char *path);
+
+/* The number of entries queued so far. */
+extern int parallel_checkout_queue_size(void);
+
+/*
+ * Write out the queued entries, update their stat data if "state"
+ * asks for it, and stop queueing.  "progress" is advanced from
+ * "*progress_cnt" as each of them is written.  Returns non-zero if
+ * any of them could not be checked out.
+ */
+extern int run_parallel_checkout(const struct checkout *state,
+				 struct progress *progress,
+				 unsigned *progress_cnt);
+
+#endif
@@ -63,6 +63,18 @@ void packet_buf_flush(struct strbuf *buf)
 	strbuf_add(buf, "0000", 4);
 }
 
+void packet_delim(int fd)
+{
+	packet_trace("0001", 4, 1);
+	write_or_die(fd, "0001", 4);
+}
+
+void packet_buf_delim(struct strbuf *buf)
+{
+	packet_trace("0001", 4, 1);
+	strbuf_add(buf, "0001", 4);
+}
+
 #define hex(a) (hexchar[(a) & 15])
 static char buffer[1000];
 static unsigned format_packet(const char *fmt, va_list args)
@@ -160,28 +172,38 @@ static int packet_length(const char *linelen)
 	return len;
 }
 
-int packet_read(int fd, char **src_buf, size_t *src_len,
-		char *buffer, unsigned size, int options)
+enum packet_read_status packet_read_with_status(int fd, char **src_buf,
+						size_t *src_len, char *buffer,
+						unsigned size, int *pktlen,
+						int options)
 {
 	int len, ret;
 	char linelen[4];
 
 	ret = get_packet_data(fd, src_buf, src_len, linelen, 4, options);
 	if (ret < 0)
-		return ret;
+		return PACKET_READ_EOF;
 	len = packet_length(linelen);
 	if (len < 0)
 		die("protocol error: bad line length character: %.4s", linelen);
 	if (!len) {
 		packet_trace("0000", 4, 0);
-		return 0;
+		*pktlen = 0;
+		return PACKET_READ_FLUSH;
+	}
+	if (len == 1) {
+		packet_trace("0001", 4, 0);
+		*pktlen = 0;
+		return PACKET_READ_DELIM;
 	}
+	if (len < 4)
+		die("protocol error: bad line length %d", len);
 	len -= 4;
 	if (len >= size)
 		die("protocol error: bad line length %d", len);
 	ret = get_packet_data(fd, src_buf, src_len, buffer, len, options);
 	if (ret < 0)
-		return ret;
+		return PACKET_READ_EOF;
 
 	if ((options & PACKET_READ_CHOMP_NEWLINE) &&
 	    len && buffer[len-1] == '\n')
@@ -189,7 +211,24 @@ int packet_read(int fd, char **src_buf, size_t *src_len,
 
 	buffer[len] = 0;
 	packet_trace(buffer, len, 0);
-	return len;
+	*pktlen = len;
+	return PACKET_READ_NORMAL;
+}
+
+int packet_read(int fd, char **src_buf, size_t *src_len,
+		char *buffer, unsigned size, int options)
+{
+	int len;
+
+	switch (packet_read_with_status(fd, src_buf, src_len, buffer, size,
+					&len, options)) {
+	case PACKET_READ_EOF:
+		return -1;
+	case PACKET_READ_DELIM:
+		die("protocol error: unexpected delimiter packet");
+	default:
+		return len;
+	}
 }
 
 static char *packet_read_line_generic(int fd,
@@ -213,3 +252,16 @@ char *packet_read_line_buf(char **src, size_t *src_len, int *dst_len)
 {
 	return packet_read_line_generic(-1, src, src_len, dst_len);
 }
+
+char *packet_read_line_status(int fd, char **src, size_t *src_len,
+			      enum packet_read_status *status)
+{
+	int len;
+
+	*status = packet_read_with_status(fd, src, src_len,
+					  packet_buffer, sizeof(packet_buffer),
+					  &len,
+					  PACKET_READ_GENTLE_ON_EOF |
+					  PACKET_READ_CHOMP_NEWLINE);
+	return *status == PACKET_READ_NORMAL ? packet_buffer : NULL;
+}
@@ -7,8 +7,9 @@
 /*
  * Write a packetized stream, where each line is preceded by
  * its length (including the header) as a 4-byte hex number.
- * A length of 'zero' means end of stream (and a length of 1-3
- * would be an error).
+ * A length of 'zero' means end of stream (a "flush packet"); a length
+ * of 1 is a "delimiter packet" that separates sections of a message in
+ * protocol v2, and a length of 2-3 would be an error.
  *
  * This is all pretty stupid, but we use this packetized line
  * format to make a streaming format possible without ever
@@ -23,6 +24,8 @@ void packet_flush(int fd);
 void packet_write(int fd, const char *fmt, ...) __attribute__((format (printf, 2, 3)));
 void packet_buf_flush(struct strbuf *buf);
 void packet_buf_write(struct strbuf *buf, const char *fmt, ...) __attribute__((format (printf, 2, 3)));
+void packet_delim(int fd);
+void packet_buf_delim(struct strbuf *buf);
 
 /*
  * Read a packetized line into the buffer, which must be at least size bytes
@@ -54,12 +57,30 @@ void packet_buf_write(struct strbuf *buf, const char *fmt, ...) __attribute__((f
  *
  * If options contains PACKET_READ_CHOMP_NEWLINE, a trailing newline (if
  * present) is removed from the buffer before returning.
+ *
+ * A delimiter packet is a protocol error for packet_read().
  */
 #define PACKET_READ_GENTLE_ON_EOF (1u<<0)
 #define PACKET_READ_CHOMP_NEWLINE (1u<<1)
 int packet_read(int fd, char **src_buffer, size_t *src_len, char
 		*buffer, unsigned size, int options);
 
+/*
+ * Like packet_read(), but tell flush and delimiter packets and the end
+ * of the input apart through the return value; the length of a normal
+ * packet is stored in "pktlen".
+ */
+enum packet_read_status {
+	PACKET_READ_EOF,
+	PACKET_READ_NORMAL,
+	PACKET_READ_FLUSH,
+	PACKET_READ_DELIM
+};
+enum packet_read_status packet_read_with_status(int fd, char **src_buffer,
+						size_t *src_len, char *buffer,
+						unsigned size, int *pktlen,
+						int options);
+
 /*
  * Convenience wrapper for packet_read that is not gentle, and sets the
  * CHOMP_NEWLINE option. The return value is NULL for a flush packet,
@@ -75,6 +96,15 @@ char *packet_read_line(int fd, int *size);
  */
 char *packet_read_line_buf(char **src_buf, size_t *src_len, int *size);
 
+/*
+ * Read a line like packet_read_line() (from a buffer if src and *src
+ * are not NULL), but gently: the kind of packet read, or
+ * PACKET_READ_EOF at the end of the input, is stored in "status", and
+ * NULL is returned for anything but a normal packet.
+ */
+char *packet_read_line_status(int fd, char **src, size_t *src_len,
+			      enum packet_read_status *status);
+
 #define DEFAULT_PACKET_MAX 1000
 #define LARGE_PACKET_MAX 65520
 extern char packet_buffer[LARGE_PACKET_MAX];
@@ -54,6 +54,10 @@ static void *preload_thread(void *_data)
 			continue;
 		if (ce_uptodate(ce))
 			continue;
+		if (ce->ce_flags & CE_FSMONITOR_VALID) {
+			ce_mark_uptodate(ce);
+			continue;
+		}
 		if (!ce_path_match(ce, &p->pathspec, NULL))
 			continue;
 		if (threaded_has_symlink_leading_path(&cache, ce->name, ce_namelen(ce)))
@@ -0,0 +1,24 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+enum protocol_version {
+	protocol_unknown_version = -1,
+	protocol_v0 = 0,
+	protocol_v2 = 2
+};
+
+/*
+ * The protocol version a client asks for, from the "protocol.version"
+ * configuration variable; protocol_v0 if it is not set.
+ */
+extern enum protocol_version get_protocol_version_config(void);
+
+/*
+ * The protocol version requested by the client, as passed to a server
+ * program like upload-pack in $GIT_PROTOCOL: a colon-separated list of
+ * "key=value" parameters, of which "version=<n>" is looked at.  The
+ * highest version asked for wins; protocol_v0 if none is given.
+ */
+extern enum protocol_version determine_protocol_version_server(void);
+
+#endif /* PROTOCOL_H */
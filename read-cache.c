@@ -14,6 +14,10 @@
 #include "resolve-undo.h"
 #include "strbuf.h"
 #include "varint.h"
+#include "split-index.h"
+#include "fsmonitor.h"
+#include "sparse-index.h"
+#include "thread-utils.h"
 
 static struct cache_entry *refresh_cache_entry(struct cache_entry *ce,
 					       unsigned int options);
@@ -34,6 +38,12 @@ static struct cache_entry *refresh_cache_entry(struct cache_entry *ce,
 #define CACHE_EXT(s) ( (s[0]<<24)|(s[1]<<16)|(s[2]<<8)|(s[3]) )
 #define CACHE_EXT_TREE 0x54524545	/* "TREE" */
 #define CACHE_EXT_RESOLVE_UNDO 0x52455543 /* "REUC" */
+#define CACHE_EXT_LINK 0x6c696e6b	  /* "link" */
+#define CACHE_EXT_UNTRACKED 0x554E5452	  /* "UNTR" */
+#define CACHE_EXT_FSMONITOR 0x46534D4E	  /* "FSMN" */
+#define CACHE_EXT_SPARSE_DIRECTORIES 0x73646972 /* "sdir" */
+#define CACHE_EXT_ENDOFINDEXENTRIES 0x454F4945	/* "EOIE" */
+#define CACHE_EXT_INDEXENTRYOFFSETTABLE 0x49454F54 /* "IEOT" */
 
 struct index_state the_index;
 
@@ -47,6 +57,8 @@ static void replace_index_entry(struct index_state *istate, int nr, struct cache
 {
 	struct cache_entry *old = istate->cache[nr];
 
+	/* keep the entry paired with its copy in the shared index */
+	ce->index = old->index;
 	remove_name_hash(istate, old);
 	free(old);
 	set_index_entry(istate, nr, ce);
@@ -61,6 +73,7 @@ void rename_index_entry_at(struct index_state *istate, int nr, const char *new_n
 	new = xmalloc(cache_entry_size(namelen));
 	copy_cache_entry(new, old);
 	new->ce_flags &= ~CE_HASHED;
+	mark_fsmonitor_invalid(istate, new);
 	new->ce_namelen = namelen;
 	memcpy(new->name, new_name, namelen + 1);
 
@@ -256,22 +269,36 @@ static int ce_match_stat_basic(const struct cache_entry *ce, struct stat *st)
 	return changed;
 }
 
-static int is_racy_timestamp(const struct index_state *istate,
-			     const struct cache_entry *ce)
+static int is_racy_stat(const struct index_state *istate,
+			const struct stat_data *sd)
 {
-	return (!S_ISGITLINK(ce->ce_mode) &&
-		istate->timestamp.sec &&
+	return (istate->timestamp.sec &&
 #ifdef USE_NSEC
 		 /* nanosecond timestamped files can also be racy! */
-		(istate->timestamp.sec < ce->ce_stat_data.sd_mtime.sec ||
-		 (istate->timestamp.sec == ce->ce_stat_data.sd_mtime.sec &&
-		  istate->timestamp.nsec <= ce->ce_stat_data.sd_mtime.nsec))
+		(istate->timestamp.sec < sd->sd_mtime.sec ||
+		 (istate->timestamp.sec == sd->sd_mtime.sec &&
+		  istate->timestamp.nsec <= sd->sd_mtime.nsec))
 #else
-		istate->timestamp.sec <= ce->ce_stat_data.sd_mtime.sec
+		istate->timestamp.sec <= sd->sd_mtime.sec
 #endif
 		 );
 }
 
+static int is_racy_timestamp(const struct index_state *istate,
+			     const struct cache_entry *ce)
+{
+	return (!S_ISGITLINK(ce->ce_mode) &&
+		is_racy_stat(istate, &ce->ce_stat_data));
+}
+
+int match_stat_data_racy(const struct index_state *istate,
+			 const struct stat_data *sd, struct stat *st)
+{
+	if (is_racy_stat(istate, sd))
+		return MTIME_CHANGED;
+	return match_stat_data(sd, st);
+}
+
 int ie_match_stat(const struct index_state *istate,
 		  const struct cache_entry *ce, struct stat *st,
 		  unsigned int options)
@@ -283,13 +310,14 @@ int ie_match_stat(const struct index_state *istate,
 
 	/*
 	 * If it's marked as always valid in the index, it's
-	 * valid whatever the checked-out copy says.
+	 * valid whatever the checked-out copy says.  The same goes
+	 * for entries the file system monitor vouches for.
 	 *
 	 * skip-worktree has the same effect with higher precedence
 	 */
 	if (!ignore_skip_worktree && ce_skip_worktree(ce))
 		return 0;
-	if (!ignore_valid && (ce->ce_flags & CE_VALID))
+	if (!ignore_valid && (ce->ce_flags & (CE_VALID | CE_FSMONITOR_VALID)))
 		return 0;
 
 	/*
@@ -468,6 +496,20 @@ static int index_name_stage_pos(const struct index_state *istate, const char *na
 		}
 		first = next+1;
 	}
+
+	/*
+	 * A path inside a directory of a sparse index would sort right
+	 * after the entry for the directory: expand it to look again.
+	 */
+	if (istate->sparse_index && first > 0) {
+		struct cache_entry *ce = istate->cache[first - 1];
+
+		if (S_ISSPARSEDIR(ce->ce_mode) && namelen > ce_namelen(ce) &&
+		    !memcmp(name, ce->name, ce_namelen(ce))) {
+			ensure_full_index((struct index_state *)istate);
+			return index_name_stage_pos(istate, name, namelen, stage);
+		}
+	}
 	return -first-1;
 }
 
@@ -483,6 +525,7 @@ int remove_index_entry_at(struct index_state *istate, int pos)
 
 	record_resolve_undo(istate, ce);
 	remove_name_hash(istate, ce);
+	untracked_cache_invalidate_path(istate, ce->name);
 	free(ce);
 	istate->cache_changed = 1;
 	istate->cache_nr--;
@@ -507,6 +550,7 @@ void remove_marked_cache_entries(struct index_state *istate)
 	for (i = j = 0; i < istate->cache_nr; i++) {
 		if (ce_array[i]->ce_flags & CE_REMOVE) {
 			remove_name_hash(istate, ce_array[i]);
+			untracked_cache_invalidate_path(istate, ce_array[i]->name);
 			free(ce_array[i]);
 		}
 		else
@@ -950,6 +994,8 @@ static int add_index_entry_with_check(struct index_state *istate, struct cache_e
 	}
 	pos = -pos-1;
 
+	untracked_cache_invalidate_path(istate, ce->name);
+
 	/*
 	 * Inserting a merged entry ("stage 0") into the index
 	 * will always replace all non-merged entries..
@@ -1046,6 +1092,10 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 		ce_mark_uptodate(ce);
 		return ce;
 	}
+	if (!ignore_valid && (ce->ce_flags & CE_FSMONITOR_VALID)) {
+		ce_mark_uptodate(ce);
+		return ce;
+	}
 
 	if (lstat(ce->name, &st) < 0) {
 		if (ignore_missing && errno == ENOENT)
@@ -1077,6 +1127,17 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 			 */
 			if (!S_ISGITLINK(ce->ce_mode))
 				ce_mark_uptodate(ce);
+			/*
+			 * Remembering that the file system monitor has
+			 * nothing to report about this path is worth
+			 * writing the index out, though.
+			 */
+			if (fsmonitor_is_active(istate) &&
+			    !S_ISGITLINK(ce->ce_mode) &&
+			    !(ce->ce_flags & CE_FSMONITOR_VALID)) {
+				mark_fsmonitor_valid(istate, ce);
+				istate->cache_changed = 1;
+			}
 			return ce;
 		}
 	}
@@ -1091,6 +1152,7 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 	updated = xmalloc(size);
 	memcpy(updated, ce, size);
 	fill_stat_cache_info(updated, &st);
+	mark_fsmonitor_valid(istate, updated);
 	/*
 	 * If ignore_valid is not set, we should leave CE_VALID bit
 	 * alone.  Otherwise, paths marked with --no-assume-unchanged
@@ -1305,6 +1367,14 @@ struct ondisk_cache_entry_extended {
 			    ondisk_cache_entry_extended_size(ce_namelen(ce)) : \
 			    ondisk_cache_entry_size(ce_namelen(ce)))
 
+/*
+ * Whether readers check the SHA-1 over the whole index against its
+ * trailer (index.verifyChecksum); fsck sets force_verify_index_checksum
+ * to check it regardless.
+ */
+static int verify_index_checksum = 1;
+int force_verify_index_checksum;
+
 static int verify_hdr(struct cache_header *hdr, unsigned long size)
 {
 	git_SHA_CTX c;
@@ -1316,6 +1386,8 @@ static int verify_hdr(struct cache_header *hdr, unsigned long size)
 	hdr_version = ntohl(hdr->hdr_version);
 	if (hdr_version < INDEX_FORMAT_LB || INDEX_FORMAT_UB < hdr_version)
 		return error("bad index version %d", hdr_version);
+	if (!verify_index_checksum && !force_verify_index_checksum)
+		return 0;
 	git_SHA1_Init(&c);
 	git_SHA1_Update(&c, hdr, size - 20);
 	git_SHA1_Final(sha1, &c);
@@ -1334,6 +1406,27 @@ static int read_index_extension(struct index_state *istate,
 	case CACHE_EXT_RESOLVE_UNDO:
 		istate->resolve_undo = resolve_undo_read(data, sz);
 		break;
+	case CACHE_EXT_LINK:
+		if (read_link_extension(istate, data, sz))
+			return -1;
+		break;
+	case CACHE_EXT_UNTRACKED:
+		istate->untracked = read_untracked_extension(data, sz);
+		if (!istate->untracked)
+			warning(_("ignoring corrupt untracked cache extension"));
+		break;
+	case CACHE_EXT_FSMONITOR:
+		if (read_fsmonitor_extension(istate, data, sz))
+			discard_fsmonitor(istate);
+		break;
+	case CACHE_EXT_SPARSE_DIRECTORIES:
+		/* its presence is all there is to it */
+		istate->sparse_index = 1;
+		break;
+	case CACHE_EXT_ENDOFINDEXENTRIES:
+	case CACHE_EXT_INDEXENTRYOFFSETTABLE:
+		/* they describe the file; do_read_index() has used them */
+		break;
 	default:
 		if (*ext < 'A' || 'Z' < *ext)
 			return error("index uses %.4s extension, which we do not understand",
@@ -1344,6 +1437,210 @@ static int read_index_extension(struct index_state *istate,
 	return 0;
 }
 
+static int read_index_extensions(struct index_state *istate,
+				 const char *mmap, size_t mmap_size,
+				 unsigned long src_offset)
+{
+	while (src_offset <= mmap_size - 20 - 8) {
+		/* After an array of active_nr index entries,
+		 * there can be arbitrary number of extended
+		 * sections, each of which is prefixed with
+		 * extension name (4-byte) and section length
+		 * in 4-byte network byte order.
+		 */
+		uint32_t extsize;
+		memcpy(&extsize, mmap + src_offset + 4, 4);
+		extsize = ntohl(extsize);
+		if (read_index_extension(istate,
+					 mmap + src_offset,
+					 (char *)mmap + src_offset + 8,
+					 extsize) < 0)
+			return -1;
+		src_offset += 8;
+		src_offset += extsize;
+	}
+	return 0;
+}
+
+/*
+ * Loading the index in threads.  The "EOIE" extension, always the
+ * last one, says where the entries end and the extensions start, so
+ * that one thread can parse the extensions while others parse the
+ * entries.  The "IEOT" extension says where the blocks of entries
+ * start, so that each thread can take some of the blocks.  Both are
+ * written when index.recordOffsetTable is set; see
+ * Documentation/technical/index-format.txt.
+ */
+#define EOIE_SIZE (4 + 20)
+#define EOIE_SIZE_WITH_HEADER (4 + 4 + EOIE_SIZE)
+#define IEOT_VERSION 1
+
+/* the fewest entries worth a thread of their own */
+#define THREAD_COST (10000)
+
+struct ieot_block {
+	uint32_t offset;
+	uint32_t nr;
+};
+
+static int index_threads = 0; /* one per CPU */
+static int record_offset_table;
+
+static int index_config(const char *var, const char *value, void *cb)
+{
+	if (!strcmp(var, "index.threads")) {
+		int is_bool;
+
+		index_threads = git_config_bool_or_int(var, value, &is_bool);
+		if (is_bool)
+			index_threads = index_threads ? 0 : 1;
+		else if (index_threads < 0)
+			return error("%s cannot be negative", var);
+		return 0;
+	}
+	if (!strcmp(var, "index.recordoffsettable")) {
+		record_offset_table = git_config_bool(var, value);
+		return 0;
+	}
+	if (!strcmp(var, "index.verifychecksum")) {
+		verify_index_checksum = git_config_bool(var, value);
+		return 0;
+	}
+	return 0;
+}
+
+static void read_index_config(void)
+{
+	static int config_read;
+
+	if (config_read)
+		return;
+	git_config(index_config, NULL);
+	config_read = 1;
+}
+
+/*
+ * How many threads to load "nr" entries with, and so how many blocks
+ * to write them in.
+ */
+static int index_nr_threads(unsigned int nr)
+{
+#ifdef NO_PTHREADS
+	return 1;
+#else
+	int nr_threads;
+
+	read_index_config();
+	nr_threads = index_threads ? index_threads : online_cpus();
+	if (!getenv("GIT_FORCE_THREADS") && nr_threads > nr / THREAD_COST)
+		nr_threads = nr / THREAD_COST;
+	if (nr_threads > nr)
+		nr_threads = nr;
+	return nr_threads > 1 ? nr_threads : 1;
+#endif
+}
+
+#ifndef NO_PTHREADS
+/*
+ * Returns where the extensions start if the index ends with a valid
+ * "EOIE" extension, and 0 otherwise.
+ */
+static unsigned long read_eoie_extension(const char *mmap, size_t mmap_size)
+{
+	const char *index;
+	unsigned long offset, src_offset, eoie_offset;
+	uint32_t extsize;
+	unsigned char sha1[20];
+	git_SHA_CTX c;
+
+	if (mmap_size < sizeof(struct cache_header) + EOIE_SIZE_WITH_HEADER + 20)
+		return 0;
+	eoie_offset = mmap_size - 20 - EOIE_SIZE_WITH_HEADER;
+	index = mmap + eoie_offset;
+	if (CACHE_EXT(index) != CACHE_EXT_ENDOFINDEXENTRIES)
+		return 0;
+	index += 4;
+	if (get_be32(index) != EOIE_SIZE)
+		return 0;
+	index += 4;
+	offset = get_be32(index);
+	index += 4;
+	if (offset < sizeof(struct cache_header) || offset > eoie_offset)
+		return 0;
+
+	/* the extensions it covers have to be the ones that are there */
+	git_SHA1_Init(&c);
+	src_offset = offset;
+	while (src_offset < eoie_offset) {
+		if (eoie_offset - src_offset < 8)
+			return 0;
+		extsize = get_be32(mmap + src_offset + 4);
+		if (extsize > eoie_offset - src_offset - 8)
+			return 0;
+		git_SHA1_Update(&c, mmap + src_offset, 8);
+		src_offset += 8 + extsize;
+	}
+	git_SHA1_Final(sha1, &c);
+	if (hashcmp(sha1, (const unsigned char *)index))
+		return 0;
+	return offset;
+}
+
+/*
+ * Find and check the "IEOT" extension among the extensions starting
+ * at "ext_offset".  Returns the number of blocks, 0 if it is missing
+ * or does not describe the "nr" entries that end at "ext_offset".
+ */
+static int read_ieot_extension(const char *mmap, size_t mmap_size,
+			       unsigned long ext_offset, unsigned int nr,
+			       struct ieot_block **blocks_p)
+{
+	unsigned long src_offset = ext_offset;
+	const char *index = NULL;
+	uint32_t extsize = 0, total = 0, prev = 0;
+	struct ieot_block *blocks;
+	int i, nr_blocks;
+
+	while (src_offset + 8 <= mmap_size - 20) {
+		const char *ext = mmap + src_offset;
+
+		extsize = get_be32(ext + 4);
+		if (CACHE_EXT(ext) == CACHE_EXT_INDEXENTRYOFFSETTABLE) {
+			index = ext + 8;
+			break;
+		}
+		src_offset += 8 + extsize;
+	}
+	if (!index || extsize < 4 || (extsize - 4) % 8 ||
+	    extsize > mmap_size - 20 - src_offset - 8 ||
+	    get_be32(index) != IEOT_VERSION)
+		return 0;
+	index += 4;
+
+	nr_blocks = (extsize - 4) / 8;
+	blocks = xcalloc(nr_blocks, sizeof(*blocks));
+	for (i = 0; i < nr_blocks; i++) {
+		blocks[i].offset = get_be32(index);
+		blocks[i].nr = get_be32(index + 4);
+		index += 8;
+		if (blocks[i].offset < sizeof(struct cache_header) ||
+		    blocks[i].offset <= prev || blocks[i].offset >= ext_offset ||
+		    blocks[i].nr > nr - total) {
+			free(blocks);
+			return 0;
+		}
+		prev = blocks[i].offset;
+		total += blocks[i].nr;
+	}
+	if (total != nr) {
+		free(blocks);
+		return 0;
+	}
+	*blocks_p = blocks;
+	return nr_blocks;
+}
+#endif
+
 int read_index(struct index_state *istate)
 {
 	return read_index_from(istate, get_index_file());
@@ -1381,14 +1678,23 @@ static struct cache_entry *cache_entry_from_ondisk(struct ondisk_cache_entry *on
  * number of bytes to be stripped from the end of the previous name,
  * and the bytes to append to the result, to come up with its name.
  */
-static unsigned long expand_name_field(struct strbuf *name, const char *cp_)
+static unsigned long expand_name_field(struct strbuf *name, const char *cp_,
+				       int restart)
 {
 	const unsigned char *ep, *cp = (const unsigned char *)cp_;
 	size_t len = decode_varint(&cp);
 
-	if (name->len < len)
+	/*
+	 * The first entry of a block of the "IEOT" extension strips all
+	 * of the name before it, which a thread starting there does not
+	 * know.
+	 */
+	if (restart)
+		strbuf_reset(name);
+	else if (name->len < len)
 		die("malformed name field in the index");
-	strbuf_remove(name, name->len - len, len);
+	else
+		strbuf_remove(name, name->len - len, len);
 	for (ep = cp; *ep; ep++)
 		; /* find the end */
 	strbuf_add(name, cp, ep - cp);
@@ -1397,7 +1703,8 @@ static unsigned long expand_name_field(struct strbuf *name, const char *cp_)
 
 static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
 					    unsigned long *ent_size,
-					    struct strbuf *previous_name)
+					    struct strbuf *previous_name,
+					    int restart)
 {
 	struct cache_entry *ce;
 	size_t len;
@@ -1431,7 +1738,7 @@ static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
 		*ent_size = ondisk_ce_size(ce);
 	} else {
 		unsigned long consumed;
-		consumed = expand_name_field(previous_name, name);
+		consumed = expand_name_field(previous_name, name, restart);
 		ce = cache_entry_from_ondisk(ondisk, flags,
 					     previous_name->buf,
 					     previous_name->len);
@@ -1441,10 +1748,119 @@ static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
 	return ce;
 }
 
+#ifndef NO_PTHREADS
+struct load_entries_data {
+	pthread_t pthread;
+	struct index_state *istate;
+	const char *mmap;
+	struct ieot_block *blocks;
+	int nr_blocks;
+	unsigned int first;	/* the position of the first entry */
+};
+
+static void *load_entries_thread(void *_data)
+{
+	struct load_entries_data *p = _data;
+	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	unsigned int pos = p->first;
+	int i, j;
+
+	previous_name = p->istate->version == 4 ? &previous_name_buf : NULL;
+	for (i = 0; i < p->nr_blocks; i++) {
+		unsigned long src_offset = p->blocks[i].offset;
+
+		for (j = 0; j < p->blocks[i].nr; j++) {
+			struct ondisk_cache_entry *disk_ce;
+			struct cache_entry *ce;
+			unsigned long consumed;
+
+			disk_ce = (struct ondisk_cache_entry *)(p->mmap + src_offset);
+			ce = create_from_disk(disk_ce, &consumed, previous_name, !j);
+			set_index_entry(p->istate, pos++, ce);
+			src_offset += consumed;
+		}
+	}
+	strbuf_release(&previous_name_buf);
+	return NULL;
+}
+
+struct load_extensions_data {
+	pthread_t pthread;
+	struct index_state *istate;
+	const char *mmap;
+	size_t mmap_size;
+	unsigned long src_offset;
+	int ret;
+};
+
+static void *load_extensions_thread(void *_data)
+{
+	struct load_extensions_data *p = _data;
+
+	p->ret = read_index_extensions(p->istate, p->mmap, p->mmap_size,
+				       p->src_offset);
+	return NULL;
+}
+
+/*
+ * Parse the entries in "nr_threads" threads that share the blocks of
+ * the "IEOT" extension, while another thread parses the extensions.
+ * Returns -1 if the extensions are corrupt.
+ */
+static int load_index_threaded(struct index_state *istate, const char *mmap,
+			       size_t mmap_size, unsigned long ext_offset,
+			       struct ieot_block *blocks, int nr_blocks,
+			       int nr_threads)
+{
+	struct load_extensions_data ext;
+	struct load_entries_data *data;
+	unsigned int pos = 0;
+	int i, err, block = 0;
+
+	ext.istate = istate;
+	ext.mmap = mmap;
+	ext.mmap_size = mmap_size;
+	ext.src_offset = ext_offset;
+	ext.ret = 0;
+	err = pthread_create(&ext.pthread, NULL, load_extensions_thread, &ext);
+	if (err)
+		die(_("unable to create index extension thread: %s"), strerror(err));
+
+	if (nr_threads > nr_blocks)
+		nr_threads = nr_blocks;
+	data = xcalloc(nr_threads, sizeof(*data));
+	for (i = 0; i < nr_threads; i++) {
+		struct load_entries_data *p = &data[i];
+		int j;
+
+		p->istate = istate;
+		p->mmap = mmap;
+		p->blocks = blocks + block;
+		p->nr_blocks = (nr_blocks - block) / (nr_threads - i);
+		p->first = pos;
+		for (j = 0; j < p->nr_blocks; j++)
+			pos += p->blocks[j].nr;
+		block += p->nr_blocks;
+
+		err = pthread_create(&p->pthread, NULL, load_entries_thread, p);
+		if (err)
+			die(_("unable to create index entry thread: %s"), strerror(err));
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(data[i].pthread, NULL);
+	pthread_join(ext.pthread, NULL);
+	free(data);
+	return ext.ret;
+}
+#endif
+
 /* remember to discard_cache() before reading a different cache! */
-int read_index_from(struct index_state *istate, const char *path)
+int do_read_index(struct index_state *istate, const char *path, int must_exist)
 {
 	int fd, i;
+#ifndef NO_PTHREADS
+	int nr_threads, err;
+#endif
 	struct stat st;
 	unsigned long src_offset;
 	struct cache_header *hdr;
@@ -1459,9 +1875,9 @@ int read_index_from(struct index_state *istate, const char *path)
 	istate->timestamp.nsec = 0;
 	fd = open(path, O_RDONLY);
 	if (fd < 0) {
-		if (errno == ENOENT)
+		if (!must_exist && errno == ENOENT)
 			return 0;
-		die_errno("index file open failed");
+		die_errno("%s: index file open failed", path);
 	}
 
 	if (fstat(fd, &st))
@@ -1477,6 +1893,7 @@ int read_index_from(struct index_state *istate, const char *path)
 	close(fd);
 
 	hdr = mmap;
+	read_index_config();
 	if (verify_hdr(hdr, mmap_size) < 0)
 		goto unmap;
 
@@ -1487,6 +1904,34 @@ int read_index_from(struct index_state *istate, const char *path)
 	istate->cache = xcalloc(istate->cache_alloc, sizeof(*istate->cache));
 	istate->initialized = 1;
 
+	istate->timestamp.sec = st.st_mtime;
+	istate->timestamp.nsec = ST_MTIME_NSEC(st);
+
+#ifndef NO_PTHREADS
+	nr_threads = index_nr_threads(istate->cache_nr);
+	if (nr_threads > 1) {
+		unsigned long ext_offset = read_eoie_extension(mmap, mmap_size);
+		struct ieot_block *blocks = NULL;
+		int nr_blocks = 0;
+
+		if (ext_offset)
+			nr_blocks = read_ieot_extension(mmap, mmap_size,
+							ext_offset,
+							istate->cache_nr,
+							&blocks);
+		if (nr_blocks) {
+			err = load_index_threaded(istate, mmap, mmap_size,
+						  ext_offset, blocks, nr_blocks,
+						  nr_threads);
+			free(blocks);
+			if (err < 0)
+				goto unmap;
+			munmap(mmap, mmap_size);
+			return istate->cache_nr;
+		}
+	}
+#endif
+
 	if (istate->version == 4)
 		previous_name = &previous_name_buf;
 	else
@@ -1499,33 +1944,15 @@ int read_index_from(struct index_state *istate, const char *path)
 		unsigned long consumed;
 
 		disk_ce = (struct ondisk_cache_entry *)((char *)mmap + src_offset);
-		ce = create_from_disk(disk_ce, &consumed, previous_name);
+		ce = create_from_disk(disk_ce, &consumed, previous_name, 0);
 		set_index_entry(istate, i, ce);
 
 		src_offset += consumed;
 	}
 	strbuf_release(&previous_name_buf);
-	istate->timestamp.sec = st.st_mtime;
-	istate->timestamp.nsec = ST_MTIME_NSEC(st);
 
-	while (src_offset <= mmap_size - 20 - 8) {
-		/* After an array of active_nr index entries,
-		 * there can be arbitrary number of extended
-		 * sections, each of which is prefixed with
-		 * extension name (4-byte) and section length
-		 * in 4-byte network byte order.
-		 */
-		uint32_t extsize;
-		memcpy(&extsize, (char *)mmap + src_offset + 4, 4);
-		extsize = ntohl(extsize);
-		if (read_index_extension(istate,
-					 (const char *) mmap + src_offset,
-					 (char *) mmap + src_offset + 8,
-					 extsize) < 0)
-			goto unmap;
-		src_offset += 8;
-		src_offset += extsize;
-	}
+	if (read_index_extensions(istate, mmap, mmap_size, src_offset) < 0)
+		goto unmap;
 	munmap(mmap, mmap_size);
 	return istate->cache_nr;
 
@@ -1534,6 +1961,78 @@ unmap:
 	die("index file corrupt");
 }
 
+/*
+ * The shared index lives next to the index file that was split;
+ * "name" is "sharedindex.<SHA-1>" or a temporary file name.
+ */
+static void shared_index_path(struct strbuf *sb, const char *index_file,
+			      const char *name)
+{
+	const char *slash = strrchr(index_file, '/');
+
+	strbuf_reset(sb);
+	if (slash)
+		strbuf_add(sb, index_file, slash + 1 - index_file);
+	strbuf_addstr(sb, name);
+}
+
+int read_index_from(struct index_state *istate, const char *path)
+{
+	struct split_index *split_index;
+	struct strbuf base_path = STRBUF_INIT, name = STRBUF_INIT;
+	int ret;
+
+	/* istate->initialized covers both .git/index and .git/sharedindex.xxx */
+	if (istate->initialized)
+		return istate->cache_nr;
+
+	ret = do_read_index(istate, path, 0);
+	split_index = istate->split_index;
+	if (!split_index || is_null_sha1(split_index->base_sha1)) {
+		tweak_fsmonitor(istate);
+		if (istate->sparse_index && command_requires_full_index) {
+			ensure_full_index(istate);
+			ret = istate->cache_nr;
+		}
+		return ret;
+	}
+
+	if (split_index->base)
+		discard_index(split_index->base);
+	else
+		split_index->base = xcalloc(1, sizeof(*split_index->base));
+
+	/*
+	 * An index written elsewhere (e.g. a temporary index, or one
+	 * given to --index-output) links to the shared index of the
+	 * repository's index file.
+	 */
+	strbuf_addf(&name, "sharedindex.%s",
+		    sha1_to_hex(split_index->base_sha1));
+	shared_index_path(&base_path, path, name.buf);
+	if (access(base_path.buf, F_OK) && errno == ENOENT)
+		shared_index_path(&base_path, get_index_file(), name.buf);
+	ret = do_read_index(split_index->base, base_path.buf, 1);
+	if (hashcmp(split_index->base_sha1, split_index->base->sha1))
+		die("broken index, expect %s in %s, got %s",
+		    sha1_to_hex(split_index->base_sha1), base_path.buf,
+		    sha1_to_hex(split_index->base->sha1));
+	strbuf_release(&base_path);
+	strbuf_release(&name);
+	merge_base_index(istate);
+
+	/*
+	 * Entries taken from the shared index are only as old as that
+	 * file, so racily clean ones must be judged against its mtime.
+	 */
+	if (split_index->base->timestamp.sec < istate->timestamp.sec ||
+	    (split_index->base->timestamp.sec == istate->timestamp.sec &&
+	     split_index->base->timestamp.nsec < istate->timestamp.nsec))
+		istate->timestamp = split_index->base->timestamp;
+	tweak_fsmonitor(istate);
+	return istate->cache_nr;
+}
+
 int is_index_unborn(struct index_state *istate)
 {
 	return (!istate->cache_nr && !istate->timestamp.sec);
@@ -1546,6 +2045,10 @@ int discard_index(struct index_state *istate)
 	for (i = 0; i < istate->cache_nr; i++)
 		free(istate->cache[i]);
 	resolve_undo_clear_index(istate);
+	discard_split_index(istate);
+	free_untracked_cache(istate->untracked);
+	istate->untracked = NULL;
+	discard_fsmonitor(istate);
 	istate->cache_nr = 0;
 	istate->cache_changed = 0;
 	istate->timestamp.sec = 0;
@@ -1553,6 +2056,7 @@ int discard_index(struct index_state *istate)
 	free_name_hash(istate);
 	cache_tree_free(&(istate->cache_tree));
 	istate->initialized = 0;
+	istate->sparse_index = 0;
 	free(istate->cache);
 	istate->cache = NULL;
 	istate->cache_alloc = 0;
@@ -1569,6 +2073,134 @@ int unmerged_index(const struct index_state *istate)
 	return 0;
 }
 
+/*
+ * Hashing the index in the background.  When the index is large
+ * enough to be loaded in threads, another thread computes the SHA-1
+ * of its trailer while it is written: what ce_write() flushes is
+ * copied into one of two chunks, and a full chunk is handed to the
+ * hashing thread while the other one fills up.
+ */
+#define HASH_CHUNK_SIZE (128 * 1024)
+
+#ifndef NO_PTHREADS
+static struct index_hasher {
+	int wanted, active;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	git_SHA_CTX *context;
+	unsigned char *chunk[2];
+	unsigned long len[2];
+	int queued[2];
+	int filling, finish;
+} hasher;
+
+static void *index_hash_thread(void *data)
+{
+	int next = 0;
+
+	pthread_mutex_lock(&hasher.mutex);
+	for (;;) {
+		if (hasher.queued[next]) {
+			pthread_mutex_unlock(&hasher.mutex);
+			git_SHA1_Update(hasher.context, hasher.chunk[next],
+					hasher.len[next]);
+			pthread_mutex_lock(&hasher.mutex);
+			hasher.queued[next] = 0;
+			next ^= 1;
+			pthread_cond_signal(&hasher.cond);
+		} else if (hasher.finish)
+			break;
+		else
+			pthread_cond_wait(&hasher.cond, &hasher.mutex);
+	}
+	pthread_mutex_unlock(&hasher.mutex);
+	return NULL;
+}
+
+static void start_index_hash(git_SHA_CTX *context)
+{
+	int err;
+
+	hasher.context = context;
+	hasher.chunk[0] = xmalloc(HASH_CHUNK_SIZE);
+	hasher.chunk[1] = xmalloc(HASH_CHUNK_SIZE);
+	pthread_mutex_init(&hasher.mutex, NULL);
+	pthread_cond_init(&hasher.cond, NULL);
+	err = pthread_create(&hasher.thread, NULL, index_hash_thread, NULL);
+	if (err)
+		die(_("unable to create index hashing thread: %s"),
+		    strerror(err));
+	hasher.active = 1;
+}
+
+/* Hand the chunk being filled to the thread, and wait for the other. */
+static void queue_index_hash_chunk(void)
+{
+	int cur = hasher.filling;
+
+	pthread_mutex_lock(&hasher.mutex);
+	hasher.queued[cur] = 1;
+	pthread_cond_signal(&hasher.cond);
+	cur ^= 1;
+	while (hasher.queued[cur])
+		pthread_cond_wait(&hasher.cond, &hasher.mutex);
+	pthread_mutex_unlock(&hasher.mutex);
+	hasher.filling = cur;
+	hasher.len[cur] = 0;
+}
+#endif
+
+static void index_hash_update(git_SHA_CTX *context, const void *data,
+			      unsigned long len)
+{
+#ifndef NO_PTHREADS
+	if (hasher.wanted) {
+		if (!hasher.active)
+			start_index_hash(context);
+		while (len) {
+			int cur = hasher.filling;
+			unsigned long partial = HASH_CHUNK_SIZE - hasher.len[cur];
+
+			if (partial > len)
+				partial = len;
+			memcpy(hasher.chunk[cur] + hasher.len[cur], data, partial);
+			hasher.len[cur] += partial;
+			if (hasher.len[cur] == HASH_CHUNK_SIZE)
+				queue_index_hash_chunk();
+			len -= partial;
+			data = (const char *) data + partial;
+		}
+		return;
+	}
+#endif
+	git_SHA1_Update(context, data, len);
+}
+
+/* Wait until everything given to index_hash_update() is hashed. */
+static void finish_index_hash(void)
+{
+#ifndef NO_PTHREADS
+	if (!hasher.active) {
+		hasher.wanted = 0;
+		return;
+	}
+	if (hasher.len[hasher.filling])
+		queue_index_hash_chunk();
+	pthread_mutex_lock(&hasher.mutex);
+	hasher.finish = 1;
+	pthread_cond_signal(&hasher.cond);
+	pthread_mutex_unlock(&hasher.mutex);
+	pthread_join(hasher.thread, NULL);
+
+	pthread_cond_destroy(&hasher.cond);
+	pthread_mutex_destroy(&hasher.mutex);
+	free(hasher.chunk[0]);
+	free(hasher.chunk[1]);
+	memset(&hasher, 0, sizeof(hasher));
+#endif
+}
+
 #define WRITE_BUFFER_SIZE 8192
 static unsigned char write_buffer[WRITE_BUFFER_SIZE];
 static unsigned long write_buffer_len;
@@ -1577,7 +2209,7 @@ static int ce_write_flush(git_SHA_CTX *context, int fd)
 {
 	unsigned int buffered = write_buffer_len;
 	if (buffered) {
-		git_SHA1_Update(context, write_buffer, buffered);
+		index_hash_update(context, write_buffer, buffered);
 		if (write_in_full(fd, write_buffer, buffered) != buffered)
 			return -1;
 		write_buffer_len = 0;
@@ -1607,23 +2239,38 @@ static int ce_write(git_SHA_CTX *context, int fd, void *data, unsigned int len)
 	return 0;
 }
 
-static int write_index_ext_header(git_SHA_CTX *context, int fd,
-				  unsigned int ext, unsigned int sz)
+static int write_index_ext_header(git_SHA_CTX *context, git_SHA_CTX *eoie_context,
+				  int fd, unsigned int ext, unsigned int sz)
 {
 	ext = htonl(ext);
 	sz = htonl(sz);
+	if (eoie_context) {
+		git_SHA1_Update(eoie_context, &ext, 4);
+		git_SHA1_Update(eoie_context, &sz, 4);
+	}
 	return ((ce_write(context, fd, &ext, 4) < 0) ||
 		(ce_write(context, fd, &sz, 4) < 0)) ? -1 : 0;
 }
 
-static int ce_flush(git_SHA_CTX *context, int fd)
+/* Where the next byte given to ce_write() goes in the file. */
+static off_t ce_write_offset(int fd)
+{
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+
+	if (offset < 0)
+		return offset;
+	return offset + write_buffer_len;
+}
+
+static int ce_flush(git_SHA_CTX *context, int fd, unsigned char *sha1)
 {
 	unsigned int left = write_buffer_len;
 
 	if (left) {
 		write_buffer_len = 0;
-		git_SHA1_Update(context, write_buffer, left);
+		index_hash_update(context, write_buffer, left);
 	}
+	finish_index_hash();
 
 	/* Flush first if not enough space for SHA1 signature */
 	if (left + 20 > WRITE_BUFFER_SIZE) {
@@ -1634,6 +2281,7 @@ static int ce_flush(git_SHA_CTX *context, int fd)
 
 	/* Append the SHA1 signature at the end */
 	git_SHA1_Final(write_buffer + left, context);
+	hashcpy(sha1, write_buffer + left);
 	left += 20;
 	return (write_in_full(fd, write_buffer, left) != left) ? -1 : 0;
 }
@@ -1833,7 +2481,8 @@ void update_index_if_able(struct index_state *istate, struct lock_file *lockfile
 		rollback_lock_file(lockfile);
 }
 
-int write_index(struct index_state *istate, int newfd)
+static int write_index_to(struct index_state *istate, int newfd,
+			  int strip_extensions)
 {
 	git_SHA_CTX c;
 	struct cache_header hdr;
@@ -1842,6 +2491,10 @@ int write_index(struct index_state *istate, int newfd)
 	int entries = istate->cache_nr;
 	struct stat st;
 	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	git_SHA_CTX eoie_context, *eoie_c = NULL;
+	struct ieot_block *blocks = NULL;
+	int nr_blocks = 0, block_entries = 0, written = 0;
+	off_t offset = 0;
 
 	for (i = removed = extended = 0; i < entries; i++) {
 		if (cache[i]->ce_flags & CE_REMOVE)
@@ -1872,6 +2525,16 @@ int write_index(struct index_state *istate, int newfd)
 	if (ce_write(&c, newfd, &hdr, sizeof(hdr)) < 0)
 		return -1;
 
+	read_index_config();
+	if (record_offset_table) {
+		int nr_threads = index_nr_threads(entries - removed);
+
+		if (nr_threads > 1) {
+			blocks = xcalloc(nr_threads, sizeof(*blocks));
+			block_entries = DIV_ROUND_UP(entries - removed, nr_threads);
+		}
+	}
+
 	previous_name = (hdr_version == 4) ? &previous_name_buf : NULL;
 	for (i = 0; i < entries; i++) {
 		struct cache_entry *ce = cache[i];
@@ -1890,41 +2553,304 @@ int write_index(struct index_state *istate, int newfd)
 			else
 				return error(msg, ce->name);
 		}
+		if (blocks && !(written % block_entries)) {
+			offset = ce_write_offset(newfd);
+			if (offset < 0)
+				return -1;
+			blocks[nr_blocks++].offset = offset;
+			/*
+			 * Share no prefix with the entry before, so that
+			 * the block can be read on its own.
+			 */
+			if (previous_name && previous_name->len)
+				previous_name->buf[0] = '\0';
+		}
 		if (ce_write_entry(&c, newfd, ce, previous_name) < 0)
 			return -1;
+		if (blocks)
+			blocks[nr_blocks - 1].nr++;
+		written++;
 	}
 	strbuf_release(&previous_name_buf);
 
+	if (record_offset_table) {
+		offset = ce_write_offset(newfd);
+		if (offset < 0)
+			return -1;
+		git_SHA1_Init(&eoie_context);
+		eoie_c = &eoie_context;
+	}
+
 	/* Write extension data here */
-	if (istate->cache_tree) {
+	if (!strip_extensions && istate->split_index) {
+		struct strbuf sb = STRBUF_INIT;
+
+		err = write_link_extension(&sb, istate) < 0 ||
+			write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_LINK,
+					       sb.len) < 0 ||
+			ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+	if (!strip_extensions && istate->cache_tree) {
 		struct strbuf sb = STRBUF_INIT;
 
 		cache_tree_write(&sb, istate->cache_tree);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_TREE, sb.len) < 0
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_TREE, sb.len) < 0
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
 			return -1;
 	}
-	if (istate->resolve_undo) {
+	if (!strip_extensions && istate->resolve_undo) {
 		struct strbuf sb = STRBUF_INIT;
 
 		resolve_undo_write(&sb, istate->resolve_undo);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_RESOLVE_UNDO,
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_RESOLVE_UNDO,
 					     sb.len) < 0
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
 			return -1;
 	}
+	if (!strip_extensions && fsmonitor_is_active(istate) &&
+	    istate->fsmonitor_dirty) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_fsmonitor_extension(&sb, istate);
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_FSMONITOR,
+					     sb.len) < 0 ||
+			ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+	if (!strip_extensions && istate->sparse_index) {
+		err = write_index_ext_header(&c, eoie_c, newfd,
+					     CACHE_EXT_SPARSE_DIRECTORIES, 0) < 0;
+		if (err)
+			return -1;
+	}
+	if (!strip_extensions && istate->untracked) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_untracked_extension(&sb, istate->untracked);
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_UNTRACKED,
+					     sb.len) < 0 ||
+			ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+
+	if (blocks) {
+		struct strbuf sb = STRBUF_INIT;
+
+		strbuf_add_be32(&sb, IEOT_VERSION);
+		for (i = 0; i < nr_blocks; i++) {
+			strbuf_add_be32(&sb, blocks[i].offset);
+			strbuf_add_be32(&sb, blocks[i].nr);
+		}
+		free(blocks);
+		err = write_index_ext_header(&c, eoie_c, newfd,
+					     CACHE_EXT_INDEXENTRYOFFSETTABLE,
+					     sb.len) < 0 ||
+			ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+	if (eoie_c) {
+		struct strbuf sb = STRBUF_INIT;
+		unsigned char sha1[20];
 
-	if (ce_flush(&c, newfd) || fstat(newfd, &st))
+		/* where the entries end, and what extensions follow them */
+		strbuf_add_be32(&sb, offset);
+		git_SHA1_Final(sha1, eoie_c);
+		strbuf_add(&sb, sha1, 20);
+		err = write_index_ext_header(&c, NULL, newfd,
+					     CACHE_EXT_ENDOFINDEXENTRIES,
+					     sb.len) < 0 ||
+			ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+
+	if (ce_flush(&c, newfd, istate->sha1) || fstat(newfd, &st))
 		return -1;
 	istate->timestamp.sec = (unsigned int)st.st_mtime;
 	istate->timestamp.nsec = ST_MTIME_NSEC(st);
 	return 0;
 }
 
+static int do_write_index(struct index_state *istate, int newfd,
+			  int strip_extensions)
+{
+	int ret;
+
+#ifndef NO_PTHREADS
+	read_index_config();
+	hasher.wanted = index_nr_threads(istate->cache_nr) > 1;
+#endif
+	ret = write_index_to(istate, newfd, strip_extensions);
+	/* in case it failed before flushing */
+	finish_index_hash();
+	return ret;
+}
+
+static int write_split_index(struct index_state *istate, int newfd)
+{
+	int ret;
+
+	prepare_to_write_split_index(istate);
+	ret = do_write_index(istate, newfd, 0);
+	finish_writing_split_index(istate);
+	return ret;
+}
+
+/*
+ * Every index written in split mode touches its shared index, so one
+ * that has not been touched since splitIndex.sharedIndexExpire is no
+ * longer used by any index that is still being written to.
+ */
+static void freshen_shared_index(const unsigned char *sha1)
+{
+	struct strbuf path = STRBUF_INIT;
+
+	shared_index_path(&path, get_index_file(), "sharedindex.");
+	strbuf_addstr(&path, sha1_to_hex(sha1));
+	if (utime(path.buf, NULL) < 0 && errno != ENOENT)
+		warning("failed utime() on %s: %s", path.buf, strerror(errno));
+	strbuf_release(&path);
+}
+
+/* Remove the shared index files other than "current" that expired. */
+static void clean_shared_index_files(const char *current)
+{
+	struct strbuf path = STRBUF_INIT;
+	unsigned long expire;
+	struct dirent *de;
+	size_t baselen;
+	DIR *dir;
+
+	if (!split_index_shared_expire ||
+	    !strcmp(split_index_shared_expire, "never"))
+		return;
+	expire = approxidate(split_index_shared_expire);
+
+	shared_index_path(&path, get_index_file(), "");
+	dir = opendir(path.len ? path.buf : ".");
+	if (!dir) {
+		strbuf_release(&path);
+		return;
+	}
+	baselen = path.len;
+	while ((de = readdir(dir)) != NULL) {
+		const char *hex;
+		struct stat st;
+
+		if (!skip_prefix(de->d_name, "sharedindex.", &hex) ||
+		    !strcmp(hex, current))
+			continue;
+		strbuf_setlen(&path, baselen);
+		strbuf_addstr(&path, de->d_name);
+		if (!stat(path.buf, &st) && st.st_mtime <= expire)
+			unlink_or_warn(path.buf);
+	}
+	closedir(dir);
+	strbuf_release(&path);
+}
+
+static int write_shared_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	struct strbuf temp = STRBUF_INIT, path = STRBUF_INIT;
+	int fd, ret;
+
+	move_cache_to_base_index(istate);
+	shared_index_path(&temp, get_index_file(), "sharedindex_XXXXXX");
+	fd = xmkstemp_mode(temp.buf, 0666);
+	ret = do_write_index(si->base, fd, 1);
+	if (close(fd))
+		ret = -1;
+	if (!ret)
+		ret = adjust_shared_perm(temp.buf);
+	if (!ret) {
+		shared_index_path(&path, get_index_file(), "sharedindex.");
+		strbuf_addstr(&path, sha1_to_hex(si->base->sha1));
+		ret = rename(temp.buf, path.buf);
+	}
+	if (ret)
+		unlink_or_warn(temp.buf);
+	else
+		hashcpy(si->base_sha1, si->base->sha1);
+	strbuf_release(&temp);
+	strbuf_release(&path);
+	if (!ret)
+		clean_shared_index_files(sha1_to_hex(si->base_sha1));
+	return ret ? -1 : 0;
+}
+
+int write_index(struct index_state *istate, int newfd)
+{
+	struct split_index *si = istate->split_index;
+	int i;
+
+	if (!si && use_sparse_index && core_apply_sparse_checkout) {
+		int collapsed = prepare_to_write_sparse_index(istate);
+		int ret;
+
+		/* the bitmap follows the entries as they are written */
+		if (fsmonitor_is_active(istate))
+			fill_fsmonitor_bitmap(istate);
+		ret = do_write_index(istate, newfd, 0);
+		if (collapsed)
+			finish_writing_sparse_index(istate);
+		return ret;
+	}
+	ensure_full_index(istate);
+
+	/* positions in the bitmap are those of the whole index */
+	if (fsmonitor_is_active(istate))
+		fill_fsmonitor_bitmap(istate);
+
+	if (!si)
+		return do_write_index(istate, newfd, 0);
+
+	/* the shared and the split index are written in the same format */
+	if (!istate->version)
+		istate->version = get_index_format_default();
+
+	/*
+	 * Entries left in the shared index are not written again, so
+	 * racily clean ones must be smudged before they are compared
+	 * with it; do_write_index() only sees the ones it writes.
+	 */
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		if (!(ce->ce_flags & CE_REMOVE) &&
+		    !ce_uptodate(ce) && is_racy_timestamp(istate, ce))
+			ce_smudge_racily_clean_entry(ce);
+	}
+
+	if (si->base) {
+		prepare_to_write_split_index(istate);
+		if (!split_index_too_large(istate)) {
+			int ret = do_write_index(istate, newfd, 0);
+			finish_writing_split_index(istate);
+			if (!ret)
+				freshen_shared_index(si->base_sha1);
+			return ret;
+		}
+		finish_writing_split_index(istate);
+	}
+	if (write_shared_index(istate))
+		return -1;
+	return write_split_index(istate, newfd);
+}
+
 /*
  * Read the index file that is potentially unmerged into given
  * index_state, dropping any unmerged entries.  Returns true if
@@ -4,6 +4,8 @@
 #include "tag.h"
 #include "dir.h"
 #include "string-list.h"
+#include "reftable.h"
+#include "argv-array.h"
 
 /*
  * How to handle various characters in refnames:
@@ -340,6 +342,7 @@ struct ref_value {
 };
 
 struct ref_cache;
+struct packed_ref_cache;
 
 /*
  * Information used (along with the information in ref_entry) to
@@ -365,7 +368,10 @@ struct ref_cache;
  * directory of loose references is read, then all of the references
  * in that directory are stored, and REF_INCOMPLETE stubs are created
  * for any subdirectories, but the subdirectories themselves are not
- * read.  The reading is triggered by get_ref_dir().
+ * read.  The reading is triggered by get_ref_dir().  Packed
+ * references are read the same way when they come from a sorted
+ * packed-refs file or from a reftable stack, which can be searched
+ * without parsing all of them (see read_lazy_packed_refs()).
  */
 struct ref_dir {
 	int nr, alloc;
@@ -381,6 +387,12 @@ struct ref_dir {
 	/* A pointer to the ref_cache that contains this ref_dir. */
 	struct ref_cache *ref_cache;
 
+	/*
+	 * For packed references that are read lazily, the cache to
+	 * read this directory from while it is REF_INCOMPLETE.
+	 */
+	struct packed_ref_cache *packed;
+
 	struct ref_entry **entries;
 };
 
@@ -402,7 +414,8 @@ struct ref_dir {
 
 /*
  * Entry has not yet been read from disk (used only for REF_DIR
- * entries representing loose references)
+ * entries representing loose references or lazily read packed
+ * references)
  */
 #define REF_INCOMPLETE 0x20
 
@@ -415,7 +428,8 @@ struct ref_dir {
  * that holds the entries in that directory that have been read so
  * far.  If (flags & REF_INCOMPLETE) is set, then the directory and
  * its subdirectories haven't been read yet.  REF_INCOMPLETE is only
- * used for loose reference directories.
+ * used for loose reference directories and for packed references
+ * that are read lazily.
  *
  * References are represented by a ref_entry with (flags & REF_DIR)
  * unset and a value member that describes the reference's value.  The
@@ -460,6 +474,7 @@ struct ref_entry {
 };
 
 static void read_loose_refs(const char *dirname, struct ref_dir *dir);
+static void read_lazy_packed_refs(const char *dirname, struct ref_dir *dir);
 
 static struct ref_dir *get_ref_dir(struct ref_entry *entry)
 {
@@ -467,7 +482,10 @@ static struct ref_dir *get_ref_dir(struct ref_entry *entry)
 	assert(entry->flag & REF_DIR);
 	dir = &entry->u.subdir;
 	if (entry->flag & REF_INCOMPLETE) {
-		read_loose_refs(entry->name, dir);
+		if (dir->packed)
+			read_lazy_packed_refs(entry->name, dir);
+		else
+			read_loose_refs(entry->name, dir);
 		entry->flag &= ~REF_INCOMPLETE;
 	}
 	return dir;
@@ -862,14 +880,29 @@ static int do_one_ref(struct ref_entry *entry, void *cb_data)
 	return retval;
 }
 
+/*
+ * Is the subdirectory "entry" of the directory containing "prefix" (or
+ * any directory if prefix is NULL) worth descending into to find
+ * references that start with prefix?  The references below it either
+ * all start with prefix or none of them does.
+ */
+static int subdir_matches(struct ref_entry *entry, const char *prefix)
+{
+	return !prefix || starts_with(entry->name, prefix);
+}
+
 /*
  * Call fn for each reference in dir that has index in the range
  * offset <= index < dir->nr.  Recurse into subdirectories that are in
- * that index range, sorting them before iterating.  This function
- * does not sort dir itself; it should be sorted beforehand.  fn is
- * called for all references, including broken ones.
+ * that index range, sorting them before iterating.  If prefix is not
+ * NULL, dir must be the directory containing it, and subdirectories
+ * that cannot hold a reference starting with prefix are skipped.
+ * This function does not sort dir itself; it should be sorted
+ * beforehand.  fn is called for all references, including broken
+ * ones.
  */
 static int do_for_each_entry_in_dir(struct ref_dir *dir, int offset,
+				    const char *prefix,
 				    each_ref_entry_fn fn, void *cb_data)
 {
 	int i;
@@ -878,9 +911,13 @@ static int do_for_each_entry_in_dir(struct ref_dir *dir, int offset,
 		struct ref_entry *entry = dir->entries[i];
 		int retval;
 		if (entry->flag & REF_DIR) {
-			struct ref_dir *subdir = get_ref_dir(entry);
+			struct ref_dir *subdir;
+			if (!subdir_matches(entry, prefix))
+				continue;
+			subdir = get_ref_dir(entry);
 			sort_ref_dir(subdir);
-			retval = do_for_each_entry_in_dir(subdir, 0, fn, cb_data);
+			retval = do_for_each_entry_in_dir(subdir, 0, NULL,
+							  fn, cb_data);
 		} else {
 			retval = fn(entry, cb_data);
 		}
@@ -895,11 +932,12 @@ static int do_for_each_entry_in_dir(struct ref_dir *dir, int offset,
  * by refname.  Recurse into subdirectories.  If a value entry appears
  * in both dir1 and dir2, then only process the version that is in
  * dir2.  The input dirs must already be sorted, but subdirs will be
- * sorted as needed.  fn is called for all references, including
- * broken ones.
+ * sorted as needed.  prefix is as for do_for_each_entry_in_dir().
+ * fn is called for all references, including broken ones.
  */
 static int do_for_each_entry_in_dirs(struct ref_dir *dir1,
 				     struct ref_dir *dir2,
+				     const char *prefix,
 				     each_ref_entry_fn fn, void *cb_data)
 {
 	int retval;
@@ -911,10 +949,12 @@ static int do_for_each_entry_in_dirs(struct ref_dir *dir1,
 		struct ref_entry *e1, *e2;
 		int cmp;
 		if (i1 == dir1->nr) {
-			return do_for_each_entry_in_dir(dir2, i2, fn, cb_data);
+			return do_for_each_entry_in_dir(dir2, i2, prefix,
+							fn, cb_data);
 		}
 		if (i2 == dir2->nr) {
-			return do_for_each_entry_in_dir(dir1, i1, fn, cb_data);
+			return do_for_each_entry_in_dir(dir1, i1, prefix,
+							fn, cb_data);
 		}
 		e1 = dir1->entries[i1];
 		e2 = dir2->entries[i2];
@@ -922,14 +962,17 @@ static int do_for_each_entry_in_dirs(struct ref_dir *dir1,
 		if (cmp == 0) {
 			if ((e1->flag & REF_DIR) && (e2->flag & REF_DIR)) {
 				/* Both are directories; descend them in parallel. */
-				struct ref_dir *subdir1 = get_ref_dir(e1);
-				struct ref_dir *subdir2 = get_ref_dir(e2);
+				struct ref_dir *subdir1, *subdir2;
+				i1++;
+				i2++;
+				if (!subdir_matches(e1, prefix))
+					continue;
+				subdir1 = get_ref_dir(e1);
+				subdir2 = get_ref_dir(e2);
 				sort_ref_dir(subdir1);
 				sort_ref_dir(subdir2);
 				retval = do_for_each_entry_in_dirs(
-						subdir1, subdir2, fn, cb_data);
-				i1++;
-				i2++;
+						subdir1, subdir2, NULL, fn, cb_data);
 			} else if (!(e1->flag & REF_DIR) && !(e2->flag & REF_DIR)) {
 				/* Both are references; ignore the one from dir1. */
 				retval = fn(e2, cb_data);
@@ -949,10 +992,13 @@ static int do_for_each_entry_in_dirs(struct ref_dir *dir1,
 				i2++;
 			}
 			if (e->flag & REF_DIR) {
-				struct ref_dir *subdir = get_ref_dir(e);
+				struct ref_dir *subdir;
+				if (!subdir_matches(e, prefix))
+					continue;
+				subdir = get_ref_dir(e);
 				sort_ref_dir(subdir);
 				retval = do_for_each_entry_in_dir(
-						subdir, 0, fn, cb_data);
+						subdir, 0, NULL, fn, cb_data);
 			} else {
 				retval = fn(e, cb_data);
 			}
@@ -966,15 +1012,16 @@ static int do_for_each_entry_in_dirs(struct ref_dir *dir1,
  * Load all of the refs from the dir into our in-memory cache. The hard work
  * of loading loose refs is done by get_ref_dir(), so we just need to recurse
  * through all of the sub-directories. We do not even need to care about
- * sorting, as traversal order does not matter to us.
+ * sorting, as traversal order does not matter to us.  prefix is as for
+ * do_for_each_entry_in_dir().
  */
-static void prime_ref_dir(struct ref_dir *dir)
+static void prime_ref_dir(struct ref_dir *dir, const char *prefix)
 {
 	int i;
 	for (i = 0; i < dir->nr; i++) {
 		struct ref_entry *entry = dir->entries[i];
-		if (entry->flag & REF_DIR)
-			prime_ref_dir(get_ref_dir(entry));
+		if ((entry->flag & REF_DIR) && subdir_matches(entry, prefix))
+			prime_ref_dir(get_ref_dir(entry), NULL);
 	}
 }
 /*
@@ -1021,17 +1068,45 @@ static int is_refname_available(const char *refname, const char *oldrefname,
 				struct ref_dir *dir)
 {
 	struct name_conflict_cb data;
+	struct strbuf dirname = STRBUF_INIT;
+	const char *slash;
+
 	data.refname = refname;
 	data.oldrefname = oldrefname;
 	data.conflicting_refname = NULL;
 
-	sort_ref_dir(dir);
-	if (do_for_each_entry_in_dir(dir, 0, name_conflict_fn, &data)) {
-		error("'%s' exists; cannot create '%s'",
-		      data.conflicting_refname, refname);
-		return 0;
+	/*
+	 * Only the references named like a leading directory of
+	 * refname, and those within the directory named refname, can
+	 * conflict; look at just those so that the rest of the
+	 * references need not be read.
+	 */
+	for (slash = strchr(refname, '/'); slash; slash = strchr(slash + 1, '/')) {
+		struct ref_entry *entry;
+
+		strbuf_reset(&dirname);
+		strbuf_add(&dirname, refname, slash - refname);
+		entry = find_ref(dir, dirname.buf);
+		if (entry && name_conflict_fn(entry, &data))
+			goto conflict;
+	}
+
+	strbuf_reset(&dirname);
+	strbuf_addf(&dirname, "%s/", refname);
+	dir = find_containing_dir(dir, dirname.buf, 0);
+	if (dir) {
+		sort_ref_dir(dir);
+		if (do_for_each_entry_in_dir(dir, 0, NULL, name_conflict_fn, &data))
+			goto conflict;
 	}
+	strbuf_release(&dirname);
 	return 1;
+
+conflict:
+	error("'%s' exists; cannot create '%s'",
+	      data.conflicting_refname, refname);
+	strbuf_release(&dirname);
+	return 0;
 }
 
 struct packed_ref_cache {
@@ -1056,6 +1131,33 @@ struct packed_ref_cache {
 
 	/* The metadata from when this packed-refs cache was read */
 	struct stat_validity validity;
+
+	/*
+	 * The contents of packed-refs, mapped into memory, and where
+	 * its records start (after the header).  If the file is
+	 * sorted, the directories of root are read lazily from it.
+	 */
+	void *map;
+	size_t map_len;
+	const char *records, *eof;
+	enum { PEELED_NONE, PEELED_TAGS, PEELED_FULLY } peeled;
+
+	/*
+	 * If the packed references are stored in a reftable stack
+	 * ($GIT_DIR/reftable) instead of packed-refs, the stack; the
+	 * directories of root are then always read lazily.  The
+	 * changes to write out when the stack is locked are kept in
+	 * "updates".
+	 */
+	struct reftable_stack *reftable;
+
+	/*
+	 * Single references looked up directly in packed-refs or the
+	 * reftable stack, without reading the directories of root.
+	 */
+	struct ref_entry *lookups;
+	struct reftable_ref *updates;
+	int nr_updates, alloc_updates;
 };
 
 /*
@@ -1085,6 +1187,18 @@ static void acquire_packed_ref_cache(struct packed_ref_cache *packed_refs)
 	packed_refs->referrers++;
 }
 
+/* Forget the changes queued for the locked reftable stack. */
+static void clear_reftable_updates(struct packed_ref_cache *packed_refs)
+{
+	int i;
+
+	for (i = 0; i < packed_refs->nr_updates; i++)
+		free((char *)packed_refs->updates[i].refname);
+	free(packed_refs->updates);
+	packed_refs->updates = NULL;
+	packed_refs->nr_updates = packed_refs->alloc_updates = 0;
+}
+
 /*
  * Decrease the reference count of *packed_refs.  If it goes to zero,
  * free *packed_refs and return true; otherwise return false.
@@ -1093,6 +1207,12 @@ static int release_packed_ref_cache(struct packed_ref_cache *packed_refs)
 {
 	if (!--packed_refs->referrers) {
 		free_ref_entry(packed_refs->root);
+		if (packed_refs->lookups)
+			free_ref_entry(packed_refs->lookups);
+		clear_reftable_updates(packed_refs);
+		reftable_stack_free(packed_refs->reftable);
+		if (packed_refs->map)
+			munmap(packed_refs->map, packed_refs->map_len);
 		stat_validity_clear(&packed_refs->validity);
 		free(packed_refs);
 		return 1;
@@ -1164,43 +1284,177 @@ static struct ref_cache *get_ref_cache(const char *submodule)
  * traits will be added later.  The trailing space is required.
  */
 static const char PACKED_REFS_HEADER[] =
-	"# pack-refs with: peeled fully-peeled \n";
+	"# pack-refs with: peeled fully-peeled sorted \n";
 
 /*
- * Parse one line from a packed-refs file.  Write the SHA1 to sha1.
- * Return a pointer to the refname within the line (null-terminated),
- * or NULL if there was a problem.
+ * Parse the record of packed-refs at *pos, a reference line followed
+ * by an optional peeled line, and advance *pos past it.  Return 0 and
+ * fill ref (its refname is kept in "refname"), or -1 if the line is
+ * not a reference; it is skipped all the same.
  */
-static const char *parse_ref_line(char *line, unsigned char *sha1)
+static int parse_packed_ref_record(struct packed_ref_cache *packed_refs,
+				   const char **pos, struct strbuf *refname,
+				   struct reftable_ref *ref)
 {
+	const char *line = *pos, *eol;
+
+	eol = memchr(line, '\n', packed_refs->eof - line);
+	if (!eol) {
+		*pos = packed_refs->eof;
+		return -1;
+	}
+	*pos = eol + 1;
+
 	/*
 	 * 42: the answer to everything.
 	 *
 	 * In this case, it happens to be the answer to
 	 *  40 (length of sha1 hex representation)
 	 *  +1 (space in between hex and name)
-	 *  +1 (newline at the end of the line)
+	 *  +1 (at least one character of the name)
 	 */
-	int len = strlen(line) - 42;
+	if (eol - line < 42 ||
+	    get_sha1_hex(line, ref->sha1) < 0 ||
+	    !isspace(line[40]) || isspace(line[41]))
+		return -1;
+	strbuf_reset(refname);
+	strbuf_add(refname, line + 41, eol - line - 41);
+	ref->refname = refname->buf;
+	ref->flags = 0;
+	hashclr(ref->peeled);
+
+	line = *pos;
+	if (packed_refs->eof - line >= PEELED_LINE_LENGTH &&
+	    line[0] == '^' &&
+	    line[PEELED_LINE_LENGTH - 1] == '\n' &&
+	    !get_sha1_hex(line + 1, ref->peeled)) {
+		*pos = line + PEELED_LINE_LENGTH;
+		/*
+		 * Regardless of what the file header said, we
+		 * definitely know the value of *this* reference:
+		 */
+		ref->flags |= REFTABLE_PEELED;
+	} else if (packed_refs->peeled == PEELED_FULLY ||
+		   (packed_refs->peeled == PEELED_TAGS &&
+		    starts_with(refname->buf, "refs/tags/"))) {
+		hashclr(ref->peeled);
+		ref->flags |= REFTABLE_PEELED;
+	}
+	return 0;
+}
 
-	if (len <= 0)
-		return NULL;
-	if (get_sha1_hex(line, sha1) < 0)
-		return NULL;
-	if (!isspace(line[40]))
-		return NULL;
+/* Compare the refname of the reference line at "line" with "name". */
+static int packed_ref_line_cmp(struct packed_ref_cache *packed_refs,
+			       const char *line, const char *name)
+{
+	const char *eol = memchr(line, '\n', packed_refs->eof - line);
+	size_t len, namelen = strlen(name);
+	int cmp;
+
+	if (!eol || eol - line < 42 || line[40] != ' ')
+		die("unexpected line in sorted packed-refs: %.*s",
+		    (int)((eol ? eol : packed_refs->eof) - line), line);
 	line += 41;
-	if (isspace(*line))
-		return NULL;
-	if (line[len] != '\n')
-		return NULL;
-	line[len] = 0;
+	len = eol - line;
+	cmp = memcmp(line, name, len < namelen ? len : namelen);
+	if (cmp)
+		return cmp;
+	return len < namelen ? -1 : len > namelen;
+}
+
+/*
+ * Return the start of the first record of the sorted packed-refs
+ * whose refname sorts at or after "name", or its end.
+ */
+static const char *find_packed_ref_record(struct packed_ref_cache *packed_refs,
+					  const char *name)
+{
+	const char *lo = packed_refs->records, *hi = packed_refs->eof;
+
+	while (lo < hi) {
+		const char *mid = lo + (hi - lo) / 2, *line = mid;
+
+		while (line > lo && line[-1] != '\n')
+			line--;
+		if (*line == '^' && line > lo) {
+			/* a peeled line belongs to the record before it */
+			line--;
+			while (line > lo && line[-1] != '\n')
+				line--;
+		}
+		if (packed_ref_line_cmp(packed_refs, line, name) < 0) {
+			line = memchr(line, '\n', hi - line) + 1;
+			if (line < hi && *line == '^') {
+				const char *eol = memchr(line, '\n', hi - line);
+				line = eol ? eol + 1 : hi;
+			}
+			lo = line;
+		} else {
+			hi = line;
+		}
+	}
+	return lo;
+}
+
+/*
+ * A cursor over the packed references of a packed_ref_cache whose
+ * directories are read lazily, from packed-refs or a reftable stack.
+ */
+struct packed_ref_iterator {
+	struct packed_ref_cache *packed_refs;
+	const char *pos;
+	struct strbuf refname;
+	struct reftable_iterator reftable;
+};
+#define PACKED_REF_ITERATOR_INIT { NULL, NULL, STRBUF_INIT, REFTABLE_ITERATOR_INIT }
+
+static void packed_ref_iterator_seek(struct packed_ref_iterator *iter,
+				     struct packed_ref_cache *packed_refs,
+				     const char *name)
+{
+	iter->packed_refs = packed_refs;
+	if (packed_refs->reftable)
+		reftable_stack_seek(packed_refs->reftable, &iter->reftable, name);
+	else
+		iter->pos = find_packed_ref_record(packed_refs, name);
+}
+
+/* Return 0 and fill ref with the next reference, or 1 at the end. */
+static int packed_ref_iterator_next(struct packed_ref_iterator *iter,
+				    struct reftable_ref *ref)
+{
+	struct packed_ref_cache *packed_refs = iter->packed_refs;
+
+	if (packed_refs->reftable)
+		return reftable_iterator_next(&iter->reftable, ref);
+	while (iter->pos < packed_refs->eof)
+		if (!parse_packed_ref_record(packed_refs, &iter->pos,
+					     &iter->refname, ref))
+			return 0;
+	return 1;
+}
 
-	return line;
+static void packed_ref_iterator_release(struct packed_ref_iterator *iter)
+{
+	reftable_iterator_release(&iter->reftable);
+	strbuf_release(&iter->refname);
+}
+
+static struct ref_entry *create_packed_ref_entry(const struct reftable_ref *ref)
+{
+	struct ref_entry *entry;
+
+	entry = create_ref_entry(ref->refname, ref->sha1, REF_ISPACKED, 1);
+	if (ref->flags & REFTABLE_PEELED) {
+		hashcpy(entry->u.value.peeled, ref->peeled);
+		entry->flag |= REF_KNOWS_PEELED;
+	}
+	return entry;
 }
 
 /*
- * Read f, which is a packed-refs file, into dir.
+ * Read the whole packed-refs of packed_refs, which need not be
+ * sorted, into dir.
  *
  * A comment line of the form "# pack-refs with: " may contain zero or
  * more traits. We interpret the traits as follows:
@@ -1225,51 +1479,169 @@ static const char *parse_ref_line(char *line, unsigned char *sha1)
  *      trait should typically be written alongside "peeled" for
  *      compatibility with older clients, but we do not require it
  *      (i.e., "peeled" is a no-op if "fully-peeled" is set).
+ *
+ *   sorted:
+ *
+ *      The references are sorted by refname and each appears only
+ *      once, so that the file can be searched instead of being read
+ *      completely (see get_packed_ref_cache()).
  */
-static void read_packed_refs(FILE *f, struct ref_dir *dir)
+static void read_packed_refs(struct packed_ref_cache *packed_refs,
+			     struct ref_dir *dir)
 {
-	struct ref_entry *last = NULL;
-	char refline[PATH_MAX];
-	enum { PEELED_NONE, PEELED_TAGS, PEELED_FULLY } peeled = PEELED_NONE;
+	const char *pos = packed_refs->records;
+	struct strbuf refname = STRBUF_INIT;
+	struct reftable_ref ref;
 
-	while (fgets(refline, sizeof(refline), f)) {
-		unsigned char sha1[20];
-		const char *refname;
-		static const char header[] = "# pack-refs with:";
-
-		if (!strncmp(refline, header, sizeof(header)-1)) {
-			const char *traits = refline + sizeof(header) - 1;
-			if (strstr(traits, " fully-peeled "))
-				peeled = PEELED_FULLY;
-			else if (strstr(traits, " peeled "))
-				peeled = PEELED_TAGS;
-			/* perhaps other traits later as well */
-			continue;
-		}
+	while (pos < packed_refs->eof)
+		if (!parse_packed_ref_record(packed_refs, &pos, &refname, &ref))
+			add_ref(dir, create_packed_ref_entry(&ref));
+	strbuf_release(&refname);
+}
+
+/*
+ * Map the packed-refs file at path into packed_refs and parse its
+ * header.  Return 1 if it is sorted, 0 otherwise (including when it
+ * does not exist or is empty).
+ */
+static int map_packed_refs(struct packed_ref_cache *packed_refs,
+			   const char *path)
+{
+	static const char header[] = "# pack-refs with:";
+	struct stat st;
+	const char *eol;
+	int fd, sorted = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return 0;
+	}
+	stat_validity_update(&packed_refs->validity, fd);
+	packed_refs->map_len = xsize_t(st.st_size);
+	if (!packed_refs->map_len) {
+		close(fd);
+		return 0;
+	}
+	packed_refs->map = xmmap(NULL, packed_refs->map_len, PROT_READ,
+				 MAP_PRIVATE, fd, 0);
+	close(fd);
+	packed_refs->records = packed_refs->map;
+	packed_refs->eof = packed_refs->records + packed_refs->map_len;
+
+	if (packed_refs->map_len > sizeof(header) - 1 &&
+	    !memcmp(packed_refs->records, header, sizeof(header) - 1) &&
+	    (eol = memchr(packed_refs->records, '\n', packed_refs->map_len))) {
+		struct strbuf traits = STRBUF_INIT;
+
+		strbuf_add(&traits, packed_refs->records + sizeof(header) - 1,
+			   eol - packed_refs->records - (sizeof(header) - 1));
+		if (strstr(traits.buf, " fully-peeled "))
+			packed_refs->peeled = PEELED_FULLY;
+		else if (strstr(traits.buf, " peeled "))
+			packed_refs->peeled = PEELED_TAGS;
+		sorted = !!strstr(traits.buf, " sorted ");
+		/* perhaps other traits later as well */
+		strbuf_release(&traits);
+		packed_refs->records = eol + 1;
+	}
+	return sorted;
+}
+
+static struct ref_entry *create_packed_dir_entry(struct packed_ref_cache *packed_refs,
+						 struct ref_cache *ref_cache,
+						 const char *dirname,
+						 size_t len)
+{
+	struct ref_entry *direntry = create_dir_entry(ref_cache, dirname, len, 1);
+	direntry->u.subdir.packed = packed_refs;
+	return direntry;
+}
+
+/*
+ * Read the references in the namespace dirname from the packed-refs
+ * or reftable stack of dir into dir.
+ *
+ * The top levels ("" and "refs/") hold namespaces that are often not
+ * needed at all (think "refs/pull/" when looking for a branch); their
+ * subdirectories are only noted as incomplete stubs, and seeking past
+ * each of them skips its contents.  Deeper directories are read
+ * completely, including their subdirectories, in a single pass.
+ */
+static void read_lazy_packed_refs(const char *dirname, struct ref_dir *dir)
+{
+	struct packed_ref_cache *packed_refs = dir->packed;
+	struct packed_ref_iterator iter = PACKED_REF_ITERATOR_INIT;
+	struct reftable_ref ref;
+	struct strbuf next = STRBUF_INIT;
+	int dirnamelen = strlen(dirname);
+	int lazy = !*dirname || !strcmp(dirname, "refs/");
 
-		refname = parse_ref_line(refline, sha1);
-		if (refname) {
-			last = create_ref_entry(refname, sha1, REF_ISPACKED, 1);
-			if (peeled == PEELED_FULLY ||
-			    (peeled == PEELED_TAGS && starts_with(refname, "refs/tags/")))
-				last->flag |= REF_KNOWS_PEELED;
-			add_ref(dir, last);
+	packed_ref_iterator_seek(&iter, packed_refs, dirname);
+	while (!packed_ref_iterator_next(&iter, &ref)) {
+		struct ref_dir *subdir = dir;
+		const char *slash;
+
+		if (strncmp(ref.refname, dirname, dirnamelen))
+			break;
+		slash = strchr(ref.refname + dirnamelen, '/');
+		if (slash && lazy) {
+			int len = slash - ref.refname + 1;
+			add_entry_to_dir(dir,
+					 create_packed_dir_entry(packed_refs,
+								 dir->ref_cache,
+								 ref.refname, len));
+			/* '0' is the character following '/' */
+			strbuf_reset(&next);
+			strbuf_add(&next, ref.refname, len - 1);
+			strbuf_addch(&next, '0');
+			packed_ref_iterator_seek(&iter, packed_refs, next.buf);
 			continue;
 		}
-		if (last &&
-		    refline[0] == '^' &&
-		    strlen(refline) == PEELED_LINE_LENGTH &&
-		    refline[PEELED_LINE_LENGTH - 1] == '\n' &&
-		    !get_sha1_hex(refline + 1, sha1)) {
-			hashcpy(last->u.value.peeled, sha1);
-			/*
-			 * Regardless of what the file header said,
-			 * we definitely know the value of *this*
-			 * reference:
-			 */
-			last->flag |= REF_KNOWS_PEELED;
-		}
+		for (; slash; slash = strchr(slash + 1, '/'))
+			subdir = search_for_subdir(subdir, ref.refname,
+						   slash - ref.refname + 1, 1);
+		add_entry_to_dir(subdir, create_packed_ref_entry(&ref));
 	}
+	packed_ref_iterator_release(&iter);
+	strbuf_release(&next);
+}
+
+/*
+ * Look up a single reference in the packed-refs or reftable stack of
+ * a lazily read packed_refs.  Returns 0 and fills ref if it exists
+ * (ref->refname points at the argument), 1 otherwise.
+ */
+static int read_lazy_packed_ref(struct packed_ref_cache *packed_refs,
+				const char *refname, struct reftable_ref *ref)
+{
+	struct packed_ref_iterator iter = PACKED_REF_ITERATOR_INIT;
+	int ret;
+
+	if (packed_refs->reftable)
+		return reftable_stack_read_ref(packed_refs->reftable, refname, ref);
+	packed_ref_iterator_seek(&iter, packed_refs, refname);
+	ret = packed_ref_iterator_next(&iter, ref) || strcmp(ref->refname, refname);
+	packed_ref_iterator_release(&iter);
+	ref->refname = refname;
+	return ret;
+}
+
+static const char *reftable_dir(struct ref_cache *refs)
+{
+	if (*refs->name)
+		return git_path_submodule(refs->name, "reftable");
+	return git_path("reftable");
+}
+
+static int has_reftable(struct ref_cache *refs)
+{
+	if (*refs->name)
+		return file_exists(git_path_submodule(refs->name,
+						      "reftable/tables.list"));
+	return file_exists(git_path("reftable/tables.list"));
 }
 
 /*
@@ -1286,25 +1658,45 @@ static struct packed_ref_cache *get_packed_ref_cache(struct ref_cache *refs)
 		packed_refs_file = git_path("packed-refs");
 
 	if (refs->packed &&
-	    !stat_validity_check(&refs->packed->validity, packed_refs_file))
+	    (refs->packed->reftable
+	     ? !reftable_stack_is_current(refs->packed->reftable)
+	     : !stat_validity_check(&refs->packed->validity, packed_refs_file)))
 		clear_packed_ref_cache(refs);
 
 	if (!refs->packed) {
-		FILE *f;
-
-		refs->packed = xcalloc(1, sizeof(*refs->packed));
-		acquire_packed_ref_cache(refs->packed);
-		refs->packed->root = create_dir_entry(refs, "", 0, 0);
-		f = fopen(packed_refs_file, "r");
-		if (f) {
-			stat_validity_update(&refs->packed->validity, fileno(f));
-			read_packed_refs(f, get_ref_dir(refs->packed->root));
-			fclose(f);
+		struct packed_ref_cache *packed_refs;
+
+		packed_refs = refs->packed = xcalloc(1, sizeof(*refs->packed));
+		acquire_packed_ref_cache(packed_refs);
+		if (has_reftable(refs)) {
+			packed_refs->reftable = reftable_stack_open(reftable_dir(refs));
+			if (!packed_refs->reftable)
+				die("unable to read the reftable stack in %s",
+				    reftable_dir(refs));
+			packed_refs->root =
+				create_packed_dir_entry(packed_refs, refs, "", 0);
+		} else if (map_packed_refs(packed_refs, packed_refs_file)) {
+			packed_refs->root =
+				create_packed_dir_entry(packed_refs, refs, "", 0);
+		} else {
+			packed_refs->root = create_dir_entry(refs, "", 0, 0);
+			if (packed_refs->map)
+				read_packed_refs(packed_refs,
+						 get_ref_dir(packed_refs->root));
 		}
 	}
 	return refs->packed;
 }
 
+/*
+ * Are the directories of packed_refs read lazily?  Single references
+ * can then be looked up without reading them.
+ */
+static int packed_refs_are_lazy(struct packed_ref_cache *packed_refs)
+{
+	return packed_refs->root->u.subdir.packed != NULL;
+}
+
 static struct ref_dir *get_packed_ref_dir(struct packed_ref_cache *packed_ref_cache)
 {
 	return get_ref_dir(packed_ref_cache->root);
@@ -1315,15 +1707,39 @@ static struct ref_dir *get_packed_refs(struct ref_cache *refs)
 	return get_packed_ref_dir(get_packed_ref_cache(refs));
 }
 
+/*
+ * Note a change to be written out to the reftable stack of the
+ * locked packed_ref_cache (if it has one), and return the record to
+ * fill in.  The cache itself has to be updated separately.
+ */
+static struct reftable_ref *add_reftable_update(struct packed_ref_cache *packed_ref_cache,
+						const char *refname)
+{
+	struct reftable_ref *ref;
+
+	if (!packed_ref_cache->reftable)
+		return NULL;
+	ALLOC_GROW(packed_ref_cache->updates, packed_ref_cache->nr_updates + 1,
+		   packed_ref_cache->alloc_updates);
+	ref = &packed_ref_cache->updates[packed_ref_cache->nr_updates++];
+	memset(ref, 0, sizeof(*ref));
+	ref->refname = xstrdup(refname);
+	return ref;
+}
+
 void add_packed_ref(const char *refname, const unsigned char *sha1)
 {
 	struct packed_ref_cache *packed_ref_cache =
 		get_packed_ref_cache(&ref_cache);
+	struct reftable_ref *ref;
 
 	if (!packed_ref_cache->lock)
 		die("internal error: packed refs not locked");
 	add_ref(get_packed_ref_dir(packed_ref_cache),
 		create_ref_entry(refname, sha1, REF_ISPACKED, 1));
+	ref = add_reftable_update(packed_ref_cache, refname);
+	if (ref)
+		hashcpy(ref->sha1, sha1);
 }
 
 /*
@@ -1498,7 +1914,29 @@ int resolve_gitlink_ref(const char *path, const char *refname, unsigned char *sh
  */
 static struct ref_entry *get_packed_ref(const char *refname)
 {
-	return find_ref(get_packed_refs(&ref_cache), refname);
+	struct packed_ref_cache *packed_ref_cache =
+		get_packed_ref_cache(&ref_cache);
+	struct ref_entry *entry;
+	struct reftable_ref ref;
+
+	/*
+	 * Unless changes are being made to the cache, look a single
+	 * reference up in packed-refs or the reftable stack directly
+	 * instead of reading the directories that lead to it.
+	 */
+	if (!packed_refs_are_lazy(packed_ref_cache) || packed_ref_cache->lock)
+		return find_ref(get_packed_ref_dir(packed_ref_cache), refname);
+
+	if (!packed_ref_cache->lookups)
+		packed_ref_cache->lookups = create_dir_entry(&ref_cache, "", 0, 0);
+	entry = find_ref(get_ref_dir(packed_ref_cache->lookups), refname);
+	if (entry)
+		return entry;
+	if (read_lazy_packed_ref(packed_ref_cache, refname, &ref))
+		return NULL;
+	entry = create_packed_ref_entry(&ref);
+	add_ref(get_ref_dir(packed_ref_cache->lookups), entry);
+	return entry;
 }
 
 /*
@@ -1883,7 +2321,8 @@ void warn_dangling_symrefs(FILE *fp, const char *msg_fmt, const struct string_li
 
 /*
  * Call fn for each reference in the specified ref_cache, omitting
- * references not in the containing_dir of base.  fn is called for all
+ * references not in the containing_dir of base and the subdirectories
+ * of it that cannot hold references starting with base.  fn is called for all
  * references, including broken ones.  If fn ever returns a non-zero
  * value, stop the iteration and return that value; otherwise, return
  * 0.
@@ -1909,7 +2348,7 @@ static int do_for_each_entry(struct ref_cache *refs, const char *base,
 		loose_dir = find_containing_dir(loose_dir, base, 0);
 	}
 	if (loose_dir)
-		prime_ref_dir(loose_dir);
+		prime_ref_dir(loose_dir, base);
 
 	packed_ref_cache = get_packed_ref_cache(refs);
 	acquire_packed_ref_cache(packed_ref_cache);
@@ -1922,15 +2361,15 @@ static int do_for_each_entry(struct ref_cache *refs, const char *base,
 		sort_ref_dir(packed_dir);
 		sort_ref_dir(loose_dir);
 		retval = do_for_each_entry_in_dirs(
-				packed_dir, loose_dir, fn, cb_data);
+				packed_dir, loose_dir, base, fn, cb_data);
 	} else if (packed_dir) {
 		sort_ref_dir(packed_dir);
 		retval = do_for_each_entry_in_dir(
-				packed_dir, 0, fn, cb_data);
+				packed_dir, 0, base, fn, cb_data);
 	} else if (loose_dir) {
 		sort_ref_dir(loose_dir);
 		retval = do_for_each_entry_in_dir(
-				loose_dir, 0, fn, cb_data);
+				loose_dir, 0, base, fn, cb_data);
 	}
 
 	release_packed_ref_cache(packed_ref_cache);
@@ -2002,6 +2441,11 @@ int for_each_ref_in(const char *prefix, each_ref_fn fn, void *cb_data)
 	return do_for_each_ref(&ref_cache, prefix, fn, strlen(prefix), 0, cb_data);
 }
 
+int for_each_fullref_in(const char *prefix, each_ref_fn fn, void *cb_data)
+{
+	return do_for_each_ref(&ref_cache, prefix, fn, 0, 0, cb_data);
+}
+
 int for_each_ref_in_submodule(const char *submodule, const char *prefix,
 		each_ref_fn fn, void *cb_data)
 {
@@ -2128,6 +2572,15 @@ static const char *ref_rev_parse_rules[] = {
 	NULL
 };
 
+void expand_ref_prefix(struct argv_array *prefixes, const char *prefix)
+{
+	const char **p;
+	int len = strlen(prefix);
+
+	for (p = ref_rev_parse_rules; *p; p++)
+		argv_array_pushf(prefixes, *p, len, prefix);
+}
+
 int refname_match(const char *abbrev_name, const char *full_name)
 {
 	const char **p;
@@ -2422,11 +2875,22 @@ static int write_packed_entry_fn(struct ref_entry *entry, void *cb_data)
 	return 0;
 }
 
+/*
+ * The file to lock for changing the packed references: packed-refs,
+ * or the list of tables of the reftable stack.
+ */
+static const char *packed_refs_lock_path(void)
+{
+	if (has_reftable(&ref_cache))
+		return git_path("reftable/tables.list");
+	return git_path("packed-refs");
+}
+
 int lock_packed_refs(int flags)
 {
 	struct packed_ref_cache *packed_ref_cache;
 
-	if (hold_lock_file_for_update(&packlock, git_path("packed-refs"), flags) < 0)
+	if (hold_lock_file_for_update(&packlock, packed_refs_lock_path(), flags) < 0)
 		return -1;
 	/*
 	 * Get the current packed-refs while holding the lock.  If the
@@ -2441,7 +2905,7 @@ int lock_packed_refs(int flags)
 	return 0;
 }
 
-int commit_packed_refs(void)
+static int commit_packed_refs_1(unsigned int reftable_flags)
 {
 	struct packed_ref_cache *packed_ref_cache =
 		get_packed_ref_cache(&ref_cache);
@@ -2449,11 +2913,24 @@ int commit_packed_refs(void)
 
 	if (!packed_ref_cache->lock)
 		die("internal error: packed-refs not locked");
+	if (packed_ref_cache->reftable) {
+		/* Only the changes are written, as a new table */
+		error = reftable_stack_add(packed_ref_cache->reftable,
+					   packed_ref_cache->lock,
+					   packed_ref_cache->updates,
+					   packed_ref_cache->nr_updates,
+					   reftable_flags);
+		clear_reftable_updates(packed_ref_cache);
+		packed_ref_cache->lock = NULL;
+		release_packed_ref_cache(packed_ref_cache);
+		clear_packed_ref_cache(&ref_cache);
+		return error;
+	}
 	write_or_die(packed_ref_cache->lock->fd,
 		     PACKED_REFS_HEADER, strlen(PACKED_REFS_HEADER));
 
 	do_for_each_entry_in_dir(get_packed_ref_dir(packed_ref_cache),
-				 0, write_packed_entry_fn,
+				 0, NULL, write_packed_entry_fn,
 				 &packed_ref_cache->lock->fd);
 	if (commit_lock_file(packed_ref_cache->lock))
 		error = -1;
@@ -2462,6 +2939,11 @@ int commit_packed_refs(void)
 	return error;
 }
 
+int commit_packed_refs(void)
+{
+	return commit_packed_refs_1(0);
+}
+
 void rollback_packed_refs(void)
 {
 	struct packed_ref_cache *packed_ref_cache =
@@ -2469,6 +2951,7 @@ void rollback_packed_refs(void)
 
 	if (!packed_ref_cache->lock)
 		die("internal error: packed-refs not locked");
+	clear_reftable_updates(packed_ref_cache);
 	rollback_lock_file(packed_ref_cache->lock);
 	packed_ref_cache->lock = NULL;
 	release_packed_ref_cache(packed_ref_cache);
@@ -2483,6 +2966,7 @@ struct ref_to_prune {
 
 struct pack_refs_cb_data {
 	unsigned int flags;
+	struct packed_ref_cache *packed_ref_cache;
 	struct ref_dir *packed_refs;
 	struct ref_to_prune *ref_to_prune;
 };
@@ -2498,6 +2982,7 @@ static int pack_if_possible_fn(struct ref_entry *entry, void *cb_data)
 	struct pack_refs_cb_data *cb = cb_data;
 	enum peel_status peel_status;
 	struct ref_entry *packed_entry;
+	struct reftable_ref *ref;
 	int is_tag_ref = starts_with(entry->name, "refs/tags/");
 
 	/* ALWAYS pack tags */
@@ -2525,6 +3010,13 @@ static int pack_if_possible_fn(struct ref_entry *entry, void *cb_data)
 	}
 	hashcpy(packed_entry->u.value.peeled, entry->u.value.peeled);
 
+	ref = add_reftable_update(cb->packed_ref_cache, entry->name);
+	if (ref) {
+		hashcpy(ref->sha1, entry->u.value.sha1);
+		hashcpy(ref->peeled, entry->u.value.peeled);
+		ref->flags = REFTABLE_PEELED;
+	}
+
 	/* Schedule the loose reference for pruning if requested. */
 	if ((cb->flags & PACK_REFS_PRUNE)) {
 		int namelen = strlen(entry->name) + 1;
@@ -2588,20 +3080,102 @@ static void prune_refs(struct ref_to_prune *r)
 	}
 }
 
+/*
+ * An each_ref_entry_fn that adds the entry to the array of
+ * reftable_refs in cb_data.
+ */
+static int collect_reftable_ref_fn(struct ref_entry *entry, void *cb_data)
+{
+	struct reftable_ref **refs = cb_data;
+	enum peel_status peel_status = peel_entry(entry, 0);
+	struct reftable_ref *ref = (*refs)++;
+
+	if (peel_status != PEEL_PEELED && peel_status != PEEL_NON_TAG)
+		error("internal error: %s is not a valid packed reference!",
+		      entry->name);
+	memset(ref, 0, sizeof(*ref));
+	ref->refname = entry->name;
+	hashcpy(ref->sha1, entry->u.value.sha1);
+	if (peel_status == PEEL_PEELED)
+		hashcpy(ref->peeled, entry->u.value.peeled);
+	if (peel_status == PEEL_PEELED || peel_status == PEEL_NON_TAG)
+		ref->flags = REFTABLE_PEELED;
+	return 0;
+}
+
+static int count_ref_fn(struct ref_entry *entry, void *cb_data)
+{
+	(*(int *)cb_data)++;
+	return 0;
+}
+
+/*
+ * Move the packed references of the locked packed-refs file into a
+ * new reftable stack, and remove packed-refs.
+ */
+static int convert_packed_refs_to_reftable(struct packed_ref_cache *packed_ref_cache)
+{
+	/* lock_file objects must stay around until exit */
+	struct lock_file *lock = xcalloc(1, sizeof(*lock));
+	struct ref_dir *packed = get_packed_ref_dir(packed_ref_cache);
+	struct reftable_stack *st;
+	struct reftable_ref *refs, *end;
+	int nr = 0, ret;
+
+	if (safe_create_leading_directories_const(git_path("reftable/tables.list")))
+		return error("unable to create %s", git_path("reftable"));
+	if (hold_lock_file_for_update(lock, git_path("reftable/tables.list"), 0) < 0)
+		return unable_to_lock_error(git_path("reftable/tables.list"), errno);
+	st = reftable_stack_open(git_path("reftable"));
+	if (!st) {
+		rollback_lock_file(lock);
+		return -1;
+	}
+
+	do_for_each_entry_in_dir(packed, 0, NULL, count_ref_fn, &nr);
+	refs = end = xmalloc(nr * sizeof(*refs));
+	do_for_each_entry_in_dir(packed, 0, NULL, collect_reftable_ref_fn, &end);
+	ret = reftable_stack_add(st, lock, refs, nr, REFTABLE_COMPACT_ALL);
+	free(refs);
+	reftable_stack_free(st);
+
+	/*
+	 * Remove packed-refs while still holding its lock; the cache
+	 * must not be looked at anymore (it would notice the missing
+	 * file while locked).
+	 */
+	if (!ret)
+		unlink_or_warn(git_path("packed-refs"));
+	rollback_lock_file(packed_ref_cache->lock);
+	packed_ref_cache->lock = NULL;
+	release_packed_ref_cache(packed_ref_cache);
+	clear_packed_ref_cache(&ref_cache);
+	return ret;
+}
+
 int pack_refs(unsigned int flags)
 {
 	struct pack_refs_cb_data cbdata;
+	int ret;
 
 	memset(&cbdata, 0, sizeof(cbdata));
 	cbdata.flags = flags;
 
 	lock_packed_refs(LOCK_DIE_ON_ERROR);
-	cbdata.packed_refs = get_packed_refs(&ref_cache);
+	cbdata.packed_ref_cache = get_packed_ref_cache(&ref_cache);
+	cbdata.packed_refs = get_packed_ref_dir(cbdata.packed_ref_cache);
 
-	do_for_each_entry_in_dir(get_loose_refs(&ref_cache), 0,
+	do_for_each_entry_in_dir(get_loose_refs(&ref_cache), 0, NULL,
 				 pack_if_possible_fn, &cbdata);
 
-	if (commit_packed_refs())
+	if (cbdata.packed_ref_cache->reftable)
+		/* This is the time to merge the whole stack */
+		ret = commit_packed_refs_1(REFTABLE_COMPACT_ALL);
+	else if (ref_storage_format == REF_STORAGE_REFTABLE)
+		ret = convert_packed_refs_to_reftable(cbdata.packed_ref_cache);
+	else
+		ret = commit_packed_refs();
+	if (ret)
 		die_errno("unable to overwrite old ref-pack file");
 
 	prune_refs(cbdata.ref_to_prune);
@@ -2667,6 +3241,7 @@ static int curate_packed_ref_fn(struct ref_entry *entry, void *cb_data)
 
 int repack_without_refs(const char **refnames, int n)
 {
+	struct packed_ref_cache *packed_ref_cache;
 	struct ref_dir *packed;
 	struct string_list refs_to_delete = STRING_LIST_INIT_DUP;
 	struct string_list_item *ref_to_delete;
@@ -2682,15 +3257,31 @@ int repack_without_refs(const char **refnames, int n)
 		return 0; /* no refname exists in packed refs */
 
 	if (lock_packed_refs(0)) {
-		unable_to_lock_error(git_path("packed-refs"), errno);
+		unable_to_lock_error(packed_refs_lock_path(), errno);
 		return error("cannot delete '%s' from packed refs", refnames[i]);
 	}
-	packed = get_packed_refs(&ref_cache);
+	packed_ref_cache = get_packed_ref_cache(&ref_cache);
+	packed = get_packed_ref_dir(packed_ref_cache);
 
 	/* Remove refnames from the cache */
-	for (i = 0; i < n; i++)
-		if (remove_entry(packed, refnames[i]) != -1)
+	for (i = 0; i < n; i++) {
+		struct reftable_ref ref;
+
+		if (packed_ref_cache->reftable) {
+			/*
+			 * Deletions are written as such; there is no
+			 * need to read the directories of the cache.
+			 */
+			if (reftable_stack_read_ref(packed_ref_cache->reftable,
+						    refnames[i], &ref))
+				continue;
+			add_reftable_update(packed_ref_cache, refnames[i])->flags =
+				REFTABLE_DELETION;
+			removed = 1;
+		} else if (remove_entry(packed, refnames[i]) != -1) {
 			removed = 1;
+		}
+	}
 	if (!removed) {
 		/*
 		 * All packed entries disappeared while we were
@@ -2700,8 +3291,15 @@ int repack_without_refs(const char **refnames, int n)
 		return 0;
 	}
 
+	/*
+	 * Only the deletions are written to a reftable stack, so there
+	 * is no reason to look at (and read) all the other entries.
+	 */
+	if (packed_ref_cache->reftable)
+		return commit_packed_refs();
+
 	/* Remove any other accumulated cruft */
-	do_for_each_entry_in_dir(packed, 0, curate_packed_ref_fn, &refs_to_delete);
+	do_for_each_entry_in_dir(packed, 0, NULL, curate_packed_ref_fn, &refs_to_delete);
 	for_each_string_list_item(ref_to_delete, &refs_to_delete) {
 		if (remove_entry(packed, ref_to_delete->string) == -1)
 			die("internal error");
@@ -3038,45 +3636,85 @@ static int is_branch(const char *refname)
 	return !strcmp(refname, "HEAD") || starts_with(refname, "refs/heads/");
 }
 
-int write_ref_sha1(struct ref_lock *lock,
-	const unsigned char *sha1, const char *logmsg)
+/*
+ * Refuse to point the locked ref at a missing object, or a branch at
+ * something that is not a commit.
+ */
+static int check_ref_value(struct ref_lock *lock, const unsigned char *sha1)
 {
-	static char term = '\n';
-	struct object *o;
+	struct object *o = parse_object(sha1);
 
-	if (!lock)
-		return -1;
-	if (!lock->force_write && !hashcmp(lock->old_sha1, sha1)) {
-		unlock_ref(lock);
-		return 0;
-	}
-	o = parse_object(sha1);
-	if (!o) {
-		error("Trying to write ref %s with nonexistent object %s",
-			lock->ref_name, sha1_to_hex(sha1));
-		unlock_ref(lock);
-		return -1;
+	if (!o)
+		return error("Trying to write ref %s with nonexistent object %s",
+			     lock->ref_name, sha1_to_hex(sha1));
+	if (o->type != OBJ_COMMIT && is_branch(lock->ref_name))
+		return error("Trying to write non-commit object %s to branch %s",
+			     sha1_to_hex(sha1), lock->ref_name);
+	return 0;
+}
+
+/*
+ * Are the refs under "refs/" stored in a reftable stack?  Other refs
+ * (like HEAD) are always loose.
+ */
+static int ref_in_reftable(const char *refname)
+{
+	return starts_with(refname, "refs/") && has_reftable(&ref_cache);
+}
+
+/*
+ * Store the new values of the locked refs (a NULL sha1 deletes the
+ * ref) in a single new table, so that they all become visible at
+ * once, and remove loose files that would hide them.
+ */
+static int write_refs_to_reftable(struct ref_lock **locks,
+				  const unsigned char **sha1s, int n)
+{
+	struct packed_ref_cache *packed_ref_cache;
+	int i;
+
+	if (lock_packed_refs(0))
+		return unable_to_lock_error(packed_refs_lock_path(), errno);
+	packed_ref_cache = get_packed_ref_cache(&ref_cache);
+	if (!packed_ref_cache->reftable) {
+		rollback_packed_refs();
+		return error("the reftable stack went away");
 	}
-	if (o->type != OBJ_COMMIT && is_branch(lock->ref_name)) {
-		error("Trying to write non-commit object %s to branch %s",
-			sha1_to_hex(sha1), lock->ref_name);
-		unlock_ref(lock);
-		return -1;
+	for (i = 0; i < n; i++) {
+		struct reftable_ref *ref;
+
+		ref = add_reftable_update(packed_ref_cache, locks[i]->ref_name);
+		if (sha1s[i])
+			hashcpy(ref->sha1, sha1s[i]);
+		else
+			ref->flags = REFTABLE_DELETION;
 	}
-	if (write_in_full(lock->lock_fd, sha1_to_hex(sha1), 40) != 40 ||
-	    write_in_full(lock->lock_fd, &term, 1) != 1
-		|| close_ref(lock) < 0) {
-		error("Couldn't write %s", lock->lk->filename);
-		unlock_ref(lock);
+	if (commit_packed_refs())
 		return -1;
+
+	for (i = 0; i < n; i++) {
+		const char *path = git_path("%s", locks[i]->ref_name);
+		struct stat st;
+
+		if (!lstat(path, &st) && !S_ISDIR(st.st_mode))
+			unlink_or_warn(path);
 	}
 	clear_loose_ref_cache(&ref_cache);
+	return 0;
+}
+
+/*
+ * Record the update of the locked ref to sha1 in the reflogs of the
+ * ref, of the symref it was locked through, and of HEAD if that
+ * points at it.
+ */
+static int log_ref_update(struct ref_lock *lock, const unsigned char *sha1,
+			  const char *logmsg)
+{
 	if (log_ref_write(lock->ref_name, lock->old_sha1, sha1, logmsg) < 0 ||
 	    (strcmp(lock->ref_name, lock->orig_ref_name) &&
-	     log_ref_write(lock->orig_ref_name, lock->old_sha1, sha1, logmsg) < 0)) {
-		unlock_ref(lock);
+	     log_ref_write(lock->orig_ref_name, lock->old_sha1, sha1, logmsg) < 0))
 		return -1;
-	}
 	if (strcmp(lock->orig_ref_name, "HEAD") != 0) {
 		/*
 		 * Special hack: If a branch is updated directly and HEAD
@@ -3098,7 +3736,45 @@ int write_ref_sha1(struct ref_lock *lock,
 		    !strcmp(head_ref, lock->ref_name))
 			log_ref_write("HEAD", lock->old_sha1, sha1, logmsg);
 	}
-	if (commit_ref(lock)) {
+	return 0;
+}
+
+int write_ref_sha1(struct ref_lock *lock,
+	const unsigned char *sha1, const char *logmsg)
+{
+	static char term = '\n';
+	int in_reftable;
+
+	if (!lock)
+		return -1;
+	if (!lock->force_write && !hashcmp(lock->old_sha1, sha1)) {
+		unlock_ref(lock);
+		return 0;
+	}
+	if (check_ref_value(lock, sha1)) {
+		unlock_ref(lock);
+		return -1;
+	}
+	in_reftable = ref_in_reftable(lock->ref_name);
+	if (in_reftable) {
+		if (write_refs_to_reftable(&lock, &sha1, 1)) {
+			error("Couldn't set %s", lock->ref_name);
+			unlock_ref(lock);
+			return -1;
+		}
+	} else if (write_in_full(lock->lock_fd, sha1_to_hex(sha1), 40) != 40 ||
+		   write_in_full(lock->lock_fd, &term, 1) != 1
+		   || close_ref(lock) < 0) {
+		error("Couldn't write %s", lock->lk->filename);
+		unlock_ref(lock);
+		return -1;
+	}
+	clear_loose_ref_cache(&ref_cache);
+	if (log_ref_update(lock, sha1, logmsg)) {
+		unlock_ref(lock);
+		return -1;
+	}
+	if (!in_reftable && commit_ref(lock)) {
 		error("Couldn't set %s", lock->ref_name);
 		unlock_ref(lock);
 		return -1;
@@ -3660,6 +4336,64 @@ static int ref_update_reject_duplicates(struct ref_update **updates, int n,
 	return 0;
 }
 
+/*
+ * Carry out the locked updates of refs stored in the reftable stack
+ * by writing one new table, so that either all or none of them take
+ * effect.  Updates that are done are unlocked and their lock is set
+ * to NULL; the others are left to the caller.
+ */
+static int reftable_transaction_commit(struct ref_update **updates, int n,
+				       const char *msg,
+				       enum action_on_err onerr)
+{
+	struct ref_update **done = xmalloc(n * sizeof(*done));
+	struct ref_lock **locks = xmalloc(n * sizeof(*locks));
+	const unsigned char **sha1s = xmalloc(n * sizeof(*sha1s));
+	int i, nr = 0, ret = 0;
+
+	for (i = 0; i < n; i++) {
+		struct ref_update *update = updates[i];
+		int is_delete = is_null_sha1(update->new_sha1);
+
+		if (!ref_in_reftable(update->lock->ref_name))
+			continue;
+		if (!is_delete && check_ref_value(update->lock, update->new_sha1)) {
+			ret = 1;
+			goto cleanup;
+		}
+		done[nr] = update;
+		locks[nr] = update->lock;
+		sha1s[nr++] = is_delete ? NULL : update->new_sha1;
+	}
+	if (!nr)
+		goto cleanup;
+
+	if (write_refs_to_reftable(locks, sha1s, nr)) {
+		const char *str = "Cannot update the refs in '%s'.";
+		switch (onerr) {
+		case UPDATE_REFS_MSG_ON_ERR: error(str, reftable_dir(&ref_cache)); break;
+		case UPDATE_REFS_DIE_ON_ERR: die(str, reftable_dir(&ref_cache)); break;
+		case UPDATE_REFS_QUIET_ON_ERR: break;
+		}
+		ret = 1;
+		goto cleanup;
+	}
+	for (i = 0; i < nr; i++) {
+		if (sha1s[i])
+			ret |= log_ref_update(locks[i], sha1s[i], msg) < 0;
+		else
+			unlink_or_warn(git_path("logs/%s", locks[i]->ref_name));
+		unlock_ref(locks[i]);
+		done[i]->lock = NULL;
+	}
+
+cleanup:
+	free(done);
+	free(locks);
+	free(sha1s);
+	return ret;
+}
+
 int ref_transaction_commit(struct ref_transaction *transaction,
 			   const char *msg, enum action_on_err onerr)
 {
@@ -3695,11 +4429,18 @@ int ref_transaction_commit(struct ref_transaction *transaction,
 		}
 	}
 
+	/* All refs stored in a reftable stack are updated at once */
+	if (has_reftable(&ref_cache)) {
+		ret = reftable_transaction_commit(updates, n, msg, onerr);
+		if (ret)
+			goto cleanup;
+	}
+
 	/* Perform updates first so live commits remain referenced */
 	for (i = 0; i < n; i++) {
 		struct ref_update *update = updates[i];
 
-		if (!is_null_sha1(update->new_sha1)) {
+		if (update->lock && !is_null_sha1(update->new_sha1)) {
 			ret = update_ref_write(msg,
 					       update->refname,
 					       update->new_sha1,
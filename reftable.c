@@ -0,0 +1,658 @@
+#include "cache.h"
+#include "csum-file.h"
+#include "varint.h"
+#include "reftable.h"
+
+#define REFTABLE_SIGNATURE 0x52454654 /* "REFT" */
+#define REFTABLE_VERSION 1
+#define REFTABLE_HEADER_SIZE 28
+#define REFTABLE_FOOTER_SIZE (8 + 4 + 8 + 20)
+#define REFTABLE_BLOCK_SIZE 4096
+
+/* value types of a ref record */
+#define REFTABLE_VALUE_DELETION 0
+#define REFTABLE_VALUE_SHA1 1
+#define REFTABLE_VALUE_PEELED 2
+#define REFTABLE_VALUE_NOT_PEELABLE 3
+
+static void put_be64(unsigned char *buf, uint64_t value)
+{
+	put_be32(buf, (uint32_t)(value >> 32));
+	put_be32(buf + 4, (uint32_t)value);
+}
+
+static uint64_t get_be64(const unsigned char *buf)
+{
+	return ((uint64_t)get_be32(buf) << 32) | get_be32(buf + 4);
+}
+
+static struct reftable *open_reftable(const char *dir, const char *name)
+{
+	struct reftable *t;
+	struct stat st;
+	size_t size;
+	const unsigned char *data, *footer;
+	char *path = xstrfmt("%s/%s", dir, name);
+	int fd, saved_errno;
+
+	fd = git_open_noatime(path);
+	if (fd < 0) {
+		saved_errno = errno;
+		free(path);
+		errno = saved_errno;
+		return NULL;
+	}
+	if (fstat(fd, &st)) {
+		error("failed to read %s", path);
+		close(fd);
+		free(path);
+		errno = EINVAL;
+		return NULL;
+	}
+	size = xsize_t(st.st_size);
+	if (size < REFTABLE_HEADER_SIZE + REFTABLE_FOOTER_SIZE) {
+		error("reftable %s is too small", path);
+		close(fd);
+		free(path);
+		errno = EINVAL;
+		return NULL;
+	}
+	data = xmmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	t = xcalloc(1, sizeof(*t) + strlen(name) + 1);
+	strcpy(t->name, name);
+	t->data = data;
+	t->data_len = size;
+
+	if (get_be32(data) != REFTABLE_SIGNATURE) {
+		error("reftable %s has a bad signature", path);
+		goto fail;
+	}
+	if (get_be32(data + 4) != REFTABLE_VERSION) {
+		error("reftable %s has unknown version %"PRIu32,
+		      path, get_be32(data + 4));
+		goto fail;
+	}
+	t->block_size = get_be32(data + 8);
+	t->min_update_index = get_be64(data + 12);
+	t->max_update_index = get_be64(data + 20);
+
+	footer = data + size - REFTABLE_FOOTER_SIZE;
+	t->index_offset = get_be64(footer);
+	t->nr_blocks = get_be32(footer + 8);
+	t->nr_refs = get_be64(footer + 12);
+	if (t->index_offset < REFTABLE_HEADER_SIZE ||
+	    t->index_offset > size - REFTABLE_FOOTER_SIZE ||
+	    (size - REFTABLE_FOOTER_SIZE - t->index_offset) / 8 != t->nr_blocks) {
+		error("reftable %s has a corrupt index", path);
+		goto fail;
+	}
+	free(path);
+	return t;
+
+fail:
+	munmap((void *)t->data, t->data_len);
+	free(t);
+	free(path);
+	errno = EINVAL;
+	return NULL;
+}
+
+static void close_reftable(struct reftable *t)
+{
+	munmap((void *)t->data, t->data_len);
+	free(t);
+}
+
+static const unsigned char *block_start(struct reftable *t, uint32_t block)
+{
+	uint64_t offset = get_be64(t->data + t->index_offset + 8 * block);
+
+	if (offset < REFTABLE_HEADER_SIZE || offset >= t->index_offset)
+		die("reftable %s has a corrupt index", t->name);
+	return t->data + offset;
+}
+
+/*
+ * Compare the full refname stored in the first record of a block to
+ * "key".
+ */
+static int block_name_cmp(struct reftable *t, uint32_t block, const char *key)
+{
+	const unsigned char *p = block_start(t, block);
+	const unsigned char *end = t->data + t->index_offset;
+	size_t len, keylen = strlen(key);
+	int cmp;
+
+	if (decode_varint(&p) != 0 || p >= end)
+		die("reftable %s has a corrupt block", t->name);
+	len = decode_varint(&p);
+	if (len > end - p)
+		die("reftable %s has a corrupt block", t->name);
+	cmp = memcmp(p, key, len < keylen ? len : keylen);
+	if (cmp)
+		return cmp;
+	return len < keylen ? -1 : len > keylen;
+}
+
+struct reftable_table_iter {
+	struct reftable *table;
+	/* the next record, and the end of the ref records */
+	const unsigned char *pos, *end;
+	/* the current record; only meaningful if "valid" */
+	struct strbuf name;
+	struct reftable_ref ref;
+	int valid;
+};
+
+static void corrupt_record(struct reftable_table_iter *ti)
+{
+	die("reftable %s has a corrupt record at offset %"PRIuMAX,
+	    ti->table->name, (uintmax_t)(ti->pos - ti->table->data));
+}
+
+static void table_iter_next(struct reftable_table_iter *ti)
+{
+	const unsigned char *p = ti->pos;
+	uintmax_t prefix, suffix;
+	unsigned char type;
+
+	if (p >= ti->end) {
+		ti->valid = 0;
+		return;
+	}
+	prefix = decode_varint(&p);
+	if (p >= ti->end)
+		corrupt_record(ti);
+	suffix = decode_varint(&p);
+	if (prefix > ti->name.len || suffix >= ti->end - p)
+		corrupt_record(ti);
+	strbuf_setlen(&ti->name, prefix);
+	strbuf_add(&ti->name, p, suffix);
+	p += suffix;
+
+	type = *p++;
+	ti->ref.refname = ti->name.buf;
+	ti->ref.flags = 0;
+	hashclr(ti->ref.peeled);
+	if (type == REFTABLE_VALUE_DELETION) {
+		hashclr(ti->ref.sha1);
+		ti->ref.flags = REFTABLE_DELETION;
+	} else {
+		if (type > REFTABLE_VALUE_NOT_PEELABLE || ti->end - p < 20)
+			corrupt_record(ti);
+		hashcpy(ti->ref.sha1, p);
+		p += 20;
+		if (type == REFTABLE_VALUE_PEELED) {
+			if (ti->end - p < 20)
+				corrupt_record(ti);
+			hashcpy(ti->ref.peeled, p);
+			p += 20;
+		}
+		if (type != REFTABLE_VALUE_SHA1)
+			ti->ref.flags = REFTABLE_PEELED;
+	}
+	ti->pos = p;
+	ti->valid = 1;
+}
+
+static void table_iter_seek(struct reftable_table_iter *ti, struct reftable *t,
+			    const char *key)
+{
+	uint32_t lo = 0, hi = t->nr_blocks;
+
+	ti->table = t;
+	ti->end = t->data + t->index_offset;
+	ti->valid = 0;
+	if (!t->nr_blocks)
+		return;
+
+	/* find the last block starting at or before key */
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (block_name_cmp(t, mid, key) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	ti->pos = block_start(t, lo);
+	strbuf_reset(&ti->name);
+	do {
+		table_iter_next(ti);
+	} while (ti->valid && strcmp(ti->name.buf, key) < 0);
+}
+
+static void merged_seek(struct reftable_iterator *it, struct reftable **tables,
+			int nr, const char *name)
+{
+	int i;
+
+	if (it->nr != nr) {
+		reftable_iterator_release(it);
+		it->sub = xcalloc(nr, sizeof(*it->sub));
+		for (i = 0; i < nr; i++)
+			strbuf_init(&it->sub[i].name, 0);
+		it->nr = nr;
+	}
+	for (i = 0; i < nr; i++)
+		table_iter_seek(&it->sub[i], tables[i], name);
+}
+
+void reftable_stack_seek(struct reftable_stack *st, struct reftable_iterator *it,
+			 const char *name)
+{
+	merged_seek(it, st->tables, st->nr, name);
+}
+
+int reftable_iterator_next(struct reftable_iterator *it, struct reftable_ref *ref)
+{
+	for (;;) {
+		struct reftable_table_iter *best = NULL;
+		int i;
+
+		/* the smallest name wins; among equal names the newest table */
+		for (i = 0; i < it->nr; i++) {
+			struct reftable_table_iter *ti = &it->sub[i];
+			if (ti->valid &&
+			    (!best || strcmp(ti->name.buf, best->name.buf) <= 0))
+				best = ti;
+		}
+		if (!best)
+			return 1;
+
+		strbuf_reset(&it->name);
+		strbuf_addbuf(&it->name, &best->name);
+		*ref = best->ref;
+		ref->refname = it->name.buf;
+
+		for (i = 0; i < it->nr; i++) {
+			struct reftable_table_iter *ti = &it->sub[i];
+			if (ti->valid && !strcmp(ti->name.buf, it->name.buf))
+				table_iter_next(ti);
+		}
+		if (!(ref->flags & REFTABLE_DELETION) || it->include_deletions)
+			return 0;
+	}
+}
+
+void reftable_iterator_release(struct reftable_iterator *it)
+{
+	int i;
+
+	for (i = 0; i < it->nr; i++)
+		strbuf_release(&it->sub[i].name);
+	free(it->sub);
+	it->sub = NULL;
+	it->nr = 0;
+	strbuf_release(&it->name);
+}
+
+int reftable_stack_read_ref(struct reftable_stack *st, const char *refname,
+			    struct reftable_ref *ref)
+{
+	struct reftable_table_iter ti;
+	int i, ret = 1;
+
+	strbuf_init(&ti.name, 0);
+	/* the newest table mentioning the name decides */
+	for (i = st->nr - 1; i >= 0; i--) {
+		table_iter_seek(&ti, st->tables[i], refname);
+		if (ti.valid && !strcmp(ti.name.buf, refname)) {
+			*ref = ti.ref;
+			ref->refname = refname;
+			ret = !!(ref->flags & REFTABLE_DELETION);
+			break;
+		}
+	}
+	strbuf_release(&ti.name);
+	return ret;
+}
+
+struct reftable_stack *reftable_stack_open(const char *dir)
+{
+	struct reftable_stack *st = xcalloc(1, sizeof(*st));
+	struct strbuf list = STRBUF_INIT;
+	int tries = 5;
+	char *p, *eol;
+	int fd;
+
+	st->dir = xstrdup(dir);
+	st->list_file = xstrfmt("%s/tables.list", dir);
+
+retry:
+	fd = open(st->list_file, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			error("unable to read %s: %s", st->list_file,
+			      strerror(errno));
+			reftable_stack_free(st);
+			return NULL;
+		}
+		stat_validity_clear(&st->validity);
+		return st;
+	}
+	stat_validity_update(&st->validity, fd);
+	strbuf_reset(&list);
+	if (strbuf_read(&list, fd, 0) < 0) {
+		error("unable to read %s: %s", st->list_file, strerror(errno));
+		close(fd);
+		goto fail;
+	}
+	close(fd);
+
+	for (p = list.buf; *p; p = eol) {
+		struct reftable *t;
+
+		eol = strchrnul(p, '\n');
+		if (*eol)
+			*eol++ = '\0';
+		if (!*p)
+			continue;
+		t = open_reftable(dir, p);
+		if (!t) {
+			/*
+			 * A concurrent compaction may have removed the
+			 * table after we read the list; read it again.
+			 */
+			if (errno == ENOENT && --tries) {
+				while (st->nr)
+					close_reftable(st->tables[--st->nr]);
+				goto retry;
+			}
+			error("unable to read reftable %s/%s", dir, p);
+			goto fail;
+		}
+		ALLOC_GROW(st->tables, st->nr + 1, st->alloc);
+		st->tables[st->nr++] = t;
+	}
+	strbuf_release(&list);
+	return st;
+
+fail:
+	strbuf_release(&list);
+	reftable_stack_free(st);
+	return NULL;
+}
+
+void reftable_stack_free(struct reftable_stack *st)
+{
+	int i;
+
+	if (!st)
+		return;
+	for (i = 0; i < st->nr; i++)
+		close_reftable(st->tables[i]);
+	free(st->tables);
+	stat_validity_clear(&st->validity);
+	free(st->list_file);
+	free(st->dir);
+	free(st);
+}
+
+int reftable_stack_is_current(struct reftable_stack *st)
+{
+	return stat_validity_check(&st->validity, st->list_file);
+}
+
+struct reftable_writer {
+	struct sha1file *f;
+	struct strbuf tmp_file;
+	uint64_t min_update_index, max_update_index;
+	uint64_t offset;
+	uint64_t block_start;
+	uint64_t *blocks;
+	uint32_t nr_blocks, alloc_blocks;
+	uint64_t nr_refs;
+	struct strbuf last;
+};
+
+static void writer_begin(struct reftable_writer *w, const char *dir,
+			 uint64_t min_update_index, uint64_t max_update_index)
+{
+	unsigned char header[REFTABLE_HEADER_SIZE];
+	int fd;
+
+	memset(w, 0, sizeof(*w));
+	strbuf_init(&w->tmp_file, 0);
+	strbuf_init(&w->last, 0);
+	w->min_update_index = min_update_index;
+	w->max_update_index = max_update_index;
+
+	strbuf_addf(&w->tmp_file, "%s/tmp_reftable_XXXXXX", dir);
+	fd = git_mkstemp_mode(w->tmp_file.buf, 0444);
+	if (fd < 0)
+		die_errno("unable to create '%s'", w->tmp_file.buf);
+	w->f = sha1fd(fd, w->tmp_file.buf);
+
+	put_be32(header, REFTABLE_SIGNATURE);
+	put_be32(header + 4, REFTABLE_VERSION);
+	put_be32(header + 8, REFTABLE_BLOCK_SIZE);
+	put_be64(header + 12, min_update_index);
+	put_be64(header + 20, max_update_index);
+	sha1write(w->f, header, sizeof(header));
+	w->offset = sizeof(header);
+}
+
+static void writer_add(struct reftable_writer *w, const struct reftable_ref *ref)
+{
+	unsigned char buf[16];
+	size_t len = strlen(ref->refname), prefix = 0;
+	unsigned char type;
+	int n;
+
+	if (w->nr_refs && strcmp(w->last.buf, ref->refname) >= 0)
+		die("BUG: reftable records out of order: '%s' after '%s'",
+		    ref->refname, w->last.buf);
+
+	if (!w->nr_refs || w->offset - w->block_start >= REFTABLE_BLOCK_SIZE) {
+		/* start a new block with a full refname */
+		ALLOC_GROW(w->blocks, w->nr_blocks + 1, w->alloc_blocks);
+		w->blocks[w->nr_blocks++] = w->offset;
+		w->block_start = w->offset;
+	} else {
+		while (prefix < len && prefix < w->last.len &&
+		       w->last.buf[prefix] == ref->refname[prefix])
+			prefix++;
+	}
+
+	n = encode_varint(prefix, buf);
+	n += encode_varint(len - prefix, buf + n);
+	sha1write(w->f, buf, n);
+	sha1write(w->f, ref->refname + prefix, len - prefix);
+	w->offset += n + len - prefix;
+
+	if (ref->flags & REFTABLE_DELETION)
+		type = REFTABLE_VALUE_DELETION;
+	else if (!(ref->flags & REFTABLE_PEELED))
+		type = REFTABLE_VALUE_SHA1;
+	else if (is_null_sha1(ref->peeled))
+		type = REFTABLE_VALUE_NOT_PEELABLE;
+	else
+		type = REFTABLE_VALUE_PEELED;
+	sha1write(w->f, &type, 1);
+	w->offset++;
+	if (type != REFTABLE_VALUE_DELETION) {
+		sha1write(w->f, ref->sha1, 20);
+		w->offset += 20;
+	}
+	if (type == REFTABLE_VALUE_PEELED) {
+		sha1write(w->f, ref->peeled, 20);
+		w->offset += 20;
+	}
+
+	strbuf_reset(&w->last);
+	strbuf_add(&w->last, ref->refname, len);
+	w->nr_refs++;
+}
+
+/*
+ * Write the block index and the footer, and move the table into
+ * place.  Returns the name of the table within "dir".
+ */
+static char *writer_finish(struct reftable_writer *w, const char *dir)
+{
+	unsigned char buf[REFTABLE_FOOTER_SIZE - 20];
+	char *name, *path;
+	uint32_t i;
+
+	for (i = 0; i < w->nr_blocks; i++) {
+		put_be64(buf, w->blocks[i]);
+		sha1write(w->f, buf, 8);
+	}
+	put_be64(buf, w->offset);
+	put_be32(buf + 8, w->nr_blocks);
+	put_be64(buf + 12, w->nr_refs);
+	sha1write(w->f, buf, sizeof(buf));
+	sha1close(w->f, NULL, CSUM_FSYNC);
+
+	if (adjust_shared_perm(w->tmp_file.buf))
+		die_errno("unable to make temporary reftable readable");
+	name = xstrfmt("%012"PRIuMAX"-%012"PRIuMAX".ref",
+		       (uintmax_t)w->min_update_index,
+		       (uintmax_t)w->max_update_index);
+	path = xstrfmt("%s/%s", dir, name);
+	if (rename(w->tmp_file.buf, path))
+		die_errno("unable to rename temporary reftable to '%s'", path);
+
+	free(path);
+	free(w->blocks);
+	strbuf_release(&w->tmp_file);
+	strbuf_release(&w->last);
+	return name;
+}
+
+static int ref_ptr_cmp(const void *a_, const void *b_)
+{
+	const struct reftable_ref *a = *(const struct reftable_ref **)a_;
+	const struct reftable_ref *b = *(const struct reftable_ref **)b_;
+	int cmp = strcmp(a->refname, b->refname);
+
+	if (cmp)
+		return cmp;
+	/* keep the order of the updates to the same ref */
+	return a < b ? -1 : a > b;
+}
+
+static char *write_refs_table(const char *dir, uint64_t update_index,
+			      struct reftable_ref *refs, int nr)
+{
+	struct reftable_writer w;
+	struct reftable_ref **sorted;
+	int i;
+
+	sorted = xmalloc(nr * sizeof(*sorted));
+	for (i = 0; i < nr; i++)
+		sorted[i] = &refs[i];
+	qsort(sorted, nr, sizeof(*sorted), ref_ptr_cmp);
+
+	writer_begin(&w, dir, update_index, update_index);
+	for (i = 0; i < nr; i++)
+		if (i == nr - 1 ||
+		    strcmp(sorted[i]->refname, sorted[i + 1]->refname))
+			writer_add(&w, sorted[i]);
+	free(sorted);
+	return writer_finish(&w, dir);
+}
+
+/*
+ * Merge "tables" into one.  Deletion records need to be kept unless
+ * the bottom of the stack is part of the merge.
+ */
+static char *merge_tables(const char *dir, struct reftable **tables, int nr,
+			  int keep_deletions)
+{
+	struct reftable_writer w;
+	struct reftable_iterator it = REFTABLE_ITERATOR_INIT;
+	struct reftable_ref ref;
+
+	writer_begin(&w, dir, tables[0]->min_update_index,
+		     tables[nr - 1]->max_update_index);
+	it.include_deletions = keep_deletions;
+	merged_seek(&it, tables, nr, "");
+	while (!reftable_iterator_next(&it, &ref))
+		writer_add(&w, &ref);
+	reftable_iterator_release(&it);
+	return writer_finish(&w, dir);
+}
+
+/*
+ * Find the first table of the suffix of the stack that should be
+ * merged: a table is merged with all tables above it unless it is at
+ * least twice as large as those together.
+ */
+static int compaction_start(struct reftable **tables, int nr)
+{
+	int i = nr - 1;
+	uint64_t above;
+
+	if (nr < 2)
+		return nr;
+	above = tables[i]->data_len;
+	while (i > 0 && tables[i - 1]->data_len < 2 * above) {
+		i--;
+		above += tables[i]->data_len;
+	}
+	return i;
+}
+
+int reftable_stack_add(struct reftable_stack *st, struct lock_file *lock,
+		       struct reftable_ref *refs, int nr, unsigned int flags)
+{
+	struct reftable **tables;
+	struct reftable *merged = NULL;
+	struct strbuf list = STRBUF_INIT;
+	int nr_tables = st->nr, first, i, ret = 0;
+	uint64_t update_index = 1;
+
+	if (st->nr)
+		update_index = st->tables[st->nr - 1]->max_update_index + 1;
+
+	tables = xmalloc((st->nr + 1) * sizeof(*tables));
+	memcpy(tables, st->tables, st->nr * sizeof(*tables));
+	if (nr) {
+		char *name = write_refs_table(st->dir, update_index, refs, nr);
+		tables[nr_tables] = open_reftable(st->dir, name);
+		if (!tables[nr_tables])
+			die("unable to read new reftable %s/%s", st->dir, name);
+		nr_tables++;
+		free(name);
+	}
+
+	first = (flags & REFTABLE_COMPACT_ALL) ? 0 : compaction_start(tables, nr_tables);
+	if (nr_tables - first > 1) {
+		char *name = merge_tables(st->dir, tables + first,
+					  nr_tables - first, first > 0);
+		merged = open_reftable(st->dir, name);
+		if (!merged)
+			die("unable to read new reftable %s/%s", st->dir, name);
+		free(name);
+	} else {
+		first = nr_tables;
+	}
+
+	for (i = 0; i < first; i++)
+		strbuf_addf(&list, "%s\n", tables[i]->name);
+	if (merged)
+		strbuf_addf(&list, "%s\n", merged->name);
+	if (write_in_full(lock->fd, list.buf, list.len) != list.len ||
+	    commit_lock_file(lock)) {
+		error("unable to write %s: %s", st->list_file, strerror(errno));
+		rollback_lock_file(lock);
+		ret = -1;
+	}
+
+	/* remove the tables that did not make it into the list */
+	for (i = ret ? st->nr : first; i < nr_tables; i++)
+		unlink_or_warn(mkpath("%s/%s", st->dir, tables[i]->name));
+	if (merged && ret)
+		unlink_or_warn(mkpath("%s/%s", st->dir, merged->name));
+
+	for (i = st->nr; i < nr_tables; i++)
+		close_reftable(tables[i]);
+	if (merged)
+		close_reftable(merged);
+	free(tables);
+	strbuf_release(&list);
+	return ret;
+}
@@ -0,0 +1,120 @@
+#ifndef REFTABLE_H
+#define REFTABLE_H
+
+/*
+ * A reftable is an immutable, sorted binary table of references.  The
+ * refnames are prefix-compressed against the previous record and
+ * grouped into blocks whose first record stores its name in full; an
+ * index of the block offsets at the end of the file lets a reader
+ * binary search for a refname without looking at the other blocks.
+ *
+ * Tables are stacked: $GIT_DIR/reftable/tables.list names the tables
+ * from the oldest to the newest, and a newer table overrides the
+ * values (or, with a deletion record, the existence) of references in
+ * older ones.  An update appends a small table and rewrites only the
+ * list; to keep the number of tables logarithmic in the number of
+ * updates, tables at the top of the stack are merged whenever one is
+ * not at least twice the size of the tables above it.
+ *
+ * See Documentation/technical/reftable.txt for the file format.
+ */
+
+struct lock_file;
+
+struct reftable_ref {
+	const char *refname;
+	unsigned char sha1[20];
+	/* only meaningful with REFTABLE_PEELED; null if not peelable */
+	unsigned char peeled[20];
+	unsigned int flags;
+};
+
+/* The reference is deleted; the record hides older values. */
+#define REFTABLE_DELETION 0x01
+/* The peeled value of the reference is known. */
+#define REFTABLE_PEELED 0x02
+
+struct reftable {
+	const unsigned char *data;
+	size_t data_len;
+
+	uint32_t block_size;
+	uint64_t min_update_index;
+	uint64_t max_update_index;
+	uint64_t nr_refs;
+
+	/* the ref records end where the block index starts */
+	uint64_t index_offset;
+	uint32_t nr_blocks;
+
+	char name[FLEX_ARRAY];
+};
+
+struct reftable_stack {
+	char *dir;
+	char *list_file;
+	struct reftable **tables;
+	int nr, alloc;
+	/* the tables.list file this stack was read from */
+	struct stat_validity validity;
+};
+
+/*
+ * Read the stack of tables in "dir" (e.g. $GIT_DIR/reftable).  A
+ * missing tables.list gives an empty stack.  Returns NULL (after
+ * reporting an error) if a table cannot be read.
+ */
+extern struct reftable_stack *reftable_stack_open(const char *dir);
+extern void reftable_stack_free(struct reftable_stack *st);
+
+/* Has tables.list been changed since the stack was read? */
+extern int reftable_stack_is_current(struct reftable_stack *st);
+
+/*
+ * Look up a single reference.  Returns 0 and fills "ref" if it exists
+ * (ref->refname points at the argument), 1 otherwise.
+ */
+extern int reftable_stack_read_ref(struct reftable_stack *st,
+				   const char *refname,
+				   struct reftable_ref *ref);
+
+struct reftable_table_iter;
+
+struct reftable_iterator {
+	struct reftable_table_iter *sub;
+	int nr;
+	int include_deletions;
+	struct strbuf name;
+};
+#define REFTABLE_ITERATOR_INIT { NULL, 0, 0, STRBUF_INIT }
+
+/*
+ * Position "it" at the first reference of "st" that sorts at or after
+ * "name"; references are returned in strcmp() order by
+ * reftable_iterator_next(), which returns 1 at the end.  The refname
+ * filled in "ref" is valid until the next call.  Seeking again an
+ * iterator that was already used is allowed.
+ */
+extern void reftable_stack_seek(struct reftable_stack *st,
+				struct reftable_iterator *it,
+				const char *name);
+extern int reftable_iterator_next(struct reftable_iterator *it,
+				  struct reftable_ref *ref);
+extern void reftable_iterator_release(struct reftable_iterator *it);
+
+/* flags for reftable_stack_add() */
+#define REFTABLE_COMPACT_ALL 0x01
+
+/*
+ * Add a table holding "refs" (in any order; of several records for
+ * the same refname the last one wins) on top of "st", merge tables as
+ * needed and commit "lock", which must be held on the tables.list of
+ * "st" and must have been taken before "st" was read.
+ * REFTABLE_COMPACT_ALL merges the whole stack into a single table.
+ * Returns 0 on success; "st" is stale afterwards.
+ */
+extern int reftable_stack_add(struct reftable_stack *st, struct lock_file *lock,
+			      struct reftable_ref *refs, int nr,
+			      unsigned int flags);
+
+#endif
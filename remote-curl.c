@@ -11,6 +11,7 @@
 #include "argv-array.h"
 #include "credential.h"
 #include "sha1-array.h"
+#include "connect.h"
 
 static struct remote *remote;
 /* always ends with a trailing slash */
@@ -25,10 +26,19 @@ struct options {
 		update_shallow : 1,
 		followtags : 1,
 		dry_run : 1,
-		thin : 1;
+		thin : 1,
+		from_promisor : 1,
+		no_dependents : 1;
+	char *filter;
 };
 static struct options options;
 static struct string_list cas_options = STRING_LIST_INIT_DUP;
+/* the refs the caller is interested in; see "option ref-prefix" */
+static struct argv_array ref_prefixes = ARGV_ARRAY_INIT;
+
+/* ask upload-pack for protocol v2 (protocol.version) */
+static int use_protocol_v2;
+#define PROTOCOL_V2_HEADER "Git-Protocol: version=2"
 
 static int set_option(const char *name, const char *value)
 {
@@ -98,6 +108,29 @@ static int set_option(const char *name, const char *value)
 		else
 			return -1;
 		return 0;
+	} else if (!strcmp(name, "ref-prefix")) {
+		argv_array_push(&ref_prefixes, value);
+		return 0;
+	} else if (!strcmp(name, "filter")) {
+		free(options.filter);
+		options.filter = xstrdup(value);
+		return 0;
+	} else if (!strcmp(name, "from-promisor")) {
+		if (!strcmp(value, "true"))
+			options.from_promisor = 1;
+		else if (!strcmp(value, "false"))
+			options.from_promisor = 0;
+		else
+			return -1;
+		return 0;
+	} else if (!strcmp(name, "no-dependents")) {
+		if (!strcmp(value, "true"))
+			options.no_dependents = 1;
+		else if (!strcmp(value, "false"))
+			options.no_dependents = 0;
+		else
+			return -1;
+		return 0;
 	} else if (!strcmp(name, "update-shallow")) {
 		if (!strcmp(value, "true"))
 			options.update_shallow = 1;
@@ -119,6 +152,7 @@ struct discovery {
 	struct ref *refs;
 	struct sha1_array shallow;
 	unsigned proto_git : 1;
+	unsigned proto_v2 : 1;
 };
 static struct discovery *last_discovery;
 
@@ -221,6 +255,72 @@ static int show_http_message(struct strbuf *type, struct strbuf *charset,
 	return 0;
 }
 
+static int run_slot(struct active_request_slot *slot,
+		    struct slot_results *results)
+{
+	int err;
+	struct slot_results results_buf;
+
+	if (!results)
+		results = &results_buf;
+
+	err = run_one_slot(slot, results);
+
+	if (err != HTTP_OK && err != HTTP_REAUTH) {
+		error("RPC failed; result=%d, HTTP code = %ld",
+		      results->curl_result, results->http_code);
+	}
+
+	return err;
+}
+
+/*
+ * A protocol v2 server only advertised its capabilities; ask it for
+ * the refs we are interested in.
+ */
+static void ls_refs_v2(struct discovery *heads, struct strbuf *response)
+{
+	struct active_request_slot *slot;
+	struct curl_slist *headers = NULL;
+	struct strbuf request = STRBUF_INIT;
+	struct strbuf service_url = STRBUF_INIT;
+	int err;
+
+	ls_refs_request(&request, &ref_prefixes);
+	strbuf_addf(&service_url, "%s%s", url.buf, heads->service);
+
+	headers = curl_slist_append(headers,
+		"Content-Type: application/x-git-upload-pack-request");
+	headers = curl_slist_append(headers,
+		"Accept: application/x-git-upload-pack-result");
+	headers = curl_slist_append(headers, PROTOCOL_V2_HEADER);
+
+	do {
+		slot = get_active_slot();
+		strbuf_reset(response);
+
+		curl_easy_setopt(slot->curl, CURLOPT_NOBODY, 0);
+		curl_easy_setopt(slot->curl, CURLOPT_POST, 1);
+		curl_easy_setopt(slot->curl, CURLOPT_URL, service_url.buf);
+		curl_easy_setopt(slot->curl, CURLOPT_ENCODING, "gzip");
+		curl_easy_setopt(slot->curl, CURLOPT_POSTFIELDS, request.buf);
+		curl_easy_setopt(slot->curl, CURLOPT_POSTFIELDSIZE, request.len);
+		curl_easy_setopt(slot->curl, CURLOPT_HTTPHEADER, headers);
+		curl_easy_setopt(slot->curl, CURLOPT_WRITEFUNCTION, fwrite_buffer);
+		curl_easy_setopt(slot->curl, CURLOPT_FILE, response);
+
+		err = run_slot(slot, NULL);
+		if (err == HTTP_REAUTH)
+			credential_fill(&http_auth);
+	} while (err == HTTP_REAUTH);
+	if (err != HTTP_OK)
+		die("unable to list the refs of '%s'", url.buf);
+
+	curl_slist_free_all(headers);
+	strbuf_release(&service_url);
+	strbuf_release(&request);
+}
+
 static struct discovery* discover_refs(const char *service, int for_push)
 {
 	struct strbuf exp = STRBUF_INIT;
@@ -232,6 +332,7 @@ static struct discovery* discover_refs(const char *service, int for_push)
 	struct discovery *last = last_discovery;
 	int http_ret, maybe_smart = 0;
 	struct http_get_options options;
+	struct string_list extra_headers = STRING_LIST_INIT_NODUP;
 
 	if (last && !strcmp(service, last->service))
 		return last;
@@ -255,6 +356,10 @@ static struct discovery* discover_refs(const char *service, int for_push)
 	options.base_url = &url;
 	options.no_cache = 1;
 	options.keep_error = 1;
+	if (use_protocol_v2 && !strcmp(service, "git-upload-pack")) {
+		string_list_append(&extra_headers, PROTOCOL_V2_HEADER);
+		options.extra_headers = &extra_headers;
+	}
 
 	http_ret = http_get_strbuf(refs_url.buf, &buffer, &options);
 	switch (http_ret) {
@@ -309,12 +414,29 @@ static struct discovery* discover_refs(const char *service, int for_push)
 	else
 		last->refs = parse_info_refs(last);
 
+	if (last->proto_git && server_protocol_version() == protocol_v2) {
+		struct strbuf refs = STRBUF_INIT;
+
+		last->proto_v2 = 1;
+		ls_refs_v2(last, &refs);
+		get_remote_refs(-1, refs.buf, refs.len, &last->refs);
+
+		/* fetch-pack reads the refs after the capabilities */
+		strbuf_add(&buffer, last->buf, last->len);
+		strbuf_addbuf(&buffer, &refs);
+		free(last->buf_alloc);
+		last->buf_alloc = strbuf_detach(&buffer, &last->len);
+		last->buf = last->buf_alloc;
+		strbuf_release(&refs);
+	}
+
 	strbuf_release(&refs_url);
 	strbuf_release(&exp);
 	strbuf_release(&type);
 	strbuf_release(&charset);
 	strbuf_release(&effective_url);
 	strbuf_release(&buffer);
+	string_list_clear(&extra_headers, 0);
 	last_discovery = last;
 	return last;
 }
@@ -360,6 +482,7 @@ struct rpc_state {
 	struct strbuf result;
 	unsigned gzip_request : 1;
 	unsigned initial_buffer : 1;
+	unsigned protocol_v2 : 1;
 };
 
 static size_t rpc_out(void *ptr, size_t eltsize,
@@ -417,25 +540,6 @@ static size_t rpc_in(char *ptr, size_t eltsize,
 	return size;
 }
 
-static int run_slot(struct active_request_slot *slot,
-		    struct slot_results *results)
-{
-	int err;
-	struct slot_results results_buf;
-
-	if (!results)
-		results = &results_buf;
-
-	err = run_one_slot(slot, results);
-
-	if (err != HTTP_OK && err != HTTP_REAUTH) {
-		error("RPC failed; result=%d, HTTP code = %ld",
-		      results->curl_result, results->http_code);
-	}
-
-	return err;
-}
-
 static int probe_rpc(struct rpc_state *rpc, struct slot_results *results)
 {
 	struct active_request_slot *slot;
@@ -447,6 +551,8 @@ static int probe_rpc(struct rpc_state *rpc, struct slot_results *results)
 
 	headers = curl_slist_append(headers, rpc->hdr_content_type);
 	headers = curl_slist_append(headers, rpc->hdr_accept);
+	if (rpc->protocol_v2)
+		headers = curl_slist_append(headers, PROTOCOL_V2_HEADER);
 
 	curl_easy_setopt(slot->curl, CURLOPT_NOBODY, 0);
 	curl_easy_setopt(slot->curl, CURLOPT_POST, 1);
@@ -515,6 +621,8 @@ static int post_rpc(struct rpc_state *rpc)
 	headers = curl_slist_append(headers, rpc->hdr_accept);
 	headers = curl_slist_append(headers, needs_100_continue ?
 		"Expect: 100-continue" : "Expect:");
+	if (rpc->protocol_v2)
+		headers = curl_slist_append(headers, PROTOCOL_V2_HEADER);
 
 retry:
 	slot = get_active_slot();
@@ -718,8 +826,9 @@ static int fetch_git(struct discovery *heads,
 	struct rpc_state rpc;
 	struct strbuf preamble = STRBUF_INIT;
 	char *depth_arg = NULL;
+	char *filter_arg = NULL;
 	int argc = 0, i, err;
-	const char *argv[17];
+	const char *argv[20];
 
 	argv[argc++] = "fetch-pack";
 	argv[argc++] = "--stateless-rpc";
@@ -747,6 +856,14 @@ static int fetch_git(struct discovery *heads,
 		depth_arg = strbuf_detach(&buf, NULL);
 		argv[argc++] = depth_arg;
 	}
+	if (options.filter) {
+		filter_arg = xstrfmt("--filter=%s", options.filter);
+		argv[argc++] = filter_arg;
+	}
+	if (options.from_promisor)
+		argv[argc++] = "--from-promisor";
+	if (options.no_dependents)
+		argv[argc++] = "--no-dependents";
 	argv[argc++] = url.buf;
 	argv[argc++] = NULL;
 
@@ -764,6 +881,7 @@ static int fetch_git(struct discovery *heads,
 	rpc.argv = argv;
 	rpc.stdin_preamble = &preamble;
 	rpc.gzip_request = 1;
+	rpc.protocol_v2 = heads->proto_v2;
 
 	err = rpc_service(&rpc, heads);
 	if (rpc.result.len)
@@ -771,6 +889,7 @@ static int fetch_git(struct discovery *heads,
 	strbuf_release(&rpc.result);
 	strbuf_release(&preamble);
 	free(depth_arg);
+	free(filter_arg);
 	return err;
 }
 
@@ -966,6 +1085,7 @@ int main(int argc, const char **argv)
 	}
 
 	http_init(remote, url.buf, 0);
+	use_protocol_v2 = get_protocol_version_config() == protocol_v2;
 
 	do {
 		const char *arg;
@@ -404,6 +404,11 @@ static int handle_config(const char *key, const char *value, void *cb)
 		remote->skip_default_update = git_config_bool(key, value);
 	else if (!strcmp(subkey, ".prune"))
 		remote->prune = git_config_bool(key, value);
+	else if (!strcmp(subkey, ".promisor"))
+		remote->promisor = git_config_bool(key, value);
+	else if (!strcmp(subkey, ".partialclonefilter"))
+		return git_config_string(&remote->partial_clone_filter,
+					 key, value);
 	else if (!strcmp(subkey, ".url")) {
 		const char *v;
 		if (git_config_string(&v, key, value))
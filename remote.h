@@ -44,6 +44,13 @@ struct remote {
 	int mirror;
 	int prune;
 
+	/*
+	 * The remote promised the objects a partial clone left out; the
+	 * packs fetched from it are promisor packs.
+	 */
+	int promisor;
+	const char *partial_clone_filter;
+
 	const char *receivepack;
 	const char *uploadpack;
 
@@ -145,6 +152,14 @@ extern struct ref **get_remote_heads(int in, char *src_buf, size_t src_len,
 				     struct sha1_array *extra_have,
 				     struct sha1_array *shallow);
 
+/*
+ * Read the refs listed in response to a protocol v2 ls-refs command
+ * (see ls_refs_request() in connect.h), from "in" or from src_buf like
+ * get_remote_heads().
+ */
+extern struct ref **get_remote_refs(int in, char *src_buf, size_t src_len,
+				    struct ref **list);
+
 int resolve_remote_symref(struct ref *ref, struct ref *list);
 int ref_newer(const unsigned char *new_sha1, const unsigned char *old_sha1);
 
@@ -1696,6 +1696,10 @@ static int handle_revision_opt(struct rev_info *revs, int argc, const char **arg
 		return 2;
 	} else if (!strcmp(arg, "--merge")) {
 		revs->show_merge = 1;
+	} else if (!strcmp(arg, "--exclude-promisor-objects")) {
+		/* the objects the promisor remote promised stay missing */
+		fetch_if_missing = 0;
+		revs->exclude_promisor_objects = 1;
 	} else if (!strcmp(arg, "--topo-order")) {
 		revs->sort_order = REV_SORT_IN_GRAPH_ORDER;
 		revs->topo_order = 1;
@@ -2654,12 +2658,37 @@ void reset_revision_walk(void)
 	clear_object_flags(SEEN | ADDED | SHOWN);
 }
 
+/*
+ * Hide the objects in promisor packs: they came from the promisor
+ * remote of a partial clone, which also promised the objects they
+ * refer to (see is_promisor_object()).
+ */
+static void mark_promisor_objects_uninteresting(void)
+{
+	struct packed_git *p;
+
+	prepare_packed_git();
+	for (p = packed_git; p; p = p->next) {
+		uint32_t i;
+
+		if (!p->pack_promisor || open_pack_index(p))
+			continue;
+		for (i = 0; i < p->num_objects; i++) {
+			const unsigned char *sha1 = nth_packed_object_sha1(p, i);
+			lookup_unknown_object(sha1)->flags |= UNINTERESTING | SEEN;
+		}
+	}
+}
+
 int prepare_revision_walk(struct rev_info *revs)
 {
 	int nr = revs->pending.nr;
 	struct object_array_entry *e, *list;
 	struct commit_list **next = &revs->commits;
 
+	if (revs->exclude_promisor_objects)
+		mark_promisor_objects_uninteresting();
+
 	e = list = revs->pending.objects;
 	revs->pending.nr = 0;
 	revs->pending.alloc = 0;
@@ -76,7 +76,8 @@ struct rev_info {
 
 	unsigned int	early_output:1,
 			ignore_missing:1,
-			ignore_missing_links:1;
+			ignore_missing_links:1,
+			exclude_promisor_objects:1;
 
 	/* Traversal flags */
 	unsigned int	dense:1,
@@ -356,6 +356,12 @@ static int check_repo_format(const char *var, const char *value, void *cb)
 		repository_format_version = git_config_int(var, value);
 	else if (strcmp(var, "core.sharedrepository") == 0)
 		shared_repository = git_config_perm(var, value);
+	else if (strcmp(var, "extensions.partialclone") == 0) {
+		if (!value)
+			return config_error_nonbool(var);
+		free(repository_format_partial_clone);
+		repository_format_partial_clone = xstrdup(value);
+	}
 	return 0;
 }
 
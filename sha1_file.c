@@ -22,6 +22,10 @@
 #include "bulk-checkin.h"
 #include "streaming.h"
 #include "dir.h"
+#include "midx.h"
+#include "sha1-array.h"
+#include "fetch-object.h"
+#include "thread-utils.h"
 
 #ifndef O_NOATIME
 #if defined(__linux__) && (defined(__i386__) || defined(__PPC__))
@@ -68,6 +72,14 @@ static struct cached_object empty_tree = {
  */
 static struct packed_git *last_found_pack;
 
+/*
+ * The multi-pack-index of the local object directory, if
+ * core.multiPackIndex is enabled and one has been written. Packs it
+ * covers are marked with "multi_pack_index" and are only searched
+ * through it.
+ */
+static struct multi_pack_index *packed_midx;
+
 static struct cached_object *find_cached_object(const unsigned char *sha1)
 {
 	int i;
@@ -1055,7 +1067,8 @@ struct packed_git *add_packed_git(const char *path, int path_len, int local)
 {
 	static int have_set_try_to_free_routine;
 	struct stat st;
-	struct packed_git *p = alloc_packed_git(path_len + 2);
+	/* room to replace ".idx" with ".promisor" */
+	struct packed_git *p = alloc_packed_git(path_len + 6);
 
 	if (!have_set_try_to_free_routine) {
 		have_set_try_to_free_routine = 1;
@@ -1077,6 +1090,10 @@ struct packed_git *add_packed_git(const char *path, int path_len, int local)
 	if (!access(p->pack_name, F_OK))
 		p->pack_keep = 1;
 
+	strcpy(p->pack_name + path_len, ".promisor");
+	if (!access(p->pack_name, F_OK))
+		p->pack_promisor = 1;
+
 	strcpy(p->pack_name + path_len, ".pack");
 	if (stat(p->pack_name, &st) || !S_ISREG(st.st_mode)) {
 		free(p);
@@ -1226,17 +1243,33 @@ static void prepare_packed_git_one(char *objdir, int local)
 			     * See if it really is a valid .idx file with
 			     * corresponding .pack file that we can map.
 			     */
-			    (p = add_packed_git(path, len + namelen, local)) != NULL)
+			    (p = add_packed_git(path, len + namelen, local)) != NULL) {
+				if (local && packed_midx) {
+					int pack_int_id = midx_pack_pos(packed_midx,
+									de->d_name);
+					if (pack_int_id >= 0) {
+						packed_midx->packs[pack_int_id] = p;
+						p->multi_pack_index = 1;
+					}
+				}
 				install_packed_git(p);
+			}
 		}
 
 		if (!report_garbage)
 			continue;
 
+		if (!strcmp(de->d_name, "multi-pack-index") ||
+		    (starts_with(de->d_name, "multi-pack-index-") &&
+		     has_extension(de->d_name, ".bitmap")))
+			continue;
+
 		if (has_extension(de->d_name, ".idx") ||
 		    has_extension(de->d_name, ".pack") ||
 		    has_extension(de->d_name, ".bitmap") ||
-		    has_extension(de->d_name, ".keep"))
+		    has_extension(de->d_name, ".rev") ||
+		    has_extension(de->d_name, ".keep") ||
+		    has_extension(de->d_name, ".promisor"))
 			string_list_append(&garbage, path);
 		else
 			report_garbage("garbage found", path);
@@ -1300,6 +1333,12 @@ static void rearrange_packed_git(void)
 	free(ary);
 }
 
+struct multi_pack_index *get_local_multi_pack_index(void)
+{
+	prepare_packed_git();
+	return packed_midx;
+}
+
 static int prepare_packed_git_run_once = 0;
 void prepare_packed_git(void)
 {
@@ -1307,6 +1346,8 @@ void prepare_packed_git(void)
 
 	if (prepare_packed_git_run_once)
 		return;
+	if (core_multi_pack_index && !packed_midx)
+		packed_midx = load_multi_pack_index(get_object_directory());
 	prepare_packed_git_one(get_object_directory(), 1);
 	prepare_alt_odb();
 	for (alt = alt_odb_list; alt; alt = alt->next) {
@@ -1645,7 +1686,9 @@ unsigned long get_size_from_delta(struct packed_git *p,
 	do {
 		in = use_pack(p, w_curs, curpos, &stream.avail_in);
 		stream.next_in = in;
+		obj_read_unlock();
 		st = git_inflate(&stream, Z_FINISH);
+		obj_read_lock();
 		curpos += stream.next_in - in;
 	} while ((st == Z_OK || st == Z_BUF_ERROR) &&
 		 stream.total_out < sizeof(delta_head));
@@ -1667,11 +1710,11 @@ unsigned long get_size_from_delta(struct packed_git *p,
 	return get_delta_hdr_size(&data, delta_head+sizeof(delta_head));
 }
 
-static off_t get_delta_base(struct packed_git *p,
-				    struct pack_window **w_curs,
-				    off_t *curpos,
-				    enum object_type type,
-				    off_t delta_obj_offset)
+off_t get_delta_base(struct packed_git *p,
+		     struct pack_window **w_curs,
+		     off_t *curpos,
+		     enum object_type type,
+		     off_t delta_obj_offset)
 {
 	unsigned char *base_info = use_pack(p, w_curs, *curpos, NULL);
 	off_t base_offset;
@@ -1722,18 +1765,19 @@ static const unsigned char *get_delta_base_sha1(struct packed_git *p,
 		unsigned char *base = use_pack(p, w_curs, curpos, NULL);
 		return base;
 	} else if (type == OBJ_OFS_DELTA) {
-		struct revindex_entry *revidx;
+		struct pack_revindex *pridx;
+		int pos;
 		off_t base_offset = get_delta_base(p, w_curs, &curpos,
 						   type, delta_obj_offset);
 
 		if (!base_offset)
 			return NULL;
 
-		revidx = find_pack_revindex(p, base_offset);
-		if (!revidx)
+		pos = find_pack_revindex(p, base_offset, &pridx);
+		if (pos < 0)
 			return NULL;
 
-		return nth_packed_object_sha1(p, revidx->nr);
+		return nth_packed_object_sha1(p, revindex_nr(pridx, pos));
 	} else
 		return NULL;
 }
@@ -1766,13 +1810,13 @@ int unpack_object_header(struct packed_git *p,
 
 static int retry_bad_packed_offset(struct packed_git *p, off_t obj_offset)
 {
-	int type;
-	struct revindex_entry *revidx;
+	int type, pos;
+	struct pack_revindex *pridx;
 	const unsigned char *sha1;
-	revidx = find_pack_revindex(p, obj_offset);
-	if (!revidx)
+	pos = find_pack_revindex(p, obj_offset, &pridx);
+	if (pos < 0)
 		return OBJ_BAD;
-	sha1 = nth_packed_object_sha1(p, revidx->nr);
+	sha1 = nth_packed_object_sha1(p, revindex_nr(pridx, pos));
 	mark_bad_packed_object(p, sha1);
 	type = sha1_object_info(sha1, NULL);
 	if (type <= OBJ_NONE)
@@ -1883,8 +1927,9 @@ static int packed_object_info(struct packed_git *p, off_t obj_offset,
 	}
 
 	if (oi->disk_sizep) {
-		struct revindex_entry *revidx = find_pack_revindex(p, obj_offset);
-		*oi->disk_sizep = revidx[1].offset - obj_offset;
+		struct pack_revindex *pridx;
+		int pos = find_pack_revindex(p, obj_offset, &pridx);
+		*oi->disk_sizep = revindex_offset(pridx, pos + 1) - obj_offset;
 	}
 
 	if (oi->typep) {
@@ -1916,6 +1961,72 @@ out:
 	return type;
 }
 
+/*
+ * Reported under GIT_TRACE_DELTA_BASE_CACHE at exit; hits and misses
+ * count the lookups of the bases of deltas.
+ */
+static struct {
+	uintmax_t hits, misses, evictions;
+	uintmax_t bytes_inflated;
+	size_t max_cached;
+} delta_base_cache_stats;
+
+static void report_delta_base_cache_stats(void)
+{
+	trace_printf_key("GIT_TRACE_DELTA_BASE_CACHE",
+			 "delta base cache: %"PRIuMAX" hits, %"PRIuMAX" misses, "
+			 "%"PRIuMAX" evictions, %"PRIuMAX" bytes inflated, "
+			 "%"PRIuMAX" of %"PRIuMAX" bytes used at most\n",
+			 delta_base_cache_stats.hits,
+			 delta_base_cache_stats.misses,
+			 delta_base_cache_stats.evictions,
+			 delta_base_cache_stats.bytes_inflated,
+			 (uintmax_t)delta_base_cache_stats.max_cached,
+			 (uintmax_t)delta_base_cache_limit);
+}
+
+#ifndef NO_PTHREADS
+static pthread_mutex_t obj_read_mutex;
+static int obj_read_use_lock;
+
+void enable_obj_read_lock(void)
+{
+	if (obj_read_use_lock++)
+		return;
+	init_recursive_mutex(&obj_read_mutex);
+}
+
+void disable_obj_read_lock(void)
+{
+	if (!obj_read_use_lock)
+		die("BUG: disable_obj_read_lock() without enable_obj_read_lock()");
+	if (--obj_read_use_lock)
+		return;
+	pthread_mutex_destroy(&obj_read_mutex);
+}
+
+void obj_read_lock(void)
+{
+	if (obj_read_use_lock)
+		pthread_mutex_lock(&obj_read_mutex);
+}
+
+void obj_read_unlock(void)
+{
+	if (obj_read_use_lock)
+		pthread_mutex_unlock(&obj_read_mutex);
+}
+#else
+void enable_obj_read_lock(void) {}
+void disable_obj_read_lock(void) {}
+void obj_read_lock(void) {}
+void obj_read_unlock(void) {}
+#endif
+
+/*
+ * The window stays mapped while we hold it in "w_curs", and the
+ * buffer is ours, so the lock is let go while inflating.
+ */
 static void *unpack_compressed_entry(struct packed_git *p,
 				    struct pack_window **w_curs,
 				    off_t curpos,
@@ -1934,7 +2045,9 @@ static void *unpack_compressed_entry(struct packed_git *p,
 	do {
 		in = use_pack(p, w_curs, curpos, &stream.avail_in);
 		stream.next_in = in;
+		obj_read_unlock();
 		st = git_inflate(&stream, Z_FINISH);
+		obj_read_lock();
 		if (!stream.avail_out)
 			break; /* the payload is larger than it should be */
 		curpos += stream.next_in - in;
@@ -1944,63 +2057,120 @@ static void *unpack_compressed_entry(struct packed_git *p,
 		free(buffer);
 		return NULL;
 	}
+	delta_base_cache_stats.bytes_inflated += size;
 
 	return buffer;
 }
 
-#define MAX_DELTA_CACHE (256)
-
-static size_t delta_base_cached;
+/*
+ * The delta base cache keeps recently used delta bases, keyed by their
+ * place in a pack, up to delta_base_cache_limit bytes.  When it is full,
+ * the bases used least recently go first, blobs before the others.
+ */
+struct delta_base_cache_key {
+	struct packed_git *p;
+	off_t base_offset;
+};
 
 static struct delta_base_cache_lru_list {
 	struct delta_base_cache_lru_list *prev;
 	struct delta_base_cache_lru_list *next;
 } delta_base_cache_lru = { &delta_base_cache_lru, &delta_base_cache_lru };
 
-static struct delta_base_cache_entry {
+struct delta_base_cache_entry {
+	struct hashmap_entry ent;
+	struct delta_base_cache_key key;
 	struct delta_base_cache_lru_list lru;
 	void *data;
-	struct packed_git *p;
-	off_t base_offset;
 	unsigned long size;
 	enum object_type type;
-} delta_base_cache[MAX_DELTA_CACHE];
+};
+
+#define lru_entry(l) ((struct delta_base_cache_entry *) \
+	((char *)(l) - offsetof(struct delta_base_cache_entry, lru)))
+
+static struct hashmap delta_base_cache;
+static size_t delta_base_cached;
 
-static unsigned long pack_entry_hash(struct packed_git *p, off_t base_offset)
+static int delta_base_cache_cmp(const struct delta_base_cache_entry *e1,
+				const struct delta_base_cache_entry *e2,
+				const void *unused)
+{
+	return e1->key.p != e2->key.p ||
+	       e1->key.base_offset != e2->key.base_offset;
+}
+
+static unsigned int pack_entry_hash(struct packed_git *p, off_t base_offset)
 {
 	unsigned long hash;
 
 	hash = (unsigned long)p + (unsigned long)base_offset;
 	hash += (hash >> 8) + (hash >> 16);
-	return hash % MAX_DELTA_CACHE;
+	return hash;
 }
 
+static void init_delta_base_cache(void)
+{
+	hashmap_init(&delta_base_cache,
+		     (hashmap_cmp_fn)delta_base_cache_cmp, 0);
+	if (trace_want("GIT_TRACE_DELTA_BASE_CACHE"))
+		atexit(report_delta_base_cache_stats);
+}
+
+/* Look "p" at "base_offset" up; NULL when not cached. */
 static struct delta_base_cache_entry *
 get_delta_base_cache_entry(struct packed_git *p, off_t base_offset)
 {
-	unsigned long hash = pack_entry_hash(p, base_offset);
-	return delta_base_cache + hash;
+	struct delta_base_cache_entry key;
+
+	if (!delta_base_cache.tablesize)
+		init_delta_base_cache();
+
+	hashmap_entry_init(&key, pack_entry_hash(p, base_offset));
+	key.key.p = p;
+	key.key.base_offset = base_offset;
+	return hashmap_get(&delta_base_cache, &key, NULL);
 }
 
-static int eq_delta_base_cache_entry(struct delta_base_cache_entry *ent,
-				     struct packed_git *p, off_t base_offset)
+static int in_delta_base_cache(struct packed_git *p, off_t base_offset)
 {
-	return (ent->data && ent->p == p && ent->base_offset == base_offset);
+	struct delta_base_cache_entry key;
+
+	if (!delta_base_cache.tablesize)
+		return 0;
+	hashmap_entry_init(&key, pack_entry_hash(p, base_offset));
+	key.key.p = p;
+	key.key.base_offset = base_offset;
+	return !!hashmap_get(&delta_base_cache, &key, NULL);
 }
 
-static int in_delta_base_cache(struct packed_git *p, off_t base_offset)
+static void lru_unlink(struct delta_base_cache_lru_list *lru)
 {
-	struct delta_base_cache_entry *ent;
-	ent = get_delta_base_cache_entry(p, base_offset);
-	return eq_delta_base_cache_entry(ent, p, base_offset);
+	lru->next->prev = lru->prev;
+	lru->prev->next = lru->next;
+}
+
+static void lru_append(struct delta_base_cache_lru_list *lru)
+{
+	lru->next = &delta_base_cache_lru;
+	lru->prev = delta_base_cache_lru.prev;
+	delta_base_cache_lru.prev->next = lru;
+	delta_base_cache_lru.prev = lru;
 }
 
-static void clear_delta_base_cache_entry(struct delta_base_cache_entry *ent)
+/* Take "ent" out of the cache; its data is the caller's to free. */
+static void detach_delta_base_cache_entry(struct delta_base_cache_entry *ent)
 {
-	ent->data = NULL;
-	ent->lru.next->prev = ent->lru.prev;
-	ent->lru.prev->next = ent->lru.next;
+	hashmap_remove(&delta_base_cache, ent, NULL);
+	lru_unlink(&ent->lru);
 	delta_base_cached -= ent->size;
+	free(ent);
+}
+
+static void release_delta_base_cache(struct delta_base_cache_entry *ent)
+{
+	free(ent->data);
+	detach_delta_base_cache_entry(ent);
 }
 
 static void *cache_or_unpack_entry(struct packed_git *p, off_t base_offset,
@@ -2010,74 +2180,74 @@ static void *cache_or_unpack_entry(struct packed_git *p, off_t base_offset,
 	void *ret;
 
 	ent = get_delta_base_cache_entry(p, base_offset);
-
-	if (!eq_delta_base_cache_entry(ent, p, base_offset))
+	if (!ent)
 		return unpack_entry(p, base_offset, type, base_size);
 
-	ret = ent->data;
-
-	if (!keep_cache)
-		clear_delta_base_cache_entry(ent);
-	else
-		ret = xmemdupz(ent->data, ent->size);
 	*type = ent->type;
 	*base_size = ent->size;
-	return ret;
-}
-
-static inline void release_delta_base_cache(struct delta_base_cache_entry *ent)
-{
-	if (ent->data) {
-		free(ent->data);
-		ent->data = NULL;
-		ent->lru.next->prev = ent->lru.prev;
-		ent->lru.prev->next = ent->lru.next;
-		delta_base_cached -= ent->size;
+	if (!keep_cache) {
+		ret = ent->data;
+		detach_delta_base_cache_entry(ent);
+	} else {
+		ret = xmemdupz(ent->data, ent->size);
+		lru_unlink(&ent->lru);
+		lru_append(&ent->lru);
 	}
+	return ret;
 }
 
 void clear_delta_base_cache(void)
 {
-	unsigned long p;
-	for (p = 0; p < MAX_DELTA_CACHE; p++)
-		release_delta_base_cache(&delta_base_cache[p]);
+	while (delta_base_cache_lru.next != &delta_base_cache_lru)
+		release_delta_base_cache(lru_entry(delta_base_cache_lru.next));
 }
 
-static void add_delta_base_cache(struct packed_git *p, off_t base_offset,
-	void *base, unsigned long base_size, enum object_type type)
+static void evict_delta_base_cache(int blobs_only)
 {
-	unsigned long hash = pack_entry_hash(p, base_offset);
-	struct delta_base_cache_entry *ent = delta_base_cache + hash;
-	struct delta_base_cache_lru_list *lru;
+	struct delta_base_cache_lru_list *lru, *next;
 
-	release_delta_base_cache(ent);
-	delta_base_cached += base_size;
-
-	for (lru = delta_base_cache_lru.next;
-	     delta_base_cached > delta_base_cache_limit
-	     && lru != &delta_base_cache_lru;
-	     lru = lru->next) {
-		struct delta_base_cache_entry *f = (void *)lru;
-		if (f->type == OBJ_BLOB)
-			release_delta_base_cache(f);
-	}
 	for (lru = delta_base_cache_lru.next;
 	     delta_base_cached > delta_base_cache_limit
 	     && lru != &delta_base_cache_lru;
-	     lru = lru->next) {
-		struct delta_base_cache_entry *f = (void *)lru;
+	     lru = next) {
+		struct delta_base_cache_entry *f = lru_entry(lru);
+
+		next = lru->next;
+		if (blobs_only && f->type != OBJ_BLOB)
+			continue;
 		release_delta_base_cache(f);
+		delta_base_cache_stats.evictions++;
 	}
+}
+
+/* The cache takes "base" over. */
+static void add_delta_base_cache(struct packed_git *p, off_t base_offset,
+	void *base, unsigned long base_size, enum object_type type)
+{
+	struct delta_base_cache_entry *ent;
+
+	if (in_delta_base_cache(p, base_offset)) {
+		/* another thread got here first */
+		free(base);
+		return;
+	}
+
+	delta_base_cached += base_size;
+	evict_delta_base_cache(1);
+	evict_delta_base_cache(0);
 
-	ent->p = p;
-	ent->base_offset = base_offset;
+	ent = xmalloc(sizeof(*ent));
+	hashmap_entry_init(ent, pack_entry_hash(p, base_offset));
+	ent->key.p = p;
+	ent->key.base_offset = base_offset;
 	ent->type = type;
 	ent->data = base;
 	ent->size = base_size;
-	ent->lru.next = &delta_base_cache_lru;
-	ent->lru.prev = delta_base_cache_lru.prev;
-	delta_base_cache_lru.prev->next = &ent->lru;
-	delta_base_cache_lru.prev = &ent->lru;
+	hashmap_add(&delta_base_cache, ent);
+	lru_append(&ent->lru);
+
+	if (delta_base_cache_stats.max_cached < delta_base_cached)
+		delta_base_cache_stats.max_cached = delta_base_cached;
 }
 
 static void *read_object(const unsigned char *sha1, enum object_type *type,
@@ -2140,21 +2310,30 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 		struct delta_base_cache_entry *ent;
 
 		ent = get_delta_base_cache_entry(p, curpos);
-		if (eq_delta_base_cache_entry(ent, p, curpos)) {
+		if (delta_stack_nr) {
+			/* looking for the base of the delta we came from */
+			if (ent)
+				delta_base_cache_stats.hits++;
+			else
+				delta_base_cache_stats.misses++;
+		}
+		if (ent) {
 			type = ent->type;
 			data = ent->data;
 			size = ent->size;
-			clear_delta_base_cache_entry(ent);
+			detach_delta_base_cache_entry(ent);
 			base_from_cache = 1;
 			break;
 		}
 
 		if (do_check_packed_object_crc && p->index_version > 1) {
-			struct revindex_entry *revidx = find_pack_revindex(p, obj_offset);
-			unsigned long len = revidx[1].offset - obj_offset;
-			if (check_pack_crc(p, &w_curs, obj_offset, len, revidx->nr)) {
+			struct pack_revindex *pridx;
+			int pos = find_pack_revindex(p, obj_offset, &pridx);
+			unsigned long len = revindex_offset(pridx, pos + 1) - obj_offset;
+			uint32_t nr = revindex_nr(pridx, pos);
+			if (check_pack_crc(p, &w_curs, obj_offset, len, nr)) {
 				const unsigned char *sha1 =
-					nth_packed_object_sha1(p, revidx->nr);
+					nth_packed_object_sha1(p, nr);
 				error("bad packed object CRC for %s",
 				      sha1_to_hex(sha1));
 				mark_bad_packed_object(p, sha1);
@@ -2224,13 +2403,12 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 		void *delta_data;
 		void *base = data;
 		unsigned long delta_size, base_size = size;
+		off_t base_offset = obj_offset;
+		int base_from_pack = !!base;
 		int i;
 
 		data = NULL;
 
-		if (base)
-			add_delta_base_cache(p, obj_offset, base, base_size, type);
-
 		if (!base) {
 			/*
 			 * We're probably in deep shit, but let's try to fetch
@@ -2238,11 +2416,12 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 			 * This is costly but should happen only in the presence
 			 * of a corrupted pack, and is better than failing outright.
 			 */
-			struct revindex_entry *revidx;
+			struct pack_revindex *pridx;
 			const unsigned char *base_sha1;
-			revidx = find_pack_revindex(p, obj_offset);
-			if (revidx) {
-				base_sha1 = nth_packed_object_sha1(p, revidx->nr);
+			int pos = find_pack_revindex(p, obj_offset, &pridx);
+			if (pos >= 0) {
+				base_sha1 = nth_packed_object_sha1(p,
+						revindex_nr(pridx, pos));
 				error("failed to read delta base object %s"
 				      " at offset %"PRIuMAX" from %s",
 				      sha1_to_hex(base_sha1), (uintmax_t)obj_offset,
@@ -2260,6 +2439,11 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 		if (!base)
 			continue;
 
+		/*
+		 * "base" is ours until it goes into the cache below, so
+		 * that another thread cannot evict it while we do not
+		 * hold the lock.
+		 */
 		delta_data = unpack_compressed_entry(p, &w_curs, curpos, delta_size);
 
 		if (!delta_data) {
@@ -2267,12 +2451,24 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 			      "at offset %"PRIuMAX" from %s",
 			      (uintmax_t)curpos, p->pack_name);
 			data = NULL;
+			if (base_from_pack)
+				add_delta_base_cache(p, base_offset, base,
+						     base_size, type);
+			else
+				free(base);
 			continue;
 		}
 
+		obj_read_unlock();
 		data = patch_delta(base, base_size,
 				   delta_data, delta_size,
 				   &size);
+		obj_read_lock();
+
+		if (base_from_pack)
+			add_delta_base_cache(p, base_offset, base, base_size, type);
+		else
+			free(base);
 
 		/*
 		 * We could not apply the delta; warn the user, but keep going.
@@ -2337,6 +2533,92 @@ off_t nth_packed_object_offset(const struct packed_git *p, uint32_t n)
 	}
 }
 
+static struct sha1_array promisor_objects;
+
+static void add_promisor_object(const unsigned char *sha1)
+{
+	enum object_type type = sha1_object_info(sha1, NULL);
+
+	sha1_array_append(&promisor_objects, sha1);
+
+	/*
+	 * The objects these point to need not be present: the promisor
+	 * remote can give them to us, too.
+	 */
+	if (type == OBJ_COMMIT) {
+		struct commit *commit = lookup_commit(sha1);
+		struct commit_list *parent;
+
+		if (!commit || parse_commit(commit))
+			return;
+		if (commit->tree)
+			sha1_array_append(&promisor_objects,
+					  commit->tree->object.sha1);
+		for (parent = commit->parents; parent; parent = parent->next)
+			sha1_array_append(&promisor_objects,
+					  parent->item->object.sha1);
+	} else if (type == OBJ_TREE) {
+		struct tree_desc desc;
+		struct name_entry entry;
+		enum object_type t;
+		unsigned long size;
+		void *buf = read_sha1_file(sha1, &t, &size);
+
+		if (!buf)
+			return;
+		init_tree_desc(&desc, buf, size);
+		while (tree_entry(&desc, &entry))
+			if (!S_ISGITLINK(entry.mode))
+				sha1_array_append(&promisor_objects, entry.sha1);
+		free(buf);
+	} else if (type == OBJ_TAG) {
+		struct tag *tag = lookup_tag(sha1);
+
+		if (tag && !parse_tag(tag) && tag->tagged)
+			sha1_array_append(&promisor_objects,
+					  tag->tagged->sha1);
+	}
+}
+
+int is_promisor_object(const unsigned char *sha1)
+{
+	static int prepared;
+
+	if (!prepared) {
+		struct packed_git *p;
+
+		prepare_packed_git();
+		for (p = packed_git; p; p = p->next) {
+			uint32_t i;
+
+			if (!p->pack_promisor || open_pack_index(p))
+				continue;
+			for (i = 0; i < p->num_objects; i++)
+				add_promisor_object(nth_packed_object_sha1(p, i));
+		}
+		prepared = 1;
+	}
+	return sha1_array_lookup(&promisor_objects, sha1) >= 0;
+}
+
+/*
+ * Ask the promisor remote of a partial clone for a missing object.
+ * Returns 1 if it was asked, after which the caller should look for
+ * the object again; every object is asked for only once.
+ */
+static int fetch_missing_object(const unsigned char *sha1)
+{
+	static struct sha1_array asked;
+
+	if (!fetch_if_missing || !repository_format_partial_clone)
+		return 0;
+	if (sha1_array_lookup(&asked, sha1) >= 0)
+		return 0;
+	sha1_array_append(&asked, sha1);
+	fetch_object(repository_format_partial_clone, sha1);
+	return 1;
+}
+
 off_t find_pack_entry_one(const unsigned char *sha1,
 				  struct packed_git *p)
 {
@@ -2462,17 +2744,33 @@ static int fill_pack_entry(const unsigned char *sha1,
 static int find_pack_entry(const unsigned char *sha1, struct pack_entry *e)
 {
 	struct packed_git *p;
+	int skip_midx_packs = 0;
 
 	prepare_packed_git();
 	if (!packed_git)
 		return 0;
 
-	if (last_found_pack && fill_pack_entry(sha1, e, last_found_pack))
+	if (packed_midx) {
+		int ret = fill_midx_entry(sha1, e, packed_midx);
+		if (ret > 0)
+			return 1;
+		/*
+		 * If the index knows the object but could not use the
+		 * pack it points at, look at every pack for another copy.
+		 */
+		skip_midx_packs = !ret;
+	}
+
+	if (last_found_pack &&
+	    !(skip_midx_packs && last_found_pack->multi_pack_index) &&
+	    fill_pack_entry(sha1, e, last_found_pack))
 		return 1;
 
 	for (p = packed_git; p; p = p->next) {
 		if (p == last_found_pack)
 			continue; /* we already checked this one */
+		if (skip_midx_packs && p->multi_pack_index)
+			continue;
 
 		if (fill_pack_entry(sha1, e, p)) {
 			last_found_pack = p;
@@ -2543,7 +2841,8 @@ static int sha1_loose_object_info(const unsigned char *sha1,
 	return 0;
 }
 
-int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi, unsigned flags)
+static int do_sha1_object_info_extended(const unsigned char *sha1,
+					struct object_info *oi, unsigned flags)
 {
 	struct cached_object *co;
 	struct pack_entry e;
@@ -2573,14 +2872,17 @@ int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi,
 
 		/* Not a loose object; someone else may have just packed it. */
 		reprepare_packed_git();
-		if (!find_pack_entry(real, &e))
+		if (!find_pack_entry(real, &e)) {
+			if (fetch_missing_object(real))
+				return do_sha1_object_info_extended(sha1, oi, flags);
 			return -1;
+		}
 	}
 
 	rtype = packed_object_info(e.p, e.offset, oi);
 	if (rtype < 0) {
 		mark_bad_packed_object(e.p, real);
-		return sha1_object_info_extended(real, oi, 0);
+		return do_sha1_object_info_extended(real, oi, 0);
 	} else if (in_delta_base_cache(e.p, e.offset)) {
 		oi->whence = OI_DBCACHED;
 	} else {
@@ -2594,6 +2896,16 @@ int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi,
 	return 0;
 }
 
+int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi, unsigned flags)
+{
+	int ret;
+
+	obj_read_lock();
+	ret = do_sha1_object_info_extended(sha1, oi, flags);
+	obj_read_unlock();
+	return ret;
+}
+
 /* returns enum object_type or negative */
 int sha1_object_info(const unsigned char *sha1, unsigned long *sizep)
 {
@@ -2668,7 +2980,10 @@ static void *read_object(const unsigned char *sha1, enum object_type *type,
 		return buf;
 	map = map_sha1_file(sha1, &mapsize);
 	if (map) {
+		/* the mapping is ours alone */
+		obj_read_unlock();
 		buf = unpack_sha1_file(map, mapsize, type, size, sha1);
+		obj_read_lock();
 		munmap(map, mapsize);
 		return buf;
 	}
@@ -2681,10 +2996,10 @@ static void *read_object(const unsigned char *sha1, enum object_type *type,
  * deal with them should arrange to call read_object() and give error
  * messages themselves.
  */
-void *read_sha1_file_extended(const unsigned char *sha1,
-			      enum object_type *type,
-			      unsigned long *size,
-			      unsigned flag)
+static void *do_read_sha1_file_extended(const unsigned char *sha1,
+					enum object_type *type,
+					unsigned long *size,
+					unsigned flag)
 {
 	void *data;
 	const struct packed_git *p;
@@ -2692,6 +3007,10 @@ void *read_sha1_file_extended(const unsigned char *sha1,
 
 	errno = 0;
 	data = read_object(repl, type, size);
+	if (!data && !has_sha1_file(repl) && fetch_missing_object(repl)) {
+		errno = 0;
+		data = read_object(repl, type, size);
+	}
 	if (data)
 		return data;
 
@@ -2717,6 +3036,93 @@ void *read_sha1_file_extended(const unsigned char *sha1,
 	return NULL;
 }
 
+void *read_sha1_file_extended(const unsigned char *sha1,
+			      enum object_type *type,
+			      unsigned long *size,
+			      unsigned flag)
+{
+	void *data;
+
+	obj_read_lock();
+	data = do_read_sha1_file_extended(sha1, type, size, flag);
+	obj_read_unlock();
+	return data;
+}
+
+void object_batch_add(struct object_batch *batch, const unsigned char *sha1,
+		      void *util)
+{
+	struct object_batch_entry *e;
+
+	ALLOC_GROW(batch->entries, batch->nr + 1, batch->alloc);
+	e = &batch->entries[batch->nr];
+	hashcpy(e->sha1, sha1);
+	e->util = util;
+	e->pack_order = -1;
+	e->offset = 0;
+	e->nr = batch->nr++;
+}
+
+void object_batch_clear(struct object_batch *batch)
+{
+	free(batch->entries);
+	batch->entries = NULL;
+	batch->nr = batch->alloc = 0;
+}
+
+/* Packed objects pack by pack and by offset; then the others by name. */
+static int object_batch_cmp(const void *a_, const void *b_)
+{
+	const struct object_batch_entry *a = a_, *b = b_;
+	int cmp;
+
+	if (a->pack_order != b->pack_order) {
+		if (a->pack_order < 0)
+			return 1;
+		if (b->pack_order < 0)
+			return -1;
+		return a->pack_order < b->pack_order ? -1 : 1;
+	}
+	if (a->pack_order >= 0 && a->offset != b->offset)
+		return a->offset < b->offset ? -1 : 1;
+	if (a->pack_order < 0 && (cmp = hashcmp(a->sha1, b->sha1)))
+		return cmp;
+	return a->nr < b->nr ? -1 : a->nr != b->nr;
+}
+
+int for_each_object_in_pack_order(struct object_batch *batch,
+				  object_batch_fn fn, void *cb_data)
+{
+	struct packed_git *p;
+	int i, order = 0, ret = 0;
+
+	obj_read_lock();
+	prepare_packed_git();
+	for (p = packed_git; p; p = p->next)
+		p->order = order++;
+	for (i = 0; i < batch->nr; i++) {
+		struct object_batch_entry *e = &batch->entries[i];
+		const unsigned char *real = lookup_replace_object(e->sha1);
+		struct pack_entry pe;
+
+		if (!find_pack_entry(real, &pe))
+			continue;
+		e->pack_order = pe.p->order;
+		e->offset = pe.offset;
+	}
+	obj_read_unlock();
+
+	qsort(batch->entries, batch->nr, sizeof(*batch->entries),
+	      object_batch_cmp);
+
+	for (i = 0; !ret && i < batch->nr; i++) {
+		struct object_batch_entry *e = &batch->entries[i];
+
+		ret = fn(e->sha1, e->util, cb_data);
+	}
+	return ret;
+}
+
 void *read_object_with_reference(const unsigned char *sha1,
 				 const char *required_type_name,
 				 unsigned long *size,
@@ -0,0 +1,202 @@
+#include "cache.h"
+#include "cache-tree.h"
+#include "tree.h"
+#include "pathspec.h"
+#include "sparse-index.h"
+
+/*
+ * While a sparse index is written: the full list of entries, and the
+ * directory entries made to stand in for some of them.
+ */
+static struct {
+	struct cache_entry **cache;
+	unsigned int cache_nr, cache_alloc;
+	int sparse_index;
+	struct cache_entry **dirs;
+	int nr_dirs, alloc_dirs;
+} saved;
+
+/* Is "ce" in the directory "dir" of "len" bytes, trailing slash included? */
+static int in_dir(const struct cache_entry *ce, const char *dir, int len)
+{
+	return ce_namelen(ce) > len && !memcmp(ce->name, dir, len);
+}
+
+/*
+ * How many entries from "pos" on are the contents of the directory
+ * "dir" whose cache tree is "it", provided that they can all be
+ * replaced by one entry for the directory; 0 if they cannot.
+ */
+static int collapsible(struct index_state *istate, int pos,
+		       const char *dir, int len, struct cache_tree *it)
+{
+	int i, end;
+
+	if (it->entry_count <= 0)
+		return 0;
+	end = pos + it->entry_count;
+	if (end > istate->cache_nr ||
+	    (end < istate->cache_nr && in_dir(istate->cache[end], dir, len)))
+		return 0;
+	for (i = pos; i < end; i++) {
+		const struct cache_entry *ce = istate->cache[i];
+
+		if (!in_dir(ce, dir, len) || ce_stage(ce) ||
+		    !ce_skip_worktree(ce) || S_ISSPARSEDIR(ce->ce_mode) ||
+		    (ce->ce_flags & (CE_REMOVE | CE_INTENT_TO_ADD)))
+			return 0;
+	}
+	return it->entry_count;
+}
+
+static struct cache_entry *make_sparse_dir_entry(const char *dir, int len,
+						 const unsigned char *sha1)
+{
+	struct cache_entry *ce = xcalloc(1, cache_entry_size(len));
+
+	ce->ce_mode = S_IFDIR;
+	ce->ce_flags = create_ce_flags(0) | CE_SKIP_WORKTREE;
+	ce->ce_namelen = len;
+	memcpy(ce->name, dir, len);
+	hashcpy(ce->sha1, sha1);
+	return ce;
+}
+
+int prepare_to_write_sparse_index(struct index_state *istate)
+{
+	struct cache_entry **cache = NULL;
+	unsigned int nr = 0, alloc = 0, i;
+
+	if (!istate->cache_tree)
+		return 0;
+
+	for (i = 0; i < istate->cache_nr; ) {
+		struct cache_entry *ce = istate->cache[i];
+		struct cache_tree *it = istate->cache_tree;
+		const char *start = ce->name, *slash;
+		int n = 0;
+
+		/*
+		 * Try the directories that this entry is the first one
+		 * of, outermost first.
+		 */
+		for (slash = strchr(start, '/'); slash; slash = strchr(start, '/')) {
+			int len = slash - ce->name + 1;
+
+			it = cache_tree_subtree(it, start, slash - start);
+			if (!it)
+				break;
+			start = slash + 1;
+			if (i && in_dir(istate->cache[i - 1], ce->name, len))
+				continue;
+			n = collapsible(istate, i, ce->name, len, it);
+			if (n) {
+				ce = make_sparse_dir_entry(ce->name, len, it->sha1);
+				ALLOC_GROW(saved.dirs, saved.nr_dirs + 1,
+					   saved.alloc_dirs);
+				saved.dirs[saved.nr_dirs++] = ce;
+				break;
+			}
+		}
+		ALLOC_GROW(cache, nr + 1, alloc);
+		cache[nr++] = ce;
+		i += n ? n : 1;
+	}
+
+	if (!saved.nr_dirs) {
+		free(cache);
+		return 0;
+	}
+	saved.cache = istate->cache;
+	saved.cache_nr = istate->cache_nr;
+	saved.cache_alloc = istate->cache_alloc;
+	saved.sparse_index = istate->sparse_index;
+	istate->cache = cache;
+	istate->cache_nr = nr;
+	istate->cache_alloc = alloc;
+	istate->sparse_index = 1;
+	return 1;
+}
+
+void finish_writing_sparse_index(struct index_state *istate)
+{
+	int i;
+
+	free(istate->cache);
+	istate->cache = saved.cache;
+	istate->cache_nr = saved.cache_nr;
+	istate->cache_alloc = saved.cache_alloc;
+	istate->sparse_index = saved.sparse_index;
+	for (i = 0; i < saved.nr_dirs; i++)
+		free(saved.dirs[i]);
+	free(saved.dirs);
+	memset(&saved, 0, sizeof(saved));
+}
+
+struct expand_data {
+	struct cache_entry **cache;
+	unsigned int nr, alloc;
+};
+
+static int add_expanded_entry(const unsigned char *sha1, const char *base,
+			      int baselen, const char *pathname,
+			      unsigned mode, int stage, void *context)
+{
+	struct expand_data *data = context;
+	struct cache_entry *ce;
+	int len;
+
+	if (S_ISDIR(mode))
+		return READ_TREE_RECURSIVE;
+
+	len = strlen(pathname);
+	ce = xcalloc(1, cache_entry_size(baselen + len));
+	ce->ce_mode = create_ce_mode(mode);
+	ce->ce_flags = create_ce_flags(0) | CE_SKIP_WORKTREE;
+	ce->ce_namelen = baselen + len;
+	memcpy(ce->name, base, baselen);
+	memcpy(ce->name + baselen, pathname, len + 1);
+	hashcpy(ce->sha1, sha1);
+
+	ALLOC_GROW(data->cache, data->nr + 1, data->alloc);
+	data->cache[data->nr++] = ce;
+	return 0;
+}
+
+void ensure_full_index(struct index_state *istate)
+{
+	struct expand_data data;
+	struct pathspec pathspec;
+	unsigned int i;
+
+	if (!istate->sparse_index)
+		return;
+
+	memset(&data, 0, sizeof(data));
+	memset(&pathspec, 0, sizeof(pathspec));
+	free_name_hash(istate);
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		struct tree *tree;
+
+		ce->ce_flags &= ~CE_HASHED;
+		if (!S_ISSPARSEDIR(ce->ce_mode)) {
+			ALLOC_GROW(data.cache, data.nr + 1, data.alloc);
+			data.cache[data.nr++] = ce;
+			continue;
+		}
+		tree = parse_tree_indirect(ce->sha1);
+		if (!tree ||
+		    read_tree_recursive(tree, ce->name, ce_namelen(ce), 0,
+					&pathspec, add_expanded_entry, &data))
+			die(_("unable to expand sparse directory %s"), ce->name);
+		free(ce);
+	}
+
+	free(istate->cache);
+	istate->cache = data.cache;
+	istate->cache_nr = data.nr;
+	istate->cache_alloc = data.alloc;
+	istate->sparse_index = 0;
+}
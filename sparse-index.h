@@ -0,0 +1,31 @@
+#ifndef SPARSE_INDEX_H
+#define SPARSE_INDEX_H
+
+struct index_state;
+
+/*
+ * A sparse index stores each directory whose entries are all outside
+ * the sparse checkout (stage 0 and CE_SKIP_WORKTREE) as one entry for
+ * the tree of the directory, named after it with a trailing slash.
+ * The trees come from the cache tree, so only directories it knows
+ * to be valid are collapsed; the "sdir" extension keeps readers that
+ * do not know such entries away from the index.
+ *
+ * The directories are collapsed when the index is written with
+ * index.sparse and core.sparseCheckout set.  Reading the index
+ * expands them again, unless the command cleared
+ * command_requires_full_index to say that it copes with them.
+ */
+
+/*
+ * Replace the entries of istate that collapse into directories by
+ * those directories, until finish_writing_sparse_index() puts them
+ * back.  Returns whether it collapsed any.
+ */
+int prepare_to_write_sparse_index(struct index_state *istate);
+void finish_writing_sparse_index(struct index_state *istate);
+
+/* Replace the directory entries of a sparse index by their contents. */
+void ensure_full_index(struct index_state *istate);
+
+#endif
@@ -0,0 +1,376 @@
+#include "cache.h"
+#include "split-index.h"
+#include "ewah/ewok.h"
+
+struct split_index *init_split_index(struct index_state *istate)
+{
+	if (!istate->split_index) {
+		istate->split_index = xcalloc(1, sizeof(*istate->split_index));
+		istate->split_index->refcount = 1;
+	}
+	return istate->split_index;
+}
+
+static int read_bitmap(struct ewah_bitmap **bitmap,
+		       const unsigned char **data, unsigned long *sz)
+{
+	uint32_t buffer_size;
+	unsigned long len;
+	int ret;
+
+	/* bit size, word count, rlw position, and the words themselves */
+	if (*sz < 12)
+		return -1;
+	buffer_size = get_be32(*data + 4);
+	len = 12 + (unsigned long)buffer_size * 8;
+	if (*sz < len)
+		return -1;
+
+	*bitmap = ewah_new();
+	ret = ewah_read_mmap(*bitmap, (void *)*data, len);
+	if (ret < 0 || ret != len)
+		return -1;
+	*data += len;
+	*sz -= len;
+	return 0;
+}
+
+int read_link_extension(struct index_state *istate,
+			const void *data_, unsigned long sz)
+{
+	const unsigned char *data = data_;
+	struct split_index *si;
+
+	if (sz < 20)
+		return error("corrupt link extension (too short)");
+	si = init_split_index(istate);
+	hashcpy(si->base_sha1, data);
+	data += 20;
+	sz -= 20;
+	if (!sz)
+		return 0;
+	if (read_bitmap(&si->delete_bitmap, &data, &sz))
+		return error("corrupt delete bitmap in link extension");
+	if (read_bitmap(&si->replace_bitmap, &data, &sz))
+		return error("corrupt replace bitmap in link extension");
+	if (sz)
+		return error("garbage at the end of link extension");
+	return 0;
+}
+
+static int write_strbuf(void *user_data, const void *data, size_t len)
+{
+	struct strbuf *sb = user_data;
+	strbuf_add(sb, data, len);
+	return len;
+}
+
+int write_link_extension(struct strbuf *sb,
+			 struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	strbuf_add(sb, si->base_sha1, 20);
+	if (!si->delete_bitmap && !si->replace_bitmap)
+		return 0;
+	ewah_serialize_to(si->delete_bitmap, write_strbuf, sb);
+	ewah_serialize_to(si->replace_bitmap, write_strbuf, sb);
+	return 0;
+}
+
+static struct cache_entry *dup_cache_entry(const struct cache_entry *ce)
+{
+	unsigned int size = ce_size(ce);
+	struct cache_entry *new = xmalloc(size);
+
+	memcpy(new, ce, size);
+	new->ce_flags &= ~CE_HASHED;
+	return new;
+}
+
+/*
+ * Make every entry of the index part of a fresh base index. The
+ * entries stay in "istate"; the base keeps its own copies so that
+ * changes made in place can be told apart from the shared version.
+ */
+void move_cache_to_base_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	struct index_state *base;
+	unsigned int i, nr = 0;
+
+	if (si->base)
+		discard_index(si->base);
+	else
+		si->base = xcalloc(1, sizeof(*si->base));
+	base = si->base;
+
+	base->version = istate->version;
+	base->timestamp = istate->timestamp;
+	base->cache_alloc = alloc_nr(istate->cache_nr);
+	base->cache = xcalloc(base->cache_alloc, sizeof(*base->cache));
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+
+		if (ce->ce_flags & CE_REMOVE) {
+			ce->index = 0;
+			continue;
+		}
+		base->cache[nr] = dup_cache_entry(ce);
+		ce->index = ++nr;
+	}
+	base->cache_nr = nr;
+	base->initialized = 1;
+}
+
+static void mark_entry_for_delete(size_t pos, void *data)
+{
+	struct index_state *istate = data;
+
+	if (pos >= istate->cache_nr)
+		die("position for delete %d exceeds base index size %d",
+		    (int)pos, istate->cache_nr);
+	istate->cache[pos]->ce_flags |= CE_REMOVE;
+	istate->split_index->nr_deletions++;
+}
+
+static void replace_entry(size_t pos, void *data)
+{
+	struct index_state *istate = data;
+	struct split_index *si = istate->split_index;
+	struct cache_entry *dst, *src;
+
+	if (pos >= istate->cache_nr)
+		die("position for replacement %d exceeds base index size %d",
+		    (int)pos, istate->cache_nr);
+	if (si->nr_replacements >= si->saved_cache_nr)
+		die("too many replacements (%d vs %d)",
+		    si->nr_replacements, si->saved_cache_nr);
+	dst = istate->cache[pos];
+	src = si->saved_cache[si->nr_replacements];
+	if (ce_namelen(src) != ce_namelen(dst) ||
+	    memcmp(src->name, dst->name, ce_namelen(src)))
+		die("replacement entry '%s' does not match base entry '%s'",
+		    src->name, dst->name);
+	src->index = pos + 1;
+	istate->cache[pos] = src;
+	free(dst);
+	si->nr_replacements++;
+}
+
+static int ce_sort_compare(const struct cache_entry *a,
+			   const struct cache_entry *b)
+{
+	return cache_name_stage_compare(a->name, ce_namelen(a), ce_stage(a),
+					b->name, ce_namelen(b), ce_stage(b));
+}
+
+/*
+ * "istate" holds the entries read from $GIT_DIR/index: first the ones
+ * replacing base entries, in the order of the replace bitmap, then the
+ * added ones, sorted. Rebuild the full index from the base.
+ */
+void merge_base_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	struct index_state *base = si->base;
+	struct cache_entry **merged;
+	unsigned int i, nr, added, nr_merged = 0;
+
+	si->saved_cache = istate->cache;
+	si->saved_cache_nr = istate->cache_nr;
+	si->nr_deletions = 0;
+	si->nr_replacements = 0;
+
+	istate->cache_nr = base->cache_nr;
+	istate->cache_alloc = alloc_nr(base->cache_nr + si->saved_cache_nr);
+	istate->cache = xcalloc(istate->cache_alloc, sizeof(*istate->cache));
+	for (i = 0; i < base->cache_nr; i++) {
+		istate->cache[i] = dup_cache_entry(base->cache[i]);
+		istate->cache[i]->index = i + 1;
+	}
+
+	if (si->replace_bitmap)
+		ewah_each_bit(si->replace_bitmap, replace_entry, istate);
+	if (si->delete_bitmap)
+		ewah_each_bit(si->delete_bitmap, mark_entry_for_delete, istate);
+
+	for (nr = si->nr_replacements + 1; nr < si->saved_cache_nr; nr++)
+		if (ce_sort_compare(si->saved_cache[nr - 1],
+				    si->saved_cache[nr]) >= 0)
+			die("added entries in the split index are not sorted");
+
+	/* drop the deleted entries and merge in the added ones */
+	merged = xcalloc(istate->cache_alloc, sizeof(*merged));
+	added = si->nr_replacements;
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+
+		if (ce->ce_flags & CE_REMOVE) {
+			free(ce);
+			continue;
+		}
+		while (added < si->saved_cache_nr) {
+			struct cache_entry *new = si->saved_cache[added];
+			int cmp = ce_sort_compare(new, ce);
+
+			if (!cmp)
+				die("added entry '%s' is already in the base index",
+				    new->name);
+			if (cmp > 0)
+				break;
+			new->index = 0;
+			merged[nr_merged++] = new;
+			added++;
+		}
+		merged[nr_merged++] = ce;
+	}
+	for (; added < si->saved_cache_nr; added++) {
+		si->saved_cache[added]->index = 0;
+		merged[nr_merged++] = si->saved_cache[added];
+	}
+
+	free(istate->cache);
+	istate->cache = merged;
+	istate->cache_nr = nr_merged;
+
+	free(si->saved_cache);
+	si->saved_cache = NULL;
+	si->saved_cache_nr = 0;
+	ewah_free(si->delete_bitmap);
+	ewah_free(si->replace_bitmap);
+	si->delete_bitmap = NULL;
+	si->replace_bitmap = NULL;
+}
+
+/* Does "ce" differ from "base" in anything that is written out? */
+static int compare_ce_content(const struct cache_entry *ce,
+			      const struct cache_entry *base)
+{
+	unsigned int ondisk_flags = CE_STAGEMASK | CE_VALID | CE_EXTENDED_FLAGS;
+
+	return (ce->ce_flags & ondisk_flags) != (base->ce_flags & ondisk_flags) ||
+		ce->ce_mode != base->ce_mode ||
+		hashcmp(ce->sha1, base->sha1) ||
+		memcmp(&ce->ce_stat_data, &base->ce_stat_data,
+		       sizeof(ce->ce_stat_data));
+}
+
+/*
+ * Replace istate->cache with the entries that must be written to
+ * $GIT_DIR/index, and compute the bitmaps for the link extension. The
+ * full list is saved and put back by finish_writing_split_index().
+ *
+ * Entries matched to the base keep the sort order of both, so their
+ * positions in the base are increasing and the base can be walked
+ * alongside the index in one pass.
+ */
+void prepare_to_write_split_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	struct index_state *base = si->base;
+	struct cache_entry **entries = NULL, **added = NULL;
+	unsigned int nr_entries = 0, nr_added = 0;
+	int alloc_entries = 0, alloc_added = 0;
+	unsigned int i, pos, last = 0;
+
+	si->delete_bitmap = ewah_new();
+	si->replace_bitmap = ewah_new();
+	si->nr_deletions = 0;
+	si->nr_replacements = 0;
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+
+		if (ce->ce_flags & CE_REMOVE)
+			continue;
+		if (ce->index > last && ce->index <= base->cache_nr) {
+			struct cache_entry *base_ce = base->cache[ce->index - 1];
+
+			if (!ce_sort_compare(ce, base_ce)) {
+				for (pos = last; pos < ce->index - 1; pos++) {
+					ewah_set(si->delete_bitmap, pos);
+					si->nr_deletions++;
+				}
+				last = ce->index;
+				if (compare_ce_content(ce, base_ce)) {
+					ewah_set(si->replace_bitmap, ce->index - 1);
+					si->nr_replacements++;
+					ALLOC_GROW(entries, nr_entries + 1, alloc_entries);
+					entries[nr_entries++] = ce;
+				}
+				continue;
+			}
+		}
+		ce->index = 0;
+		ALLOC_GROW(added, nr_added + 1, alloc_added);
+		added[nr_added++] = ce;
+	}
+	for (pos = last; pos < base->cache_nr; pos++) {
+		ewah_set(si->delete_bitmap, pos);
+		si->nr_deletions++;
+	}
+
+	ALLOC_GROW(entries, nr_entries + nr_added, alloc_entries);
+	if (nr_added)
+		memcpy(entries + nr_entries, added, nr_added * sizeof(*added));
+	free(added);
+
+	si->saved_cache = istate->cache;
+	si->saved_cache_nr = istate->cache_nr;
+	istate->cache = entries;
+	istate->cache_nr = nr_entries + nr_added;
+}
+
+void finish_writing_split_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+
+	ewah_free(si->delete_bitmap);
+	ewah_free(si->replace_bitmap);
+	si->delete_bitmap = NULL;
+	si->replace_bitmap = NULL;
+	free(istate->cache);
+	istate->cache = si->saved_cache;
+	istate->cache_nr = si->saved_cache_nr;
+	si->saved_cache = NULL;
+	si->saved_cache_nr = 0;
+}
+
+/*
+ * Called between prepare_to_write_split_index() and
+ * finish_writing_split_index(): do the entries that differ from the
+ * shared index make up more than splitIndex.maxPercentChange of it?
+ * Past that point the small writes no longer pay for merging the two
+ * at read time, and a new shared index should be written.
+ */
+int split_index_too_large(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	uint64_t changed = (uint64_t)si->nr_deletions + istate->cache_nr;
+
+	if (split_index_max_percent_change == 100)
+		return 0;
+	if (!split_index_max_percent_change)
+		return 1;
+	return changed * 100 >
+		(uint64_t)si->base->cache_nr * split_index_max_percent_change;
+}
+
+void discard_split_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+
+	if (!si)
+		return;
+	istate->split_index = NULL;
+	if (--si->refcount)
+		return;
+	if (si->base) {
+		discard_index(si->base);
+		free(si->base);
+	}
+	ewah_free(si->delete_bitmap);
+	ewah_free(si->replace_bitmap);
+	free(si->saved_cache);
+	free(si);
+}
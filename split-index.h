@@ -0,0 +1,39 @@
+#ifndef SPLIT_INDEX_H
+#define SPLIT_INDEX_H
+
+struct index_state;
+struct strbuf;
+struct ewah_bitmap;
+
+/*
+ * A split index keeps most entries in a shared index file
+ * ($GIT_DIR/sharedindex.<SHA-1>) that is rarely rewritten, and records
+ * in the "link" extension of $GIT_DIR/index only the entries that were
+ * replaced, deleted or added since, so that a small update does not
+ * need to rewrite (and rehash) the whole index.
+ */
+struct split_index {
+	unsigned char base_sha1[20];
+	struct index_state *base;
+	struct ewah_bitmap *delete_bitmap;
+	struct ewah_bitmap *replace_bitmap;
+	struct cache_entry **saved_cache;
+	unsigned int saved_cache_nr;
+	unsigned int nr_deletions;
+	unsigned int nr_replacements;
+	int refcount;
+};
+
+struct split_index *init_split_index(struct index_state *istate);
+int read_link_extension(struct index_state *istate,
+			const void *data, unsigned long sz);
+int write_link_extension(struct strbuf *sb,
+			 struct index_state *istate);
+void move_cache_to_base_index(struct index_state *istate);
+void merge_base_index(struct index_state *istate);
+void prepare_to_write_split_index(struct index_state *istate);
+void finish_writing_split_index(struct index_state *istate);
+int split_index_too_large(struct index_state *istate);
+void discard_split_index(struct index_state *istate);
+
+#endif
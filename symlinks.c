@@ -273,6 +273,15 @@ static int threaded_has_dirs_only_path(struct cache_def *cache, const char *name
 		FL_DIR;
 }
 
+/*
+ * Forget what has_dirs_only_path() and friends know of the working
+ * tree, for a caller that may have changed it behind their back.
+ */
+void invalidate_lstat_cache(void)
+{
+	reset_lstat_cache(&default_cache);
+}
+
 static struct removal_def {
 	char path[PATH_MAX];
 	int len;
@@ -296,4 +296,41 @@ test_expect_success '%(deltabase) reports packed delta bases' '
 	}
 '
 
+test_expect_success '--unordered without --batch fails' '
+	test_must_fail git cat-file --unordered -t $hello_sha1 &&
+	test_must_fail git cat-file --unordered blob $hello_sha1
+'
+
+test_expect_success 'setup objects both packed and loose' '
+	echo loose >loose &&
+	git add loose &&
+	git commit -m loose &&
+	git rev-list --objects --all >objects.raw &&
+	{
+		sed "s/ .*//" objects.raw &&
+		echo does-not-exist &&
+		echo HEAD:loose some rest
+	} >objects
+'
+
+for batch in batch-check batch
+do
+	test_expect_success "--$batch --unordered shows the same objects" '
+		git cat-file --$batch="%(objectname) %(objecttype) %(rest)" \
+			<objects >expect.unsorted &&
+		git cat-file --$batch="%(objectname) %(objecttype) %(rest)" \
+			--unordered <objects >actual.unsorted &&
+		sort expect.unsorted >expect &&
+		sort actual.unsorted >actual &&
+		test_cmp expect actual
+	'
+done
+
+test_expect_success '--unordered reports unresolvable names first' '
+	git cat-file --batch-check --unordered <objects >actual &&
+	echo "does-not-exist missing" >expect &&
+	head -n 1 actual >actual.first &&
+	test_cmp expect actual.first
+'
+
 test_done
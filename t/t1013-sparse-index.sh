@@ -0,0 +1,117 @@
+#!/bin/sh
+
+test_description='sparse index
+
+Directories outside the sparse checkout are stored in the index as
+single entries for their trees, and expanded again when read.'
+
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	mkdir -p in out1/sub out2 &&
+	echo in >in/file &&
+	echo top >top &&
+	echo a >out1/a &&
+	echo b >out1/b &&
+	echo c >out1/sub/c &&
+	echo d >out2/d &&
+	git add . &&
+	test_tick &&
+	git commit -m initial &&
+	echo changed >out1/a &&
+	git commit -q -a -m changed &&
+	cat >.git/info/sparse-checkout <<-\EOF &&
+	/*
+	!/*/
+	/in/
+	EOF
+	git config core.sparseCheckout true &&
+	git read-tree -m -u HEAD &&
+	test_path_is_missing out1 &&
+	test_path_is_file in/file &&
+	git ls-files --stage >expect.stage &&
+	git ls-files -t >expect.tags
+'
+
+test_expect_success 'directories outside the checkout are collapsed' '
+	git config index.sparse true &&
+	git read-tree -m -u HEAD &&
+	cat >expect <<-EOF &&
+	100644 $(git rev-parse HEAD:in/file) 0	in/file
+	040000 $(git rev-parse HEAD:out1) 0	out1/
+	040000 $(git rev-parse HEAD:out2) 0	out2/
+	100644 $(git rev-parse HEAD:top) 0	top
+	EOF
+	git ls-files --sparse --stage >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'commands read the index expanded' '
+	git ls-files --stage >actual &&
+	test_cmp expect.stage actual &&
+	git ls-files -t >actual &&
+	test_cmp expect.tags actual &&
+	test "$(git write-tree)" = "$(git rev-parse HEAD^{tree})"
+'
+
+test_expect_success 'diff-files reads the sparse index as it is' '
+	echo more >>in/file &&
+	git diff-files --name-only >actual &&
+	echo in/file >expect &&
+	test_cmp expect actual &&
+	git checkout in/file &&
+	git diff-files --exit-code
+'
+
+test_expect_success 'adding a path under a collapsed directory expands it' '
+	blob=$(echo new | git hash-object -w --stdin) &&
+	git update-index --add --cacheinfo 100644 $blob out1/new &&
+	git ls-files --sparse >actual &&
+	cat >expect <<-\EOF &&
+	in/file
+	out1/a
+	out1/b
+	out1/new
+	out1/sub/
+	out2/
+	top
+	EOF
+	test_cmp expect actual &&
+	git update-index --force-remove out1/new &&
+	git write-tree >/dev/null &&
+	git ls-files --sparse >actual &&
+	grep "^out1/$" actual
+'
+
+test_expect_success 'switching commits keeps it sparse' '
+	git checkout -q HEAD^ &&
+	git ls-files --sparse --stage >actual &&
+	grep "^040000 $(git rev-parse HEAD:out1) 0	out1/$" actual &&
+	git ls-files --stage >actual &&
+	git ls-tree -r HEAD | sed "s/ blob / /; s/	/ 0	/" >expect &&
+	test_cmp expect actual &&
+	git checkout -q master &&
+	git ls-files --stage >actual &&
+	test_cmp expect.stage actual
+'
+
+test_expect_success 'the index is written in full without index.sparse' '
+	git -c index.sparse=false read-tree -m -u HEAD &&
+	git ls-files --sparse --stage >actual &&
+	test_cmp expect.stage actual
+'
+
+test_expect_success 'widening the checkout brings the directories back' '
+	git read-tree -m -u HEAD &&
+	git ls-files --sparse >actual &&
+	grep "^out2/$" actual &&
+	echo "/out2/" >>.git/info/sparse-checkout &&
+	git read-tree -m -u HEAD &&
+	test_path_is_file out2/d &&
+	test_path_is_missing out1 &&
+	git ls-files --sparse >actual &&
+	grep "^out2/d$" actual &&
+	grep "^out1/$" actual
+'
+
+test_done
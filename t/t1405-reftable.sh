@@ -0,0 +1,199 @@
+#!/bin/sh
+
+test_description='references stored in a reftable stack'
+
+. ./test-lib.sh
+
+test_expect_success 'init creates an empty stack' '
+	git -c core.refStorage=reftable init repo &&
+	test_path_is_file repo/.git/reftable/tables.list &&
+	test_must_be_empty repo/.git/reftable/tables.list &&
+	echo reftable >expect &&
+	git -C repo config core.refStorage >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'refs are written to the stack' '
+	(
+		cd repo &&
+		test_commit one &&
+		git branch side &&
+		git tag -a -m annotated annotated &&
+		test_path_is_missing .git/refs/heads/master &&
+		test_path_is_missing .git/refs/heads/side &&
+		test_path_is_missing .git/refs/tags/one &&
+		test_path_is_missing .git/packed-refs &&
+		git rev-parse one >expect &&
+		git rev-parse master >actual &&
+		test_cmp expect actual &&
+		git rev-parse side >actual &&
+		test_cmp expect actual &&
+		git rev-parse annotated^{} >actual &&
+		test_cmp expect actual &&
+		git reflog master >actual &&
+		test_line_count = 1 actual
+	)
+'
+
+test_expect_success 'iteration is sorted and limited to a prefix' '
+	(
+		cd repo &&
+		git update-ref refs/heads/a/b HEAD &&
+		git update-ref refs/heads/a-b HEAD &&
+		git update-ref refs/notes/x HEAD &&
+		git for-each-ref --format="%(refname)" >actual &&
+		cat >expect <<-\EOF &&
+		refs/heads/a-b
+		refs/heads/a/b
+		refs/heads/master
+		refs/heads/side
+		refs/notes/x
+		refs/tags/annotated
+		refs/tags/one
+		EOF
+		test_cmp expect actual &&
+		git for-each-ref --format="%(refname)" refs/heads/a >actual &&
+		echo refs/heads/a/b >expect &&
+		test_cmp expect actual &&
+		git show-ref --tags -d >actual &&
+		test_line_count = 3 actual
+	)
+'
+
+test_expect_success 'deleted refs go away' '
+	(
+		cd repo &&
+		git branch -D side &&
+		git update-ref -d refs/heads/a/b &&
+		test_must_fail git rev-parse --verify -q side &&
+		test_must_fail git rev-parse --verify -q a/b &&
+		git for-each-ref --format="%(refname)" refs/heads >actual &&
+		cat >expect <<-\EOF &&
+		refs/heads/a-b
+		refs/heads/master
+		EOF
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'directory/file conflicts are detected' '
+	(
+		cd repo &&
+		git branch dir/file &&
+		test_must_fail git branch dir &&
+		test_must_fail git branch dir/file/sub &&
+		git branch -m dir/file dir &&
+		git rev-parse --verify dir
+	)
+'
+
+test_expect_success 'transactions are atomic' '
+	(
+		cd repo &&
+		head=$(git rev-parse HEAD) &&
+		cat >stdin <<-EOF &&
+		create refs/heads/t1 $head
+		create refs/heads/t2 $head
+		update refs/heads/master $head $_z40
+		EOF
+		test_must_fail git update-ref --stdin <stdin &&
+		test_must_fail git rev-parse --verify -q t1 &&
+		test_must_fail git rev-parse --verify -q t2 &&
+		cat >stdin <<-EOF &&
+		create refs/heads/t1 $head
+		create refs/heads/t2 $head
+		delete refs/heads/a-b $head
+		EOF
+		git update-ref --stdin <stdin &&
+		git rev-parse --verify t1 &&
+		git rev-parse --verify t2 &&
+		test_must_fail git rev-parse --verify -q a-b
+	)
+'
+
+test_expect_success 'the stack is compacted geometrically' '
+	(
+		cd repo &&
+		for i in $(test_seq 100)
+		do
+			git update-ref refs/heads/many/$i HEAD || return 1
+		done &&
+		git for-each-ref refs/heads/many >actual &&
+		test_line_count = 100 actual &&
+		test $(wc -l <.git/reftable/tables.list) -le 7
+	)
+'
+
+test_expect_success 'pack-refs merges the stack into one table' '
+	(
+		cd repo &&
+		git for-each-ref >expect &&
+		git pack-refs --all &&
+		test_line_count = 1 .git/reftable/tables.list &&
+		git for-each-ref >actual &&
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'loose refs override the stack until they are rewritten' '
+	(
+		cd repo &&
+		git rev-parse one >.git/refs/heads/loose &&
+		git rev-parse one >expect &&
+		git rev-parse loose >actual &&
+		test_cmp expect actual &&
+		test_commit two &&
+		git update-ref refs/heads/loose HEAD &&
+		test_path_is_missing .git/refs/heads/loose &&
+		git rev-parse two >expect &&
+		git rev-parse loose >actual &&
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'gc keeps the referenced objects' '
+	(
+		cd repo &&
+		git for-each-ref >expect &&
+		git gc --prune=now &&
+		git for-each-ref >actual &&
+		test_cmp expect actual &&
+		git fsck
+	)
+'
+
+test_expect_success 'clone into a reftable repository' '
+	git -c core.refStorage=reftable clone repo clone &&
+	test_path_is_file clone/.git/reftable/tables.list &&
+	test_path_is_missing clone/.git/packed-refs &&
+	git -C repo for-each-ref --format="%(objectname) %(refname)" refs/heads |
+	sed "s,refs/heads/,refs/remotes/origin/," >expect &&
+	git -C clone for-each-ref --format="%(objectname) %(refname)" \
+		refs/remotes/origin >actual.all &&
+	grep -v "origin/HEAD$" actual.all >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'pack-refs converts packed-refs and loose refs' '
+	git init files &&
+	(
+		cd files &&
+		test_commit one &&
+		git tag -a -m annotated annotated &&
+		git branch packed &&
+		git pack-refs --all &&
+		git branch loose &&
+		git show-ref -d >expect &&
+		git -c core.refStorage=reftable pack-refs --all &&
+		test_path_is_file .git/reftable/tables.list &&
+		test_path_is_missing .git/packed-refs &&
+		test_path_is_missing .git/refs/heads/loose &&
+		git show-ref -d >actual &&
+		test_cmp expect actual &&
+		git branch new &&
+		test_path_is_missing .git/refs/heads/new &&
+		git rev-parse --verify new
+	)
+'
+
+test_done
@@ -0,0 +1,85 @@
+#!/bin/sh
+
+test_description='index with an offset table, loaded in threads'
+
+. ./test-lib.sh
+
+GIT_FORCE_THREADS=1
+export GIT_FORCE_THREADS
+
+test_expect_success 'setup' '
+	for d in a b c d
+	do
+		mkdir -p $d/sub &&
+		for i in $(test_seq 1 10)
+		do
+			echo "$d $i" >$d/file$i &&
+			echo "$d sub $i" >$d/sub/file$i || exit 1
+		done
+	done &&
+	git add . &&
+	test_tick &&
+	git commit -m initial &&
+	git rm -q --cached a/file1 &&
+	git commit -m removed &&
+	git checkout -q HEAD^ -- a/file1 &&
+	git ls-files --stage >expect.stage
+'
+
+for version in 2 3 4
+do
+	test_expect_success "write a version $version index" '
+		rm -f .git/index &&
+		GIT_INDEX_VERSION=$version git \
+			-c index.recordOffsetTable=true -c index.threads=4 \
+			read-tree HEAD &&
+		git -c index.recordOffsetTable=true -c index.threads=4 \
+			update-index --add a/file1 &&
+		git -c index.recordOffsetTable=true -c index.threads=4 \
+			update-index -q --refresh &&
+		test-index-version <.git/index >version &&
+		{
+			test $version = $(cat version) ||
+			test $version = 3 -a 2 = $(cat version)
+		}
+	'
+
+	test_expect_success PTHREADS "version $version: the offset table is there" '
+		grep EOIE .git/index >/dev/null &&
+		grep IEOT .git/index >/dev/null
+	'
+
+	test_expect_success "version $version: threads read the same entries" '
+		git -c index.threads=4 ls-files --stage >actual 2>err &&
+		test_cmp expect.stage actual &&
+		test_must_be_empty err &&
+		git -c index.threads=4 diff-files --exit-code
+	'
+
+	test_expect_success "version $version: serial readers read the same entries" '
+		git -c index.threads=1 ls-files --stage >actual 2>err &&
+		test_cmp expect.stage actual &&
+		test_must_be_empty err
+	'
+done
+
+test_expect_success 'extensions are read in their own thread' '
+	test_config index.recordOffsetTable true &&
+	git write-tree >/dev/null &&
+	test_config index.threads 1 &&
+	test-dump-cache-tree >expect.tree &&
+	test_config index.threads 4 &&
+	test-dump-cache-tree >actual &&
+	test_cmp expect.tree actual
+'
+
+test_expect_success 'an index without the offset table is read serially' '
+	rm -f .git/index &&
+	git read-tree HEAD &&
+	git update-index --add a/file1 &&
+	! grep IEOT .git/index >/dev/null &&
+	git -c index.threads=4 ls-files --stage >actual &&
+	test_cmp expect.stage actual
+'
+
+test_done
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+test_description='the SHA-1 at the end of the index'
+
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	blob=$(echo content | git hash-object -w --stdin) &&
+	test_seq 1 3000 |
+	awk -v blob=$blob "{ printf \"100644 %s\\tdir%d/file%d\\n\", blob, \$1 % 50, \$1 }" |
+	git update-index --index-info &&
+	git commit -q -m initial &&
+	git ls-files --stage >expect &&
+	cp .git/index good-index
+'
+
+test_expect_success 'writing the index hashes it in the background' '
+	rm -f .git/index &&
+	GIT_FORCE_THREADS=1 git -c index.threads=4 read-tree HEAD &&
+	cp .git/index threaded-index &&
+	rm -f .git/index &&
+	git -c index.threads=1 read-tree HEAD &&
+	cmp .git/index threaded-index &&
+	git ls-files --stage >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'corrupt the checksum' '
+	perl -e "
+		local \$/;
+		my \$index = <STDIN>;
+		substr(\$index, -1, 1) ^= \"\\001\";
+		print \$index;
+	" <good-index >.git/index
+'
+
+test_expect_success 'a bad checksum is found by default' '
+	test_must_fail git ls-files 2>err &&
+	grep "bad index file sha1 signature" err
+'
+
+test_expect_success 'index.verifyChecksum=false does not look' '
+	git -c index.verifyChecksum=false ls-files --stage >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'fsck finds it even so' '
+	test_must_fail git -c index.verifyChecksum=false fsck 2>err &&
+	grep "bad index file sha1 signature" err
+'
+
+test_done
@@ -0,0 +1,238 @@
+#!/bin/sh
+
+test_description='split index mode tests'
+
+. ./test-lib.sh
+
+EMPTY_BLOB=e69de29bb2d1d6434b8b29ae775ad8c2e48c5391
+
+dump_split_index () {
+	test-dump-split-index .git/index | sed "/^own /d" >actual
+}
+
+base_sha1 () {
+	test-dump-split-index .git/index | sed -n "s/^base //p"
+}
+
+test_expect_success 'enable split index' '
+	git config splitIndex.maxPercentChange 100 &&
+	git update-index --split-index &&
+	base=$(base_sha1) &&
+	test_path_is_file .git/sharedindex.$base &&
+	dump_split_index &&
+	cat >expect <<-EOF &&
+	base $base
+	replacements:
+	deletions:
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'add one file' '
+	: >one &&
+	git update-index --add one &&
+	git ls-files --stage >ls-files.actual &&
+	cat >ls-files.expect <<-EOF &&
+	100644 $EMPTY_BLOB 0	one
+	EOF
+	test_cmp ls-files.expect ls-files.actual &&
+
+	dump_split_index &&
+	cat >expect <<-EOF &&
+	base $base
+	100644 $EMPTY_BLOB 0	one
+	replacements:
+	deletions:
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'disable split index' '
+	git update-index --no-split-index &&
+	git ls-files --stage >ls-files.actual &&
+	test_cmp ls-files.expect ls-files.actual &&
+	test-dump-split-index .git/index | sed "/^own /d" >actual &&
+	echo "not a split index" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'enable split index again, "one" now belongs to base index' '
+	git update-index --split-index &&
+	base=$(base_sha1) &&
+	git ls-files --stage >ls-files.actual &&
+	test_cmp ls-files.expect ls-files.actual &&
+
+	dump_split_index &&
+	cat >expect <<-EOF &&
+	base $base
+	replacements:
+	deletions:
+	EOF
+	test_cmp expect actual &&
+	GIT_INDEX_FILE=.git/sharedindex.$base git ls-files >actual &&
+	echo one >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modify original file, base index untouched' '
+	echo modified >one &&
+	blob=$(git hash-object one) &&
+	git update-index one &&
+	git ls-files --stage >ls-files.actual &&
+	cat >ls-files.expect <<-EOF &&
+	100644 $blob 0	one
+	EOF
+	test_cmp ls-files.expect ls-files.actual &&
+
+	dump_split_index &&
+	cat >expect <<-EOF &&
+	base $base
+	100644 $blob 0	one
+	replacements: 0
+	deletions:
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'add another file, which stays in the delta' '
+	: >two &&
+	git update-index --add two &&
+	git ls-files --stage >ls-files.actual &&
+	cat >ls-files.expect <<-EOF &&
+	100644 $blob 0	one
+	100644 $EMPTY_BLOB 0	two
+	EOF
+	test_cmp ls-files.expect ls-files.actual &&
+
+	dump_split_index &&
+	cat >expect <<-EOF &&
+	base $base
+	100644 $blob 0	one
+	100644 $EMPTY_BLOB 0	two
+	replacements: 0
+	deletions:
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'delete file in the base index' '
+	git update-index --force-remove one &&
+	git ls-files --stage >ls-files.actual &&
+	cat >ls-files.expect <<-EOF &&
+	100644 $EMPTY_BLOB 0	two
+	EOF
+	test_cmp ls-files.expect ls-files.actual &&
+
+	dump_split_index &&
+	cat >expect <<-EOF &&
+	base $base
+	100644 $EMPTY_BLOB 0	two
+	replacements:
+	deletions: 0
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'add entries sorting before and after base entries' '
+	git update-index --add one &&
+	git update-index --split-index &&
+	base=$(base_sha1) &&
+	: >a-first &&
+	: >z-last &&
+	git update-index --add a-first z-last &&
+	git ls-files >actual &&
+	cat >expect <<-\EOF &&
+	a-first
+	one
+	two
+	z-last
+	EOF
+	test_cmp expect actual &&
+	test "$(base_sha1)" = "$base"
+'
+
+test_expect_success 'a large change writes a new shared index' '
+	git config splitIndex.maxPercentChange 20 &&
+	for i in 1 2 3
+	do
+		: >new-$i || return 1
+	done &&
+	git update-index --add new-1 new-2 new-3 &&
+	new_base=$(base_sha1) &&
+	test "$new_base" != "$base" &&
+	dump_split_index &&
+	cat >expect <<-EOF &&
+	base $new_base
+	replacements:
+	deletions:
+	EOF
+	test_cmp expect actual &&
+	base=$new_base
+'
+
+test_expect_success 'maxPercentChange=0 writes a new shared index every time' '
+	git -c splitIndex.maxPercentChange=0 update-index --remove new-3 &&
+	rm new-3 &&
+	git -c splitIndex.maxPercentChange=0 update-index --remove new-3 &&
+	test "$(base_sha1)" != "$base" &&
+	base=$(base_sha1)
+'
+
+test_expect_success 'commit and reset keep the split index' '
+	git config splitIndex.maxPercentChange 100 &&
+	test_tick &&
+	git commit -m initial &&
+	echo changed >two &&
+	git add two &&
+	git reset --hard HEAD &&
+	test "$(base_sha1)" = "$base" &&
+	git ls-files >actual &&
+	git ls-tree -r --name-only HEAD >expect &&
+	test_cmp expect actual &&
+	git diff-index --exit-code HEAD &&
+	git status --porcelain --untracked-files=no >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'missing shared index is an error' '
+	mv .git/sharedindex.$base shared-save &&
+	test_must_fail git ls-files 2>err &&
+	grep "sharedindex.$base" err &&
+	mv shared-save .git/sharedindex.$base &&
+	git ls-files
+'
+
+test_expect_success 'writing the split index keeps its shared index fresh' '
+	test-chmtime =-1209700 .git/sharedindex.$base &&
+	git update-index --add --cacheinfo 100644 $EMPTY_BLOB new-4 &&
+	test $(test-chmtime -v +0 .git/sharedindex.$base | cut -f1) -gt \
+		$(($(date +%s) - 60))
+'
+
+test_expect_success 'unused shared index files expire' '
+	ls .git/sharedindex.* >before &&
+	test_line_count -gt 1 before &&
+	for f in $(cat before)
+	do
+		test-chmtime =-1209700 $f || return 1
+	done &&
+	git -c splitIndex.maxPercentChange=0 update-index --remove new-4 &&
+	base=$(base_sha1) &&
+	ls .git/sharedindex.* >actual &&
+	echo .git/sharedindex.$base >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'splitIndex.sharedIndexExpire=never keeps them' '
+	git -c splitIndex.maxPercentChange=0 \
+		-c splitIndex.sharedIndexExpire=never \
+		update-index --add --cacheinfo 100644 $EMPTY_BLOB new-4 &&
+	test_path_is_file .git/sharedindex.$base &&
+	git -c splitIndex.maxPercentChange=0 \
+		-c splitIndex.sharedIndexExpire=now \
+		update-index --remove new-4 &&
+	ls .git/sharedindex.* >actual &&
+	test_line_count = 1 actual
+'
+
+test_done
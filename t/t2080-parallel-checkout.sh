@@ -0,0 +1,118 @@
+#!/bin/sh
+
+test_description='parallel checkout
+
+Check out the same trees with checkout.workers set to one and to
+several, and compare the results.'
+
+. ./test-lib.sh
+
+parallel="-c checkout.workers=4 -c checkout.thresholdForParallelism=1"
+
+test_expect_success 'setup' '
+	for d in a b c
+	do
+		mkdir -p $d/sub &&
+		for i in $(test_seq 1 20)
+		do
+			echo "$d $i" >$d/file$i &&
+			echo "$d sub $i" >$d/sub/file$i || exit 1
+		done
+	done &&
+	echo "#!/bin/sh" >script &&
+	test_chmod +x script &&
+	echo "\$Id\$" >ident.txt &&
+	printf "one\ntwo\n" >crlf.txt &&
+	{
+		echo "ident.txt ident" &&
+		echo "crlf.txt eol=crlf"
+	} >.gitattributes &&
+	test-genrandom big 20000 >big &&
+	git add . &&
+	test_ln_s_add a/file1 link &&
+	test_tick &&
+	git commit -m one &&
+	git rm -rq b &&
+	for i in $(test_seq 1 20)
+	do
+		echo "a $i changed" >a/file$i || exit 1
+	done &&
+	mkdir d &&
+	echo new >d/file &&
+	git add . &&
+	test_tick &&
+	git commit -m two
+'
+
+test_expect_success 'clone in parallel matches a serial clone' '
+	git clone -c checkout.workers=1 . serial &&
+	git $parallel -c core.bigFileThreshold=10k clone . parallel &&
+	(
+		cd parallel &&
+		git diff-files --exit-code &&
+		test -z "$(git status --porcelain)" &&
+		test -x script
+	) &&
+	rm -rf serial/.git parallel/.git &&
+	diff -r serial parallel
+'
+
+test_expect_success 'switching branches in parallel' '
+	git clone -q . switch &&
+	(
+		cd switch &&
+		git $parallel checkout -q HEAD^ &&
+		git diff-files --exit-code &&
+		test -z "$(git status --porcelain)" &&
+		test_path_is_dir b/sub &&
+		test_path_is_missing d &&
+		git $parallel checkout -q master &&
+		git diff-files --exit-code &&
+		test -z "$(git status --porcelain)" &&
+		test_path_is_missing b &&
+		echo "a 3 changed" >expect &&
+		test_cmp expect a/file3
+	)
+'
+
+test_expect_success 'files the attributes convert are written too' '
+	(
+		cd parallel &&
+		grep "\\\$Id: [0-9a-f]* \\\$" ident.txt &&
+		printf "one\r\ntwo\r\n" >expect &&
+		test_cmp expect crlf.txt
+	)
+'
+
+test_expect_success 'below the threshold the files are written serially' '
+	git clone -q --no-checkout . few &&
+	(
+		cd few &&
+		git -c checkout.workers=4 -c checkout.thresholdForParallelism=1000 \
+			checkout -q master &&
+		git diff-files --exit-code &&
+		test -z "$(git status --porcelain)"
+	)
+'
+
+test_expect_success CASE_INSENSITIVE_FS,SYMLINKS 'nothing is written through a symlink replacing a queued directory' '
+	mkdir outside &&
+	git init collide &&
+	(
+		cd collide &&
+		blob=$(echo file | git hash-object -w --stdin) &&
+		link=$(printf ../outside | git hash-object -w --stdin) &&
+		sub=$(printf "100644 blob $blob\tfile\n" | git mktree) &&
+		tree=$(printf "040000 tree $sub\tA\n120000 blob $link\ta\n" |
+		       git mktree) &&
+		commit=$(git commit-tree -m collide $tree) &&
+		git $parallel reset -q --hard $commit
+	) &&
+	test_path_is_missing outside/file
+'
+
+test_expect_success 'negative checkout.workers is rejected' '
+	test_must_fail git -c checkout.workers=-1 checkout -q HEAD^
+'
+
+test_done
@@ -0,0 +1,47 @@
+#!/bin/sh
+
+test_description='building the name hash, in threads and not'
+
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	blob=$(echo content | git hash-object -w --stdin) &&
+	for path in top Dir/a Dir/sub/b Dir/sub/deep/c dir/z dir2/x \
+		other/one other/sub/two zz/last
+	do
+		git update-index --add --cacheinfo 100644 $blob $path || exit 1
+	done &&
+	for i in $(test_seq 1 30)
+	do
+		git update-index --add --cacheinfo 100644 $blob many/d$i/f ||
+		exit 1
+	done &&
+	test-lazy-init-name-hash dir many/d7 >expect
+'
+
+test_expect_success 'every name and directory is found' '
+	n=$(git ls-files | wc -l) &&
+	d=$(($(grep -c "^dir " expect) / 2)) &&
+	head -n $(($n + $d)) expect >before &&
+	test $(grep -c "^file .* found$" before) = $n &&
+	! grep missing before
+'
+
+test_expect_success 'forgetting the entries empties their directories' '
+	tail -n $(($(grep -c "^dir " expect) / 2)) expect >after &&
+	grep "^dir Dir missing" after &&
+	grep "^dir Dir/sub/deep missing" after &&
+	grep "^dir dir missing" after &&
+	grep "^dir many/d7 missing" after &&
+	grep "^dir dir2 found" after &&
+	grep "^dir many found" after &&
+	grep "^dir many/d8 found" after &&
+	test $(grep -c missing after) = 5
+'
+
+test_expect_success 'threads build the same hashes' '
+	GIT_FORCE_THREADS=1 test-lazy-init-name-hash dir many/d7 >actual &&
+	test_cmp expect actual
+'
+
+test_done
@@ -151,4 +151,52 @@ test_expect_success 'delete ref while another dangling packed ref' '
 	test_cmp /dev/null result
 '
 
+test_expect_success 'packed-refs is written sorted' '
+	git pack-refs --all &&
+	head -n 1 .git/packed-refs >header &&
+	grep " sorted " header &&
+	sed -e "1d" -e "/^\^/d" -e "s/^[0-9a-f]* //" .git/packed-refs >refs &&
+	sort refs >expect &&
+	test_cmp expect refs
+'
+
+test_expect_success 'refs are looked up in sorted packed-refs' '
+	for i in 1 2 3 4 5 6 7 8 9
+	do
+		git branch -f search/$i/a HEAD &&
+		git branch -f search/$i-b HEAD || return 1
+	done &&
+	git tag -a -m search search-tag &&
+	git pack-refs --all &&
+	git rev-parse HEAD >expect &&
+	git rev-parse search/5/a >actual &&
+	test_cmp expect actual &&
+	git rev-parse search/9-b >actual &&
+	test_cmp expect actual &&
+	git rev-parse search-tag^{} >actual &&
+	test_cmp expect actual &&
+	test_must_fail git rev-parse --verify -q search/5 &&
+	test_must_fail git rev-parse --verify -q search/0-b &&
+	git for-each-ref --format="%(refname)" refs/heads/search/3 >actual &&
+	echo refs/heads/search/3/a >expect &&
+	test_cmp expect actual &&
+	git for-each-ref --format="%(refname)" refs/heads/search >actual &&
+	test_line_count = 18 actual &&
+	sort actual >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'unsorted packed-refs without the trait is still read' '
+	head -n 1 .git/packed-refs | sed "s/sorted //" >packed &&
+	sed -e 1d -e "/^\^/d" .git/packed-refs | sort -r -k2 >>packed &&
+	mv packed .git/packed-refs &&
+	git rev-parse HEAD >expect &&
+	git rev-parse search/5/a >actual &&
+	test_cmp expect actual &&
+	git for-each-ref --format="%(refname)" refs/heads/search >actual &&
+	sort actual >expect &&
+	test_cmp expect actual &&
+	test_line_count = 18 actual
+'
+
 test_done
@@ -400,6 +400,105 @@ test_expect_success 'verify resulting packs' '
 	git verify-pack test-11-*.pack
 '
 
+test_expect_success 'setup many similar blobs' '
+	git init many &&
+	(
+		cd many &&
+		test_seq 1 25000 |
+		awk "{
+			print \"blob\";
+			print \"data <<EOF\";
+			print \"a blob that looks like the others\";
+			print \"apart from the number \" \$1;
+			print \"EOF\";
+		}" | git fast-import &&
+		idx=$(echo .git/objects/pack/pack-*.idx) &&
+		git show-index <"$idx" >index &&
+		cut -d" " -f2 <index >objects &&
+		test_line_count = 25000 objects
+	)
+'
+
+test_expect_success 'checking objects in threads gives the same pack' '
+	(
+		cd many &&
+		git pack-objects --window=0 --threads=1 one <objects >one.name &&
+		git pack-objects --window=0 --threads=4 many <objects >many.name &&
+		test_cmp one.name many.name &&
+		test_cmp one-$(cat one.name).pack many-$(cat many.name).pack &&
+		git verify-pack many-$(cat many.name).pack
+	)
+'
+
+test_expect_success PTHREADS 'delta search in threads reports each thread' '
+	(
+		cd many &&
+		GIT_TRACE_PACK_THREADS="$(pwd)/trace" \
+		git pack-objects --no-reuse-delta --window=10 --threads=4 search <objects >search.name &&
+		git verify-pack search-$(cat search.name).pack &&
+		test $(grep -c "^pack-objects: thread [0-3]: " trace) = 4 &&
+		grep "^pack-objects: delta search took" trace
+	)
+'
+
+test_expect_success 'setup thin pack with many missing bases' '
+	git init thin-src &&
+	(
+		cd thin-src &&
+		for i in $(test_seq 1 50)
+		do
+			test_seq $i $(($i + 200)) >file$i || return 1
+		done &&
+		git add . &&
+		git commit -m base &&
+		git branch base &&
+		for i in $(test_seq 1 50)
+		do
+			echo change >>file$i || return 1
+		done &&
+		git commit -a -m change &&
+		printf "%s\n" HEAD ^base |
+		git pack-objects --revs --thin --stdout >../thin.pack
+	) &&
+	git init thin-dst &&
+	(
+		cd thin-dst &&
+		git fetch ../thin-src base
+	)
+'
+
+test_expect_success 'fixing a thin pack in threads gives the same pack' '
+	for threads in 1 4
+	do
+		rm -rf thin-$threads &&
+		cp -R thin-dst thin-$threads &&
+		(
+			cd thin-$threads &&
+			git index-pack --threads=$threads --fix-thin --stdin \
+				<../thin.pack >name
+		) || return 1
+	done &&
+	test_cmp thin-1/name thin-4/name &&
+	pack=$(cut -f2 thin-1/name) &&
+	test_cmp thin-1/.git/objects/pack/pack-$pack.pack \
+		thin-4/.git/objects/pack/pack-$pack.pack &&
+	git verify-pack -v thin-4/.git/objects/pack/pack-$pack.idx >verify &&
+	grep "^chain length = 1: 50 objects" verify
+'
+
+test_expect_success PTHREADS 'index-pack in a pipeline gives the same index' '
+	(
+		cd many &&
+		pack=many-$(cat many.name).pack &&
+		git index-pack --threads=1 -o one.idx $pack &&
+		git index-pack --threads=4 -o four.idx $pack &&
+		test_cmp one.idx four.idx &&
+		git init --bare stdin.git &&
+		git --git-dir=stdin.git index-pack --threads=4 --stdin <$pack >name &&
+		test_cmp one.idx stdin.git/objects/pack/pack-$(cut -f2 name).idx
+	)
+'
+
 #
 # WARNING!
 #
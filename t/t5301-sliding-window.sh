@@ -57,4 +57,59 @@ test_expect_success \
      git config --unset core.packedGitLimit &&
      git verify-pack -v "$pack2"'
 
+test_expect_success 'setup deltas against several bases' '
+	git init chain &&
+	(
+		cd chain &&
+		for i in $(test_seq 1 30)
+		do
+			for f in 1 2 3 4 5
+			do
+				test_seq 1 $((100 + $i * 5)) | sed "s/^/$f /" >file$f
+			done &&
+			git add . &&
+			git commit -q -m "commit $i" || exit 1
+		done &&
+		git repack -adfq --depth=50 &&
+		git log -p >../chain.log
+	)
+'
+
+test_expect_success 'delta base cache reports its hits and misses' '
+	(
+		cd chain &&
+		GIT_TRACE_DELTA_BASE_CACHE="$(pwd)/trace" git log -p >actual &&
+		test_cmp ../chain.log actual &&
+		grep "^delta base cache: [1-9][0-9]* hits, [1-9][0-9]* misses, 0 evictions" trace
+	)
+'
+
+test_expect_success 'only the lookups of delta bases are counted' '
+	(
+		cd chain &&
+		git verify-pack -v .git/objects/pack/pack-*.idx >verify &&
+		whole=$(awk "\$2 == \"blob\" && NF == 5 { print \$1; exit }" verify) &&
+		delta=$(awk "\$2 == \"blob\" && \$6 == 1 { print \$1; exit }" verify) &&
+		rm -f trace &&
+		GIT_TRACE_DELTA_BASE_CACHE="$(pwd)/trace" \
+			git cat-file blob $whole >/dev/null &&
+		grep "^delta base cache: 0 hits, 0 misses," trace &&
+		rm -f trace &&
+		GIT_TRACE_DELTA_BASE_CACHE="$(pwd)/trace" \
+			git cat-file blob $delta >/dev/null &&
+		grep "^delta base cache: 0 hits, 1 misses," trace
+	)
+'
+
+test_expect_success 'delta base cache evicts down to its limit' '
+	(
+		cd chain &&
+		rm -f trace &&
+		GIT_TRACE_DELTA_BASE_CACHE="$(pwd)/trace" \
+			git -c core.deltaBaseCacheLimit=1k log -p >actual &&
+		test_cmp ../chain.log actual &&
+		grep "misses, [1-9][0-9]* evictions" trace
+	)
+'
+
 test_done
@@ -119,6 +119,37 @@ test_expect_success 'fetch (full bitmap)' '
 	test_cmp expect actual
 '
 
+test_expect_success 'setup history with deltas' '
+	git checkout -b deltas master &&
+	test_seq 1 1000 >big &&
+	git add big &&
+	git commit -m "big file" &&
+	for i in $(test_seq 1 20)
+	do
+		echo $i >>big &&
+		echo $i >small &&
+		git add big small &&
+		git commit -m "big file $i" || return 1
+	done &&
+	git checkout master &&
+	git repack -adf &&
+	git verify-pack -v .git/objects/pack/pack-*.idx >verify &&
+	grep "chain length" verify
+'
+
+test_expect_success 'pack reuses wanted objects from the middle of the pack' '
+	git rev-list --objects deltas ^master >revs &&
+	cut -d" " -f1 revs | sort >expect &&
+	printf "%s\n" deltas ^master |
+	git pack-objects --revs --stdout --delta-base-offset --progress \
+		>reused.pack 2>err &&
+	grep "pack-reused [1-9]" err &&
+	git index-pack -o reused.idx reused.pack &&
+	git verify-pack reused.idx &&
+	git show-index <reused.idx | cut -d" " -f2 | sort >actual &&
+	test_cmp expect actual
+'
+
 test_expect_success 'create objects for missing-HAVE tests' '
 	blob=$(echo "missing have" | git hash-object -w --stdin) &&
 	tree=$(printf "100644 blob $blob\tfile\n" | git mktree) &&
@@ -0,0 +1,251 @@
+#!/bin/sh
+
+test_description='commit graph'
+. ./test-lib.sh
+
+test_expect_success 'setup full repo' '
+	mkdir full &&
+	cd "$TRASH_DIRECTORY/full" &&
+	git init &&
+	git config core.commitGraph true &&
+	objdir=".git/objects"
+'
+
+test_expect_success 'write graph with no packs' '
+	cd "$TRASH_DIRECTORY/full" &&
+	git commit-graph write &&
+	test_path_is_file $objdir/info/commit-graph
+'
+
+test_expect_success 'create commits and repack' '
+	cd "$TRASH_DIRECTORY/full" &&
+	for i in $(test_seq 3)
+	do
+		test_commit $i &&
+		git branch commits/$i
+	done &&
+	git repack
+'
+
+graph_read_expect() {
+	OPTIONAL=""
+	NUM_CHUNKS=3
+	if test ! -z $2
+	then
+		OPTIONAL=" $2"
+		NUM_CHUNKS=$((3 + $(echo "$2" | wc -w)))
+	fi
+	cat >expect <<- EOF
+	header: 43475048 1 1 $NUM_CHUNKS 0
+	num_commits: $1
+	chunks: oid_fanout oid_lookup commit_metadata$OPTIONAL
+	EOF
+	git commit-graph read >output &&
+	test_cmp expect output
+}
+
+test_expect_success 'write graph' '
+	cd "$TRASH_DIRECTORY/full" &&
+	git commit-graph write &&
+	test_path_is_file $objdir/info/commit-graph &&
+	graph_read_expect "3"
+'
+
+test_expect_success 'Add more commits' '
+	cd "$TRASH_DIRECTORY/full" &&
+	git reset --hard commits/1 &&
+	for i in $(test_seq 4 5)
+	do
+		test_commit $i &&
+		git branch commits/$i
+	done &&
+	git reset --hard commits/2 &&
+	for i in $(test_seq 6 7)
+	do
+		test_commit $i &&
+		git branch commits/$i
+	done &&
+	git reset --hard commits/2 &&
+	git merge commits/4 &&
+	git branch merge/1 &&
+	git reset --hard commits/4 &&
+	git merge commits/6 &&
+	git branch merge/2 &&
+	git reset --hard commits/3 &&
+	git merge commits/5 commits/7 &&
+	git branch merge/3 &&
+	git repack
+'
+
+# Current graph structure:
+#
+#   __M3___
+#  /   |   \
+# 3 M1 5 M2 7
+# |/  \|/  \|
+# 2    4    6
+# |___/____/
+# 1
+
+graph_git_two_modes() {
+	git -c core.commitGraph=true $1 >output &&
+	git -c core.commitGraph=false $1 >expect &&
+	test_cmp expect output
+}
+
+graph_git_behavior() {
+	MSG=$1
+	DIR=$2
+	BRANCH=$3
+	COMPARE=$4
+	test_expect_success "check normal git operations: $MSG" '
+		cd "$TRASH_DIRECTORY/$DIR" &&
+		graph_git_two_modes "log --oneline $BRANCH" &&
+		graph_git_two_modes "log --topo-order $BRANCH" &&
+		graph_git_two_modes "log --graph $COMPARE..$BRANCH" &&
+		graph_git_two_modes "branch -vv" &&
+		graph_git_two_modes "merge-base -a $BRANCH $COMPARE" &&
+		graph_git_two_modes "branch --contains $COMPARE"
+	'
+}
+
+graph_git_behavior 'graph exists, no merges' full commits/3 commits/1
+
+test_expect_success 'write graph with merges' '
+	cd "$TRASH_DIRECTORY/full" &&
+	git commit-graph write &&
+	test_path_is_file $objdir/info/commit-graph &&
+	graph_read_expect "10" "extra_edges"
+'
+
+graph_git_behavior 'merge 1 vs 2' full merge/1 merge/2
+graph_git_behavior 'merge 1 vs 3' full merge/1 merge/3
+graph_git_behavior 'merge 2 vs 3' full merge/2 merge/3
+graph_git_behavior 'commit 3 vs merge 3' full commits/3 merge/3
+graph_git_behavior 'commit 4 vs commit 6' full commits/4 commits/6
+
+test_expect_success 'Add one more commit' '
+	cd "$TRASH_DIRECTORY/full" &&
+	test_commit 8 &&
+	git branch commits/8 &&
+	ls $objdir/pack | grep idx >existing-idx &&
+	git repack &&
+	ls $objdir/pack| grep idx | grep -v --file=existing-idx >new-idx
+'
+
+# Current graph structure:
+#
+#      8
+#      |
+#   __M3___
+#  /   |   \
+# 3 M1 5 M2 7
+# |/  \|/  \|
+# 2    4    6
+# |___/____/
+# 1
+
+graph_git_behavior 'mixed mode, commit 8 vs merge 1' full commits/8 merge/1
+graph_git_behavior 'mixed mode, commit 8 vs merge 2' full commits/8 merge/2
+
+test_expect_success 'write graph with new commit' '
+	cd "$TRASH_DIRECTORY/full" &&
+	git commit-graph write &&
+	test_path_is_file $objdir/info/commit-graph &&
+	graph_read_expect "11" "extra_edges"
+'
+
+graph_git_behavior 'full graph, commit 8 vs merge 1' full commits/8 merge/1
+graph_git_behavior 'full graph, commit 8 vs merge 2' full commits/8 merge/2
+
+test_expect_success 'merge-base --is-ancestor with generation numbers' '
+	cd "$TRASH_DIRECTORY/full" &&
+	git merge-base --is-ancestor commits/1 commits/8 &&
+	git merge-base --is-ancestor merge/2 merge/2 &&
+	git merge-base --is-ancestor commits/6 merge/3 &&
+	test_must_fail git merge-base --is-ancestor commits/8 commits/1 &&
+	test_must_fail git merge-base --is-ancestor merge/1 merge/3 &&
+	test_must_fail git merge-base --is-ancestor commits/3 merge/2
+'
+
+test_expect_success 'ancestor of the newer of several references' '
+	cd "$TRASH_DIRECTORY" &&
+	git init follow &&
+	cd follow &&
+	git config core.commitGraph true &&
+	test_commit A &&
+	git branch old &&
+	test_commit B &&
+	git tag -a -m "tag B" tag-B &&
+	test_commit C &&
+	git commit-graph write --reachable &&
+	git init --bare ../follow-dst &&
+	git push --follow-tags ../follow-dst old master &&
+	git --git-dir=../follow-dst rev-parse --verify tag-B
+'
+
+test_expect_success 'write graph from reachable commits' '
+	cd "$TRASH_DIRECTORY/full" &&
+	test_commit 9 &&
+	git branch commits/9 &&
+	git commit-graph write --reachable &&
+	graph_read_expect "12" "extra_edges"
+'
+
+test_expect_success 'write graph from commits on stdin' '
+	cd "$TRASH_DIRECTORY/full" &&
+	git rev-parse commits/4 | git commit-graph write --stdin-commits &&
+	graph_read_expect "2"
+'
+
+graph_git_behavior 'partial graph, commit 9 vs merge 1' full commits/9 merge/1
+graph_git_behavior 'partial graph, merge 3 vs commit 4' full merge/3 commits/4
+
+test_expect_success 'gc writes the commit-graph when asked to' '
+	cd "$TRASH_DIRECTORY/full" &&
+	rm -f $objdir/info/commit-graph &&
+	git -c gc.writeCommitGraph=true gc &&
+	graph_read_expect "12" "extra_edges"
+'
+
+test_expect_success 'grafts disable the commit-graph' '
+	cd "$TRASH_DIRECTORY/full" &&
+	git rev-parse commits/2 >.git/info/grafts &&
+	test_when_finished "rm -f .git/info/grafts" &&
+	git log --oneline commits/3 >output &&
+	test_line_count = 2 output &&
+	test_must_fail git commit-graph write --reachable
+'
+
+test_expect_success 'setup bare repo' '
+	cd "$TRASH_DIRECTORY" &&
+	git clone --bare --no-local full bare &&
+	cd bare &&
+	git config core.commitGraph true &&
+	baredir="./objects"
+'
+
+graph_git_behavior 'bare repo, commit 8 vs merge 1' bare commits/8 merge/1
+
+test_expect_success 'write graph in bare repo' '
+	cd "$TRASH_DIRECTORY/bare" &&
+	git commit-graph write &&
+	test_path_is_file $baredir/info/commit-graph &&
+	graph_read_expect "12" "extra_edges"
+'
+
+graph_git_behavior 'bare repo with graph, commit 8 vs merge 1' bare commits/8 merge/1
+graph_git_behavior 'bare repo with graph, commit 8 vs merge 2' bare commits/8 merge/2
+
+test_expect_success 'corrupt graph is ignored with an error' '
+	cd "$TRASH_DIRECTORY/bare" &&
+	git rev-parse commits/8 >expect &&
+	chmod u+w $baredir/info/commit-graph &&
+	printf "XXXX" | dd of=$baredir/info/commit-graph bs=1 conv=notrunc 2>/dev/null &&
+	git rev-parse commits/8 >actual 2>err &&
+	test_cmp expect actual &&
+	git log --oneline commits/8 >output 2>err &&
+	grep "commit-graph signature" err
+'
+
+test_done
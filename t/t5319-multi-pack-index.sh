@@ -0,0 +1,190 @@
+#!/bin/sh
+
+test_description='multi-pack-indexes'
+. ./test-lib.sh
+
+objdir=.git/objects
+
+midx_read_expect () {
+	NUM_PACKS=$1
+	NUM_OBJECTS=$2
+	{
+		cat <<-EOF &&
+		header: 4d494458 1 1 4
+		chunks: pack-names oid-fanout oid-lookup object-offsets
+		num_objects: $NUM_OBJECTS
+		packs:
+		EOF
+		ls $objdir/pack | grep "\.idx$" | sort
+	} >expect &&
+	test $NUM_PACKS = $(ls $objdir/pack | grep "\.idx$" | wc -l) &&
+	git multi-pack-index read >actual &&
+	test_cmp expect actual
+}
+
+test_expect_success 'write midx with no packs' '
+	test_when_finished "rm -f $objdir/pack/multi-pack-index" &&
+	git multi-pack-index write &&
+	test_path_is_file $objdir/pack/multi-pack-index &&
+	midx_read_expect 0 0
+'
+
+generate_objects () {
+	i=$1
+	iii=$(printf "%03i" $i)
+	{
+		test-genrandom "bar" 200 &&
+		test-genrandom "baz $iii" 50
+	} >wide_delta_$iii &&
+	{
+		test-genrandom "foo"$i 100 &&
+		test-genrandom "foo"$(( $i + 1 )) 100 &&
+		test-genrandom "foo"$(( $i + 2 )) 100
+	} >deep_delta_$iii &&
+	echo $iii >file_$iii &&
+	test-genrandom "$iii" 8192 >>file_$iii &&
+	git update-index --add file_$iii deep_delta_$iii wide_delta_$iii &&
+	i=$(( $i + 1 ))
+}
+
+commit_and_list_objects () {
+	{
+		echo 101 &&
+		test-genrandom 100 8192;
+	} >file_101 &&
+	git update-index --add file_101 &&
+	tree=$(git write-tree) &&
+	commit=$(git commit-tree $tree -p HEAD</dev/null) &&
+	{
+		echo $tree &&
+		git ls-tree $tree | sed -e "s/.* \\([0-9a-f]*\\)	.*/\\1/"
+	} >obj-list &&
+	git reset --hard $commit
+}
+
+test_expect_success 'create objects' '
+	test_commit initial &&
+	for i in $(test_seq 1 5)
+	do
+		generate_objects $i
+	done &&
+	commit_and_list_objects
+'
+
+test_expect_success 'write midx with one v1 pack' '
+	pack=$(git pack-objects --index-version=1 $objdir/pack/test <obj-list) &&
+	test_when_finished rm $objdir/pack/test-$pack.pack \
+		$objdir/pack/test-$pack.idx $objdir/pack/multi-pack-index &&
+	git multi-pack-index write &&
+	midx_read_expect 1 18
+'
+
+compare_results_with_midx () {
+	MSG=$1
+	test_expect_success "check normal git operations: $MSG" '
+		git rev-list --objects --all >obj-list &&
+		git -c core.multiPackIndex=false cat-file --batch-check <obj-list >expect &&
+		git -c core.multiPackIndex=true cat-file --batch-check <obj-list >actual &&
+		test_cmp expect actual &&
+		git -c core.multiPackIndex=false cat-file --batch <obj-list >expect &&
+		git -c core.multiPackIndex=true cat-file --batch <obj-list >actual &&
+		test_cmp expect actual &&
+		git -c core.multiPackIndex=true fsck
+	'
+}
+
+test_expect_success 'write midx with one v2 pack' '
+	git pack-objects --index-version=2,0x40 $objdir/pack/test <obj-list &&
+	git multi-pack-index write &&
+	midx_read_expect 1 18
+'
+
+compare_results_with_midx "one v2 pack"
+
+test_expect_success 'add more objects' '
+	for i in $(test_seq 6 10)
+	do
+		generate_objects $i
+	done &&
+	commit_and_list_objects
+'
+
+test_expect_success 'write midx with two packs' '
+	git pack-objects --index-version=1 $objdir/pack/test-2 <obj-list &&
+	git multi-pack-index write &&
+	midx_read_expect 2 34
+'
+
+compare_results_with_midx "two packs"
+
+test_expect_success 'add more packs' '
+	for j in $(test_seq 11 20)
+	do
+		generate_objects $j &&
+		commit_and_list_objects &&
+		git pack-objects --index-version=2 $objdir/pack/test-pack <obj-list
+	done
+'
+
+compare_results_with_midx "mixed mode (two packs + extra)"
+
+test_expect_success 'write midx with twelve packs' '
+	git multi-pack-index write &&
+	midx_read_expect 12 74
+'
+
+compare_results_with_midx "twelve packs"
+
+test_expect_success 'lookups of missing objects do not fail' '
+	test_must_fail git -c core.multiPackIndex=true \
+		cat-file -e 0000000000000000000000000000000000000001
+'
+
+test_expect_success 'count-objects does not report the midx as garbage' '
+	git count-objects -v >output &&
+	grep "^garbage: 0" output
+'
+
+test_expect_success 'repack rewrites the midx' '
+	git config core.multiPackIndex true &&
+	git repack -ad &&
+	midx_read_expect 1 $(git rev-list --objects --all | wc -l)
+'
+
+compare_results_with_midx "after repack"
+
+test_expect_success 'fetching a pack updates the midx' '
+	git clone --no-local . clone &&
+	(
+		cd clone &&
+		git config core.multiPackIndex true &&
+		git config transfer.unpackLimit 1 &&
+		git repack -ad &&
+		cd .. &&
+		test_commit extra &&
+		cd clone &&
+		git fetch origin &&
+		test 2 = $(ls .git/objects/pack/*.idx | wc -l) &&
+		git multi-pack-index read >midx &&
+		grep -c "^pack-.*\.idx$" midx >count &&
+		echo 2 >expect &&
+		test_cmp expect count &&
+		git cat-file -e origin/master &&
+		git -c core.multiPackIndex=true fsck
+	)
+'
+
+test_expect_success 'a stale midx still finds objects in new packs' '
+	(
+		cd clone &&
+		git config --unset core.multiPackIndex &&
+		cp .git/objects/pack/multi-pack-index stale-midx &&
+		git repack -ad &&
+		cp stale-midx .git/objects/pack/multi-pack-index &&
+		git rev-list --objects --all | cut -d" " -f1 >obj-list &&
+		git -c core.multiPackIndex=true cat-file --batch-check <obj-list >actual &&
+		! grep missing actual
+	)
+'
+
+test_done
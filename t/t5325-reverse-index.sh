@@ -0,0 +1,136 @@
+#!/bin/sh
+
+test_description='on-disk reverse index of packs'
+. ./test-lib.sh
+
+packdir=.git/objects/pack
+
+disk_sizes () {
+	idx=$(echo $packdir/pack-*.idx) &&
+	git show-index <$idx |
+	cut -d" " -f2 |
+	git cat-file --batch-check="%(objectname) %(objectsize:disk)"
+}
+
+test_expect_success 'setup history with deltas' '
+	for i in $(test_seq 1 50)
+	do
+		test_seq 1 $i >file &&
+		git add file &&
+		git commit -q -m "commit $i" || return 1
+	done &&
+	git repack -adq &&
+	disk_sizes >expect &&
+	test_line_count = 150 expect
+'
+
+test_expect_success 'repack writes a .rev with pack.writeReverseIndex' '
+	git -c pack.writeReverseIndex=true repack -adfq &&
+	rev=$(echo $packdir/pack-*.rev) &&
+	test -f "$rev" &&
+	test $(wc -c <"$rev") = $((12 + 4 * 150 + 40))
+'
+
+test_expect_success 'the .rev gives the same disk sizes' '
+	disk_sizes >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'index-pack --rev-index writes the same .rev' '
+	pack=$(echo $packdir/pack-*.pack) &&
+	cp "$pack" copy.pack &&
+	git index-pack --rev-index copy.pack &&
+	test_cmp $packdir/pack-*.rev copy.rev &&
+	git index-pack --no-rev-index -o other.idx copy.pack &&
+	test_path_is_missing other.rev
+'
+
+test_expect_success 'index-pack --stdin stores the .rev with the pack' '
+	git init --bare stdin.git &&
+	git -C stdin.git -c pack.writeReverseIndex=true \
+		index-pack --stdin <copy.pack &&
+	test_cmp copy.rev stdin.git/objects/pack/pack-*.rev
+'
+
+test_expect_success 'a broken .rev is reported and ignored' '
+	rev=$(echo $packdir/pack-*.rev) &&
+	mv "$rev" saved.rev &&
+	head -c 100 saved.rev >"$rev" &&
+	disk_sizes >actual 2>err &&
+	test_cmp expect actual &&
+	grep "reverse index file .* has the wrong size" err &&
+	rm -f "$rev" &&
+	mv saved.rev "$rev"
+'
+
+test_expect_success 'a .rev of another pack is ignored' '
+	rev=$(echo $packdir/pack-*.rev) &&
+	mv "$rev" saved.rev &&
+	cp copy.rev "$rev" &&
+	dd if=/dev/zero of="$rev" bs=1 seek=$((12 + 4 * 150)) count=20 \
+		conv=notrunc 2>/dev/null &&
+	disk_sizes >actual 2>err &&
+	test_cmp expect actual &&
+	grep "does not match its pack" err &&
+	rm -f "$rev" &&
+	mv saved.rev "$rev"
+'
+
+test_expect_success 'fsck checks the .rev' '
+	git fsck --full 2>err &&
+	test_must_be_empty err
+'
+
+test_expect_success 'a .rev entry out of range is caught' '
+	rev=$(echo $packdir/pack-*.rev) &&
+	mv "$rev" saved.rev &&
+	cp saved.rev "$rev" &&
+	printf "\377\377\377\377" |
+	dd of="$rev" bs=1 seek=12 conv=notrunc 2>/dev/null &&
+	test_must_fail disk_sizes >actual 2>err &&
+	grep "reverse index file .* is corrupt" err &&
+	test_must_fail git fsck --full 2>err &&
+	grep "entry 0 out of range" err &&
+	grep "reverse index file .* SHA1 mismatch" err &&
+	rm -f "$rev" &&
+	mv saved.rev "$rev"
+'
+
+test_expect_success 'fsck catches a .rev out of pack order' '
+	rev=$(echo $packdir/pack-*.rev) &&
+	mv "$rev" saved.rev &&
+	cp saved.rev "$rev" &&
+	dd if=saved.rev of="$rev" bs=1 skip=16 seek=12 count=4 \
+		conv=notrunc 2>/dev/null &&
+	dd if=saved.rev of="$rev" bs=1 skip=12 seek=16 count=4 \
+		conv=notrunc 2>/dev/null &&
+	test_must_fail git fsck --full 2>err &&
+	grep "not in pack order at entry 1" err &&
+	rm -f "$rev" &&
+	mv saved.rev "$rev"
+'
+
+test_expect_success 'bitmap pack reuse reads the .rev' '
+	git -c pack.writeReverseIndex=true repack -adbq &&
+	echo HEAD |
+	git pack-objects --stdout --revs --delta-base-offset \
+		--use-bitmap-index >with.pack &&
+	rm $packdir/pack-*.rev &&
+	echo HEAD |
+	git pack-objects --stdout --revs --delta-base-offset \
+		--use-bitmap-index >without.pack &&
+	test_cmp with.pack without.pack
+'
+
+test_expect_success 'count-objects does not report a .rev as garbage' '
+	git -c pack.writeReverseIndex=true repack -adfq &&
+	git count-objects -v >out &&
+	grep "^garbage: 0" out
+'
+
+test_expect_success 'repack without the config drops the .rev' '
+	git repack -adfq &&
+	! ls $packdir/pack-*.rev
+'
+
+test_done
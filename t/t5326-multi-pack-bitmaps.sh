@@ -0,0 +1,155 @@
+#!/bin/sh
+
+test_description='reachability bitmaps for the multi-pack-index'
+. ./test-lib.sh
+
+packdir=.git/objects/pack
+
+midx_bitmap () {
+	ls $packdir | sed -n "/^multi-pack-index-.*\.bitmap$/p"
+}
+
+test_expect_success 'setup history in several packs' '
+	git config core.multiPackIndex true &&
+	git config pack.writebitmaphashcache true &&
+	for i in $(test_seq 1 5)
+	do
+		test_commit $i &&
+		git repack -d -q || return 1
+	done &&
+	git checkout -b other HEAD~3 &&
+	for i in $(test_seq 1 5)
+	do
+		test_commit side-$i &&
+		git repack -d -q || return 1
+	done &&
+	git checkout master &&
+	blob=$(echo tagged-blob | git hash-object -w --stdin) &&
+	git tag tagged-blob $blob &&
+	git repack -d -q &&
+	test $(ls $packdir/*.pack | wc -l) -gt 10 &&
+	test_must_fail git rev-list --test-bitmap HEAD
+'
+
+test_expect_success 'write a multi-pack bitmap' '
+	git multi-pack-index write --bitmap &&
+	midx_bitmap >bitmaps &&
+	test_line_count = 1 bitmaps &&
+	! ls $packdir | grep "^pack-.*\.bitmap$"
+'
+
+test_expect_success 'the bitmap is named after the multi-pack-index' '
+	midx=$(tail -c 20 $packdir/multi-pack-index |
+		od -An -tx1 | tr -d " \n") &&
+	test_path_is_file $packdir/multi-pack-index-$midx.bitmap
+'
+
+test_expect_success 'rev-list --test-bitmap verifies bitmaps' '
+	git rev-list --test-bitmap HEAD &&
+	git rev-list --test-bitmap other
+'
+
+rev_list_tests () {
+	state=$1
+
+	test_expect_success "counting commits via bitmap ($state)" '
+		git rev-list --count HEAD >expect &&
+		git rev-list --use-bitmap-index --count HEAD >actual &&
+		test_cmp expect actual
+	'
+
+	test_expect_success "counting partial commits via bitmap ($state)" '
+		git rev-list --count HEAD~3..HEAD >expect &&
+		git rev-list --use-bitmap-index --count HEAD~3..HEAD >actual &&
+		test_cmp expect actual
+	'
+
+	test_expect_success "counting non-linear history ($state)" '
+		git rev-list --count other...master >expect &&
+		git rev-list --use-bitmap-index --count other...master >actual &&
+		test_cmp expect actual
+	'
+
+	test_expect_success "enumerate --objects ($state)" '
+		git rev-list --objects --use-bitmap-index HEAD >tmp &&
+		cut -d" " -f1 <tmp | sort >actual &&
+		git rev-list --objects HEAD >tmp &&
+		cut -d" " -f1 <tmp | sort >expect &&
+		test_cmp expect actual
+	'
+
+	test_expect_success "bitmap --objects handles non-commit objects ($state)" '
+		git rev-list --objects --use-bitmap-index HEAD tagged-blob >actual &&
+		grep $blob actual
+	'
+}
+
+rev_list_tests 'multi-pack bitmap'
+
+test_expect_success 'clone from the bitmapped repository' '
+	git clone --no-local --bare . clone.git &&
+	git rev-parse HEAD other >expect &&
+	git --git-dir=clone.git rev-parse HEAD other >actual &&
+	test_cmp expect actual &&
+	git --git-dir=clone.git fsck
+'
+
+test_expect_success 'received packs keep the bitmapped multi-pack-index' '
+	git --git-dir=clone.git config core.multiPackIndex true &&
+	git --git-dir=clone.git repack -d -q -b &&
+	ls clone.git/objects/pack | grep "^multi-pack-index-.*\.bitmap$" >before &&
+	test_line_count = 1 before &&
+	cp clone.git/objects/pack/multi-pack-index midx.before &&
+	test_commit pushed &&
+	git push clone.git master &&
+	test_cmp midx.before clone.git/objects/pack/multi-pack-index &&
+	ls clone.git/objects/pack | grep "^multi-pack-index-.*\.bitmap$" >after &&
+	test_cmp before after &&
+	git --git-dir=clone.git rev-list --count master >expect &&
+	git --git-dir=clone.git rev-list --use-bitmap-index --count master >actual &&
+	test_cmp expect actual
+'
+
+rev_list_tests 'new commits outside the bitmap'
+
+test_expect_success 'incremental repack -b rewrites the bitmap' '
+	midx_bitmap >old &&
+	git repack -d -q -b &&
+	midx_bitmap >new &&
+	test_line_count = 1 new &&
+	! test_cmp old new &&
+	! ls $packdir | grep "^pack-.*\.bitmap$" &&
+	git rev-list --test-bitmap HEAD
+'
+
+test_expect_success 'rewriting the multi-pack-index drops its bitmap' '
+	test_commit unbitmapped &&
+	git repack -d -q &&
+	midx_bitmap >bitmaps &&
+	test_must_be_empty bitmaps
+'
+
+test_expect_success 'objects outside of the packs prevent writing a bitmap' '
+	test_commit loose &&
+	test_must_fail git multi-pack-index write --bitmap 2>err &&
+	grep "not writing a multi-pack bitmap" err &&
+	midx_bitmap >bitmaps &&
+	test_must_be_empty bitmaps
+'
+
+test_expect_success 'a bitmap for another multi-pack-index is ignored' '
+	git repack -d -q -b &&
+	old=$(midx_bitmap) &&
+	mv $packdir/$old saved.bitmap &&
+	test_commit mismatched &&
+	git repack -d -q &&
+	midx=$(tail -c 20 $packdir/multi-pack-index |
+		od -An -tx1 | tr -d " \n") &&
+	mv saved.bitmap $packdir/multi-pack-index-$midx.bitmap &&
+	git rev-list --count HEAD >expect &&
+	git rev-list --use-bitmap-index --count HEAD >actual 2>err &&
+	test_cmp expect actual &&
+	grep "does not match the multi-pack-index" err
+'
+
+test_done
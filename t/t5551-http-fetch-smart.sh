@@ -187,6 +187,18 @@ test_expect_success 'smart clone respects namespace' '
 	test_cmp expect actual
 '
 
+test_expect_success 'clone and fetch with protocol v2' '
+	GIT_TRACE_PACKET="$(pwd)/log" \
+		git -c protocol.version=2 clone "$HTTPD_URL/smart/repo.git" clone-v2 &&
+	grep "< version 2" log &&
+	grep "> command=ls-refs" log &&
+	grep "> command=fetch" log &&
+	test_commit v2-fetch &&
+	git push public &&
+	(cd clone-v2 && git -c protocol.version=2 pull) &&
+	test_cmp v2-fetch.t clone-v2/v2-fetch.t
+'
+
 test_expect_success 'dumb clone via http-backend respects namespace' '
 	git --git-dir="$HTTPD_DOCUMENT_ROOT_PATH/repo.git" \
 		config http.getanyfile true &&
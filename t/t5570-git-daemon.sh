@@ -47,6 +47,18 @@ test_expect_success 'remote detects correct HEAD' '
 	)
 '
 
+test_expect_success 'clone and fetch with protocol v2' '
+	GIT_TRACE_PACKET="$(pwd)/log" \
+		git -c protocol.version=2 clone "$GIT_DAEMON_URL/repo.git" clone-v2 &&
+	test_cmp file clone-v2/file &&
+	grep "clone< version 2" log &&
+	echo content >>file &&
+	git commit -a -m three &&
+	git push public &&
+	(cd clone-v2 && git -c protocol.version=2 pull) &&
+	test_cmp file clone-v2/file
+'
+
 test_expect_success 'prepare pack objects' '
 	cp -R "$GIT_DAEMON_DOCUMENT_ROOT_PATH"/repo.git "$GIT_DAEMON_DOCUMENT_ROOT_PATH"/repo_pack.git &&
 	(cd "$GIT_DAEMON_DOCUMENT_ROOT_PATH"/repo_pack.git &&
@@ -0,0 +1,162 @@
+#!/bin/sh
+
+test_description='git partial clone'
+
+. ./test-lib.sh
+
+# Check whether repository $1 has object $2, without fetching it.
+have_object () {
+	for idx in "$1"/.git/objects/pack/*.idx
+	do
+		git show-index <"$idx" | grep "$2" >/dev/null && return 0
+	done
+	test -f "$1/.git/objects/$(echo $2 | sed "s|^..|&/|")"
+}
+
+# create a normal "src" repo where we can later create new commits.
+# expect_1.oids will contain a list of the OIDs of all blobs.
+test_expect_success 'setup normal src repo' '
+	echo "{print \$1}" >print_1.awk &&
+	echo "{print \$2}" >print_2.awk &&
+
+	git init src &&
+	for n in 1 2 3 4
+	do
+		echo "This is file: $n" >src/file.$n.txt
+		git -C src add file.$n.txt
+		git -C src commit -m "file $n"
+		git -C src ls-files -s file.$n.txt >>temp
+	done &&
+	awk -f print_2.awk <temp | sort >expect_1.oids &&
+	test_line_count = 4 expect_1.oids
+'
+
+# bare clone "src" giving "srv.bare" for use as our server.
+test_expect_success 'setup bare clone for server' '
+	git clone --bare "file://$(pwd)/src" srv.bare &&
+	git -C srv.bare config --local uploadpack.allowfilter 1 &&
+	git -C srv.bare config --local uploadpack.allowanysha1inwant 1
+'
+
+# do basic partial clone from "srv.bare"
+# confirm we are missing all of the known blobs.
+# confirm partial clone was registered in the local config.
+test_expect_success 'do partial clone 1' '
+	git clone --no-checkout --filter=blob:none "file://$(pwd)/srv.bare" pc1 &&
+
+	git -C pc1 rev-list HEAD --quiet --objects --exclude-promisor-objects \
+		>observed &&
+	test_must_be_empty observed &&
+	ls pc1/.git/objects/pack/*.promisor >promisor &&
+	test_line_count = 1 promisor &&
+
+	test "$(git -C pc1 config --local extensions.partialclone)" = "origin" &&
+	test "$(git -C pc1 config --local remote.origin.promisor)" = "true" &&
+	test "$(git -C pc1 config --local remote.origin.partialclonefilter)" = "blob:none"
+'
+
+test_expect_success 'the blobs are missing, but fsck is happy' '
+	for oid in $(cat expect_1.oids)
+	do
+		! have_object pc1 $oid || return 1
+	done &&
+	git -C pc1 fsck
+'
+
+test_expect_success 'missing blob is fetched on demand' '
+	oid=$(git -C src rev-parse HEAD~2:file.2.txt) &&
+	echo "This is file: 2" >expect &&
+	git -C pc1 cat-file -p $oid >actual &&
+	test_cmp expect actual &&
+	ls pc1/.git/objects/pack/*.promisor >promisor &&
+	test_line_count = 2 promisor
+'
+
+test_expect_success 'checkout fetches the missing blobs in one go' '
+	rm -f trace &&
+	GIT_TRACE_PACKET="$(pwd)/trace" git -C pc1 checkout master &&
+	test_path_is_file pc1/file.4.txt &&
+	grep "git> want" trace >wants &&
+	test_line_count = 3 wants &&
+	ls pc1/.git/objects/pack/*.promisor >promisor &&
+	test_line_count = 3 promisor
+'
+
+# create new commits in "src" repo to establish a blame history on file.1.txt
+# and push to "srv.bare".
+test_expect_success 'push new commits to server' '
+	for x in a b c d e
+	do
+		echo "Mod file.1.txt $x" >>src/file.1.txt
+		git -C src add file.1.txt
+		git -C src commit -m "mod $x"
+	done &&
+	git -C src blame master -- file.1.txt >expect.blame &&
+	git -C src push -u "file://$(pwd)/srv.bare" master
+'
+
+# (partially) fetch in the partial clone repo from the promisor remote.
+# verify that fetch inherited the filter-spec from the config and DOES NOT
+# have the new blobs.
+test_expect_success 'partial fetch inherits filter settings' '
+	git -C pc1 fetch origin &&
+	git -C pc1 rev-list master..origin/master --quiet --objects \
+		--exclude-promisor-objects >observed &&
+	test_must_be_empty observed &&
+	git -C src rev-parse master:file.1.txt >blob &&
+	! have_object pc1 $(cat blob)
+'
+
+# force dynamic object fetch using diff.
+# we should only get 1 new blob (for the file in origin/master).
+test_expect_success 'manual prefetch of missing objects' '
+	git -C pc1 diff master..origin/master -- file.1.txt &&
+	have_object pc1 $(cat blob)
+'
+
+test_expect_success 'partial fetch with --filter from the command line' '
+	git -C src checkout -b side &&
+	printf "%1000s" X >src/large &&
+	echo small >src/small &&
+	git -C src add large small &&
+	git -C src commit -m large &&
+	git -C src push "file://$(pwd)/srv.bare" side &&
+	git -C pc1 fetch --filter=blob:limit=100 origin side:side &&
+	have_object pc1 $(git -C src rev-parse side:small) &&
+	! have_object pc1 $(git -C src rev-parse side:large)
+'
+
+test_expect_success '--filter is rejected for other remotes' '
+	test_must_fail git -C pc1 fetch --filter=blob:none \
+		"file://$(pwd)/srv.bare" master
+'
+
+test_expect_success 'repack keeps the promisor packs' '
+	ls pc1/.git/objects/pack/*.promisor >before &&
+	(cd pc1 && test_commit local) &&
+	git -C pc1 repack -a -d &&
+	ls pc1/.git/objects/pack/*.promisor >after &&
+	test_cmp before after &&
+	git -C pc1 fsck &&
+	git -C pc1 cat-file -e local
+'
+
+test_expect_success 'partial clone with protocol v2' '
+	rm -f trace &&
+	GIT_TRACE_PACKET="$(pwd)/trace" git -c protocol.version=2 \
+		clone --filter=blob:none "file://$(pwd)/srv.bare" pc2 &&
+	grep "clone> filter blob:none" trace &&
+	test_cmp src/file.4.txt pc2/file.4.txt &&
+	git -C pc2 fsck
+'
+
+test_expect_success 'filter is ignored with a warning if not allowed' '
+	git clone --bare "file://$(pwd)/src" nofilter.bare &&
+	git clone --filter=blob:none "file://$(pwd)/nofilter.bare" pc3 2>err &&
+	grep "filtering not recognized by server" err &&
+	git -C pc3 rev-list --objects --all --exclude-promisor-objects \
+		>observed &&
+	test_must_be_empty observed
+'
+
+test_done
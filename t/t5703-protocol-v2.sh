@@ -0,0 +1,115 @@
+#!/bin/sh
+
+test_description='fetching with protocol version 2'
+. ./test-lib.sh
+
+test_expect_success 'setup repository' '
+	git init server &&
+	(
+		cd server &&
+		test_commit one &&
+		git tag -a -m annotated annotated &&
+		git branch side &&
+		git update-ref refs/other/x HEAD
+	)
+'
+
+test_expect_success 'ls-remote advertises capabilities only' '
+	rm -f log &&
+	GIT_TRACE_PACKET="$(pwd)/log" git -c protocol.version=2 \
+		ls-remote "file://$(pwd)/server" >actual &&
+	git -C server show-ref -d --head >expect.raw &&
+	sed "s/ /	/" expect.raw >expect &&
+	test_cmp expect actual &&
+	grep "git< version 2" log &&
+	grep "git< ls-refs" log &&
+	grep "git> command=ls-refs" log
+'
+
+test_expect_success 'ls-remote --heads only asks for branches' '
+	rm -f log &&
+	GIT_TRACE_PACKET="$(pwd)/log" git -c protocol.version=2 \
+		ls-remote --heads "file://$(pwd)/server" >actual &&
+	git -C server for-each-ref --format="%(objectname)	%(refname)" \
+		refs/heads >expect &&
+	test_cmp expect actual &&
+	grep "git> ref-prefix refs/heads/" log &&
+	! grep "upload-pack> .* refs/tags/" log &&
+	! grep "upload-pack> .* refs/other/x" log
+'
+
+test_expect_success 'upload-pack stays at version 0 by default' '
+	rm -f log &&
+	GIT_TRACE_PACKET="$(pwd)/log" git ls-remote "file://$(pwd)/server" &&
+	! grep "version 2" log
+'
+
+test_expect_success 'clone with protocol v2' '
+	rm -f log &&
+	GIT_TRACE_PACKET="$(pwd)/log" git -c protocol.version=2 \
+		clone "file://$(pwd)/server" client &&
+	git -C client rev-parse --verify origin/side &&
+	git -C client rev-parse --verify annotated &&
+	git -C server rev-parse one >expect &&
+	git -C client rev-parse HEAD >actual &&
+	test_cmp expect actual &&
+	grep "clone> command=fetch" log &&
+	! grep "upload-pack> .* refs/other/x" log
+'
+
+test_expect_success 'fetch with protocol v2 negotiates' '
+	(cd server && test_commit two) &&
+	rm -f log &&
+	(
+		cd client &&
+		git checkout -b local &&
+		test_commit three &&
+		GIT_TRACE_PACKET="$(pwd)/../log" git -c protocol.version=2 \
+			fetch origin master:refs/remotes/origin/master &&
+		git rev-parse --verify two
+	) &&
+	git -C server rev-parse master >expect &&
+	git -C client rev-parse origin/master >actual &&
+	test_cmp expect actual &&
+	grep "fetch> ref-prefix refs/heads/master" log &&
+	grep "fetch> have $(git -C client rev-parse three)" log &&
+	grep "fetch< packfile" log &&
+	git -C client fsck
+'
+
+test_expect_success 'shallow clone and deepen with protocol v2' '
+	(cd server && test_commit four) &&
+	git -c protocol.version=2 clone --depth=1 \
+		"file://$(pwd)/server" shallow &&
+	test_line_count = 1 shallow/.git/shallow &&
+	git -C shallow log --oneline >actual &&
+	test_line_count = 1 actual &&
+	git -C shallow -c protocol.version=2 fetch --depth=2 &&
+	git -C shallow log --oneline origin/master >actual &&
+	test_line_count = 2 actual &&
+	git -C shallow -c protocol.version=2 fetch --unshallow &&
+	test_path_is_missing shallow/.git/shallow &&
+	git -C shallow fsck
+'
+
+test_expect_success 'hidden refs are not listed' '
+	git -C server config uploadpack.hiderefs refs/other &&
+	git -c protocol.version=2 ls-remote "file://$(pwd)/server" >actual &&
+	! grep refs/other actual
+'
+
+test_expect_success 'http-backend passes the Git-Protocol header on' '
+	git init --bare http.git &&
+	git -C http.git config http.receivepack false &&
+	git -C server push ../http.git master &&
+	HTTP_GIT_PROTOCOL=version=2 \
+	REQUEST_METHOD=GET \
+	QUERY_STRING=service=git-upload-pack \
+	PATH_TRANSLATED="$(pwd)/http.git/info/refs" \
+	GIT_HTTP_EXPORT_ALL=1 \
+		git http-backend >out &&
+	grep "version 2" out &&
+	! grep refs/heads/master out
+'
+
+test_done
@@ -0,0 +1,187 @@
+#!/bin/sh
+
+test_description='git rev-list using object filtering'
+
+. ./test-lib.sh
+
+# Test the blob:none filter.
+
+test_expect_success 'setup r1' '
+	echo "{print \$1}" >print_1.awk &&
+	echo "{print \$2}" >print_2.awk &&
+
+	git init r1 &&
+	for n in 1 2 3 4 5
+	do
+		echo "This is file: $n" >r1/file.$n
+		git -C r1 add file.$n
+		git -C r1 commit -m "$n"
+	done
+'
+
+test_expect_success 'verify blob:none omits all 5 blobs' '
+	git -C r1 ls-files -s file.1 file.2 file.3 file.4 file.5 |
+	awk -f print_2.awk |
+	sort >expected &&
+	git -C r1 rev-list HEAD --quiet --objects --filter-print-omitted \
+		--filter=blob:none |
+	awk -f print_1.awk |
+	sed "s/~//" |
+	sort >observed &&
+	test_cmp observed expected
+'
+
+test_expect_success 'verify emitted+omitted == all' '
+	git -C r1 rev-list HEAD --objects |
+	awk -f print_1.awk |
+	sort >expected &&
+	git -C r1 rev-list HEAD --objects --filter-print-omitted \
+		--filter=blob:none |
+	awk -f print_1.awk |
+	sed "s/~//" |
+	sort >observed &&
+	test_cmp observed expected
+'
+
+test_expect_success '--no-filter turns the filter off' '
+	git -C r1 rev-list HEAD --objects >expected &&
+	git -C r1 rev-list HEAD --objects --filter=blob:none --no-filter \
+		>observed &&
+	test_cmp observed expected
+'
+
+# Test blob:limit=<n>[kmg] filter.
+# We boundary test around the size parameter.  The filter is strictly
+# less than the value, so size 500 and 1000 should have the same
+# results, but 1001 should differ.
+
+test_expect_success 'setup r2' '
+	git init r2 &&
+	for n in 1000 10000
+	do
+		printf "%"$n"s" X >r2/large.$n
+		git -C r2 add large.$n
+		git -C r2 commit -m "$n"
+	done
+'
+
+test_expect_success 'verify blob:limit=500 omits all blobs' '
+	git -C r2 ls-files -s large.1000 large.10000 |
+	awk -f print_2.awk |
+	sort >expected &&
+	git -C r2 rev-list HEAD --quiet --objects --filter-print-omitted \
+		--filter=blob:limit=500 |
+	awk -f print_1.awk |
+	sed "s/~//" |
+	sort >observed &&
+	test_cmp observed expected
+'
+
+test_expect_success 'verify blob:limit=1000' '
+	git -C r2 ls-files -s large.1000 large.10000 |
+	awk -f print_2.awk |
+	sort >expected &&
+	git -C r2 rev-list HEAD --quiet --objects --filter-print-omitted \
+		--filter=blob:limit=1000 |
+	awk -f print_1.awk |
+	sed "s/~//" |
+	sort >observed &&
+	test_cmp observed expected
+'
+
+test_expect_success 'verify blob:limit=1001' '
+	git -C r2 ls-files -s large.10000 |
+	awk -f print_2.awk |
+	sort >expected &&
+	git -C r2 rev-list HEAD --quiet --objects --filter-print-omitted \
+		--filter=blob:limit=1001 |
+	awk -f print_1.awk |
+	sed "s/~//" |
+	sort >observed &&
+	test_cmp observed expected
+'
+
+test_expect_success 'verify blob:limit=1k' '
+	git -C r2 ls-files -s large.10000 |
+	awk -f print_2.awk |
+	sort >expected &&
+	git -C r2 rev-list HEAD --quiet --objects --filter-print-omitted \
+		--filter=blob:limit=1k |
+	awk -f print_1.awk |
+	sed "s/~//" |
+	sort >observed &&
+	test_cmp observed expected
+'
+
+test_expect_success 'verify blob:limit=1m' '
+	git -C r2 rev-list HEAD --quiet --objects --filter-print-omitted \
+		--filter=blob:limit=1m >observed &&
+	test_must_be_empty observed
+'
+
+# Test tree:<depth> filter.
+
+test_expect_success 'setup r3' '
+	git init r3 &&
+	mkdir -p r3/dir1/dir2 &&
+	echo top >r3/top &&
+	echo one >r3/dir1/one &&
+	echo two >r3/dir1/dir2/two &&
+	git -C r3 add . &&
+	git -C r3 commit -m tree
+'
+
+test_expect_success 'verify tree:0 omits all trees and blobs' '
+	git -C r3 rev-list HEAD --objects --filter=tree:0 >observed &&
+	git -C r3 rev-parse HEAD >expected &&
+	test_cmp expected observed
+'
+
+test_expect_success 'verify tree:1 shows the root tree only' '
+	git -C r3 rev-list HEAD --objects --filter=tree:1 |
+	awk -f print_1.awk >observed &&
+	git -C r3 rev-parse HEAD HEAD^{tree} >expected &&
+	test_cmp expected observed
+'
+
+test_expect_success 'verify tree:2 omits what is below dir1' '
+	git -C r3 rev-list HEAD --objects --filter-print-omitted \
+		--filter=tree:2 >observed &&
+	grep "^$(git -C r3 rev-parse HEAD:top) top" observed &&
+	grep "^$(git -C r3 rev-parse HEAD:dir1) dir1" observed &&
+	grep "^~$(git -C r3 rev-parse HEAD:dir1/dir2)" observed &&
+	grep "^~$(git -C r3 rev-parse HEAD:dir1/one)" observed &&
+	! grep "$(git -C r3 rev-parse HEAD:dir1/dir2/two)" observed
+'
+
+# Test sparse:oid=<blob-ish> filter.
+
+test_expect_success 'setup r4' '
+	git init r4 &&
+	mkdir -p r4/dir1 r4/dir2 &&
+	echo a >r4/dir1/a &&
+	echo b >r4/dir2/b &&
+	echo c >r4/c &&
+	printf "/dir1/\n/c\n" >r4/pattern &&
+	git -C r4 add . &&
+	git -C r4 commit -m sparse
+'
+
+test_expect_success 'verify sparse:oid=<blob-ish> omits unmatched blobs' '
+	git -C r4 ls-files -s dir2/b pattern |
+	awk -f print_2.awk |
+	sort >expected &&
+	git -C r4 rev-list HEAD --quiet --objects --filter-print-omitted \
+		--filter=sparse:oid=master:pattern |
+	awk -f print_1.awk |
+	sed "s/~//" |
+	sort >observed &&
+	test_cmp observed expected
+'
+
+test_expect_success 'invalid filter-spec is rejected' '
+	test_must_fail git -C r1 rev-list HEAD --objects --filter=blob:nope &&
+	test_must_fail git -C r1 rev-list HEAD --objects --filter=tree:x
+'
+
+test_done
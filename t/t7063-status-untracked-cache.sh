@@ -0,0 +1,263 @@
+#!/bin/sh
+
+test_description='test untracked cache'
+
+. ./test-lib.sh
+
+EMPTY_BLOB=e69de29bb2d1d6434b8b29ae775ad8c2e48c5391
+
+# The cache trusts directory mtimes only when they are older than the
+# index. Move the directories modified since the last call into the
+# past (each time to a different, increasing point) so that the tests
+# are not racy and do not need to sleep.
+racy_count=0
+avoid_racy () {
+	racy_count=$(($racy_count + 1)) &&
+	for d in $(find . -name .git -prune -o -type d -newer ../racy-stamp -print)
+	do
+		test-chmtime =$((1000000000 + $racy_count)) "$d" || return 1
+	done &&
+	: >../racy-stamp
+}
+
+status_trace () {
+	avoid_racy &&
+	: >../trace &&
+	GIT_TRACE_UNTRACKED_STATS="$TRASH_DIRECTORY/trace" \
+	git status --porcelain >../actual &&
+	test_cmp ../status.expect ../actual
+}
+
+trace_expect () {
+	cat >../trace.expect <<-EOF &&
+	node creation: $1
+	gitignore invalidation: $2
+	directory invalidation: $3
+	opendir: $4
+	EOF
+	test_cmp ../trace.expect ../trace
+}
+
+test_expect_success 'setup' '
+	: >racy-stamp &&
+	test-chmtime =1000000000 racy-stamp &&
+	git init worktree &&
+	cd worktree &&
+	mkdir done dtwo dthree &&
+	touch one two three done/one dtwo/two dthree/three &&
+	git add one two done/one &&
+	: >.git/info/exclude &&
+	git update-index --untracked-cache
+'
+
+test_expect_success 'untracked cache is empty' '
+	test-dump-untracked-cache >../actual &&
+	cat >../expect <<-EOF &&
+	info/exclude 0000000000000000000000000000000000000000
+	core.excludesfile 0000000000000000000000000000000000000000
+	exclude_per_dir .gitignore
+	flags 00000006
+	EOF
+	test_cmp ../expect ../actual
+'
+
+test_expect_success 'status first time (empty cache)' '
+	cat >../status.expect <<-EOF &&
+	A  done/one
+	A  one
+	A  two
+	?? dthree/
+	?? dtwo/
+	?? three
+	EOF
+	status_trace &&
+	trace_expect 3 1 0 4
+'
+
+test_expect_success 'untracked cache after first status' '
+	test-dump-untracked-cache >../actual &&
+	cat >../expect <<-EOF &&
+	info/exclude $EMPTY_BLOB
+	core.excludesfile 0000000000000000000000000000000000000000
+	exclude_per_dir .gitignore
+	flags 00000006
+	/ 0000000000000000000000000000000000000000 recurse valid
+	three
+	/done/ 0000000000000000000000000000000000000000 recurse valid
+	/dthree/ 0000000000000000000000000000000000000000 recurse check_only valid
+	three
+	/dtwo/ 0000000000000000000000000000000000000000 recurse check_only valid
+	two
+	EOF
+	test_cmp ../expect ../actual
+'
+
+test_expect_success 'status second time (fully populated cache)' '
+	status_trace &&
+	trace_expect 0 0 0 0
+'
+
+test_expect_success 'new file in an untracked directory' '
+	touch dthree/four &&
+	status_trace &&
+	trace_expect 0 0 1 1
+'
+
+test_expect_success 'untracked directory becomes empty' '
+	rm dthree/three dthree/four &&
+	cat >../status.expect <<-EOF &&
+	A  done/one
+	A  one
+	A  two
+	?? dtwo/
+	?? three
+	EOF
+	status_trace &&
+	trace_expect 0 0 1 1
+'
+
+test_expect_success 'new file in a tracked directory' '
+	touch done/two &&
+	cat >../status.expect <<-EOF &&
+	A  done/one
+	A  one
+	A  two
+	?? done/two
+	?? dtwo/
+	?? three
+	EOF
+	status_trace &&
+	trace_expect 0 0 1 1
+'
+
+test_expect_success 'adding a file invalidates its directories' '
+	git add done/two &&
+	cat >../status.expect <<-EOF &&
+	A  done/one
+	A  done/two
+	A  one
+	A  two
+	?? dtwo/
+	?? three
+	EOF
+	status_trace &&
+	trace_expect 0 0 0 2
+'
+
+test_expect_success 'removing a file from the index' '
+	git rm --cached -q done/two &&
+	cat >../status.expect <<-EOF &&
+	A  done/one
+	A  one
+	A  two
+	?? done/two
+	?? dtwo/
+	?? three
+	EOF
+	status_trace &&
+	trace_expect 0 0 0 2
+'
+
+test_expect_success 'new .gitignore' '
+	echo two >done/.gitignore &&
+	cat >../status.expect <<-EOF &&
+	A  done/one
+	A  one
+	A  two
+	?? done/.gitignore
+	?? dtwo/
+	?? three
+	EOF
+	status_trace &&
+	trace_expect 0 1 1 1
+'
+
+test_expect_success 'modified .gitignore' '
+	echo one >done/.gitignore &&
+	cat >../status.expect <<-EOF &&
+	A  done/one
+	A  one
+	A  two
+	?? done/.gitignore
+	?? done/two
+	?? dtwo/
+	?? three
+	EOF
+	status_trace &&
+	trace_expect 0 1 0 1
+'
+
+test_expect_success 'modified info/exclude' '
+	echo three >.git/info/exclude &&
+	cat >../status.expect <<-EOF &&
+	A  done/one
+	A  one
+	A  two
+	?? done/.gitignore
+	?? done/two
+	?? dtwo/
+	EOF
+	status_trace &&
+	trace_expect 0 1 0 4
+'
+
+test_expect_success 'two-way merges keep the cache correct' '
+	git add done/.gitignore &&
+	git commit -q -m first &&
+	git checkout -q -b side &&
+	git rm -q --cached one &&
+	git commit -q -m second &&
+	git checkout -q -f master &&
+	cat >../status.expect <<-EOF &&
+	?? done/two
+	?? dtwo/
+	EOF
+	status_trace &&
+	git read-tree -m HEAD side &&
+	cat >../status.expect <<-EOF &&
+	D  one
+	?? done/two
+	?? dtwo/
+	?? one
+	EOF
+	status_trace &&
+	git read-tree -m side HEAD &&
+	cat >../status.expect <<-EOF &&
+	?? done/two
+	?? dtwo/
+	EOF
+	status_trace
+'
+
+test_expect_success 'other status modes do not use the cache' '
+	git status --porcelain -uall >../actual &&
+	cat >../expect <<-EOF &&
+	?? done/two
+	?? dtwo/two
+	EOF
+	test_cmp ../expect ../actual &&
+	git status --porcelain --ignored >../actual &&
+	cat >../expect <<-EOF &&
+	?? done/two
+	?? dtwo/
+	!! three
+	EOF
+	test_cmp ../expect ../actual &&
+	cat >../status.expect <<-EOF &&
+	?? done/two
+	?? dtwo/
+	EOF
+	status_trace &&
+	trace_expect 0 0 0 0
+'
+
+test_expect_success 'turn off untracked cache' '
+	git update-index --no-untracked-cache &&
+	test-dump-untracked-cache >../actual &&
+	echo "no untracked cache" >../expect &&
+	test_cmp ../expect ../actual &&
+	status_trace &&
+	test_must_be_empty ../trace
+'
+
+test_done
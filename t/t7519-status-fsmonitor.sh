@@ -0,0 +1,217 @@
+#!/bin/sh
+
+test_description='git status with file system watcher'
+
+. ./test-lib.sh
+
+# The hook below stands in for a real file system watcher: it reports
+# the NUL separated paths listed in .git/changed, and records that it
+# was called.
+write_hook () {
+	write_script .git/fsmonitor-test <<-\EOF
+	echo "$1 $2" >>.git/fsmonitor-calls
+	tr "\n" "\000" <.git/changed
+	EOF
+}
+
+changed () {
+	printf "%s\n" "$@" >.git/changed
+}
+
+dirty_repo () {
+	: >untracked &&
+	: >dir1/untracked &&
+	: >dir2/untracked &&
+	echo 1 >modified &&
+	echo 2 >dir1/modified &&
+	echo 3 >dir2/modified &&
+	echo 4 >new &&
+	echo 5 >dir1/new &&
+	echo 6 >dir2/new
+}
+
+test_expect_success 'setup' '
+	mkdir dir1 dir2 &&
+	: >tracked &&
+	: >modified &&
+	: >dir1/tracked &&
+	: >dir1/modified &&
+	: >dir2/tracked &&
+	: >dir2/modified &&
+	git add . &&
+	test_tick &&
+	git commit -m initial &&
+	cat >.gitignore <<-\EOF &&
+	.gitignore
+	expect*
+	actual*
+	EOF
+	write_hook &&
+	changed &&
+	git config core.fsmonitor .git/fsmonitor-test
+'
+
+test_expect_success 'refresh remembers the clean entries' '
+	git update-index --refresh &&
+	test-dump-fsmonitor >actual &&
+	cat >expect <<-\EOF &&
+	+ dir1/modified
+	+ dir1/tracked
+	+ dir2/modified
+	+ dir2/tracked
+	+ modified
+	+ tracked
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'the hook is called with the version and a timestamp' '
+	: >.git/fsmonitor-calls &&
+	git status >/dev/null &&
+	test_line_count = 1 .git/fsmonitor-calls &&
+	grep "^1 [1-9][0-9]*\$" .git/fsmonitor-calls
+'
+
+test_expect_success 'reported paths are examined again' '
+	echo change >modified &&
+	echo change >dir1/modified &&
+	changed modified dir1/modified &&
+	git status --porcelain --untracked-files=no >actual &&
+	cat >expect <<-\EOF &&
+	 M dir1/modified
+	 M modified
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'changes the hook does not report are not seen' '
+	changed &&
+	echo change >dir2/modified &&
+	git status --porcelain --untracked-files=no >actual &&
+	test_cmp expect actual &&
+	git checkout -- modified dir1/modified dir2/modified
+'
+
+test_expect_success 'a reported directory covers everything below it' '
+	echo change >dir1/modified &&
+	echo change >dir2/modified &&
+	changed dir1 dir2/ &&
+	git status --porcelain --untracked-files=no >actual &&
+	cat >expect <<-\EOF &&
+	 M dir1/modified
+	 M dir2/modified
+	EOF
+	test_cmp expect actual &&
+	git checkout -- dir1/modified dir2/modified
+'
+
+test_expect_success '"/" invalidates everything' '
+	changed &&
+	git update-index --refresh &&
+	echo change >tracked &&
+	changed / &&
+	git status --porcelain --untracked-files=no >actual &&
+	cat >expect <<-\EOF &&
+	 M tracked
+	EOF
+	test_cmp expect actual &&
+	git checkout -- tracked
+'
+
+test_expect_success 'a failing hook invalidates everything' '
+	changed &&
+	git update-index --refresh &&
+	echo change >tracked &&
+	git -c core.fsmonitor=false status --porcelain \
+		--untracked-files=no >actual &&
+	test_cmp expect actual &&
+	git checkout -- tracked
+'
+
+test_expect_success 'update-index --really-refresh ignores the hook' '
+	changed &&
+	git update-index --refresh &&
+	echo change >tracked &&
+	git update-index --refresh &&
+	echo "tracked: needs update" >expect &&
+	test_must_fail git update-index --really-refresh >actual &&
+	test_cmp expect actual &&
+	git checkout -- tracked
+'
+
+test_expect_success 'status sees all changes' '
+	changed &&
+	git update-index --refresh &&
+	dirty_repo &&
+	git add new dir1/new dir2/new &&
+	changed untracked dir1/untracked dir2/untracked \
+		modified dir1/modified dir2/modified \
+		new dir1/new dir2/new &&
+	git status --porcelain >actual &&
+	cat >expect <<-\EOF &&
+	 M dir1/modified
+	A  dir1/new
+	 M dir2/modified
+	A  dir2/new
+	 M modified
+	A  new
+	?? dir1/untracked
+	?? dir2/untracked
+	?? untracked
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'works with the untracked cache' '
+	git update-index --untracked-cache &&
+	changed &&
+	git status --porcelain >actual &&
+	test_cmp expect actual &&
+	: >dir1/another &&
+	changed dir1/another &&
+	git status --porcelain >actual &&
+	cat >expect <<-\EOF &&
+	 M dir1/modified
+	A  dir1/new
+	 M dir2/modified
+	A  dir2/new
+	 M modified
+	A  new
+	?? dir1/another
+	?? dir1/untracked
+	?? dir2/untracked
+	?? untracked
+	EOF
+	test_cmp expect actual &&
+	: >dir2/unreported &&
+	changed &&
+	git status --porcelain >actual &&
+	test_cmp expect actual &&
+	rm dir1/another dir2/unreported &&
+	changed dir1/another dir2/unreported &&
+	git status --porcelain >actual &&
+	cat >expect <<-\EOF &&
+	 M dir1/modified
+	A  dir1/new
+	 M dir2/modified
+	A  dir2/new
+	 M modified
+	A  new
+	?? dir1/untracked
+	?? dir2/untracked
+	?? untracked
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'unsetting core.fsmonitor drops the extension' '
+	git config --unset core.fsmonitor &&
+	: >.git/fsmonitor-calls &&
+	git update-index -q --refresh;
+	test_must_be_empty .git/fsmonitor-calls &&
+	git config core.fsmonitor .git/fsmonitor-test &&
+	test-dump-fsmonitor >actual &&
+	! grep "^+" actual
+'
+
+test_done
@@ -1202,4 +1202,24 @@ test_expect_success LIBPCRE 'grep -P "^ "' '
 	test_cmp expected actual
 '
 
+test_expect_success PTHREADS 'grep in packed trees gives the same result in threads' '
+	git init threads &&
+	(
+		cd threads &&
+		for i in $(test_seq 1 20)
+		do
+			test_seq $i 100 >file$((i % 5)) &&
+			git add . &&
+			git commit -q -m "commit $i" || exit 1
+		done &&
+		git repack -adq --depth=50 &&
+		git grep -n 7 HEAD HEAD~5 HEAD~10 >expect &&
+		GIT_FORCE_THREADS=1 git grep -n 7 HEAD HEAD~5 HEAD~10 >actual &&
+		test_cmp expect actual &&
+		git grep --cached -c 7 >expect &&
+		GIT_FORCE_THREADS=1 git grep --cached -c 7 >actual &&
+		test_cmp expect actual
+	)
+'
+
 test_done
@@ -0,0 +1,22 @@
+#include "cache.h"
+
+int main(int ac, char **av)
+{
+	int i;
+
+	setup_git_directory();
+	/*
+	 * Do not let reading the index ask the monitor about anything:
+	 * "true" reports no change, so the flags are those of the extension.
+	 */
+	core_fsmonitor = "true";
+	if (read_cache() < 0)
+		die("unable to read index file");
+	for (i = 0; i < the_index.cache_nr; i++) {
+		struct cache_entry *ce = the_index.cache[i];
+		printf("%c %s\n",
+		       ce->ce_flags & CE_FSMONITOR_VALID ? '+' : '-',
+		       ce->name);
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include "cache.h"
+#include "string-list.h"
+
+/*
+ * Look up every entry of the index and every directory it is in, in
+ * upper case and with core.ignorecase on; then forget the entries
+ * under each directory given on the command line, and look the
+ * directories up again.
+ */
+
+static struct string_list dirs = STRING_LIST_INIT_DUP;
+
+static char *upcase(const char *name, int len)
+{
+	char *up = xmemdupz(name, len);
+	int i;
+
+	for (i = 0; i < len; i++)
+		up[i] = toupper(up[i]);
+	return up;
+}
+
+static void show_dirs(void)
+{
+	int i;
+
+	for (i = 0; i < dirs.nr; i++) {
+		const char *dir = dirs.items[i].string;
+		char *up = upcase(dir, strlen(dir));
+
+		printf("dir %s %s\n", dir,
+		       index_dir_exists(&the_index, up, strlen(up)) ?
+		       "found" : "missing");
+		free(up);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int i, j;
+
+	setup_git_directory();
+	ignore_case = 1;
+	read_cache();
+
+	for (i = 0; i < the_index.cache_nr; i++) {
+		const struct cache_entry *ce = the_index.cache[i];
+		char *up = upcase(ce->name, ce_namelen(ce));
+
+		printf("file %s %s\n", ce->name,
+		       index_file_exists(&the_index, up, ce_namelen(ce), 1) == ce ?
+		       "found" : "missing");
+		free(up);
+		for (j = 0; j < ce_namelen(ce); j++)
+			if (ce->name[j] == '/') {
+				char *dir = xmemdupz(ce->name, j);
+
+				string_list_insert(&dirs, dir);
+				free(dir);
+			}
+	}
+	show_dirs();
+
+	for (i = 1; i < argc; i++) {
+		int len = strlen(argv[i]);
+
+		for (j = 0; j < the_index.cache_nr; j++) {
+			struct cache_entry *ce = the_index.cache[j];
+
+			if (ce_namelen(ce) > len && ce->name[len] == '/' &&
+			    !strncasecmp(ce->name, argv[i], len))
+				remove_name_hash(&the_index, ce);
+		}
+	}
+	if (argc > 1)
+		show_dirs();
+	return 0;
+}
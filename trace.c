@@ -188,3 +188,11 @@ int trace_want(const char *key)
 		return 0;
 	return 1;
 }
+
+uint64_t getnanotime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+}
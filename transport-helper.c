@@ -259,7 +259,9 @@ static const char *unsupported_options[] = {
 static const char *boolean_options[] = {
 	TRANS_OPT_THIN,
 	TRANS_OPT_KEEP,
-	TRANS_OPT_FOLLOWTAGS
+	TRANS_OPT_FOLLOWTAGS,
+	TRANS_OPT_FROM_PROMISOR,
+	TRANS_OPT_NO_DEPENDENTS
 	};
 
 static int set_helper_option(struct transport *transport,
@@ -967,7 +969,8 @@ static int has_attribute(const char *attrs, const char *attr) {
 	}
 }
 
-static struct ref *get_refs_list(struct transport *transport, int for_push)
+static struct ref *get_refs_list(struct transport *transport, int for_push,
+				 const struct argv_array *ref_prefixes)
 {
 	struct helper_data *data = transport->data;
 	struct child_process *helper;
@@ -980,7 +983,17 @@ static struct ref *get_refs_list(struct transport *transport, int for_push)
 
 	if (process_connect(transport, for_push)) {
 		do_take_over(transport);
-		return transport->get_refs_list(transport, for_push);
+		return transport->get_refs_list(transport, for_push,
+						ref_prefixes);
+	}
+
+	/* the prefixes are only a hint; stop if the helper ignores them */
+	if (!for_push && ref_prefixes) {
+		int i;
+		for (i = 0; i < ref_prefixes->argc; i++)
+			if (set_helper_option(transport, "ref-prefix",
+					      ref_prefixes->argv[i]))
+				break;
 	}
 
 	if (data->push && for_push)
@@ -197,7 +197,8 @@ static const char *rsync_url(const char *url)
 	return url;
 }
 
-static struct ref *get_refs_via_rsync(struct transport *transport, int for_push)
+static struct ref *get_refs_via_rsync(struct transport *transport, int for_push,
+				       const struct argv_array *ref_prefixes)
 {
 	struct strbuf buf = STRBUF_INIT, temp_dir = STRBUF_INIT;
 	struct ref dummy = {NULL}, *tail = &dummy;
@@ -409,7 +410,8 @@ struct bundle_transport_data {
 	struct bundle_header header;
 };
 
-static struct ref *get_refs_from_bundle(struct transport *transport, int for_push)
+static struct ref *get_refs_from_bundle(struct transport *transport, int for_push,
+					 const struct argv_array *ref_prefixes)
 {
 	struct bundle_transport_data *data = transport->data;
 	struct ref *result = NULL;
@@ -455,6 +457,7 @@ struct git_transport_data {
 	struct child_process *conn;
 	int fd[2];
 	unsigned got_remote_heads : 1;
+	enum protocol_version version;
 	struct sha1_array extra_have;
 	struct sha1_array shallow;
 };
@@ -490,6 +493,18 @@ static int set_git_option(struct git_transport_options *opts,
 				die("transport: invalid depth option '%s'", value);
 		}
 		return 0;
+	} else if (!strcmp(name, TRANS_OPT_LIST_OBJECTS_FILTER)) {
+		if (!value)
+			list_objects_filter_release(&opts->filter_options);
+		else if (parse_list_objects_filter(&opts->filter_options, value))
+			die("transport: invalid filter '%s'", value);
+		return 0;
+	} else if (!strcmp(name, TRANS_OPT_FROM_PROMISOR)) {
+		opts->from_promisor = !!value;
+		return 0;
+	} else if (!strcmp(name, TRANS_OPT_NO_DEPENDENTS)) {
+		opts->no_dependents = !!value;
+		return 0;
 	}
 	return 1;
 }
@@ -497,33 +512,62 @@ static int set_git_option(struct git_transport_options *opts,
 static int connect_setup(struct transport *transport, int for_push, int verbose)
 {
 	struct git_transport_data *data = transport->data;
+	int flags;
 
 	if (data->conn)
 		return 0;
 
+	flags = verbose ? CONNECT_VERBOSE : 0;
+	/* only upload-pack speaks protocol v2 */
+	if (!for_push && get_protocol_version_config() == protocol_v2)
+		flags |= CONNECT_PROTOCOL_V2;
 	data->conn = git_connect(data->fd, transport->url,
 				 for_push ? data->options.receivepack :
 				 data->options.uploadpack,
-				 verbose ? CONNECT_VERBOSE : 0);
+				 flags);
 
 	return 0;
 }
 
-static struct ref *get_refs_via_connect(struct transport *transport, int for_push)
+/*
+ * Read the advertisement of the server; a protocol v2 server only
+ * sends the refs matching ref_prefixes (or all of them if NULL or
+ * empty) in response to an explicit ls-refs request.
+ */
+static struct ref *read_remote_refs(struct transport *transport, int for_push,
+				    const struct argv_array *ref_prefixes,
+				    struct sha1_array *extra_have)
 {
 	struct git_transport_data *data = transport->data;
 	struct ref *refs;
 
-	connect_setup(transport, for_push, 0);
 	get_remote_heads(data->fd[0], NULL, 0, &refs,
 			 for_push ? REF_NORMAL : 0,
-			 &data->extra_have,
-			 &data->shallow);
+			 extra_have, &data->shallow);
+	data->version = server_protocol_version();
+	if (data->version == protocol_v2) {
+		struct strbuf req = STRBUF_INIT;
+
+		ls_refs_request(&req, ref_prefixes);
+		write_or_die(data->fd[1], req.buf, req.len);
+		strbuf_release(&req);
+		get_remote_refs(data->fd[0], NULL, 0, &refs);
+	}
 	data->got_remote_heads = 1;
 
 	return refs;
 }
 
+static struct ref *get_refs_via_connect(struct transport *transport, int for_push,
+					const struct argv_array *ref_prefixes)
+{
+	struct git_transport_data *data = transport->data;
+
+	connect_setup(transport, for_push, 0);
+	return read_remote_refs(transport, for_push, ref_prefixes,
+				&data->extra_have);
+}
+
 static int fetch_refs_via_pack(struct transport *transport,
 			       int nr_heads, struct ref **to_fetch)
 {
@@ -547,18 +591,19 @@ static int fetch_refs_via_pack(struct transport *transport,
 		data->options.check_self_contained_and_connected;
 	args.cloning = transport->cloning;
 	args.update_shallow = data->options.update_shallow;
+	args.filter_options = data->options.filter_options;
+	args.from_promisor = data->options.from_promisor;
+	args.no_dependents = data->options.no_dependents;
 
 	if (!data->got_remote_heads) {
 		connect_setup(transport, 0, 0);
-		get_remote_heads(data->fd[0], NULL, 0, &refs_tmp, 0,
-				 NULL, &data->shallow);
-		data->got_remote_heads = 1;
+		refs_tmp = read_remote_refs(transport, 0, NULL, NULL);
 	}
 
 	refs = fetch_pack(&args, data->fd, data->conn,
 			  refs_tmp ? refs_tmp : transport->remote_refs,
 			  dest, to_fetch, nr_heads, &data->shallow,
-			  &transport->pack_lockfile);
+			  &transport->pack_lockfile, data->version);
 	close(data->fd[0]);
 	close(data->fd[1]);
 	if (finish_connect(data->conn))
@@ -1144,7 +1189,7 @@ int transport_push(struct transport *transport,
 		if (check_push_refs(local_refs, refspec_nr, refspec) < 0)
 			return -1;
 
-		remote_refs = transport->get_refs_list(transport, 1);
+		remote_refs = transport->get_refs_list(transport, 1, NULL);
 
 		if (flags & TRANSPORT_PUSH_ALL)
 			match_flags |= MATCH_REFS_ALL;
@@ -1225,10 +1270,12 @@ int transport_push(struct transport *transport,
 	return 1;
 }
 
-const struct ref *transport_get_remote_refs(struct transport *transport)
+const struct ref *transport_get_remote_refs(struct transport *transport,
+					    const struct argv_array *ref_prefixes)
 {
 	if (!transport->got_remote_refs) {
-		transport->remote_refs = transport->get_refs_list(transport, 0);
+		transport->remote_refs = transport->get_refs_list(transport, 0,
+								  ref_prefixes);
 		transport->got_remote_refs = 1;
 	}
 
@@ -1377,7 +1424,7 @@ static int refs_from_alternate_cb(struct alternate_object_database *e,
 	other[len - 8] = '\0';
 	remote = remote_get(other);
 	transport = transport_get(remote, other);
-	for (extra = transport_get_remote_refs(transport);
+	for (extra = transport_get_remote_refs(transport, NULL);
 	     extra;
 	     extra = extra->next)
 		cb->fn(extra, cb->data);
@@ -4,6 +4,9 @@
 #include "cache.h"
 #include "run-command.h"
 #include "remote.h"
+#include "list-objects-filter.h"
+
+struct argv_array;
 
 struct git_transport_options {
 	unsigned thin : 1;
@@ -12,10 +15,13 @@ struct git_transport_options {
 	unsigned check_self_contained_and_connected : 1;
 	unsigned self_contained_and_connected : 1;
 	unsigned update_shallow : 1;
+	unsigned from_promisor : 1;
+	unsigned no_dependents : 1;
 	int depth;
 	const char *uploadpack;
 	const char *receivepack;
 	struct push_cas_option *cas;
+	struct list_objects_filter_options filter_options;
 };
 
 struct transport {
@@ -58,8 +64,13 @@ struct transport {
 	 * If the transport is able to determine the remote hash for
 	 * the ref without a huge amount of effort, it should store it
 	 * in the ref's old_sha1 field; otherwise it should be all 0.
+	 *
+	 * ref_prefixes, if not NULL or empty, is a hint that only the
+	 * refs starting with one of the prefixes are of interest; the
+	 * transport may still return others.
 	 **/
-	struct ref *(*get_refs_list)(struct transport *transport, int for_push);
+	struct ref *(*get_refs_list)(struct transport *transport, int for_push,
+				     const struct argv_array *ref_prefixes);
 
 	/**
 	 * Fetch the objects for the given refs. Note that this gets
@@ -156,6 +167,19 @@ struct transport *transport_get(struct remote *, const char *);
 /* Accept refs that may update .git/shallow without --depth */
 #define TRANS_OPT_UPDATE_SHALLOW "updateshallow"
 
+/* Filter the objects to fetch by the filter-spec if not null */
+#define TRANS_OPT_LIST_OBJECTS_FILTER "filter"
+
+/* Mark the fetched pack as coming from the promisor remote if not null */
+#define TRANS_OPT_FROM_PROMISOR "from-promisor"
+
+/*
+ * Only fetch the objects asked for, not the objects they refer to, and
+ * do not negotiate with haves; used to fetch missing objects of a
+ * partial clone.
+ */
+#define TRANS_OPT_NO_DEPENDENTS "no-dependents"
+
 /**
  * Returns 0 if the option was used, non-zero otherwise. Prints a
  * message to stderr if the option is not used.
@@ -175,7 +199,12 @@ int transport_push(struct transport *connection,
 		   int refspec_nr, const char **refspec, int flags,
 		   unsigned int * reject_reasons);
 
-const struct ref *transport_get_remote_refs(struct transport *transport);
+/*
+ * Retrieve the refs of the remote; see get_refs_list() for the meaning
+ * of ref_prefixes.  The result is cached for later calls.
+ */
+const struct ref *transport_get_remote_refs(struct transport *transport,
+					    const struct argv_array *ref_prefixes);
 
 int transport_fetch_refs(struct transport *transport, struct ref *refs);
 void transport_unlock_pack(struct transport *transport);
@@ -8,6 +8,11 @@
 #include "progress.h"
 #include "refs.h"
 #include "attr.h"
+#include "split-index.h"
+#include "sha1-array.h"
+#include "fetch-object.h"
+#include "parallel-checkout.h"
+#include "sparse-index.h"
 
 /*
  * Error messages expected by scripts out of plumbing commands such as
@@ -218,17 +223,46 @@ static int check_updates(struct unpack_trees_options *o)
 	remove_marked_cache_entries(&o->result);
 	remove_scheduled_dirs();
 
+	if (o->update && !o->dry_run && repository_format_partial_clone &&
+	    fetch_if_missing) {
+		/*
+		 * Fetch the blobs a partial clone left out in one go,
+		 * instead of one at a time as they are checked out.
+		 */
+		struct sha1_array to_fetch = SHA1_ARRAY_INIT;
+
+		for (i = 0; i < index->cache_nr; i++) {
+			const struct cache_entry *ce = index->cache[i];
+
+			if ((ce->ce_flags & CE_UPDATE) &&
+			    !S_ISGITLINK(ce->ce_mode) &&
+			    !has_sha1_file(ce->sha1))
+				sha1_array_append(&to_fetch, ce->sha1);
+		}
+		if (to_fetch.nr)
+			fetch_objects(repository_format_partial_clone,
+				      &to_fetch);
+		sha1_array_clear(&to_fetch);
+	}
+
+	if (o->update && !o->dry_run)
+		init_parallel_checkout();
 	for (i = 0; i < index->cache_nr; i++) {
 		struct cache_entry *ce = index->cache[i];
 
 		if (ce->ce_flags & CE_UPDATE) {
-			display_progress(progress, ++cnt);
+			int queued = parallel_checkout_queue_size();
+
 			ce->ce_flags &= ~CE_UPDATE;
 			if (o->update && !o->dry_run) {
 				errs |= checkout_entry(ce, &state, NULL);
 			}
+			/* a queued one is counted when it is written */
+			if (parallel_checkout_queue_size() == queued)
+				display_progress(progress, ++cnt);
 		}
 	}
+	errs |= run_parallel_checkout(&state, progress, &cnt);
 	stop_progress(&progress);
 	if (o->update)
 		git_attr_set_direction(GIT_ATTR_CHECKIN, NULL);
@@ -1004,6 +1038,8 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 
 	if (len > MAX_UNPACK_TREES)
 		die("unpack_trees takes at most %d trees", MAX_UNPACK_TREES);
+	/* the trees are merged with every entry of the index */
+	ensure_full_index(o->src_index);
 	memset(&state, 0, sizeof(state));
 	state.base_dir = "";
 	state.force = 1;
@@ -1025,6 +1061,9 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 	o->result.timestamp.sec = o->src_index->timestamp.sec;
 	o->result.timestamp.nsec = o->src_index->timestamp.nsec;
 	o->result.version = o->src_index->version;
+	o->result.split_index = o->src_index->split_index;
+	if (o->result.split_index)
+		o->result.split_index->refcount++;
 	o->merge_size = len;
 	mark_all_ce_unused(o->src_index);
 
@@ -1138,6 +1177,20 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 		}
 	}
 
+	if (o->dst_index) {
+		/*
+		 * When merging, paths that changed were invalidated by
+		 * invalidate_ce_path(); otherwise the whole index has
+		 * been replaced.
+		 */
+		o->result.untracked = o->src_index->untracked;
+		o->src_index->untracked = NULL;
+		if (!o->merge)
+			untracked_cache_invalidate_all(&o->result);
+		/* entries taken over from the old index keep their flags */
+		o->result.fsmonitor_last_update =
+			o->src_index->fsmonitor_last_update;
+	}
 	o->src_index = NULL;
 	ret = check_updates(o) ? (-2) : 0;
 	if (o->dst_index) {
@@ -1242,8 +1295,10 @@ static int verify_uptodate_sparse(const struct cache_entry *ce,
 static void invalidate_ce_path(const struct cache_entry *ce,
 			       struct unpack_trees_options *o)
 {
-	if (ce)
-		cache_tree_invalidate_path(o->src_index->cache_tree, ce->name);
+	if (!ce)
+		return;
+	cache_tree_invalidate_path(o->src_index->cache_tree, ce->name);
+	untracked_cache_invalidate_path(o->src_index, ce->name);
 }
 
 /*
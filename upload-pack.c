@@ -14,6 +14,9 @@
 #include "sigchain.h"
 #include "version.h"
 #include "string-list.h"
+#include "argv-array.h"
+#include "protocol.h"
+#include "list-objects-filter.h"
 
 static const char upload_pack_usage[] = "git upload-pack [--strict] [--timeout=<n>] <dir>";
 
@@ -36,6 +39,9 @@ static int no_done;
 static int use_thin_pack, use_ofs_delta, use_include_tag;
 static int no_progress, daemon_mode;
 static int allow_tip_sha1_in_want;
+static int allow_any_sha1_in_want;
+static int allow_filter;
+static struct list_objects_filter_options filter_options;
 static int shallow_nr;
 static struct object_array have_obj;
 static struct object_array want_obj;
@@ -48,6 +54,7 @@ static int keepalive = 5;
 static int use_sideband;
 static int advertise_refs;
 static int stateless_rpc;
+static enum protocol_version protocol_version;
 
 static void reset_timeout(void)
 {
@@ -86,7 +93,8 @@ static void create_pack_file(void)
 		"corruption on the remote side.";
 	int buffered = -1;
 	ssize_t sz;
-	const char *argv[12];
+	const char *argv[13];
+	char *filter_arg = NULL;
 	int i, arg = 0;
 	FILE *pipe_fd;
 
@@ -106,6 +114,10 @@ static void create_pack_file(void)
 		argv[arg++] = "--delta-base-offset";
 	if (use_include_tag)
 		argv[arg++] = "--include-tag";
+	if (filter_options.choice) {
+		filter_arg = xstrfmt("--filter=%s", filter_options.filter_spec);
+		argv[arg++] = filter_arg;
+	}
 	argv[arg++] = NULL;
 
 	memset(&pack_objects, 0, sizeof(pack_objects));
@@ -262,6 +274,7 @@ static void create_pack_file(void)
 	}
 	if (use_sideband)
 		packet_flush(1);
+	free(filter_arg);
 	return;
 
  fail:
@@ -453,8 +466,12 @@ static void check_non_tip(void)
 	char namebuf[42]; /* ^ + SHA-1 + LF */
 	int i;
 
-	/* In the normal in-process case non-tip request can never happen */
-	if (!stateless_rpc)
+	/*
+	 * In the normal in-process case non-tip request can never
+	 * happen, but with protocol v2 the refs may have been listed by
+	 * an earlier command.
+	 */
+	if (!stateless_rpc && protocol_version != protocol_v2)
 		goto error;
 
 	cmd.argv = argv;
@@ -528,6 +545,133 @@ error:
 	}
 }
 
+static int process_shallow(const char *line, struct object_array *shallows)
+{
+	const char *arg;
+	unsigned char sha1[20];
+	struct object *object;
+
+	if (!skip_prefix(line, "shallow ", &arg))
+		return 0;
+	if (get_sha1_hex(arg, sha1))
+		die("invalid shallow line: %s", line);
+	object = parse_object(sha1);
+	if (!object)
+		return 1;
+	if (object->type != OBJ_COMMIT)
+		die("invalid shallow object %s", sha1_to_hex(sha1));
+	if (!(object->flags & CLIENT_SHALLOW)) {
+		object->flags |= CLIENT_SHALLOW;
+		add_object_array(object, NULL, shallows);
+	}
+	return 1;
+}
+
+static int process_filter(const char *line)
+{
+	const char *arg;
+
+	if (!allow_filter || !skip_prefix(line, "filter ", &arg))
+		return 0;
+	if (parse_list_objects_filter(&filter_options, arg))
+		die("git upload-pack: invalid filter '%s'", arg);
+	return 1;
+}
+
+static int process_deepen(const char *line, int *depth)
+{
+	const char *arg;
+	char *end;
+
+	if (!skip_prefix(line, "deepen ", &arg))
+		return 0;
+	*depth = strtol(arg, &end, 0);
+	if (end == arg || *depth <= 0)
+		die("Invalid deepen: %s", line);
+	return 1;
+}
+
+/* Returns 1 if the object wanted is not one of our refs. */
+static int add_want(const unsigned char *sha1)
+{
+	struct object *o = parse_object(sha1);
+
+	if (!o)
+		die("git upload-pack: not our ref %s", sha1_to_hex(sha1));
+	if (o->flags & WANTED)
+		return 0;
+	o->flags |= WANTED;
+	add_object_array(o, NULL, &want_obj);
+	return !is_our_ref(o);
+}
+
+/*
+ * Work out the shallow boundary of the pack for the client's "deepen"
+ * request and the commits it told us it is shallow at, sending it
+ * "shallow" and "unshallow" lines if it asked to change its depth.
+ * Returns 1 if any lines were sent (without terminating them), 0
+ * otherwise.
+ */
+static int deepen(int depth, struct object_array *shallows)
+{
+	if (depth == 0 && shallows->nr == 0)
+		return 0;
+	if (depth > 0) {
+		struct commit_list *result = NULL, *backup = NULL;
+		int i;
+		if (depth == INFINITE_DEPTH && !is_repository_shallow())
+			for (i = 0; i < shallows->nr; i++) {
+				struct object *object = shallows->objects[i].item;
+				object->flags |= NOT_SHALLOW;
+			}
+		else
+			backup = result =
+				get_shallow_commits(&want_obj, depth,
+						    SHALLOW, NOT_SHALLOW);
+		while (result) {
+			struct object *object = &result->item->object;
+			if (!(object->flags & (CLIENT_SHALLOW|NOT_SHALLOW))) {
+				packet_write(1, "shallow %s",
+						sha1_to_hex(object->sha1));
+				register_shallow(object->sha1);
+				shallow_nr++;
+			}
+			result = result->next;
+		}
+		free_commit_list(backup);
+		for (i = 0; i < shallows->nr; i++) {
+			struct object *object = shallows->objects[i].item;
+			if (object->flags & NOT_SHALLOW) {
+				struct commit_list *parents;
+				packet_write(1, "unshallow %s",
+					sha1_to_hex(object->sha1));
+				object->flags &= ~CLIENT_SHALLOW;
+				/* make sure the real parents are parsed */
+				unregister_shallow(object->sha1);
+				object->parsed = 0;
+				parse_commit_or_die((struct commit *)object);
+				parents = ((struct commit *)object)->parents;
+				while (parents) {
+					add_object_array(&parents->item->object,
+							NULL, &want_obj);
+					parents = parents->next;
+				}
+				add_object_array(object, NULL, &extra_edge_obj);
+			}
+			/* make sure commit traversal conforms to client */
+			register_shallow(object->sha1);
+		}
+	} else
+		if (shallows->nr > 0) {
+			int i;
+			for (i = 0; i < shallows->nr; i++)
+				register_shallow(shallows->objects[i].item->sha1);
+		}
+
+	shallow_nr += shallows->nr;
+	return depth > 0;
+}
+
 static void receive_needs(void)
 {
 	struct object_array shallows = OBJECT_ARRAY_INIT;
@@ -536,7 +680,6 @@ static void receive_needs(void)
 
 	shallow_nr = 0;
 	for (;;) {
-		struct object *o;
 		const char *features;
 		unsigned char sha1_buf[20];
 		char *line = packet_read_line(0, NULL);
@@ -544,29 +687,12 @@ static void receive_needs(void)
 		if (!line)
 			break;
 
-		if (starts_with(line, "shallow ")) {
-			unsigned char sha1[20];
-			struct object *object;
-			if (get_sha1_hex(line + 8, sha1))
-				die("invalid shallow line: %s", line);
-			object = parse_object(sha1);
-			if (!object)
-				continue;
-			if (object->type != OBJ_COMMIT)
-				die("invalid shallow object %s", sha1_to_hex(sha1));
-			if (!(object->flags & CLIENT_SHALLOW)) {
-				object->flags |= CLIENT_SHALLOW;
-				add_object_array(object, NULL, &shallows);
-			}
+		if (process_shallow(line, &shallows))
 			continue;
-		}
-		if (starts_with(line, "deepen ")) {
-			char *end;
-			depth = strtol(line + 7, &end, 0);
-			if (end == line + 7 || depth <= 0)
-				die("Invalid deepen: %s", line);
+		if (process_deepen(line, &depth))
+			continue;
+		if (process_filter(line))
 			continue;
-		}
 		if (!starts_with(line, "want ") ||
 		    get_sha1_hex(line+5, sha1_buf))
 			die("git upload-pack: protocol error, "
@@ -593,16 +719,8 @@ static void receive_needs(void)
 		if (parse_feature_request(features, "include-tag"))
 			use_include_tag = 1;
 
-		o = parse_object(sha1_buf);
-		if (!o)
-			die("git upload-pack: not our ref %s",
-			    sha1_to_hex(sha1_buf));
-		if (!(o->flags & WANTED)) {
-			o->flags |= WANTED;
-			if (!is_our_ref(o))
-				has_non_tip = 1;
-			add_object_array(o, NULL, &want_obj);
-		}
+		if (add_want(sha1_buf))
+			has_non_tip = 1;
 	}
 
 	/*
@@ -612,68 +730,14 @@ static void receive_needs(void)
 	 * have been based on the set of older refs advertised
 	 * by another process that handled the initial request.
 	 */
-	if (has_non_tip)
+	if (has_non_tip && !allow_any_sha1_in_want)
 		check_non_tip();
 
 	if (!use_sideband && daemon_mode)
 		no_progress = 1;
 
-	if (depth == 0 && shallows.nr == 0)
-		return;
-	if (depth > 0) {
-		struct commit_list *result = NULL, *backup = NULL;
-		int i;
-		if (depth == INFINITE_DEPTH && !is_repository_shallow())
-			for (i = 0; i < shallows.nr; i++) {
-				struct object *object = shallows.objects[i].item;
-				object->flags |= NOT_SHALLOW;
-			}
-		else
-			backup = result =
-				get_shallow_commits(&want_obj, depth,
-						    SHALLOW, NOT_SHALLOW);
-		while (result) {
-			struct object *object = &result->item->object;
-			if (!(object->flags & (CLIENT_SHALLOW|NOT_SHALLOW))) {
-				packet_write(1, "shallow %s",
-						sha1_to_hex(object->sha1));
-				register_shallow(object->sha1);
-				shallow_nr++;
-			}
-			result = result->next;
-		}
-		free_commit_list(backup);
-		for (i = 0; i < shallows.nr; i++) {
-			struct object *object = shallows.objects[i].item;
-			if (object->flags & NOT_SHALLOW) {
-				struct commit_list *parents;
-				packet_write(1, "unshallow %s",
-					sha1_to_hex(object->sha1));
-				object->flags &= ~CLIENT_SHALLOW;
-				/* make sure the real parents are parsed */
-				unregister_shallow(object->sha1);
-				object->parsed = 0;
-				parse_commit_or_die((struct commit *)object);
-				parents = ((struct commit *)object)->parents;
-				while (parents) {
-					add_object_array(&parents->item->object,
-							NULL, &want_obj);
-					parents = parents->next;
-				}
-				add_object_array(object, NULL, &extra_edge_obj);
-			}
-			/* make sure commit traversal conforms to client */
-			register_shallow(object->sha1);
-		}
+	if (deepen(depth, &shallows))
 		packet_flush(1);
-	} else
-		if (shallows.nr > 0) {
-			int i;
-			for (i = 0; i < shallows.nr; i++)
-				register_shallow(shallows.objects[i].item->sha1);
-		}
-
-	shallow_nr += shallows.nr;
 	free(shallows.objects);
 }
 
@@ -717,10 +781,12 @@ static int send_ref(const char *refname, const unsigned char *sha1, int flag, vo
 		struct strbuf symref_info = STRBUF_INIT;
 
 		format_symref_info(&symref_info, cb_data);
-		packet_write(1, "%s %s%c%s%s%s%s agent=%s\n",
+		packet_write(1, "%s %s%c%s%s%s%s%s agent=%s\n",
 			     sha1_to_hex(sha1), refname_nons,
 			     0, capabilities,
-			     allow_tip_sha1_in_want ? " allow-tip-sha1-in-want" : "",
+			     allow_tip_sha1_in_want || allow_any_sha1_in_want ?
+			     " allow-tip-sha1-in-want" : "",
+			     allow_filter ? " filter" : "",
 			     stateless_rpc ? " no-done" : "",
 			     symref_info.buf,
 			     git_user_agent_sanitized());
@@ -778,10 +844,293 @@ static void upload_pack(void)
 	}
 }
 
+/*
+ * Protocol v2: after advertising its capabilities, the server waits
+ * for commands; see Documentation/technical/protocol-v2.txt.
+ */
+static void advertise_capabilities_v2(void)
+{
+	packet_write(1, "version 2\n");
+	packet_write(1, "agent=%s\n", git_user_agent_sanitized());
+	packet_write(1, "ls-refs\n");
+	packet_write(1, "fetch=shallow%s\n", allow_filter ? " filter" : "");
+	packet_flush(1);
+}
+
+struct ls_refs_data {
+	unsigned symrefs : 1;
+	unsigned peel : 1;
+	struct argv_array prefixes;
+};
+
+static int ref_matches_prefixes(const char *refname,
+				const struct argv_array *prefixes)
+{
+	int i;
+
+	if (!prefixes->argc)
+		return 1;
+	for (i = 0; i < prefixes->argc; i++)
+		if (starts_with(refname, prefixes->argv[i]))
+			return 1;
+	return 0;
+}
+
+static int send_ls_ref(const char *refname, const unsigned char *sha1,
+		       int flag, void *cb_data)
+{
+	struct ls_refs_data *data = cb_data;
+	const char *refname_nons = strip_namespace(refname);
+	struct strbuf line = STRBUF_INIT;
+	unsigned char peeled[20];
+
+	if (ref_is_hidden(refname) ||
+	    !ref_matches_prefixes(refname_nons, &data->prefixes))
+		return 0;
+
+	strbuf_addf(&line, "%s %s", sha1_to_hex(sha1), refname_nons);
+	if (data->symrefs && (flag & REF_ISSYMREF)) {
+		unsigned char unused[20];
+		const char *target = resolve_ref_unsafe(refname, unused, 0, NULL);
+		if (target) {
+			const char *target_nons = strip_namespace(target);
+			strbuf_addf(&line, " symref-target:%s",
+				    target_nons ? target_nons : target);
+		}
+	}
+	if (data->peel && !peel_ref(refname, peeled))
+		strbuf_addf(&line, " peeled:%s", sha1_to_hex(peeled));
+	packet_write(1, "%s\n", line.buf);
+	strbuf_release(&line);
+	return 0;
+}
+
+static int cmp_prefix(const void *a_, const void *b_)
+{
+	const char *a = *(const char **)a_, *b = *(const char **)b_;
+	return strcmp(a, b);
+}
+
+static void ls_refs(struct argv_array *args)
+{
+	struct ls_refs_data data;
+	struct strbuf prefix = STRBUF_INIT;
+	const char *covered = NULL;
+	int i;
+
+	memset(&data, 0, sizeof(data));
+	argv_array_init(&data.prefixes);
+	for (i = 0; i < args->argc; i++) {
+		const char *arg = args->argv[i];
+		const char *value;
+
+		if (!strcmp(arg, "symrefs"))
+			data.symrefs = 1;
+		else if (!strcmp(arg, "peel"))
+			data.peel = 1;
+		else if (skip_prefix(arg, "ref-prefix ", &value))
+			argv_array_push(&data.prefixes, value);
+		else
+			die("git upload-pack: unexpected ls-refs argument '%s'",
+			    arg);
+	}
+
+	head_ref_namespaced(send_ls_ref, &data);
+	if (!data.prefixes.argc) {
+		for_each_namespaced_ref(send_ls_ref, &data);
+		goto done;
+	}
+
+	/*
+	 * Only look at the refs under the prefixes asked for, so that
+	 * listing a few refs does not cost as much as listing them all.
+	 * A prefix that another one starts with adds nothing; with the
+	 * prefixes sorted, that one comes first.
+	 */
+	qsort(data.prefixes.argv, data.prefixes.argc,
+	      sizeof(*data.prefixes.argv), cmp_prefix);
+	for (i = 0; i < data.prefixes.argc; i++) {
+		const char *p = data.prefixes.argv[i];
+
+		if (covered && starts_with(p, covered))
+			continue;
+		covered = p;
+		if (!starts_with(p, "refs/"))
+			continue; /* only HEAD lives outside of refs/ */
+		strbuf_reset(&prefix);
+		strbuf_addf(&prefix, "%s%s", get_git_namespace(), p);
+		for_each_fullref_in(prefix.buf, send_ls_ref, &data);
+	}
+	strbuf_release(&prefix);
+done:
+	packet_flush(1);
+	argv_array_clear(&data.prefixes);
+}
+
+static void send_acknowledgments(const struct object_array *common)
+{
+	int i;
+
+	packet_write(1, "acknowledgments\n");
+	if (!common->nr)
+		packet_write(1, "NAK\n");
+	for (i = 0; i < common->nr; i++)
+		packet_write(1, "ACK %s\n",
+			     sha1_to_hex(common->objects[i].item->sha1));
+}
+
+static void fetch_v2(struct argv_array *args)
+{
+	struct object_array shallows = OBJECT_ARRAY_INIT;
+	struct object_array common = OBJECT_ARRAY_INIT;
+	int depth = 0;
+	int has_non_tip = 0;
+	int done = 0;
+	static int marked_refs;
+	int i;
+
+	if (!marked_refs) {
+		head_ref_namespaced(mark_our_ref, NULL);
+		for_each_namespaced_ref(mark_our_ref, NULL);
+		marked_refs = 1;
+	}
+
+	save_commit_buffer = 0;
+	for (i = 0; i < args->argc; i++) {
+		const char *arg = args->argv[i];
+		unsigned char sha1[20];
+		const char *hex;
+
+		if (skip_prefix(arg, "want ", &hex)) {
+			if (get_sha1_hex(hex, sha1))
+				die("git upload-pack: protocol error, "
+				    "expected to get sha, not '%s'", arg);
+			if (add_want(sha1))
+				has_non_tip = 1;
+		} else if (skip_prefix(arg, "have ", &hex)) {
+			if (got_sha1((char *)hex, sha1) >= 0)
+				add_object_array(lookup_object(sha1), NULL,
+						 &common);
+		} else if (!strcmp(arg, "done"))
+			done = 1;
+		else if (!strcmp(arg, "thin-pack"))
+			use_thin_pack = 1;
+		else if (!strcmp(arg, "ofs-delta"))
+			use_ofs_delta = 1;
+		else if (!strcmp(arg, "no-progress"))
+			no_progress = 1;
+		else if (!strcmp(arg, "include-tag"))
+			use_include_tag = 1;
+		else if (process_shallow(arg, &shallows) ||
+			 process_deepen(arg, &depth) ||
+			 process_filter(arg))
+			; /* handled */
+		else
+			die("git upload-pack: unexpected fetch argument '%s'",
+			    arg);
+	}
+	if (!want_obj.nr)
+		die("git upload-pack: fetch without any want");
+	if (has_non_tip && !allow_any_sha1_in_want)
+		check_non_tip();
+
+	/*
+	 * Unless the client is done, tell it which of its haves we
+	 * have, and whether that is enough to send a pack already.
+	 */
+	if (!done) {
+		send_acknowledgments(&common);
+		if (!ok_to_give_up()) {
+			packet_flush(1);
+			goto out;
+		}
+		packet_write(1, "ready\n");
+		packet_delim(1);
+	}
+
+	shallow_nr = 0;
+	if (depth > 0) {
+		packet_write(1, "shallow-info\n");
+		deepen(depth, &shallows);
+		packet_delim(1);
+	} else
+		deepen(depth, &shallows);
+
+	packet_write(1, "packfile\n");
+	use_sideband = LARGE_PACKET_MAX;
+	create_pack_file();
+out:
+	free(shallows.objects);
+	free(common.objects);
+}
+
+/*
+ * Read and run one command; returns 0 if the client has none left.
+ */
+static int process_command_v2(void)
+{
+	struct argv_array args = ARGV_ARRAY_INIT;
+	enum packet_read_status status;
+	const char *name;
+	char *command;
+	char *line;
+
+	line = packet_read_line_status(0, NULL, NULL, &status);
+	reset_timeout();
+	if (status == PACKET_READ_EOF || status == PACKET_READ_FLUSH)
+		return 0;
+	if (!line || !skip_prefix(line, "command=", &name))
+		die("git upload-pack: expected a command, got '%s'",
+		    line ? line : "a delimiter");
+	command = xstrdup(name);
+
+	/* capabilities the client uses; none of them changes anything yet */
+	while ((line = packet_read_line_status(0, NULL, NULL, &status)))
+		;
+	if (status == PACKET_READ_EOF)
+		die("git upload-pack: unexpected end of command '%s'", command);
+	if (status == PACKET_READ_DELIM) {
+		while ((line = packet_read_line_status(0, NULL, NULL, &status)))
+			argv_array_push(&args, line);
+		if (status != PACKET_READ_FLUSH)
+			die("git upload-pack: expected flush after arguments"
+			    " of command '%s'", command);
+	}
+
+	if (!strcmp(command, "ls-refs"))
+		ls_refs(&args);
+	else if (!strcmp(command, "fetch"))
+		fetch_v2(&args);
+	else
+		die("git upload-pack: unknown command '%s'", command);
+
+	free(command);
+	argv_array_clear(&args);
+	return 1;
+}
+
+static void upload_pack_v2(void)
+{
+	if (advertise_refs || !stateless_rpc) {
+		reset_timeout();
+		advertise_capabilities_v2();
+	}
+	if (advertise_refs)
+		return;
+
+	/* in stateless RPC mode, each request carries one command */
+	while (process_command_v2() && !stateless_rpc)
+		;
+}
+
 static int upload_pack_config(const char *var, const char *value, void *unused)
 {
 	if (!strcmp("uploadpack.allowtipsha1inwant", var))
 		allow_tip_sha1_in_want = git_config_bool(var, value);
+	else if (!strcmp("uploadpack.allowanysha1inwant", var))
+		allow_any_sha1_in_want = git_config_bool(var, value);
+	else if (!strcmp("uploadpack.allowfilter", var))
+		allow_filter = git_config_bool(var, value);
 	else if (!strcmp("uploadpack.keepalive", var)) {
 		keepalive = git_config_int(var, value);
 		if (!keepalive)
@@ -841,6 +1190,10 @@ int main(int argc, char **argv)
 		die("'%s' does not appear to be a git repository", dir);
 
 	git_config(upload_pack_config, NULL);
-	upload_pack();
+	protocol_version = determine_protocol_version_server();
+	if (protocol_version == protocol_v2)
+		upload_pack_v2();
+	else
+		upload_pack();
 	return 0;
 }